@@ -1,13 +1,36 @@
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
+#include <time.h>
 
 #include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+
+#ifdef SYS_openat2
+#include <linux/openat2.h>
+#endif
 
 #include "xcgi.h"
 #include "xcgi_cfg.h"
+#include "xcgi_fcgi.h"
+#include "xcgi_scgi.h"
+#include "xcgi_http.h"
+#include "xcgi_prefork.h"
+#include "xcgi_net.h"
+#include "xcgi_url.h"
+#include "xcgi_compress.h"
+#include "xcgi_hash.h"
+#include "xcgi_multipart.h"
 
 #include "ds_array.h"
 #include "ds_str.h"
@@ -36,8 +59,13 @@ const char *xcgi_GATEWAY_INTERFACE;
 const char *xcgi_HOSTNAME;
 const char *xcgi_HOSTTYPE;
 const char *xcgi_HTTP_ACCEPT;
+const char *xcgi_HTTP_ACCEPT_ENCODING;
 const char *xcgi_HTTP_COOKIE;
 const char *xcgi_HTTP_HOST;
+const char *xcgi_HTTP_IF_MODIFIED_SINCE;
+const char *xcgi_HTTP_IF_NONE_MATCH;
+const char *xcgi_HTTP_IF_RANGE;
+const char *xcgi_HTTP_RANGE;
 const char *xcgi_HTTP_REFERER;
 const char *xcgi_HTTP_USER_AGENT;
 const char *xcgi_HTTPS;
@@ -63,12 +91,14 @@ const char *xcgi_SERVER_SIGNATURE;
 const char *xcgi_SERVER_SOFTWARE;
 
 FILE *xcgi_stdin;
+FILE *xcgi_stdout;
 
 const char **xcgi_path_info;
 const char **xcgi_cookies;
 const char **xcgi_qstrings_content_types;
 const char ***xcgi_qstrings;
 const char **xcgi_response_headers;
+xcgi_arena_t *xcgi_arena;
 
 
 char **xcgi_config;
@@ -86,19 +116,15 @@ sqldb_t   *xcgi_db;
 #define CFG_DBTYPE         ("xcgi_dbtype")
 #define CFG_DBSTRING       ("xcgi_dbstring")
 
-static bool xcgi_dbms_init (void)
+sqldb_t *xcgi_dbms_open (void)
 {
-   bool error = true;
+   sqldb_t *ret = NULL;
    const char *dbstring = xcgi_cfg_get (xcgi_config, CFG_DBSTRING),
               *dbtype = xcgi_cfg_get (xcgi_config, CFG_DBTYPE);
    sqldb_dbtype_t type = sqldb_UNKNOWN;
 
-   if (!dbstring || !dbtype) {
-      EPRINTF ("Failed to load value for [%s] and/or [%s] from [%s]\n",
-                  CFG_DBSTRING, CFG_DBTYPE, "xcgi.ini");
-      error = false;
-      goto errorexit;
-   }
+   if (!dbstring || !dbtype)
+      return NULL;
 
    if ((strcmp (dbtype, "sqlite"))==0)
       type = sqldb_SQLITE;
@@ -108,17 +134,25 @@ static bool xcgi_dbms_init (void)
 
    if (type==sqldb_UNKNOWN) {
       EPRINTF ("Database type (dbtype) unsupported [%s]\n", dbtype);
-      goto errorexit;
+      return NULL;
    }
 
-   if (!(xcgi_db = sqldb_open (dbstring, type)))
-      goto errorexit;
+   if (!(ret = sqldb_open (dbstring, type)))
+      EPRINTF ("Failed to open database [%s]\n", dbstring);
 
-   error = false;
+   return ret;
+}
 
-errorexit:
+static bool xcgi_dbms_init (void)
+{
+   if (!xcgi_cfg_get (xcgi_config, CFG_DBSTRING) ||
+       !xcgi_cfg_get (xcgi_config, CFG_DBTYPE)) {
+      EPRINTF ("Failed to load value for [%s] and/or [%s] from [%s]\n",
+                  CFG_DBSTRING, CFG_DBTYPE, "xcgi.ini");
+      return true;
+   }
 
-   return !error;
+   return (xcgi_db = xcgi_dbms_open ()) ? true : false;
 }
 
 static void xcgi_dbms_shutdown (void)
@@ -130,7 +164,8 @@ static void xcgi_dbms_shutdown (void)
 
 
 /* ************************************************************************
- * All the cookie-related storage. This is all private to this module.
+ * All the cookie-related storage. This is all private to this module; the
+ * context only holds an opaque array of these.
  */
 typedef struct cookie_t cookie_t;
 struct cookie_t {
@@ -140,137 +175,100 @@ struct cookie_t {
    uint32_t    flags;
 };
 
-static cookie_t **xcgi_cookielist;
-
-static bool cookielist_init (void)
+static const char *cookie_time (char *dst, size_t len, time_t expires)
 {
-   return (xcgi_cookielist = (cookie_t **)ds_array_new ()) ? true : false;
-}
+   char tmp[30];
 
-static const char *cookie_time (time_t expires)
-{
-   static char ret[30];
+   if (!(ctime_r (&expires, tmp)))
+      tmp[0] = 0;
 
-   ret[0] = ';';
-   ret[1] = ' ';
-   strcpy (&ret[2], ctime (&expires));
-   char *tmp = strchr (ret, '\n');
-   if (tmp)
-      *tmp = 0;
+   char *nl = strchr (tmp, '\n');
+   if (nl)
+      *nl = 0;
 
-   return ret;
+   snprintf (dst, len, "; %s", tmp);
+   return dst;
 }
 
 static const char *cookie_samesite (uint32_t flags)
 {
-   static char ret[20];
-   memset (ret, 0, sizeof ret);
-   if (flags & XCGI_COOKIE_SAMESITE_LAX) {
-      strcpy (ret, "; SameSite=Lax");
-   }
-   if (flags & XCGI_COOKIE_SAMESITE_STRICT) {
-      strcpy (ret, "; SameSite=Strict");
-   }
-   return ret;
-}
+   if (flags & XCGI_COOKIE_SAMESITE_STRICT)
+      return "; SameSite=Strict";
 
-static bool cookielist_write (void)
-{
-   for (size_t i=0; xcgi_cookielist[i]; i++) {
-      cookie_t *cookie = xcgi_cookielist[i];
-      fprintf (stdout, "Set-Cookie: %s=%s%s%s%s%s\r\n",
-               cookie->name,
-               cookie->value,
-               cookie->expires ? cookie_time (cookie->expires) : "",
-               cookie->flags & XCGI_COOKIE_SECURE ? "; Secure" : "",
-               cookie->flags & XCGI_COOKIE_HTTPONLY ? "; HttpOnly" : "",
-               cookie_samesite (cookie->flags));
-   }
-   return true;
+   if (flags & XCGI_COOKIE_SAMESITE_LAX)
+      return "; SameSite=Lax";
+
+   return "";
 }
 
-static void cookie_del (cookie_t *cookie)
+// Formats the Set-Cookie header line for 'cookie', including the line
+// ending, into 'dst'. Returns the length of the line, as for snprintf().
+static int cookie_format (char *dst, size_t len, cookie_t *cookie)
 {
-   if (!cookie)
-      return;
-   free (cookie->name);
-   free (cookie->value);
-   free (cookie);
+   char expires[40];
+
+   return snprintf (dst, len, "Set-Cookie: %s=%s%s%s%s%s\r\n",
+                    cookie->name,
+                    cookie->value,
+                    cookie->expires ?
+                       cookie_time (expires, sizeof expires, cookie->expires) : "",
+                    cookie->flags & XCGI_COOKIE_SECURE ? "; Secure" : "",
+                    cookie->flags & XCGI_COOKIE_HTTPONLY ? "; HttpOnly" : "",
+                    cookie_samesite (cookie->flags));
 }
 
-static cookie_t *cookie_new (const char *name, const char *value,
+static cookie_t *cookie_new (xcgi_arena_t *arena,
+                             const char *name, const char *value,
                              time_t expires, uint32_t flags)
 {
-   bool error = true;
    cookie_t *ret = NULL;
 
    if (!name || !value)
-      goto errorexit;
-
-   if (!(ret = malloc (sizeof *ret)))
-      goto errorexit;
+      return NULL;
 
-   memset (ret, 0, sizeof *ret);
+   if (!(ret = xcgi_arena_alloc (arena, sizeof *ret)))
+      return NULL;
 
-   ret->name = ds_str_dup (name);
-   ret->value = ds_str_dup (value);
+   ret->name = xcgi_arena_strdup (arena, name);
+   ret->value = xcgi_arena_strdup (arena, value);
 
    ret->expires = expires;
    ret->flags = flags;
 
-   if (!ret->name || !ret->value)
-      goto errorexit;
-
-   error = false;
-
-errorexit:
-   if (error) {
-      cookie_del (ret);
-      ret = NULL;
-   }
-
-   return ret;
-}
-static void cookielist_shutdown (void)
-{
-   for (size_t i=0; xcgi_cookielist && xcgi_cookielist[i]; i++) {
-      cookie_del (xcgi_cookielist[i]);
-   }
-   ds_array_del ((void **)xcgi_cookielist);
-   xcgi_cookielist = NULL;
+   return ret->name && ret->value ? ret : NULL;
 }
 
-bool xcgi_header_cookie_set (const char *name, const char *value,
-                             time_t    expires,
-                             uint32_t  flags)
+bool xcgi_ctx_header_cookie_set (xcgi_ctx_t *ctx,
+                                 const char *name, const char *value,
+                                 time_t    expires,
+                                 uint32_t  flags)
 {
-   bool error = true;
    cookie_t *newcookie = NULL;
 
-   if (!(newcookie = cookie_new (name, value, expires, flags)))
-      goto errorexit;
-
-   if (!(ds_array_ins_tail ((void ***)&xcgi_cookielist, newcookie)))
-      goto errorexit;
+   if (!ctx)
+      return false;
 
-   error = false;
+   if (!(newcookie = cookie_new (ctx->arena, name, value, expires, flags)))
+      return false;
 
-errorexit:
-   if (error) {
-      cookie_del (newcookie);
-   }
-   return !error;
+   return xcgi_arena_array_append (ctx->arena, &ctx->cookielist,
+                                   &ctx->ncookielist, &ctx->scookielist,
+                                   newcookie);
 }
 
-void xcgi_header_cookie_clear (const char *name)
+void xcgi_ctx_header_cookie_clear (xcgi_ctx_t *ctx, const char *name)
 {
-   for (size_t i=0; xcgi_cookielist[i]; i++) {
-      cookie_t *cookie = xcgi_cookielist[i];
-      if ((strcmp (cookie->name, name))==0) {
-         cookie_del (cookie);
-         ds_array_remove ((void ***)&xcgi_cookielist, i);
-      }
+   if (!ctx || !ctx->cookielist || !name)
+      return;
+
+   size_t dst = 0;
+   for (size_t i=0; i<ctx->ncookielist; i++) {
+      cookie_t *cookie = ctx->cookielist[i];
+      if ((strcmp (cookie->name, name))!=0)
+         ctx->cookielist[dst++] = cookie;
    }
+   ctx->cookielist[dst] = NULL;
+   ctx->ncookielist = dst;
 }
 
 
@@ -380,86 +378,224 @@ static bool qs_content_types_check (const char *ct)
 
 
 /* ************************************************************************
+ * Query string slices. The query string is copied once into the arena,
+ * and each name and value is recorded as a slice of that copy. A slice is
+ * decoded in place, and NUL-terminated, the first time it is read. The
+ * decoded form is never longer than the encoded form, and every slice is
+ * followed by a delimiter or by the end of the copy, so it always fits.
  */
-static bool qstrings_init (void)
+typedef struct qslice_t qslice_t;
+struct qslice_t {
+   char       *ptr;
+   size_t      len;
+   bool        decoded;
+};
+
+typedef struct qpair_t qpair_t;
+struct qpair_t {
+   qslice_t    name;
+   qslice_t    value;
+   uint32_t    hash;
+   // One more than the index of the next pair with the same name, or
+   // zero. Only valid once the index has been built.
+   size_t      next;
+};
+
+static const char *qslice_decode (qslice_t *slice)
 {
-   return (xcgi_qstrings = (const char ***)ds_array_new ()) ? true : false;
+   if (!slice->decoded) {
+      slice->len = xcgi_url_decode (slice->ptr, slice->ptr, slice->len);
+      slice->decoded = true;
+   }
+
+   return slice->ptr;
 }
 
-static void qstrings_shutdown (void)
+// Records the name=value pairs in 'buf', which must be writable and live
+// as long as the request. Empty pairs are skipped.
+static bool qpairs_scan (xcgi_ctx_t *ctx, char *buf, size_t len)
 {
-   for (size_t i=0; xcgi_qstrings && xcgi_qstrings[i]; i++) {
-      free ((void *)xcgi_qstrings[i][0]);
-      free ((void *)xcgi_qstrings[i][1]);
-      free ((void *)xcgi_qstrings[i]);
+   char *end = buf + len;
+
+   while (buf < end) {
+      char *amp = memchr (buf, '&', end - buf);
+      if (!amp)
+         amp = end;
+
+      if (amp > buf) {
+         char *sep = memchr (buf, '=', amp - buf);
+         if (!sep) {
+            EPRINTF ("Failed to find delimiter in [%.*s]\n",
+                     (int)(amp - buf), buf);
+            return false;
+         }
+
+         qpair_t *pair = xcgi_arena_alloc (ctx->arena, sizeof *pair);
+         if (!pair)
+            return false;
+
+         pair->name.ptr = buf;
+         pair->name.len = sep - buf;
+         pair->name.decoded = false;
+         pair->value.ptr = sep + 1;
+         pair->value.len = amp - sep - 1;
+         pair->value.decoded = false;
+
+         if (!(xcgi_arena_array_append (ctx->arena, &ctx->qpairs,
+                                        &ctx->nqpairs, &ctx->sqpairs, pair)))
+            return false;
+      }
+
+      buf = amp + 1;
    }
-   ds_array_del ((void **)xcgi_qstrings);
-   xcgi_qstrings = NULL;
+
+   return true;
 }
 
-static char **qstrings_add (const char *name, const char *value)
+// Fills in the qstrings array with the pairs that are not yet in it. The
+// entries point at the decoded slices.
+static bool qstrings_fill (xcgi_ctx_t *ctx)
 {
-   bool error = true;
-   char **ret = NULL;
-   if (!name || !value)
-      return NULL;
+   for (size_t i=ctx->nqstrings; i<ctx->nqpairs; i++) {
+      qpair_t *pair = ctx->qpairs[i];
+      const char **entry = xcgi_arena_alloc (ctx->arena, sizeof *entry * 2);
+      if (!entry)
+         return false;
 
-   if (!(ret = malloc (sizeof *ret * 2)))
-      goto errorexit;
+      entry[0] = qslice_decode (&pair->name);
+      entry[1] = qslice_decode (&pair->value);
 
-   ret[0] = ds_str_dup (name);
-   ret[1] = ds_str_dup (value);
-   if (!ret[0] || !ret[1])
-      goto errorexit;
+      if (!(xcgi_arena_array_append (ctx->arena, (void ***)&ctx->qstrings,
+                                     &ctx->nqstrings, &ctx->sqstrings,
+                                     entry)))
+         return false;
+   }
 
-   if (!(ds_array_ins_tail ((void ***)&xcgi_qstrings, ret)))
-      goto errorexit;
+   return true;
+}
 
-   error = false;
+/* ************************************************************************
+ * The index of the query strings by name: an open-addressed hash table,
+ * allocated from the arena, in which each slot holds one more than the
+ * index of the first pair with a name (zero for an empty slot). The other
+ * pairs with the same name are chained from the first, in order.
+ */
+static uint32_t name_hash (const char *name, size_t len)
+{
+   // FNV-1a
+   uint32_t ret = 2166136261u;
 
-errorexit:
-   if (error) {
-      free (ret[0]);
-      free (ret[1]);
-      free (ret);
-      ret = NULL;
+   for (size_t i=0; i<len; i++) {
+      ret ^= (uint8_t)name[i];
+      ret *= 16777619u;
    }
 
    return ret;
 }
 
+static bool qindex_build (xcgi_ctx_t *ctx)
+{
+   size_t size = 8;
+   size_t *slots = NULL;
+
+   while (size < ctx->nqpairs * 2)
+      size *= 2;
+
+   if (!(slots = xcgi_arena_calloc (ctx->arena, sizeof *slots * size)))
+      return false;
+
+   // Walking backwards and adding each pair to the front of its chain
+   // leaves every chain in the original order.
+   for (size_t i=ctx->nqpairs; i-- > 0; ) {
+      qpair_t *pair = ctx->qpairs[i];
+      const char *name = qslice_decode (&pair->name);
+
+      pair->hash = name_hash (name, pair->name.len);
+      pair->next = 0;
+
+      size_t slot = pair->hash & (size - 1);
+      while (slots[slot]) {
+         qpair_t *head = ctx->qpairs[slots[slot] - 1];
+         if (head->hash == pair->hash &&
+               head->name.len == pair->name.len &&
+               (memcmp (head->name.ptr, name, pair->name.len))==0) {
+            pair->next = slots[slot];
+            break;
+         }
+         slot = (slot + 1) & (size - 1);
+      }
+      slots[slot] = i + 1;
+   }
+
+   ctx->qindex = slots;
+   ctx->qindex_size = size;
+
+   return true;
+}
+
+// Returns the first pair named 'name', or NULL if there is none.
+static qpair_t *qindex_find (xcgi_ctx_t *ctx, const char *name)
+{
+   // Nothing to find until the query strings have been scanned.
+   if (!ctx->qscanned)
+      return NULL;
+
+   if (!ctx->qindex && !(qindex_build (ctx))) {
+      EPRINTF ("OOM error building the qstrings index\n");
+      return NULL;
+   }
+
+   size_t *slots = ctx->qindex;
+   size_t len = strlen (name);
+   uint32_t hash = name_hash (name, len);
+   size_t slot = hash & (ctx->qindex_size - 1);
+
+   while (slots[slot]) {
+      qpair_t *pair = ctx->qpairs[slots[slot] - 1];
+      if (pair->hash == hash && pair->name.len == len &&
+            (memcmp (pair->name.ptr, name, len))==0)
+         return pair;
+      slot = (slot + 1) & (ctx->qindex_size - 1);
+   }
+
+   return NULL;
+}
+
 /* ************************************************************************
+ * The per-request arrays. All of these, and the strings they point to,
+ * are allocated from the context's arena and are never freed separately.
  */
-static bool parse_path_info (void)
+static const char **array_new (xcgi_arena_t *arena)
 {
-   if (!(xcgi_path_info = (const char **)ds_array_new ()))
-      return false;
+   return xcgi_arena_calloc (arena, sizeof (char *));
+}
 
-   char *tmp = ds_str_dup (xcgi_PATH_INFO);
+// Splits a copy of 'src' on any of the characters in 'delim', appending
+// each non-empty field to the array. The fields point into the copy.
+static bool split_fields (xcgi_arena_t *arena, const char *src,
+                          const char *delim,
+                          const char ***array, size_t *count, size_t *size)
+{
+   char *tmp = xcgi_arena_strdup (arena, src);
    if (!tmp)
-      return true;
+      return src ? false : true;
 
-   char *pathf = strtok (tmp, "/");
-   while (pathf) {
-      char *e = ds_str_dup (pathf);
-      if (!e || !ds_array_ins_tail ((void ***)&xcgi_path_info, e)) {
-         free (tmp);
+   char *saveptr = NULL;
+   char *field = strtok_r (tmp, delim, &saveptr);
+   while (field) {
+      if (!(xcgi_arena_array_append (arena, (void ***)array, count, size,
+                                     field)))
          return false;
-      }
-      pathf = strtok (NULL, "/");
+      field = strtok_r (NULL, delim, &saveptr);
    }
-   free (tmp);
 
    return true;
 }
 
-static void path_info_shutdown (void)
+static bool parse_path_info (xcgi_ctx_t *ctx)
 {
-   for (size_t i=0; xcgi_path_info && xcgi_path_info[i]; i++) {
-      free ((void *)xcgi_path_info[i]);
-   }
-   ds_array_del ((void **)xcgi_path_info);
-   xcgi_path_info = NULL;
+   return split_fields (ctx->arena, ctx->PATH_INFO, "/",
+                        &ctx->path_info, &ctx->npath_info, &ctx->spath_info);
 }
 
 static bool load_path (const char *path)
@@ -482,221 +618,1808 @@ static bool load_path (const char *path)
 }
 
 /* ************************************************************************
+ * The request cookies. Each cookie is trimmed in place in a single copy
+ * of HTTP_COOKIE, and the xcgi_cookies array points at the "name=value"
+ * strings. The index by name is only built on the first lookup: an
+ * open-addressed hash table of one more than the position of each entry
+ * (zero for an empty slot).
  */
-static bool parse_cookies (void)
+typedef struct cookie_entry_t cookie_entry_t;
+struct cookie_entry_t {
+   const char *name;
+   size_t      len;
+   const char *value;
+   uint32_t    hash;
+};
+
+static bool is_cookie_space (char c)
 {
-   if (!(xcgi_cookies = (const char **)ds_array_new ()))
-      return false;
+   return c == ' ' || c == '\t';
+}
 
-   char *tmp = ds_str_dup (xcgi_HTTP_COOKIE);
+static bool parse_cookies (xcgi_ctx_t *ctx)
+{
+   char *tmp = xcgi_arena_strdup (ctx->arena, ctx->HTTP_COOKIE);
    if (!tmp)
-      return true;
+      return false;
 
-   char *cookie = strtok (tmp, ";");
-   bool firstchar = true;
-   while (cookie) {
-      if (!firstchar && cookie[-1]=='\\') {
-         firstchar = false;
-         continue;
-      }
-      char *e = ds_str_dup (cookie);
-      if (!e || !ds_array_ins_tail ((void ***)&xcgi_cookies, e)) {
-         free (tmp);
-         return false;
+   while (*tmp) {
+      char *end = strchr (tmp, ';');
+      char *next = end ? end + 1 : tmp + strlen (tmp);
+      if (!end)
+         end = next;
+
+      while (tmp < end && is_cookie_space (*tmp))
+         tmp++;
+      while (end > tmp && is_cookie_space (end[-1]))
+         end--;
+
+      if (end > tmp) {
+         *end = 0;
+         if (!(xcgi_arena_array_append (ctx->arena, (void ***)&ctx->cookies,
+                                        &ctx->ncookies, &ctx->scookies, tmp)))
+            return false;
       }
-      cookie = strtok (NULL, ";");
+
+      tmp = next;
    }
-   free (tmp);
 
    return true;
 }
 
-static void cookies_shutdown (void)
+// Spaces around the '=' are not part of the name or the value. A cookie
+// without an '=' has an empty name.
+static bool cookie_index_build (xcgi_ctx_t *ctx)
 {
-   for (size_t i=0; xcgi_cookies && xcgi_cookies[i]; i++) {
-      free ((void *)xcgi_cookies[i]);
+   cookie_entry_t *entries = NULL;
+   size_t *slots = NULL;
+   size_t size = 8;
+
+   while (size < ctx->ncookies * 2)
+      size *= 2;
+
+   if (!(entries = xcgi_arena_alloc (ctx->arena,
+                                     sizeof *entries * (ctx->ncookies + 1))) ||
+       !(slots = xcgi_arena_calloc (ctx->arena, sizeof *slots * size)))
+      return false;
+
+   for (size_t i=0; i<ctx->ncookies; i++) {
+      const char *cookie = ctx->cookies[i];
+      const char *sep = strchr (cookie, '=');
+      cookie_entry_t *entry = &entries[i];
+
+      entry->name = cookie;
+      entry->len = 0;
+      entry->value = cookie;
+
+      if (sep) {
+         entry->len = sep - cookie;
+         while (entry->len && is_cookie_space (cookie[entry->len - 1]))
+            entry->len--;
+         entry->value = sep + 1;
+         while (is_cookie_space (*entry->value))
+            entry->value++;
+      }
+
+      entry->hash = name_hash (entry->name, entry->len);
+
+      // The first cookie with a name is the one that is found.
+      size_t slot = entry->hash & (size - 1);
+      bool found = false;
+      while (slots[slot] && !found) {
+         cookie_entry_t *other = &entries[slots[slot] - 1];
+         found = other->hash == entry->hash && other->len == entry->len &&
+                 (memcmp (other->name, entry->name, entry->len))==0;
+         slot = (slot + 1) & (size - 1);
+      }
+      if (!found)
+         slots[slot] = i + 1;
    }
-   ds_array_del ((void **)xcgi_cookies);
-   xcgi_cookies = NULL;
+
+   ctx->cookie_entries = entries;
+   ctx->cookie_index = slots;
+   ctx->cookie_index_size = size;
+
+   return true;
 }
 
 /* ************************************************************************
+ * The response headers. Each header is kept as a single line,
+ * "Name: value, value", which is both what the xcgi_response_headers
+ * array points to and what is written out, so that nothing has to be
+ * formatted again when the headers are sent. Values are appended to the
+ * line in place. The lines are found by name with a case-insensitive hash
+ * index of the names.
  */
-static bool response_headers_init (void)
+typedef struct header_t header_t;
+struct header_t {
+   char       *line;
+   size_t      nlen;
+   size_t      len;
+   size_t      size;
+   uint32_t    hash;
+};
+
+static uint32_t name_hash_nocase (const char *name, size_t len)
 {
-   if (!(cookielist_init ()))
-      return false;
+   // FNV-1a, of the name in lowercase
+   uint32_t ret = 2166136261u;
+
+   for (size_t i=0; i<len; i++) {
+      ret ^= (uint8_t)tolower ((uint8_t)name[i]);
+      ret *= 16777619u;
+   }
 
-   return (xcgi_response_headers = (const char **)ds_array_new ())
-               ? true : false;
+   return ret;
 }
 
-static void response_headers_shutdown (void)
+static void header_index_add (xcgi_ctx_t *ctx, size_t index)
 {
-   cookielist_shutdown ();
+   header_t **headers = (header_t **)ctx->header_entries;
+   size_t *slots = ctx->header_index;
+   size_t slot = headers[index]->hash & (ctx->header_index_size - 1);
 
-   if (!xcgi_response_headers)
-      return;
+   while (slots[slot])
+      slot = (slot + 1) & (ctx->header_index_size - 1);
 
-   for (size_t i=0; xcgi_response_headers[i]; i++) {
-      free ((char *)xcgi_response_headers[i]);
-   }
-   ds_array_del ((void **)xcgi_response_headers);
-   xcgi_response_headers = NULL;
+   slots[slot] = index + 1;
 }
 
-static size_t response_headers_find (const char *name)
+static bool header_index_build (xcgi_ctx_t *ctx, size_t size)
 {
-   if (!xcgi_response_headers)
-      if (!(response_headers_init ()))
-         return (size_t)-1;
+   size_t *slots = NULL;
 
-   if (!name)
-      return (size_t)-1;
+   if (!(slots = xcgi_arena_calloc (ctx->arena, sizeof *slots * size)))
+      return false;
 
-   size_t len = strlen (name);
+   ctx->header_index = slots;
+   ctx->header_index_size = size;
 
-   for (size_t i=0; xcgi_response_headers[i]; i++) {
-      if ((strncasecmp (xcgi_response_headers[i], name, len))==0)
-         return i;
+   for (size_t i=0; i<ctx->nresponse_headers; i++) {
+      header_index_add (ctx, i);
    }
 
-   return (size_t)-1;
+   return true;
 }
 
-
-/* ************************************************************************
- */
-struct {
-   const char *name;
-   const char **variable;
-} g_vars[] = {
-      { "CONTENT_LENGTH",           &xcgi_CONTENT_LENGTH          },
-      { "CONTENT_TYPE",             &xcgi_CONTENT_TYPE            },
-      { "CONTEXT_DOCUMENT_ROOT",    &xcgi_CONTEXT_DOCUMENT_ROOT   },
-      { "CONTEXT_PREFIX",           &xcgi_CONTENT_PREFIX          },
-      { "DOCUMENT_ROOT",            &xcgi_DOCUMENT_ROOT           },
-      { "GATEWAY_INTERFACE",        &xcgi_GATEWAY_INTERFACE       },
-      { "HOSTNAME",                 &xcgi_HOSTNAME                },
-      { "HOSTTYPE",                 &xcgi_HOSTTYPE                },
-      { "HTTP_ACCEPT",              &xcgi_HTTP_ACCEPT             },
-      { "HTTP_COOKIE",              &xcgi_HTTP_COOKIE             },
-      { "HTTP_HOST",                &xcgi_HTTP_HOST               },
-      { "HTTP_REFERER",             &xcgi_HTTP_REFERER            },
-      { "HTTP_USER_AGENT",          &xcgi_HTTP_USER_AGENT         },
-      { "HTTPS",                    &xcgi_HTTPS                   },
-      { "PATH",                     &xcgi_PATH                    },
-      { "PATH_INFO",                &xcgi_PATH_INFO               },
-      { "PWD",                      &xcgi_PWD                     },
-      { "QUERY_STRING",             &xcgi_QUERY_STRING            },
-      { "REMOTE_ADDR",              &xcgi_REMOTE_ADDR             },
-      { "REMOTE_HOST",              &xcgi_REMOTE_HOST             },
-      { "REMOTE_PORT",              &xcgi_REMOTE_PORT             },
-      { "REMOTE_USER",              &xcgi_REMOTE_USER             },
-      { "REQUEST_METHOD",           &xcgi_REQUEST_METHOD          },
-      { "REQUEST_SCHEME",           &xcgi_REQUEST_SCHEME          },
-      { "REQUEST_URI",              &xcgi_REQUEST_URI             },
-      { "SCRIPT_FILENAME",          &xcgi_SCRIPT_FILENAME         },
-      { "SCRIPT_NAME",              &xcgi_SCRIPT_NAME             },
-      { "SERVER_ADDR",              &xcgi_SERVER_ADDR             },
-      { "SERVER_ADMIN",             &xcgi_SERVER_ADMIN            },
-      { "SERVER_NAME",              &xcgi_SERVER_NAME             },
-      { "SERVER_PORT",              &xcgi_SERVER_PORT             },
-      { "SERVER_PROTOCOL",          &xcgi_SERVER_PROTOCOL         },
-      { "SERVER_SIGNATURE",         &xcgi_SERVER_SIGNATURE        },
-      { "SERVER_SOFTWARE",          &xcgi_SERVER_SOFTWARE         },
-};
-
-bool xcgi_init (const char *path)
+// Returns the position of the header named 'name' in the list of
+// headers, or (size_t)-1 if there is no such header. The whole name is
+// compared, ignoring case.
+static size_t response_headers_find (xcgi_ctx_t *ctx, const char *name)
 {
-   bool error = true;
+   if (!name || !ctx->header_index)
+      return (size_t)-1;
 
-   if (!(load_path (path))) {
-      EPRINTF ("Could not load path for [%s], aborting.\n", path);
-      goto errorexit;
+   header_t **headers = (header_t **)ctx->header_entries;
+   size_t *slots = ctx->header_index;
+   size_t len = strlen (name);
+   uint32_t hash = name_hash_nocase (name, len);
+   size_t slot = hash & (ctx->header_index_size - 1);
+
+   while (slots[slot]) {
+      header_t *header = headers[slots[slot] - 1];
+      if (header->hash == hash && header->nlen == len &&
+            (strncasecmp (header->line, name, len))==0)
+         return slots[slot] - 1;
+      slot = (slot + 1) & (ctx->header_index_size - 1);
    }
 
-   for (size_t i=0; i<sizeof g_vars/sizeof g_vars[0]; i++) {
-      char *tmp = getenv (g_vars[i].name);
-      *(g_vars[i].variable) = tmp ? tmp : "";
-   }
-   xcgi_stdin = stdin;
+   return (size_t)-1;
+}
 
-   if (!(qstrings_init ())) {
-      EPRINTF ("Failed to allocate storage for the qstrings\n");
-      goto errorexit;
+static bool header_add (xcgi_ctx_t *ctx, const char *name, const char *value)
+{
+   size_t nlen = strlen (name);
+   size_t vlen = strlen (value);
+   header_t *header = NULL;
+
+   // The index is kept at least twice the size of the list.
+   if (!ctx->header_index ||
+         (ctx->nresponse_headers + 1) * 2 > ctx->header_index_size) {
+      size_t size = ctx->header_index_size ? ctx->header_index_size * 2 : 16;
+      if (!(header_index_build (ctx, size)))
+         return false;
    }
 
-   if (!(qs_content_types_init ())) {
-      EPRINTF ("Failed to allocate storage for the content types\n");
-      goto errorexit;
-   }
+   if (!(header = xcgi_arena_alloc (ctx->arena, sizeof *header)))
+      return false;
 
-   if (!(parse_path_info ())) {
-      EPRINTF ("Failed to parse the path info [%s]\n",
-               xcgi_PATH_INFO);
-      goto errorexit;
-   }
+   header->nlen = nlen;
+   header->len = nlen + 2 + vlen;
+   header->size = header->len + 1;
+   header->hash = name_hash_nocase (name, nlen);
 
-   if (!(parse_cookies ())) {
-      EPRINTF ("Failed to parse the cookies [%s]\n",
-               xcgi_HTTP_COOKIE);
-      goto errorexit;
-   }
+   if (!(header->line = xcgi_arena_alloc (ctx->arena, header->size)))
+      return false;
 
-   if (!(response_headers_init ())) {
-      EPRINTF ("Failed to allocate storage for response headers\n");
-      goto errorexit;
-   }
+   memcpy (header->line, name, nlen);
+   memcpy (&header->line[nlen], ": ", 2);
+   memcpy (&header->line[nlen + 2], value, vlen + 1);
 
-   if (!(xcgi_dbms_init ())) {
-      EPRINTF ("Could not connect to db for [%s], ignoring.\n", path);
-      // Optional, so don't return error
+   if (!(xcgi_arena_array_append (ctx->arena, &ctx->header_entries,
+                                  &ctx->nheader_entries,
+                                  &ctx->sheader_entries,
+                                  header)))
+      return false;
+
+   if (!(xcgi_arena_array_append (ctx->arena,
+                                  (void ***)&ctx->response_headers,
+                                  &ctx->nresponse_headers,
+                                  &ctx->sresponse_headers,
+                                  header->line))) {
+      ctx->header_entries[--ctx->nheader_entries] = NULL;
+      return false;
    }
 
-   error = false;
+   header_index_add (ctx, ctx->nresponse_headers - 1);
 
-errorexit:
+   return true;
+}
 
-   if (error) {
-      xcgi_shutdown ();
+static bool header_append (xcgi_ctx_t *ctx, size_t index, const char *value)
+{
+   header_t *header = ctx->header_entries[index];
+   size_t vlen = strlen (value);
+   size_t needed = header->len + 2 + vlen + 1;
+
+   // The line grows by doubling; the old line stays in the arena until
+   // the request is done.
+   if (needed > header->size) {
+      size_t size = header->size * 2 > needed ? header->size * 2 : needed;
+      char *tmp = xcgi_arena_alloc (ctx->arena, size);
+      if (!tmp)
+         return false;
+      memcpy (tmp, header->line, header->len);
+      header->line = tmp;
+      header->size = size;
+      ctx->response_headers[index] = tmp;
    }
 
-   return !error;
+   memcpy (&header->line[header->len], ", ", 2);
+   memcpy (&header->line[header->len + 2], value, vlen + 1);
+   header->len += 2 + vlen;
+
+   return true;
 }
 
-void xcgi_shutdown (void)
-{
-   if (xcgi_stdin)
-      fclose (xcgi_stdin);
+/* ************************************************************************
+ * The response is laid out as a single header block, so that it can be
+ * sent with a single write instead of a write per header.
+ */
+#define NO_CONTENT_LENGTH     ((size_t)-1)
 
-   xcgi_dbms_shutdown ();
-   qstrings_shutdown ();
-   qs_content_types_shutdown ();
-   path_info_shutdown ();
-   cookies_shutdown ();
-   response_headers_shutdown ();
-   xcgi_cfg_del (xcgi_config);
-   xcgi_config = NULL;
+static bool header_is_status (const char *header)
+{
+   return (strncasecmp (header, "Status:", 7))==0;
 }
 
-#define MARKER_EOV      ("MARKER-END-OF-VARS")
+// Returns the header block, allocated from the arena, with the Status
+// header first, then the cookies, the rest of the headers, a
+// Content-Length header for 'clen' bytes if 'clen' is not
+// NO_CONTENT_LENGTH and the handler did not set one, and the empty line
+// that ends the block. The length of the block is stored in '*blen'.
+static char *header_block (xcgi_ctx_t *ctx, size_t clen, size_t *blen)
+{
+   cookie_t **cookielist = (cookie_t **)ctx->cookielist;
+   const char **headers = ctx->response_headers;
+   char *ret = NULL;
+   size_t len = 2;
 
-static char g_line[1024  * 16];
+   if (clen != NO_CONTENT_LENGTH &&
+         response_headers_find (ctx, "Content-Length") != (size_t)-1)
+      clen = NO_CONTENT_LENGTH;
 
-bool xcgi_save (const char *fname)
-{
-   bool error = true;
-   FILE *outf = NULL;
-   size_t clen = 0;
+   for (size_t i=0; cookielist && cookielist[i]; i++) {
+      len += cookie_format (NULL, 0, cookielist[i]);
+   }
 
-   if (!(outf = fopen (fname, "w"))) {
-      EPRINTF ("Failed to open [%s] for writing: %m\n", fname);
-      goto errorexit;
+   for (size_t i=0; headers && headers[i]; i++) {
+      len += strlen (headers[i]) + 2;
    }
 
+   if (clen != NO_CONTENT_LENGTH)
+      len += snprintf (NULL, 0, "Content-Length: %zu\r\n", clen);
+
+   // The extra byte is for the NUL written by snprintf().
+   if (!(ret = xcgi_arena_alloc (ctx->arena, len + 1)))
+      return NULL;
+
+   char *dst = ret;
+
+   for (size_t i=0; headers && headers[i]; i++) {
+      if (header_is_status (headers[i]))
+         dst += sprintf (dst, "%s\r\n", headers[i]);
+   }
+
+   for (size_t i=0; cookielist && cookielist[i]; i++) {
+      dst += cookie_format (dst, len + 1 - (dst - ret), cookielist[i]);
+   }
+
+   for (size_t i=0; headers && headers[i]; i++) {
+      if (!header_is_status (headers[i]))
+         dst += sprintf (dst, "%s\r\n", headers[i]);
+   }
+
+   if (clen != NO_CONTENT_LENGTH)
+      dst += sprintf (dst, "Content-Length: %zu\r\n", clen);
+
+   *dst++ = '\r';
+   *dst++ = '\n';
+   *dst = 0;
+
+   *blen = dst - ret;
+   return ret;
+}
+
+// Writes all of the buffers in 'iov' to the context's output stream, in
+// order. Anything the handler has already written to the stream is
+// flushed first. When the stream has a descriptor (a plain CGI program)
+// the buffers are written with a single writev(), otherwise they are
+// copied into the stream, which the front end sends out when it is
+// flushed. The contents of 'iov' are modified.
+static bool response_emit (xcgi_ctx_t *ctx, struct iovec *iov, int niov)
+{
+   int fd;
+
+   if (!ctx->outf || (fflush (ctx->outf))!=0)
+      return false;
+
+   if ((fd = fileno (ctx->outf)) >= 0)
+      return xcgi_net_writev (fd, iov, niov);
+
+   for (int i=0; i<niov; i++) {
+      if (iov[i].iov_len &&
+            fwrite (iov[i].iov_base, 1, iov[i].iov_len, ctx->outf) != iov[i].iov_len)
+         return false;
+   }
+
+   return (fflush (ctx->outf))==0;
+}
+
+
+/* ************************************************************************
+ * Response compression, negotiated with the client from the
+ * Accept-Encoding header. See xcgi_compress.h for the settings.
+ */
+#define CFG_COMPRESS_LEVEL          ("xcgi_compress_level")
+#define CFG_COMPRESS_MIN_SIZE       ("xcgi_compress_min_size")
+
+#define DEFAULT_COMPRESS_LEVEL      (6)
+#define DEFAULT_COMPRESS_MIN_SIZE   (1024)
+
+static int g_compress_level = DEFAULT_COMPRESS_LEVEL;
+static size_t g_compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+
+static void compress_config (void)
+{
+   int64_t tmp = 0;
+
+   g_compress_level = DEFAULT_COMPRESS_LEVEL;
+   g_compress_min_size = DEFAULT_COMPRESS_MIN_SIZE;
+
+   if ((xcgi_cfg_get_int (xcgi_config, CFG_COMPRESS_LEVEL, &tmp)) &&
+         tmp >= 0 && tmp <= 9)
+      g_compress_level = tmp;
+
+   if ((xcgi_cfg_get_int (xcgi_config, CFG_COMPRESS_MIN_SIZE, &tmp)) &&
+         tmp >= 0)
+      g_compress_min_size = tmp;
+}
+
+// Returns the value of the response header 'name', or NULL if it has not
+// been set.
+static const char *response_header_value (xcgi_ctx_t *ctx, const char *name)
+{
+   size_t index = response_headers_find (ctx, name);
+   if (index == (size_t)-1)
+      return NULL;
+
+   header_t *header = ctx->header_entries[index];
+   return &header->line[header->nlen + 2];
+}
+
+// Decides whether a body of at least 'len' bytes is to be compressed, and
+// returns the content-coding to use. The Vary header is set for every
+// response that could be compressed, so that caches keep the encoded and
+// the plain responses apart, and the Content-Encoding header is set when
+// the body is compressed.
+static int compress_select (xcgi_ctx_t *ctx, size_t len)
+{
+   if (!g_compress_level || len < g_compress_min_size)
+      return XCGI_ENCODING_IDENTITY;
+
+   // Bodies that the handler has encoded itself, and partial content.
+   const char *status = response_header_value (ctx, "Status");
+   if ((status && atoi (status) == 206) ||
+         response_header_value (ctx, "Content-Encoding") ||
+         !(xcgi_compress_type_ok (response_header_value (ctx,
+                                                         "Content-Type"))))
+      return XCGI_ENCODING_IDENTITY;
+
+   const char *vary = response_header_value (ctx, "Vary");
+   if (!vary || !strcasestr (vary, "Accept-Encoding")) {
+      if (!(xcgi_ctx_headers_value_set (ctx, "Vary", "Accept-Encoding")))
+         return XCGI_ENCODING_IDENTITY;
+   }
+
+   int ret = xcgi_compress_negotiate (ctx->HTTP_ACCEPT_ENCODING);
+   if (ret != XCGI_ENCODING_IDENTITY &&
+         !(xcgi_ctx_headers_value_set (ctx, "Content-Encoding",
+                                       xcgi_compress_encoding_name (ret))))
+      return XCGI_ENCODING_IDENTITY;
+
+   return ret;
+}
+
+typedef struct compress_buf_t compress_buf_t;
+struct compress_buf_t {
+   char       *buf;
+   size_t      len;
+   size_t      size;
+};
+
+static bool compress_buf_out (void *param, const void *data, size_t len)
+{
+   compress_buf_t *dst = param;
+
+   if (dst->size - dst->len < len)
+      return false;
+
+   memcpy (&dst->buf[dst->len], data, len);
+   dst->len += len;
+   return true;
+}
+
+// Compresses the whole of a body into a buffer allocated from the arena,
+// and returns it with its length in '*dlen'. Returns NULL on error.
+static char *compress_body (xcgi_ctx_t *ctx, int encoding,
+                            const void *body, size_t len, size_t *dlen)
+{
+   compress_buf_t dst = { NULL, 0, 0 };
+   xcgi_compress_t *z = NULL;
+
+   if (!(z = xcgi_compress_new (ctx->arena, encoding, g_compress_level)))
+      return NULL;
+
+   dst.size = xcgi_compress_bound (z, len);
+   if ((dst.buf = xcgi_arena_alloc (ctx->arena, dst.size)) &&
+         !(xcgi_compress_write (z, body, len, XCGI_COMPRESS_FINISH,
+                                compress_buf_out, &dst)))
+      dst.buf = NULL;
+
+   xcgi_compress_del (z);
+
+   *dlen = dst.len;
+   return dst.buf;
+}
+
+/* ************************************************************************
+ * Entity tags. With xcgi_auto_etag set in the 'xcgi.ini' file, a response
+ * written whole is given a strong ETag made from a hash of its body;
+ * handlers can also set one from a version token (xcgi_etag_check()).
+ * Either way, when the tag matches the If-None-Match request header the
+ * client's copy is current and a 304 is sent without the body.
+ */
+#define CFG_AUTO_ETAG         ("xcgi_auto_etag")
+
+static bool g_auto_etag = false;
+
+static void etag_config (void)
+{
+   int64_t tmp = 0;
+
+   g_auto_etag = (xcgi_cfg_get_int (xcgi_config, CFG_AUTO_ETAG, &tmp)) &&
+                 tmp != 0;
+}
+
+// Only the successful responses to GET and HEAD are validated.
+static bool etag_applies (xcgi_ctx_t *ctx)
+{
+   const char *status = response_header_value (ctx, "Status");
+
+   if ((strcmp (ctx->REQUEST_METHOD, "GET"))!=0 &&
+       (strcmp (ctx->REQUEST_METHOD, "HEAD"))!=0)
+      return false;
+
+   return (!status || atoi (status) == 200) &&
+          !response_header_value (ctx, "Location");
+}
+
+// Sets the ETag header to the quoted hash of the 'len' bytes of 'data'.
+static bool etag_set (xcgi_ctx_t *ctx, const void *data, size_t len)
+{
+   char etag[19];
+
+   snprintf (etag, sizeof etag, "\"%016llx\"",
+             (unsigned long long)xcgi_hash64 (data, len, 0));
+
+   xcgi_ctx_headers_clear (ctx, "ETag");
+   return xcgi_ctx_headers_value_set (ctx, "ETag", etag);
+}
+
+// Returns true if the opaque tag of 'len' bytes at 'tag' (with its
+// quotes) names the same entity as 'etag'. The client may be holding the
+// compressed form of the entity, which is tagged with the name of the
+// content-coding (see etag_encode()).
+static bool etag_same (const char *tag, size_t len, const char *etag)
+{
+   static const char *codings[] = { "gzip", "deflate" };
+   size_t elen = strlen (etag);
+
+   if (len == elen)
+      return (memcmp (tag, etag, len))==0;
+
+   for (size_t i=0; i<sizeof codings/sizeof codings[0]; i++) {
+      size_t clen = strlen (codings[i]);
+      if (len == elen + clen + 1 &&
+            (memcmp (tag, etag, elen - 1))==0 &&
+            tag[elen - 1] == '-' &&
+            (memcmp (&tag[elen], codings[i], clen))==0 &&
+            tag[len - 1] == '"')
+         return true;
+   }
+
+   return false;
+}
+
+// Returns true if any of the tags in the If-None-Match header matches the
+// ETag response header. The comparison is the weak one that RFC 7232
+// requires for If-None-Match, so "W/" prefixes are ignored.
+static bool etag_match (xcgi_ctx_t *ctx)
+{
+   const char *inm = ctx->HTTP_IF_NONE_MATCH;
+   const char *etag = response_header_value (ctx, "ETag");
+
+   if (!inm || !*inm || !etag)
+      return false;
+
+   if (etag[0] == 'W' && etag[1] == '/')
+      etag += 2;
+
+   while (*inm) {
+      inm += strspn (inm, " \t,");
+      if (*inm == '*')
+         return true;
+
+      if (inm[0] == 'W' && inm[1] == '/')
+         inm += 2;
+
+      if (*inm != '"')
+         break;
+
+      const char *end = strchr (&inm[1], '"');
+      if (!end)
+         break;
+
+      if (etag_same (inm, end - inm + 1, etag))
+         return true;
+
+      inm = end + 1;
+   }
+
+   return false;
+}
+
+// A strong tag names one representation, so the compressed body gets a
+// tag of its own: "<tag>-gzip" or "<tag>-deflate".
+static bool etag_encode (xcgi_ctx_t *ctx, int encoding)
+{
+   const char *etag = response_header_value (ctx, "ETag");
+   const char *name = xcgi_compress_encoding_name (encoding);
+   char *tmp = NULL;
+   size_t len;
+
+   if (!etag || !name || etag[0] != '"' ||
+         (len = strlen (etag)) < 2 || etag[len - 1] != '"')
+      return true;
+
+   if (!(tmp = xcgi_arena_alloc (ctx->arena, len + strlen (name) + 2)))
+      return false;
+
+   sprintf (tmp, "%.*s-%s\"", (int)(len - 1), etag, name);
+
+   xcgi_ctx_headers_clear (ctx, "ETag");
+   return xcgi_ctx_headers_value_set (ctx, "ETag", tmp);
+}
+
+// Replaces the Status header.
+static bool status_set (xcgi_ctx_t *ctx, const char *status)
+{
+   xcgi_ctx_headers_clear (ctx, "Status");
+   return xcgi_ctx_headers_value_set (ctx, "Status", status);
+}
+
+// Sends the 304 response: the headers that the full response would have
+// had, with the body in the content-coding 'encoding', without the body
+// itself.
+static bool not_modified_send (xcgi_ctx_t *ctx, int encoding)
+{
+   size_t blen = 0;
+   char *block = NULL;
+
+   ctx->response_sent = true;
+
+   if (!(etag_encode (ctx, encoding))) {
+      EPRINTF ("OOM error setting the ETag\n");
+      return false;
+   }
+
+   xcgi_ctx_headers_clear (ctx, "Content-Encoding");
+   xcgi_ctx_headers_clear (ctx, "Content-Length");
+
+   if (!(status_set (ctx, "304 Not Modified")) ||
+       !(block = header_block (ctx, NO_CONTENT_LENGTH, &blen))) {
+      EPRINTF ("OOM error building the response headers\n");
+      return false;
+   }
+
+   struct iovec iov[1] = {
+      { block, blen },
+   };
+
+   return response_emit (ctx, iov, 1);
+}
+
+/* ************************************************************************
+ * File responses. The length and date of the file come from fstat() on
+ * the descriptor that is sent, so they always describe the bytes that
+ * are sent.
+ */
+#define FILE_COPY_SIZE           (1024 * 256)
+
+#define HTTP_DATE_FORMAT         ("%a, %d %b %Y %H:%M:%S GMT")
+
+typedef struct file_info_t file_info_t;
+struct file_info_t {
+   off_t       size;
+   time_t      mtime;
+   const char *mime;
+};
+
+static const char *mime_type (const char *path)
+{
+   static const struct {
+      const char *ext;
+      const char *type;
+   } types[] = {
+      { "html",   "text/html"                },
+      { "htm",    "text/html"                },
+      { "css",    "text/css"                 },
+      { "js",     "text/javascript"          },
+      { "mjs",    "text/javascript"          },
+      { "json",   "application/json"         },
+      { "txt",    "text/plain"               },
+      { "csv",    "text/csv"                 },
+      { "md",     "text/markdown"            },
+      { "xml",    "application/xml"          },
+      { "svg",    "image/svg+xml"            },
+      { "png",    "image/png"                },
+      { "jpg",    "image/jpeg"               },
+      { "jpeg",   "image/jpeg"               },
+      { "gif",    "image/gif"                },
+      { "webp",   "image/webp"               },
+      { "ico",    "image/x-icon"             },
+      { "pdf",    "application/pdf"          },
+      { "zip",    "application/zip"          },
+      { "gz",     "application/gzip"         },
+      { "wasm",   "application/wasm"         },
+      { "woff",   "font/woff"                },
+      { "woff2",  "font/woff2"               },
+      { "mp4",    "video/mp4"                },
+   };
+
+   const char *ext = strrchr (path, '.');
+
+   if (ext && !strchr (ext, '/')) {
+      for (size_t i=0; i<sizeof types/sizeof types[0]; i++) {
+         if ((strcasecmp (&ext[1], types[i].ext))==0)
+            return types[i].type;
+      }
+   }
+
+   return "application/octet-stream";
+}
+
+// Paths must be relative, and may not leave the directory they are
+// relative to.
+static bool path_safe (const char *path)
+{
+   if (!path || !*path || *path == '/')
+      return false;
+
+   for (const char *seg = path; seg; ) {
+      if (seg[0] == '.' && seg[1] == '.' && (seg[2] == '/' || !seg[2]))
+         return false;
+      seg = strchr (seg, '/');
+      if (seg)
+         seg++;
+   }
+
+   return true;
+}
+
+// Opens the file at the relative 'path' for reading without following a
+// symbolic link in any component of the path, so that the file is always
+// beneath the working directory. openat2() does this in one call; where
+// the kernel does not have it each directory is opened in turn. The file
+// is opened non-blocking so that opening a FIFO does not wait for a
+// writer; it makes no difference to regular files.
+static int file_open (const char *path)
+{
+   int ret = -1;
+   int dirfd = AT_FDCWD;
+   char *copy = NULL;
+
+#ifdef SYS_openat2
+   struct open_how how;
+
+   memset (&how, 0, sizeof how);
+   how.flags = O_RDONLY | O_CLOEXEC | O_NONBLOCK;
+   how.resolve = RESOLVE_BENEATH | RESOLVE_NO_SYMLINKS;
+
+   if ((ret = syscall (SYS_openat2, AT_FDCWD, path, &how, sizeof how)) >= 0 ||
+         errno != ENOSYS)
+      return ret;
+#endif
+
+   if (!(copy = strdup (path)))
+      return -1;
+
+   char *seg = copy;
+   for (char *slash; (slash = strchr (seg, '/')); seg = slash + 1) {
+      *slash = 0;
+      if (!*seg || (strcmp (seg, "."))==0)
+         continue;
+
+      int fd = openat (dirfd, seg,
+                       O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_DIRECTORY);
+      if (dirfd != AT_FDCWD)
+         close (dirfd);
+      if ((dirfd = fd) < 0)
+         goto errorexit;
+   }
+
+   ret = openat (dirfd, seg, O_RDONLY | O_CLOEXEC | O_NOFOLLOW | O_NONBLOCK);
+
+errorexit:
+   if (dirfd >= 0 && dirfd != AT_FDCWD)
+      close (dirfd);
+   free (copy);
+
+   return ret;
+}
+
+static bool http_date_parse (const char *src, time_t *dst)
+{
+   struct tm tm;
+
+   memset (&tm, 0, sizeof tm);
+   if (!src || !*src || !(strptime (src, HTTP_DATE_FORMAT, &tm)))
+      return false;
+
+   *dst = timegm (&tm);
+   return true;
+}
+
+// Sets the headers that describe the file.
+static bool file_headers (xcgi_ctx_t *ctx, const file_info_t *info)
+{
+   char date[64];
+   char etag[48];
+   struct tm tm;
+
+   gmtime_r (&info->mtime, &tm);
+   strftime (date, sizeof date, HTTP_DATE_FORMAT, &tm);
+
+   snprintf (etag, sizeof etag, "\"%llx-%llx\"",
+             (unsigned long long)info->mtime,
+             (unsigned long long)info->size);
+
+   xcgi_ctx_headers_clear (ctx, "Last-Modified");
+   xcgi_ctx_headers_clear (ctx, "ETag");
+   xcgi_ctx_headers_clear (ctx, "Accept-Ranges");
+
+   return (response_header_value (ctx, "Content-Type") ||
+           xcgi_ctx_headers_value_set (ctx, "Content-Type", info->mime)) &&
+          xcgi_ctx_headers_value_set (ctx, "Last-Modified", date) &&
+          xcgi_ctx_headers_value_set (ctx, "ETag", etag) &&
+          xcgi_ctx_headers_value_set (ctx, "Accept-Ranges", "bytes");
+}
+
+// If-None-Match takes precedence over If-Modified-Since.
+static bool file_not_modified (xcgi_ctx_t *ctx, const file_info_t *info)
+{
+   time_t since;
+
+   if (ctx->HTTP_IF_NONE_MATCH[0])
+      return etag_match (ctx);
+
+   return http_date_parse (ctx->HTTP_IF_MODIFIED_SINCE, &since) &&
+          info->mtime <= since;
+}
+
+// Works out the part of the file to send from the Range header, which is
+// ignored unless it is a single byte range and any If-Range header
+// matches the file. Returns 1 for a range, 0 for the whole file and -1
+// if the range is outside the file.
+static int file_range (xcgi_ctx_t *ctx, const file_info_t *info,
+                       off_t *first, off_t *len)
+{
+   const char *spec = ctx->HTTP_RANGE;
+   unsigned long long a, b;
+   char *end = NULL;
+
+   if ((strcmp (ctx->REQUEST_METHOD, "GET"))!=0 ||
+         (strncmp (spec, "bytes=", 6))!=0 || strchr (spec, ','))
+      return 0;
+
+   if (ctx->HTTP_IF_RANGE[0]) {
+      const char *etag = response_header_value (ctx, "ETag");
+      time_t since;
+      if (ctx->HTTP_IF_RANGE[0] == '"' ?
+               (strcmp (ctx->HTTP_IF_RANGE, etag))!=0 :
+               !(http_date_parse (ctx->HTTP_IF_RANGE, &since)) ||
+                  since != info->mtime)
+         return 0;
+   }
+
+   spec += 6;
+   while (*spec == ' ' || *spec == '\t')
+      spec++;
+
+   if (*spec == '-') {
+      // The last 'b' bytes.
+      if (!isdigit ((unsigned char)spec[1]))
+         return 0;
+      b = strtoull (&spec[1], &end, 10);
+      if (*end && !isspace ((unsigned char)*end))
+         return 0;
+      if (!b || !info->size)
+         return -1;
+      if (b > (unsigned long long)info->size)
+         b = info->size;
+      *first = info->size - b;
+      *len = b;
+      return 1;
+   }
+
+   if (!isdigit ((unsigned char)*spec))
+      return 0;
+
+   a = strtoull (spec, &end, 10);
+   if (*end++ != '-')
+      return 0;
+
+   b = info->size ? info->size - 1 : 0;
+   if (isdigit ((unsigned char)*end)) {
+      unsigned long long tmp = strtoull (end, &end, 10);
+      if (tmp < a)
+         return 0;
+      if (tmp < b)
+         b = tmp;
+   }
+   if (*end && !isspace ((unsigned char)*end))
+      return 0;
+
+   if (a >= (unsigned long long)info->size)
+      return -1;
+
+   *first = a;
+   *len = b - a + 1;
+   return 1;
+}
+
+// Copies the file through a buffer, for the front ends that cannot take
+// the file directly.
+static bool file_copy (xcgi_ctx_t *ctx, int fd, off_t offset, size_t len)
+{
+   char *buf = NULL;
+   int out_fd = fileno (ctx->outf);
+
+   if (!(buf = xcgi_arena_alloc (ctx->arena, FILE_COPY_SIZE))) {
+      EPRINTF ("OOM error allocating the copy buffer\n");
+      return false;
+   }
+
+   while (len) {
+      ssize_t nbytes = pread (fd, buf, len < FILE_COPY_SIZE ? len
+                                                          : FILE_COPY_SIZE,
+                              offset);
+      if (nbytes <= 0)
+         return false;
+
+      if (out_fd >= 0 ? !(xcgi_net_write (out_fd, buf, nbytes))
+                      : fwrite (buf, 1, nbytes, ctx->outf) != (size_t)nbytes)
+         return false;
+
+      offset += nbytes;
+      len -= nbytes;
+   }
+
+   return (fflush (ctx->outf))==0;
+}
+
+// Sends the headers and the 'len' bytes of the file from 'offset'. The
+// embedded HTTP server sends the file itself after the handler returns;
+// a socket that takes the output unchanged (SCGI) is sent the file with
+// sendfile(), and everything else gets a copy.
+static bool file_send (xcgi_ctx_t *ctx, int fd, off_t offset, size_t len)
+{
+   size_t blen = 0;
+   char *block = header_block (ctx, len, &blen);
+
+   if (!block) {
+      EPRINTF ("OOM error building the response headers\n");
+      return false;
+   }
+
+   ctx->response_sent = true;
+
+   if (fwrite (block, 1, blen, ctx->outf) != blen)
+      return false;
+
+   if ((xcgi_http_sendfile (ctx->outf, fd, offset, len)))
+      return true;
+
+   if ((fflush (ctx->outf))!=0)
+      return false;
+
+   if ((strcmp (ctx->REQUEST_METHOD, "HEAD"))==0)
+      return true;
+
+   if (ctx->out_fd < 0)
+      return file_copy (ctx, fd, offset, len);
+
+   while (len) {
+      ssize_t nbytes = xcgi_net_sendfile (ctx->out_fd, fd, &offset, len);
+      if (nbytes <= 0)
+         return false;
+      len -= nbytes;
+   }
+
+   return true;
+}
+
+/* ************************************************************************
+ * The streamed body. The body is collected in a buffer, and as long as it
+ * fits it is sent with the headers (and a Content-Length) when the
+ * request ends. When the buffer fills up, or the caller flushes it, the
+ * headers are sent without a Content-Length and the body is streamed from
+ * then on, compressed as it goes if the client accepts that.
+ */
+#define BODY_BUFFER_SIZE      (1024 * 32)
+
+// The headers that have yet to be sent ahead of the next compressed
+// output.
+typedef struct body_out_t body_out_t;
+struct body_out_t {
+   xcgi_ctx_t *ctx;
+   char       *block;
+   size_t      blen;
+};
+
+static bool body_out (void *param, const void *data, size_t len)
+{
+   body_out_t *out = param;
+   struct iovec iov[2];
+   int niov = 0;
+
+   if (out->block) {
+      iov[niov].iov_base = out->block;
+      iov[niov++].iov_len = out->blen;
+      out->block = NULL;
+   }
+
+   iov[niov].iov_base = (void *)data;
+   iov[niov++].iov_len = len;
+
+   return response_emit (out->ctx, iov, niov);
+}
+
+// Sends the headers (the first time), the buffered body and the 'len'
+// bytes of 'data', and has the front end push all of it out to the
+// client. Blocks until the transport has accepted the data. 'flush' is
+// passed on to the compressor (see xcgi_compress_write()).
+static bool body_send (xcgi_ctx_t *ctx, const void *data, size_t len,
+                       int flush)
+{
+   body_out_t out = { ctx, NULL, 0 };
+   bool ok = true;
+
+   if (ctx->body_error)
+      return false;
+
+   if (!ctx->body_streaming) {
+      // The length of a streamed body is not known, so it is compressed
+      // whatever its size.
+      int encoding = compress_select (ctx, (size_t)-1);
+      if (encoding != XCGI_ENCODING_IDENTITY &&
+            !(ctx->body_compress = xcgi_compress_new (ctx->arena, encoding,
+                                                      g_compress_level))) {
+         EPRINTF ("Failed to start compressing the response body\n");
+         xcgi_ctx_headers_clear (ctx, "Content-Encoding");
+         encoding = XCGI_ENCODING_IDENTITY;
+      }
+
+      if (!(etag_encode (ctx, encoding))) {
+         EPRINTF ("OOM error setting the ETag\n");
+         return false;
+      }
+
+      if (!(out.block = header_block (ctx, NO_CONTENT_LENGTH, &out.blen))) {
+         EPRINTF ("OOM error building the response headers\n");
+         return false;
+      }
+      ctx->body_streaming = true;
+      ctx->response_sent = true;
+   }
+
+   if (ctx->body_compress) {
+      ok = xcgi_compress_write (ctx->body_compress, ctx->body_buf,
+                                ctx->body_len, XCGI_COMPRESS_NONE,
+                                body_out, &out) &&
+           xcgi_compress_write (ctx->body_compress, data, len, flush,
+                                body_out, &out);
+      if (flush == XCGI_COMPRESS_FINISH) {
+         xcgi_compress_del (ctx->body_compress);
+         ctx->body_compress = NULL;
+      }
+      data = NULL;
+      len = 0;
+   } else if (ctx->body_len) {
+      ok = body_out (&out, ctx->body_buf, ctx->body_len);
+   }
+
+   ctx->body_len = 0;
+
+   // Whatever is left to send: the data when it is not compressed, and
+   // the headers if there was no compressed output yet.
+   if (ok && (len || out.block)) {
+      struct iovec iov[2];
+      int niov = 0;
+      if (out.block) {
+         iov[niov].iov_base = out.block;
+         iov[niov++].iov_len = out.blen;
+      }
+      if (len) {
+         iov[niov].iov_base = (void *)data;
+         iov[niov++].iov_len = len;
+      }
+      ok = response_emit (ctx, iov, niov);
+   }
+
+   if (!ok || !(xcgi_http_flush (ctx->outf))) {
+      EPRINTF ("Failed to send the response body\n");
+      ctx->body_error = true;
+      return false;
+   }
+
+   return true;
+}
+
+/* ************************************************************************
+ * Other request bodies are read into memory before they are parsed, up
+ * to 'xcgi_max_body' bytes (default 16MB).
+ */
+#define CFG_MAX_BODY          ("xcgi_max_body")
+#define DEFAULT_MAX_BODY      (1024 * 1024 * 16)
+
+static size_t g_max_body = DEFAULT_MAX_BODY;
+
+static void body_config (void)
+{
+   int64_t tmp = 0;
+
+   g_max_body = DEFAULT_MAX_BODY;
+   if ((xcgi_cfg_get_int (xcgi_config, CFG_MAX_BODY, &tmp)) && tmp >= 0)
+      g_max_body = tmp;
+}
+
+/* ************************************************************************
+ * multipart/form-data bodies. The body is read in blocks and pushed
+ * through the multipart parser, so it is never held in memory in full.
+ * Fields become query strings, up to 'xcgi_multipart_max_field' bytes
+ * each (default 1MB); the memory held by all the fields of a request is
+ * held to 'xcgi_max_body'. Files are written to temporary files in
+ * 'xcgi_upload_dir' (default $TMPDIR, or /tmp) in large blocks, or are
+ * passed to the handler's sink; the temporary files are removed at the
+ * end of the request. At most 'xcgi_multipart_max_uploads' files
+ * (default 64) are accepted in one request.
+ */
+#define CFG_UPLOAD_DIR           ("xcgi_upload_dir")
+#define CFG_MAX_FIELD            ("xcgi_multipart_max_field")
+#define CFG_MAX_UPLOADS          ("xcgi_multipart_max_uploads")
+
+#define DEFAULT_MAX_FIELD        (1024 * 1024)
+#define DEFAULT_MAX_UPLOADS      (64)
+#define UPLOAD_BLOCK_SIZE        (1024 * 256)
+
+static const char *g_upload_dir;
+static size_t g_max_field = DEFAULT_MAX_FIELD;
+static size_t g_max_uploads = DEFAULT_MAX_UPLOADS;
+
+static void upload_config (void)
+{
+   int64_t tmp = 0;
+
+   // Missing keys are returned as empty strings.
+   g_upload_dir = xcgi_cfg_get (xcgi_config, CFG_UPLOAD_DIR);
+   if (!g_upload_dir || !*g_upload_dir)
+      g_upload_dir = getenv ("TMPDIR");
+   if (!g_upload_dir || !*g_upload_dir)
+      g_upload_dir = "/tmp";
+
+   g_max_field = DEFAULT_MAX_FIELD;
+   if ((xcgi_cfg_get_int (xcgi_config, CFG_MAX_FIELD, &tmp)) && tmp > 0)
+      g_max_field = tmp;
+
+   g_max_uploads = DEFAULT_MAX_UPLOADS;
+   if ((xcgi_cfg_get_int (xcgi_config, CFG_MAX_UPLOADS, &tmp)) && tmp >= 0)
+      g_max_uploads = tmp;
+}
+
+static void uploads_cleanup (xcgi_ctx_t *ctx)
+{
+   for (size_t i=0; ctx && i<ctx->nuploads; i++) {
+      xcgi_upload_t *upload = (xcgi_upload_t *)ctx->uploads[i];
+      if (upload->path)
+         unlink (upload->path);
+   }
+}
+
+static bool multipart_check (const char *content_type)
+{
+   size_t len = strcspn (content_type, ";");
+
+   while (len && isspace ((unsigned char)content_type[len - 1]))
+      len--;
+
+   return len == 19 &&
+          (strncasecmp (content_type, "multipart/form-data", 19))==0 &&
+          qs_content_types_check ("multipart/form-data");
+}
+
+// The state of the parse, for the part being read.
+typedef struct multipart_state_t multipart_state_t;
+struct multipart_state_t {
+   xcgi_ctx_t    *ctx;
+
+   // The file being received, or NULL for a field.
+   xcgi_upload_t *upload;
+   int            fd;
+   char          *block;
+   size_t         blen;
+
+   char          *field;
+   size_t         flen;
+   size_t         fsize;
+
+   // The arena memory taken by all the fields so far.
+   size_t         ftotal;
+};
+
+static bool upload_flush (multipart_state_t *state)
+{
+   if (state->blen && !(xcgi_net_write (state->fd, state->block,
+                                        state->blen))) {
+      EPRINTF ("Failed to write to [%s]\n", state->upload->path);
+      return false;
+   }
+
+   state->blen = 0;
+   return true;
+}
+
+static bool upload_begin (multipart_state_t *state,
+                          const xcgi_multipart_part_t *part)
+{
+   xcgi_ctx_t *ctx = state->ctx;
+   xcgi_upload_t *upload = NULL;
+
+   if (ctx->nuploads >= g_max_uploads) {
+      EPRINTF ("More than %zu files uploaded\n", g_max_uploads);
+      return false;
+   }
+
+   if (!(upload = xcgi_arena_calloc (ctx->arena, sizeof *upload)) ||
+       !(xcgi_arena_array_append (ctx->arena, &ctx->uploads,
+                                  &ctx->nuploads, &ctx->suploads, upload))) {
+      EPRINTF ("OOM error recording an upload\n");
+      return false;
+   }
+
+   upload->name = part->name;
+   upload->filename = part->filename;
+   upload->content_type = part->content_type;
+   state->upload = upload;
+
+   if (ctx->upload_sink)
+      return true;
+
+   size_t len = strlen (g_upload_dir) + 32;
+   char *path = xcgi_arena_alloc (ctx->arena, len);
+   if (!path ||
+         (!state->block &&
+          !(state->block = xcgi_arena_alloc (ctx->arena, UPLOAD_BLOCK_SIZE)))) {
+      EPRINTF ("OOM error starting an upload\n");
+      return false;
+   }
+
+   snprintf (path, len, "%s/xcgi-upload-XXXXXX", g_upload_dir);
+   if ((state->fd = mkstemp (path)) < 0) {
+      EPRINTF ("Failed to create a temporary file in [%s]\n", g_upload_dir);
+      return false;
+   }
+
+   upload->path = path;
+   return true;
+}
+
+static bool upload_data (multipart_state_t *state,
+                         const void *data, size_t len)
+{
+   xcgi_ctx_t *ctx = state->ctx;
+   xcgi_upload_t *upload = state->upload;
+
+   if (ctx->upload_sink) {
+      if (!(ctx->upload_sink (ctx->upload_sink_param, upload, data, len)))
+         return false;
+      upload->size += len;
+      return true;
+   }
+
+   upload->size += len;
+
+   if (state->blen + len > UPLOAD_BLOCK_SIZE && !(upload_flush (state)))
+      return false;
+
+   // A piece as large as the block is written as it is.
+   if (len >= UPLOAD_BLOCK_SIZE) {
+      if (!(xcgi_net_write (state->fd, data, len))) {
+         EPRINTF ("Failed to write to [%s]\n", upload->path);
+         return false;
+      }
+      return true;
+   }
+
+   memcpy (&state->block[state->blen], data, len);
+   state->blen += len;
+   return true;
+}
+
+static bool upload_end (multipart_state_t *state)
+{
+   xcgi_ctx_t *ctx = state->ctx;
+   bool ret = true;
+
+   if (ctx->upload_sink) {
+      ret = ctx->upload_sink (ctx->upload_sink_param, state->upload,
+                              NULL, 0);
+   } else {
+      ret = upload_flush (state);
+      close (state->fd);
+      state->fd = -1;
+   }
+
+   state->upload = NULL;
+   return ret;
+}
+
+static bool field_data (multipart_state_t *state, const void *data, size_t len)
+{
+   if (state->flen + len > g_max_field) {
+      EPRINTF ("Form field larger than %zu bytes\n", g_max_field);
+      return false;
+   }
+
+   if (!state->field || state->flen + len >= state->fsize) {
+      size_t newsize = state->fsize ? state->fsize : 256;
+      while (newsize <= state->flen + len)
+         newsize *= 2;
+
+      if (state->ftotal + newsize > g_max_body) {
+         EPRINTF ("Form fields larger than %zu bytes\n", g_max_body);
+         return false;
+      }
+
+      char *tmp = xcgi_arena_alloc (state->ctx->arena, newsize);
+      if (!tmp) {
+         EPRINTF ("OOM error reading a form field\n");
+         return false;
+      }
+      if (state->flen)
+         memcpy (tmp, state->field, state->flen);
+      state->field = tmp;
+      state->fsize = newsize;
+      state->ftotal += newsize;
+   }
+
+   memcpy (&state->field[state->flen], data, len);
+   state->flen += len;
+   return true;
+}
+
+// The field is added as a query string that is already decoded.
+static bool field_end (multipart_state_t *state,
+                       const xcgi_multipart_part_t *part)
+{
+   xcgi_ctx_t *ctx = state->ctx;
+   qpair_t *pair = NULL;
+
+   if (!state->field && !(field_data (state, "", 0)))
+      return false;
+
+   state->field[state->flen] = 0;
+
+   state->ftotal += sizeof *pair + strlen (part->name);
+   if (state->ftotal > g_max_body) {
+      EPRINTF ("Form fields larger than %zu bytes\n", g_max_body);
+      return false;
+   }
+
+   if (!(pair = xcgi_arena_alloc (ctx->arena, sizeof *pair)))
+      return false;
+
+   pair->name.ptr = (char *)part->name;
+   pair->name.len = strlen (part->name);
+   pair->name.decoded = true;
+   pair->value.ptr = state->field;
+   pair->value.len = state->flen;
+   pair->value.decoded = true;
+
+   state->field = NULL;
+   state->flen = 0;
+   state->fsize = 0;
+
+   return xcgi_arena_array_append (ctx->arena, &ctx->qpairs,
+                                   &ctx->nqpairs, &ctx->sqpairs, pair);
+}
+
+static bool multipart_part (void *param, int event,
+                            const xcgi_multipart_part_t *part,
+                            const void *data, size_t len)
+{
+   multipart_state_t *state = param;
+
+   switch (event) {
+      case XCGI_MULTIPART_BEGIN:
+         return part->filename ? upload_begin (state, part) : true;
+
+      case XCGI_MULTIPART_DATA:
+         return state->upload ? upload_data (state, data, len)
+                              : field_data (state, data, len);
+
+      case XCGI_MULTIPART_END:
+         return state->upload ? upload_end (state)
+                              : field_end (state, part);
+   }
+
+   return false;
+}
+
+static bool xcgi_parse_multipart (xcgi_ctx_t *ctx)
+{
+   bool error = true;
+   multipart_state_t state = { ctx, NULL, -1, NULL, 0, NULL, 0, 0, 0 };
+   xcgi_multipart_t *mp = NULL;
+   char *block = NULL;
+   char *endptr = NULL;
+   size_t clen = 0, total = 0;
+   bool have_clen;
+
+   if (!ctx->inf)
+      return true;
+
+   if (!(mp = xcgi_multipart_new (ctx->arena, ctx->CONTENT_TYPE,
+                                  multipart_part, &state))) {
+      EPRINTF ("No boundary in [%s]\n", ctx->CONTENT_TYPE);
+      goto errorexit;
+   }
+
+   if (!(block = xcgi_arena_alloc (ctx->arena, UPLOAD_BLOCK_SIZE))) {
+      EPRINTF ("OOM error allocating the read buffer\n");
+      goto errorexit;
+   }
+
+   clen = strtoull (ctx->CONTENT_LENGTH, &endptr, 10);
+   have_clen = isdigit ((unsigned char)ctx->CONTENT_LENGTH[0]) && !*endptr;
+
+   while (!have_clen || total < clen) {
+      size_t want = UPLOAD_BLOCK_SIZE;
+      if (have_clen && clen - total < want)
+         want = clen - total;
+
+      size_t nbytes = fread (block, 1, want, ctx->inf);
+      if (nbytes == 0)
+         break;
+      total += nbytes;
+
+      if (!(xcgi_multipart_write (mp, block, nbytes))) {
+         EPRINTF ("Failed to parse the multipart body\n");
+         goto errorexit;
+      }
+   }
+
+   if (!(xcgi_multipart_done (mp))) {
+      EPRINTF ("Incomplete multipart body (%zu bytes)\n", total);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   if (state.fd >= 0)
+      close (state.fd);
+
+   return !error;
+}
+
+/* ************************************************************************
+ * The cgi variables. Each one is a field in the context, and also has a
+ * global variable which reflects the value in the default context.
+ */
+#define CTX_VAR(field)     offsetof (xcgi_ctx_t, field)
+
+static const struct {
+   const char *name;
+   size_t offset;
+   const char **variable;
+} g_vars[] = {
+   { "CONTENT_LENGTH",         CTX_VAR (CONTENT_LENGTH),        &xcgi_CONTENT_LENGTH          },
+   { "CONTENT_TYPE",           CTX_VAR (CONTENT_TYPE),          &xcgi_CONTENT_TYPE            },
+   { "CONTEXT_DOCUMENT_ROOT",  CTX_VAR (CONTEXT_DOCUMENT_ROOT), &xcgi_CONTEXT_DOCUMENT_ROOT   },
+   { "CONTEXT_PREFIX",         CTX_VAR (CONTENT_PREFIX),        &xcgi_CONTENT_PREFIX          },
+   { "DOCUMENT_ROOT",          CTX_VAR (DOCUMENT_ROOT),         &xcgi_DOCUMENT_ROOT           },
+   { "GATEWAY_INTERFACE",      CTX_VAR (GATEWAY_INTERFACE),     &xcgi_GATEWAY_INTERFACE       },
+   { "HOSTNAME",               CTX_VAR (HOSTNAME),              &xcgi_HOSTNAME                },
+   { "HOSTTYPE",               CTX_VAR (HOSTTYPE),              &xcgi_HOSTTYPE                },
+   { "HTTP_ACCEPT",            CTX_VAR (HTTP_ACCEPT),           &xcgi_HTTP_ACCEPT             },
+   { "HTTP_ACCEPT_ENCODING",   CTX_VAR (HTTP_ACCEPT_ENCODING),  &xcgi_HTTP_ACCEPT_ENCODING    },
+   { "HTTP_COOKIE",            CTX_VAR (HTTP_COOKIE),           &xcgi_HTTP_COOKIE             },
+   { "HTTP_HOST",              CTX_VAR (HTTP_HOST),             &xcgi_HTTP_HOST               },
+   { "HTTP_IF_MODIFIED_SINCE", CTX_VAR (HTTP_IF_MODIFIED_SINCE), &xcgi_HTTP_IF_MODIFIED_SINCE  },
+   { "HTTP_IF_NONE_MATCH",     CTX_VAR (HTTP_IF_NONE_MATCH),    &xcgi_HTTP_IF_NONE_MATCH      },
+   { "HTTP_IF_RANGE",          CTX_VAR (HTTP_IF_RANGE),         &xcgi_HTTP_IF_RANGE           },
+   { "HTTP_RANGE",             CTX_VAR (HTTP_RANGE),            &xcgi_HTTP_RANGE              },
+   { "HTTP_REFERER",           CTX_VAR (HTTP_REFERER),          &xcgi_HTTP_REFERER            },
+   { "HTTP_USER_AGENT",        CTX_VAR (HTTP_USER_AGENT),       &xcgi_HTTP_USER_AGENT         },
+   { "HTTPS",                  CTX_VAR (HTTPS),                 &xcgi_HTTPS                   },
+   { "PATH",                   CTX_VAR (PATH),                  &xcgi_PATH                    },
+   { "PATH_INFO",              CTX_VAR (PATH_INFO),             &xcgi_PATH_INFO               },
+   { "PWD",                    CTX_VAR (PWD),                   &xcgi_PWD                     },
+   { "QUERY_STRING",           CTX_VAR (QUERY_STRING),          &xcgi_QUERY_STRING            },
+   { "REMOTE_ADDR",            CTX_VAR (REMOTE_ADDR),           &xcgi_REMOTE_ADDR             },
+   { "REMOTE_HOST",            CTX_VAR (REMOTE_HOST),           &xcgi_REMOTE_HOST             },
+   { "REMOTE_PORT",            CTX_VAR (REMOTE_PORT),           &xcgi_REMOTE_PORT             },
+   { "REMOTE_USER",            CTX_VAR (REMOTE_USER),           &xcgi_REMOTE_USER             },
+   { "REQUEST_METHOD",         CTX_VAR (REQUEST_METHOD),        &xcgi_REQUEST_METHOD          },
+   { "REQUEST_SCHEME",         CTX_VAR (REQUEST_SCHEME),        &xcgi_REQUEST_SCHEME          },
+   { "REQUEST_URI",            CTX_VAR (REQUEST_URI),           &xcgi_REQUEST_URI             },
+   { "SCRIPT_FILENAME",        CTX_VAR (SCRIPT_FILENAME),       &xcgi_SCRIPT_FILENAME         },
+   { "SCRIPT_NAME",            CTX_VAR (SCRIPT_NAME),           &xcgi_SCRIPT_NAME             },
+   { "SERVER_ADDR",            CTX_VAR (SERVER_ADDR),           &xcgi_SERVER_ADDR             },
+   { "SERVER_ADMIN",           CTX_VAR (SERVER_ADMIN),          &xcgi_SERVER_ADMIN            },
+   { "SERVER_NAME",            CTX_VAR (SERVER_NAME),           &xcgi_SERVER_NAME             },
+   { "SERVER_PORT",            CTX_VAR (SERVER_PORT),           &xcgi_SERVER_PORT             },
+   { "SERVER_PROTOCOL",        CTX_VAR (SERVER_PROTOCOL),       &xcgi_SERVER_PROTOCOL         },
+   { "SERVER_SIGNATURE",       CTX_VAR (SERVER_SIGNATURE),      &xcgi_SERVER_SIGNATURE        },
+   { "SERVER_SOFTWARE",        CTX_VAR (SERVER_SOFTWARE),       &xcgi_SERVER_SOFTWARE         },
+};
+
+static const char **ctx_var (xcgi_ctx_t *ctx, size_t index)
+{
+   return (const char **)((char *)ctx + g_vars[index].offset);
+}
+
+static const char *env_getvar (void *param, const char *name)
+{
+   param = param;
+   return getenv (name);
+}
+
+
+/* ************************************************************************
+ * Context management.
+ */
+// Creates a context in 'arena', from which everything in the context is
+// allocated, including the context itself.
+static xcgi_ctx_t *ctx_create (xcgi_arena_t *arena,
+                               const char *(*getvar) (void *, const char *),
+                               void *param,
+                               FILE *inf, FILE *outf)
+{
+   xcgi_ctx_t *ret = NULL;
+
+   if (!getvar || !arena)
+      return NULL;
+
+   if (!(ret = xcgi_arena_calloc (arena, sizeof *ret))) {
+      EPRINTF ("OOM error allocating request context\n");
+      return NULL;
+   }
+
+   for (size_t i=0; i<sizeof g_vars/sizeof g_vars[0]; i++) {
+      const char *tmp = getvar (param, g_vars[i].name);
+      *ctx_var (ret, i) = tmp ? tmp : "";
+   }
+   ret->inf = inf;
+   ret->outf = outf;
+   ret->out_fd = -1;
+   ret->arena = arena;
+
+   if (!(ret->qstrings = (const char ***)array_new (arena)) ||
+       !(ret->path_info = array_new (arena)) ||
+       !(ret->cookies = array_new (arena)) ||
+       !(ret->response_headers = array_new (arena)) ||
+       !(ret->cookielist = (void **)array_new (arena))) {
+      EPRINTF ("OOM error allocating request context\n");
+      return NULL;
+   }
+
+   if (!(parse_path_info (ret))) {
+      EPRINTF ("Failed to parse the path info [%s]\n",
+               ret->PATH_INFO);
+      return NULL;
+   }
+
+   if (!(parse_cookies (ret))) {
+      EPRINTF ("Failed to parse the cookies [%s]\n",
+               ret->HTTP_COOKIE);
+      return NULL;
+   }
+
+   return ret;
+}
+
+xcgi_ctx_t *xcgi_ctx_new (const char *(*getvar) (void *, const char *),
+                          void *param,
+                          FILE *inf, FILE *outf)
+{
+   xcgi_arena_t *arena = NULL;
+   xcgi_ctx_t *ret = NULL;
+
+   if (!getvar)
+      return NULL;
+
+   if (!(arena = xcgi_arena_new (0))) {
+      EPRINTF ("OOM error allocating request arena\n");
+      return NULL;
+   }
+
+   if (!(ret = ctx_create (arena, getvar, param, inf, outf)))
+      xcgi_arena_del (arena);
+
+   return ret;
+}
+
+void xcgi_ctx_del (xcgi_ctx_t *ctx)
+{
+   uploads_cleanup (ctx);
+
+   // The context lives in its own arena.
+   if (ctx)
+      xcgi_arena_del (ctx->arena);
+}
+
+/* ************************************************************************
+ * The default context, which backs the global variables and all the
+ * functions that do not take a context. Its arena is kept for the life
+ * of the process and reset between requests.
+ */
+static xcgi_ctx_t *g_ctx;
+static xcgi_arena_t *g_arena;
+
+// The caller is allowed to replace xcgi_stdin and xcgi_stdout, so the
+// default context picks them up every time it is used.
+static xcgi_ctx_t *ctx_default (void)
+{
+   if (g_ctx) {
+      // A replacement stream does not go to the front end's socket.
+      if (g_ctx->outf != xcgi_stdout)
+         g_ctx->out_fd = -1;
+      g_ctx->inf = xcgi_stdin;
+      g_ctx->outf = xcgi_stdout;
+      g_ctx->db = xcgi_db;
+   }
+
+   return g_ctx;
+}
+
+// Copies the state of the default context into the global variables.
+// Must be called after every change to the default context.
+static void ctx_publish (void)
+{
+   for (size_t i=0; i<sizeof g_vars/sizeof g_vars[0]; i++) {
+      *(g_vars[i].variable) = g_ctx ? *ctx_var (g_ctx, i) : "";
+   }
+
+   xcgi_path_info = g_ctx ? g_ctx->path_info : NULL;
+   xcgi_cookies = g_ctx ? g_ctx->cookies : NULL;
+   xcgi_qstrings = g_ctx ? g_ctx->qstrings : NULL;
+   xcgi_response_headers = g_ctx ? g_ctx->response_headers : NULL;
+   xcgi_arena = g_ctx ? g_ctx->arena : NULL;
+}
+
+xcgi_ctx_t *xcgi_ctx_default (void)
+{
+   return ctx_default ();
+}
+
+bool xcgi_request_begin (const char *(*getvar) (void *, const char *),
+                         void *param,
+                         FILE *inf, FILE *outf)
+{
+   xcgi_request_end ();
+
+   if (!g_arena && !(g_arena = xcgi_arena_new (0))) {
+      EPRINTF ("OOM error allocating request arena\n");
+      return false;
+   }
+
+   g_ctx = ctx_create (g_arena, getvar, param, inf, outf);
+   ctx_publish ();
+
+   xcgi_stdin = inf;
+   xcgi_stdout = outf;
+
+   return g_ctx ? true : false;
+}
+
+void xcgi_request_end (void)
+{
+   uploads_cleanup (g_ctx);
+   xcgi_arena_reset (g_arena);
+   g_ctx = NULL;
+   ctx_publish ();
+}
+
+#define CFG_FRONTEND       ("xcgi_frontend")
+
+bool xcgi_accept (void)
+{
+   static bool (*accept_fptr) (void) = NULL;
+   static bool stopped = false;
+
+   if (stopped)
+      return false;
+
+   if (!accept_fptr) {
+      static const struct {
+         const char *name;
+         bool (*fptr) (void);
+      } frontends[] = {
+         { "",          xcgi_fcgi_accept  },
+         { "cgi",       xcgi_fcgi_accept  },
+         { "fastcgi",   xcgi_fcgi_accept  },
+         { "scgi",      xcgi_scgi_accept  },
+         { "http",      xcgi_http_accept  },
+      };
+
+      const char *frontend = xcgi_cfg_get (xcgi_config, CFG_FRONTEND);
+
+      for (size_t i=0; i<sizeof frontends/sizeof frontends[0]; i++) {
+         if ((strcmp (frontends[i].name, frontend))==0)
+            accept_fptr = frontends[i].fptr;
+      }
+
+      if (!accept_fptr) {
+         EPRINTF ("Unknown front end [%s] in [%s]\n", frontend, "xcgi.ini");
+         return false;
+      }
+
+      // The database handle cannot be shared between processes, so each
+      // worker opens its own.
+      int nworkers = xcgi_prefork_workers ();
+      if (nworkers > 0) {
+         xcgi_dbms_shutdown ();
+
+         if (!(xcgi_prefork_run (nworkers))) {
+            stopped = true;
+            return false;
+         }
+
+         if (!(xcgi_dbms_init ())) {
+            EPRINTF ("Could not connect to db in worker, ignoring.\n");
+         }
+      }
+   }
+
+   return accept_fptr ();
+}
+
+bool xcgi_init (const char *path)
+{
+   bool error = true;
+
+   if (!(load_path (path))) {
+      EPRINTF ("Could not load path for [%s], aborting.\n", path);
+      goto errorexit;
+   }
+
+   compress_config ();
+   etag_config ();
+   upload_config ();
+   body_config ();
+
+   if (!(qs_content_types_init ())) {
+      EPRINTF ("Failed to allocate storage for the content types\n");
+      goto errorexit;
+   }
+
+   if (!(xcgi_request_begin (env_getvar, NULL, stdin, stdout))) {
+      EPRINTF ("Failed to initialise the request from the environment\n");
+      goto errorexit;
+   }
+
+   if (!(xcgi_dbms_init ())) {
+      EPRINTF ("Could not connect to db for [%s], ignoring.\n", path);
+      // Optional, so don't return error
+   }
+
+   error = false;
+
+errorexit:
+
+   if (error) {
+      xcgi_shutdown ();
+   }
+
+   return !error;
+}
+
+void xcgi_shutdown (void)
+{
+   xcgi_body_end ();
+
+   if (xcgi_stdin)
+      fclose (xcgi_stdin);
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   xcgi_dbms_shutdown ();
+   xcgi_request_end ();
+   xcgi_arena_del (g_arena);
+   g_arena = NULL;
+   qs_content_types_shutdown ();
+   xcgi_cfg_del (xcgi_config);
+   xcgi_config = NULL;
+}
+
+#define MARKER_EOV      ("MARKER-END-OF-VARS")
+
+#define LINE_SIZE       (1024  * 16)
+
+bool xcgi_save (const char *fname)
+{
+   bool error = true;
+   FILE *outf = NULL;
+   size_t clen = 0;
+   char *line = NULL;
+
+   if (!(line = malloc (LINE_SIZE))) {
+      EPRINTF ("OOM error allocating line buffer\n");
+      goto errorexit;
+   }
+
+   if (!(outf = fopen (fname, "w"))) {
+      EPRINTF ("Failed to open [%s] for writing: %m\n", fname);
+      goto errorexit;
+   }
+
+   // The line buffer is used for the escaped values that fit in it.
    for (size_t i=0; i<sizeof g_vars/sizeof g_vars[0]; i++) {
-      char *tmp = xcgi_string_escape (*(g_vars[i].variable));
+      const char *value = *(g_vars[i].variable);
+      size_t len = strlen (value);
+      char *tmp = NULL;
+
+      if (len * 3 + 1 <= LINE_SIZE) {
+         xcgi_string_escape_into (line, value, len);
+         fprintf (outf, "%s\x01%s\n", g_vars[i].name, line);
+         continue;
+      }
+
+      if (!(tmp = xcgi_string_escape (value)))
+         goto errorexit;
       fprintf (outf, "%s\x01%s\n", g_vars[i].name, tmp);
       free (tmp);
    }
@@ -705,9 +2428,9 @@ bool xcgi_save (const char *fname)
    if ((sscanf (xcgi_getenv ("CONTENT_LENGTH"), "%zu", &clen))==1) {
       fprintf (outf, "%zu\n", clen);
       while (!ferror (stdin) && !feof (stdin) && clen>0) {
-         size_t must_read = clen < sizeof g_line ? clen : sizeof g_line;
-         size_t nbytes = fread (g_line, 1, must_read, stdin);
-         size_t written = fwrite (g_line, 1, nbytes, outf);
+         size_t must_read = clen < LINE_SIZE ? clen : LINE_SIZE;
+         size_t nbytes = fread (line, 1, must_read, stdin);
+         size_t written = fwrite (line, 1, nbytes, outf);
          if (written != nbytes) {
             EPRINTF ("Wrote only [%zu/%zu] bytes to file\n",
                      written, nbytes);
@@ -724,6 +2447,8 @@ errorexit:
       fclose (outf);
    }
 
+   free (line);
+
    return !error;
 }
 
@@ -734,6 +2459,12 @@ bool xcgi_load (const char *path, const char *fname)
    char *tmp = NULL;
    size_t nlines = 0;
    size_t clen = 0;
+   char *line = NULL;
+
+   if (!(line = malloc (LINE_SIZE))) {
+      EPRINTF ("OOM error allocating line buffer\n");
+      goto errorexit;
+   }
 
    if (!(inf = fopen (fname, "r"))) {
       EPRINTF ("Failed to open [%s] for reading: %m\n", fname);
@@ -741,24 +2472,24 @@ bool xcgi_load (const char *path, const char *fname)
    }
 
    while (!(feof (inf) && !ferror (inf))) {
-      char *ltmp = fgets (g_line, sizeof g_line - 1, inf);
+      char *ltmp = fgets (line, LINE_SIZE - 1, inf);
       if (!ltmp) {
          break;
       }
 
-      tmp = strchr (g_line, '\n');
+      tmp = strchr (line, '\n');
       if (tmp)
          *tmp = 0;
 
       nlines++;
-      g_line[sizeof g_line - 1] = 0;
-      if ((memcmp (g_line, MARKER_EOV, strlen (MARKER_EOV)))==0)
+      line[LINE_SIZE - 1] = 0;
+      if ((memcmp (line, MARKER_EOV, strlen (MARKER_EOV)))==0)
          break;
 
-      tmp = strchr (g_line, 0x01);
+      tmp = strchr (line, 0x01);
       if (!tmp) {
          EPRINTF ("%zu Failed parsing variable [%s]. Aborting\n",
-                           nlines, g_line);
+                           nlines, line);
          goto errorexit;
       }
       *tmp++ = 0;
@@ -768,365 +2499,861 @@ bool xcgi_load (const char *path, const char *fname)
          goto errorexit;
       }
 
-      // TODO: For Windows must use putenv_s()
-      setenv (g_line, ltmp, 1);
-      free (ltmp);
-   }
+      // TODO: For Windows must use putenv_s()
+      setenv (line, ltmp, 1);
+      free (ltmp);
+   }
+
+   xcgi_request_end ();
+   qs_content_types_shutdown ();
+
+   xcgi_init (path);
+
+   if (!(fgets (line, LINE_SIZE - 1, inf))) {
+      error = false;
+      goto errorexit;
+   }
+
+   tmp = strchr (line, '\n');
+   if (tmp)
+      *tmp = 0;
+
+   if ((strcmp (xcgi_getenv ("CONTENT_LENGTH"), line))!=0) {
+      EPRINTF ("Content length differs: [%s:%s]\n",
+                  xcgi_getenv ("CONTENT_LENGTH"), line);
+      goto errorexit;
+   }
+
+   if ((sscanf (line, "%zu\n", &clen))!=1)
+      goto errorexit;
+
+   xcgi_stdin = inf;
+
+   error = false;
+
+errorexit:
+   if (error && inf) {
+      fclose (inf);
+   }
+
+   free (line);
+
+   return !error;
+}
+
+const char *xcgi_ctx_getenv (xcgi_ctx_t *ctx, const char *name)
+{
+   if (!ctx || !name)
+      return "";
+
+   for (size_t i=0; i<sizeof g_vars / sizeof g_vars[0]; i++) {
+      if ((strcmp (g_vars[i].name, name))==0)
+         return *ctx_var (ctx, i);
+   }
+
+   return "";
+}
+
+const char *xcgi_getenv (const char *name)
+{
+   return xcgi_ctx_getenv (ctx_default (), name);
+}
+
+char *xcgi_string_escape (const char *src)
+{
+   char *ret = NULL;
+   size_t len = 0;
+
+   if (!src)
+      return NULL;
+
+   len = strlen (src);
+
+   if (!(ret = malloc (xcgi_url_encoded_len (src, len) + 1))) {
+      EPRINTF ("OOM error allocating escaped string\n");
+      return NULL;
+   }
+
+   xcgi_url_encode (ret, src, len);
+
+   return ret;
+}
+
+size_t xcgi_string_escape_into (char *dst, const char *src, size_t len)
+{
+   if (!dst || !src)
+      return 0;
+
+   return xcgi_url_encode (dst, src, len);
+}
+
+char *xcgi_string_unescape (const char *src)
+{
+   char *ret = NULL;
+   size_t len = 0;
+
+   if (!src)
+      return NULL;
+
+   len = strlen (src);
+
+   if (!(ret = malloc (len + 1))) {
+      EPRINTF ("OOM error allocating unescaped string\n");
+      return NULL;
+   }
+
+   xcgi_url_decode (ret, src, len);
+
+   return ret;
+}
+
+size_t xcgi_string_unescape_into (char *dst, const char *src, size_t len)
+{
+   if (!dst || !src)
+      return 0;
+
+   return xcgi_url_decode (dst, src, len);
+}
+
+bool xcgi_qstrings_accept_content_type (const char *content_type)
+{
+   return (qs_content_types_add (content_type)==NULL) ? false : true;
+}
+
+bool xcgi_qstrings_reject_content_type (const char *content_type)
+{
+   return qs_content_types_remove (content_type);
+}
+
+static bool xcgi_parse_query_string (xcgi_ctx_t *ctx)
+{
+   size_t len = strlen (ctx->QUERY_STRING);
+   char *copy = xcgi_arena_strndup (ctx->arena, ctx->QUERY_STRING, len);
+
+   if (!copy) {
+      EPRINTF ("OOM error copying the query string\n");
+      return false;
+   }
+
+   return qpairs_scan (ctx, copy, len);
+}
+
+#define POST_BLOCK_SIZE       (1024 * 64)
+
+// Reads the body from 'inf' into the arena, in large blocks. When the
+// content length is known the body is read straight into its final
+// place; otherwise it is read until EOF into a growing buffer which is
+// then moved into the arena. Bodies larger than 'xcgi_max_body' bytes
+// (default 16MB) are refused. Returns NULL on error.
+static char *read_body (xcgi_ctx_t *ctx, size_t *len)
+{
+   bool error = true;
+   char *ret = NULL;
+   char *tmp = NULL;
+   size_t size = 0;
+   size_t clen = 0;
+   char *endptr = NULL;
+
+   *len = 0;
+
+   if (!ctx->inf)
+      return xcgi_arena_strdup (ctx->arena, "");
+
+   clen = strtoull (ctx->CONTENT_LENGTH, &endptr, 10);
+   if (isdigit ((unsigned char)ctx->CONTENT_LENGTH[0]) && !*endptr) {
+      if (clen == SIZE_MAX || clen > g_max_body) {
+         EPRINTF ("Refusing POST data of [%s] bytes\n", ctx->CONTENT_LENGTH);
+         goto errorexit;
+      }
+
+      if (!(ret = xcgi_arena_alloc (ctx->arena, clen + 1))) {
+         EPRINTF ("OOM error allocating %zu bytes for POST data\n", clen);
+         goto errorexit;
+      }
+
+      while (*len < clen) {
+         size_t want = clen - *len;
+         size_t nbytes = fread (&ret[*len], 1,
+                                want < POST_BLOCK_SIZE ? want : POST_BLOCK_SIZE,
+                                ctx->inf);
+         if (nbytes == 0)
+            break;
+         *len += nbytes;
+      }
+
+      ret[*len] = 0;
+      error = false;
+      goto errorexit;
+   }
+
+   while (!feof (ctx->inf) && !ferror (ctx->inf)) {
+      if (size - *len < POST_BLOCK_SIZE) {
+         size_t newsize = size ? size * 2 : POST_BLOCK_SIZE;
+         char *newtmp = realloc (tmp, newsize);
+         if (!newtmp) {
+            EPRINTF ("OOM error reading POST data\n");
+            goto errorexit;
+         }
+         tmp = newtmp;
+         size = newsize;
+      }
+
+      size_t nbytes = fread (&tmp[*len], 1, POST_BLOCK_SIZE, ctx->inf);
+      if (nbytes == 0)
+         break;
+      *len += nbytes;
+
+      if (*len > g_max_body) {
+         EPRINTF ("Refusing POST data of more than %zu bytes\n", g_max_body);
+         goto errorexit;
+      }
+   }
+
+   if (!(ret = xcgi_arena_strndup (ctx->arena, tmp ? tmp : "", *len))) {
+      EPRINTF ("OOM error allocating %zu bytes for POST data\n", *len);
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   free (tmp);
+
+   if (error) {
+      ret = NULL;
+      *len = 0;
+   }
+
+   return ret;
+}
+
+// The body is scanned in place, like the query string, so the pairs are
+// slices of the body and are only decoded when they are read.
+static bool xcgi_parse_POST_query_string (xcgi_ctx_t *ctx)
+{
+   size_t len = 0;
+   char *body = read_body (ctx, &len);
+
+   if (!body)
+      return false;
+
+   return qpairs_scan (ctx, body, len);
+}
+
+bool xcgi_ctx_qstrings_scan (xcgi_ctx_t *ctx)
+{
+   bool error = true;
+
+   if (!ctx)
+      goto errorexit;
+
+   if (ctx->qscanned)
+      return true;
+
+   if (!(xcgi_parse_query_string (ctx)))
+      goto errorexit;
+
+   if ((multipart_check (ctx->CONTENT_TYPE))) {
+      if (!(xcgi_parse_multipart (ctx)))
+         goto errorexit;
+   } else if ((qs_content_types_check (ctx->CONTENT_TYPE))) {
+      if (!(xcgi_parse_POST_query_string (ctx)))
+         goto errorexit;
+   }
+
+   ctx->qscanned = true;
+
+   error = false;
+
+errorexit:
+   // Drop a partial result, so that scanning again does not duplicate
+   // the pairs found before the error.
+   if (error && ctx) {
+      ctx->nqpairs = 0;
+      if (ctx->qpairs)
+         ctx->qpairs[0] = NULL;
+   }
+
+   return !error;
+}
+
+bool xcgi_ctx_qstrings_parse (xcgi_ctx_t *ctx)
+{
+   bool error = true;
+
+   if (!(xcgi_ctx_qstrings_scan (ctx)))
+      goto errorexit;
+
+   if (!(qstrings_fill (ctx))) {
+      EPRINTF ("OOM error filling in the qstrings\n");
+      goto errorexit;
+   }
+
+   if (!ctx->qindex && !(qindex_build (ctx))) {
+      EPRINTF ("OOM error building the qstrings index\n");
+      goto errorexit;
+   }
+
+   error = false;
+
+errorexit:
+   return !error;
+}
+
+size_t xcgi_ctx_qstrings_count (xcgi_ctx_t *ctx)
+{
+   return ctx ? ctx->nqpairs : 0;
+}
+
+const char *xcgi_ctx_qstrings_name (xcgi_ctx_t *ctx, size_t index)
+{
+   if (!ctx || index >= ctx->nqpairs)
+      return NULL;
+
+   return qslice_decode (&((qpair_t *)ctx->qpairs[index])->name);
+}
+
+const char *xcgi_ctx_qstrings_value (xcgi_ctx_t *ctx, size_t index)
+{
+   if (!ctx || index >= ctx->nqpairs)
+      return NULL;
+
+   return qslice_decode (&((qpair_t *)ctx->qpairs[index])->value);
+}
+
+const char *xcgi_ctx_qstrings_get (xcgi_ctx_t *ctx, const char *name)
+{
+   qpair_t *pair = NULL;
+
+   if (!ctx || !name || !(pair = qindex_find (ctx, name)))
+      return NULL;
+
+   return qslice_decode (&pair->value);
+}
+
+const char **xcgi_ctx_qstrings_get_all (xcgi_ctx_t *ctx, const char *name,
+                                        size_t *nvalues)
+{
+   const char **ret = NULL;
+   qpair_t *first = NULL;
+   size_t count = 0;
 
-   qstrings_shutdown ();
-   qs_content_types_shutdown ();
-   path_info_shutdown ();
-   response_headers_shutdown ();
+   if (nvalues)
+      *nvalues = 0;
 
-   xcgi_init (path);
+   if (!ctx || !name || !(first = qindex_find (ctx, name)))
+      return NULL;
 
-   if (!(fgets (g_line, sizeof g_line - 1, inf))) {
-      error = false;
-      goto errorexit;
+   for (qpair_t *pair = first; pair; ) {
+      count++;
+      pair = pair->next ? ctx->qpairs[pair->next - 1] : NULL;
    }
 
-   tmp = strchr (g_line, '\n');
-   if (tmp)
-      *tmp = 0;
+   if (!(ret = xcgi_arena_alloc (ctx->arena, sizeof *ret * (count + 1))))
+      return NULL;
 
-   if ((strcmp (xcgi_getenv ("CONTENT_LENGTH"), g_line))!=0) {
-      EPRINTF ("Content length differs: [%s:%s]\n",
-                  xcgi_getenv ("CONTENT_LENGTH"), g_line);
-      goto errorexit;
+   count = 0;
+   for (qpair_t *pair = first; pair; ) {
+      ret[count++] = qslice_decode (&pair->value);
+      pair = pair->next ? ctx->qpairs[pair->next - 1] : NULL;
    }
+   ret[count] = NULL;
 
-   if ((sscanf (g_line, "%zu\n", &clen))!=1)
-      goto errorexit;
+   if (nvalues)
+      *nvalues = count;
 
-   xcgi_stdin = inf;
+   return ret;
+}
 
-   error = false;
+bool xcgi_ctx_headers_value_set (xcgi_ctx_t *ctx,
+                                 const char *header, const char *value)
+{
+   if (!ctx || !header || !value)
+      return false;
 
-errorexit:
-   if (error && inf) {
-      fclose (inf);
-   }
+   size_t index = response_headers_find (ctx, header);
 
-   return !error;
+   return index == (size_t)-1 ? header_add (ctx, header, value)
+                              : header_append (ctx, index, value);
 }
 
-const char *xcgi_getenv (const char *name)
+void xcgi_ctx_headers_clear (xcgi_ctx_t *ctx, const char *header)
 {
-   for (size_t i=0; i<sizeof g_vars / sizeof g_vars[0]; i++) {
-      if ((strcmp (g_vars[i].name, name))==0)
-         return *(g_vars[i].variable);
-   }
+   if (!ctx)
+      return;
 
-   return "";
+   size_t index = response_headers_find (ctx, header);
+
+   if (index != (size_t)-1) {
+      // Moves the terminating NULLs down as well.
+      memmove (&ctx->response_headers[index],
+               &ctx->response_headers[index + 1],
+               sizeof *ctx->response_headers *
+                  (ctx->nresponse_headers - index));
+      memmove (&ctx->header_entries[index],
+               &ctx->header_entries[index + 1],
+               sizeof *ctx->header_entries *
+                  (ctx->nheader_entries - index));
+      ctx->nresponse_headers--;
+      ctx->nheader_entries--;
+
+      // The positions of the later headers have changed.
+      memset (ctx->header_index, 0,
+              sizeof (size_t) * ctx->header_index_size);
+      for (size_t i=0; i<ctx->nresponse_headers; i++) {
+         header_index_add (ctx, i);
+      }
+   }
 }
 
-char *xcgi_string_escape (const char *src)
+bool xcgi_ctx_headers_write (xcgi_ctx_t *ctx)
 {
-   bool error = true;
-   char *ret = NULL;
-
-   static const char *allowed =
-      "abcdefghijklmnopqrstuvwxyz"
-      "ABCDEFGHIJKLMNOPQRSTUVWXYZ"
-      "0123456789"
-      "$-_.+!*'(),";
+   if (!ctx || !ctx->response_headers)
+      return true;
 
-   if (!src)
-      return NULL;
+   if (ctx->not_modified)
+      return not_modified_send (ctx, compress_select (ctx, (size_t)-1));
 
-   size_t dst_size = 0;
-   size_t dst_index = 0;
+   size_t len = 0;
+   char *block = header_block (ctx, NO_CONTENT_LENGTH, &len);
 
-   for (size_t i=0; src[i]; i++) {
-      if (!(strchr (allowed, src[i])))
-         dst_size += 2;
-      dst_size++;
+   if (!block) {
+      EPRINTF ("OOM error building the response headers\n");
+      return false;
    }
 
-   if (!(ret = malloc (dst_size + 1))) {
-      EPRINTF ("OOM error allocating escaped string\n");
-      goto errorexit;
+   ctx->response_sent = true;
+
+   // The body follows through the stream, so the block is left in the
+   // stream's buffer to go out with the start of the body.
+   return fwrite (block, 1, len, ctx->outf) == len;
+}
+
+bool xcgi_ctx_response_write (xcgi_ctx_t *ctx, const void *body, size_t len)
+{
+   if (!ctx || !ctx->response_headers || (!body && len))
+      return false;
+
+   if (!ctx->not_modified && etag_applies (ctx)) {
+      if (g_auto_etag && !response_header_value (ctx, "ETag") &&
+            !(etag_set (ctx, body, len))) {
+         EPRINTF ("OOM error setting the ETag\n");
+         return false;
+      }
+      ctx->not_modified = etag_match (ctx);
    }
 
-   memset (ret, 0, dst_size + 1);
+   if (ctx->not_modified)
+      return not_modified_send (ctx, compress_select (ctx, len));
+
+   ctx->response_sent = true;
 
-   for (size_t i=0; src[i]; i++) {
-      if (!(strchr (allowed, src[i]))) {
-         ret[dst_index++] = '%';
-         sprintf (&ret[dst_index], "%02x", src[i]);
-         dst_index += 2;
+   int encoding = compress_select (ctx, len);
+   if (encoding != XCGI_ENCODING_IDENTITY) {
+      size_t dlen = 0;
+      const void *tmp = compress_body (ctx, encoding, body, len, &dlen);
+      if (tmp) {
+         body = tmp;
+         len = dlen;
       } else {
-         ret[dst_index++] = src[i];
+         EPRINTF ("Failed to compress the %zu byte response\n", len);
+         xcgi_ctx_headers_clear (ctx, "Content-Encoding");
+         encoding = XCGI_ENCODING_IDENTITY;
       }
    }
 
-   error = false;
-errorexit:
+   if (!(etag_encode (ctx, encoding))) {
+      EPRINTF ("OOM error setting the ETag\n");
+      return false;
+   }
 
-   if (error) {
-      free (ret);
-      ret = NULL;
+   size_t blen = 0;
+   char *block = header_block (ctx, len, &blen);
+
+   if (!block) {
+      EPRINTF ("OOM error building the response headers\n");
+      return false;
    }
 
-   return ret;
+   struct iovec iov[2] = {
+      { block, blen },
+      { (void *)body, len },
+   };
+
+   if (!(response_emit (ctx, iov, len ? 2 : 1))) {
+      EPRINTF ("Failed to write the %zu byte response\n", blen + len);
+      return false;
+   }
 
+   return true;
 }
 
-char *xcgi_string_unescape (const char *src)
+bool xcgi_ctx_body_write (xcgi_ctx_t *ctx, const void *data, size_t len)
 {
-   bool error = true;
-   char *ret = NULL;
-   size_t len = 0,
-          index = 0;
+   if (!ctx || (!data && len) || ctx->body_done || ctx->body_error)
+      return false;
 
-   if (!src)
-      return NULL;
+   if (!ctx->body_buf &&
+         !(ctx->body_buf = xcgi_arena_alloc (ctx->arena, BODY_BUFFER_SIZE))) {
+      EPRINTF ("OOM error allocating the body buffer\n");
+      return false;
+   }
 
-   len = strlen (src) + 1;
+   if (ctx->body_len + len <= BODY_BUFFER_SIZE) {
+      memcpy (&ctx->body_buf[ctx->body_len], data, len);
+      ctx->body_len += len;
+      return true;
+   }
 
-   if (!(ret = malloc (len)))
-      goto errorexit;
+   // Large writes are sent straight from the caller's buffer.
+   return body_send (ctx, data, len, XCGI_COMPRESS_NONE);
+}
 
-   for (size_t i=0; src[i] && i<len; i++) {
+bool xcgi_ctx_body_flush (xcgi_ctx_t *ctx)
+{
+   if (!ctx || ctx->body_done)
+      return false;
 
-      if (src[i]!='%') {
-         ret[index++] = src[i];
-         continue;
-      }
+   return body_send (ctx, NULL, 0, XCGI_COMPRESS_SYNC);
+}
 
-      int tmp;
-      char c;
-      i++;
-      if ((sscanf (&src[i], "%02x", &tmp))!=1) {
-         EPRINTF ("Failed to scan escaped character at %s\n",
-                  &src[i]);
-         goto errorexit;
-      }
-      c = tmp;
-      ret[index++] = c;
-      i++;
-   }
+bool xcgi_ctx_body_end (xcgi_ctx_t *ctx)
+{
+   if (!ctx || ctx->body_done)
+      return true;
 
-   ret[index] = 0;
+   // After a matching xcgi_etag_check() the handler may not have written
+   // anything at all.
+   bool not_modified = ctx->not_modified && !ctx->response_sent;
 
-   error = false;
+   if (!not_modified && !ctx->body_buf && !ctx->body_streaming)
+      return true;
 
-errorexit:
+   ctx->body_done = true;
 
-   if (error) {
-      free (ret);
-      ret = NULL;
-   }
+   if (not_modified)
+      return not_modified_send (ctx, compress_select (ctx, ctx->body_buf ?
+                                                           ctx->body_len :
+                                                           (size_t)-1));
 
-   return ret;
-}
+   if (!ctx->body_streaming)
+      return xcgi_ctx_response_write (ctx, ctx->body_buf, ctx->body_len);
 
-bool xcgi_qstrings_accept_content_type (const char *content_type)
-{
-   return (qs_content_types_add (content_type)==NULL) ? false : true;
+   return body_send (ctx, NULL, 0, XCGI_COMPRESS_FINISH);
 }
 
-bool xcgi_qstrings_reject_content_type (const char *content_type)
+bool xcgi_ctx_etag_check (xcgi_ctx_t *ctx, const char *version)
 {
-   return qs_content_types_remove (content_type);
+   if (!ctx || !version)
+      return false;
+
+   if (!(etag_set (ctx, version, strlen (version)))) {
+      EPRINTF ("OOM error setting the ETag\n");
+      return false;
+   }
+
+   ctx->not_modified = etag_applies (ctx) && etag_match (ctx);
+   return ctx->not_modified;
 }
 
-static bool xcgi_parse_query_string (void)
+bool xcgi_ctx_send_file (xcgi_ctx_t *ctx, const char *path)
 {
    bool error = true;
-   char *uestring = xcgi_string_unescape (xcgi_QUERY_STRING);
+   file_info_t info;
+   off_t first = 0, len = 0;
+   int fd = -1;
+
+   if (!ctx || !(path_safe (path)) || (fd = file_open (path)) < 0)
+      return false;
+
+   struct stat sb;
+   if ((fstat (fd, &sb))!=0 || !S_ISREG (sb.st_mode)) {
+      close (fd);
+      return false;
+   }
+
+   info.size = sb.st_size;
+   info.mtime = sb.st_mtime;
+   info.mime = mime_type (path);
+
+   // The handler is not expected to write anything else.
+   ctx->body_done = true;
 
-   char *pair = NULL;
+   if (!(file_headers (ctx, &info))) {
+      EPRINTF ("OOM error setting the file headers\n");
+      goto errorexit;
+   }
+
+   if (etag_applies (ctx) && file_not_modified (ctx, &info)) {
+      ctx->not_modified = true;
+      error = !(not_modified_send (ctx, XCGI_ENCODING_IDENTITY));
+      goto errorexit;
+   }
+
+   len = info.size;
 
-   pair = strtok (uestring, "&");
-   while (pair) {
-      char *sep = strchr (pair, '=');
-      if (!sep) {
-         EPRINTF ("Failed to find delimiter in [%s]\n", pair);
+   switch (file_range (ctx, &info, &first, &len)) {
+      case -1: {
+         char range[64];
+         snprintf (range, sizeof range, "bytes */%llu",
+                   (unsigned long long)info.size);
+         error = !(status_set (ctx, "416 Range Not Satisfiable")) ||
+                 !(xcgi_ctx_headers_value_set (ctx, "Content-Range", range)) ||
+                 !(xcgi_ctx_response_write (ctx, NULL, 0));
          goto errorexit;
       }
-      *sep = 0;
-      if (!(qstrings_add (pair, &sep[1]))) {
-         EPRINTF ("Failed to add qstrings [%s:%s]\n", pair, sep);
-         goto errorexit;
+
+      case 1: {
+         char range[96];
+         snprintf (range, sizeof range, "bytes %llu-%llu/%llu",
+                   (unsigned long long)first,
+                   (unsigned long long)(first + len - 1),
+                   (unsigned long long)info.size);
+         if (!(status_set (ctx, "206 Partial Content")) ||
+             !(xcgi_ctx_headers_value_set (ctx, "Content-Range", range))) {
+            EPRINTF ("OOM error setting the range headers\n");
+            goto errorexit;
+         }
+         break;
       }
-      *sep = '=';
-      pair = strtok (NULL, "&");
+   }
+
+   if (!(file_send (ctx, fd, first, len))) {
+      EPRINTF ("Failed to send [%s]\n", path);
+      goto errorexit;
    }
 
    error = false;
 
 errorexit:
+   close (fd);
 
-   free (uestring);
    return !error;
 }
 
-static char *read_next_pair (FILE *inf)
+size_t xcgi_ctx_cookies_count (xcgi_ctx_t *ctx)
 {
-   bool error = true;
-   char *ret = NULL;
-
-   char tmp[2];
-   tmp[0] = 0;
-   tmp[1] = 0;
+   return ctx ? ctx->ncookies : 0;
+}
 
-   while (!feof (inf) && !ferror (inf) && ((tmp[0] = fgetc (inf))!=EOF)) {
-      if (tmp[0]=='&')
-         break;
+const char *xcgi_ctx_cookie_get (xcgi_ctx_t *ctx, const char *name)
+{
+   if (!ctx || !name)
+      return NULL;
 
-      if (!(ds_str_append (&ret, tmp, NULL))) {
-         EPRINTF ("OOM error reading POST pairs\n");
-         goto errorexit;
-      }
+   if (!ctx->cookie_index && !(cookie_index_build (ctx))) {
+      EPRINTF ("OOM error building the cookie index\n");
+      return NULL;
    }
 
-   error = false;
-
-errorexit:
-   if (error) {
-      free (ret);
-      ret = NULL;
+   cookie_entry_t *entries = ctx->cookie_entries;
+   size_t *slots = ctx->cookie_index;
+   size_t len = strlen (name);
+   uint32_t hash = name_hash (name, len);
+   size_t slot = hash & (ctx->cookie_index_size - 1);
+
+   while (slots[slot]) {
+      cookie_entry_t *entry = &entries[slots[slot] - 1];
+      if (entry->hash == hash && entry->len == len &&
+            (memcmp (entry->name, name, len))==0)
+         return entry->value;
+      slot = (slot + 1) & (ctx->cookie_index_size - 1);
    }
-   return ret;
+
+   return NULL;
 }
 
-static bool xcgi_parse_POST_query_string (void)
+void xcgi_ctx_uploads_sink_set (xcgi_ctx_t *ctx, xcgi_upload_sink_t *sink,
+                                void *param)
 {
-   bool error = true;
-   char *pair = NULL;
-   char *tmp = NULL;
+   if (!ctx)
+      return;
 
-   while ((pair = read_next_pair (xcgi_stdin))) {
-      free (tmp);
-      tmp = xcgi_string_unescape (pair);
-      free (pair); pair = NULL;
+   ctx->upload_sink = sink;
+   ctx->upload_sink_param = param;
+}
 
-      char *sep = strchr (tmp, '=');
-      if (!sep) {
-         EPRINTF ("Failed to find delimiter in [%s]\n", tmp);
-         goto errorexit;
-      }
+size_t xcgi_ctx_uploads_count (xcgi_ctx_t *ctx)
+{
+   return ctx ? ctx->nuploads : 0;
+}
 
-      *sep++ = 0;
+const xcgi_upload_t *xcgi_ctx_uploads_entry (xcgi_ctx_t *ctx, size_t index)
+{
+   if (!ctx || index >= ctx->nuploads)
+      return NULL;
 
-      if (!(qstrings_add (tmp, sep))) {
-         EPRINTF ("Failed to add qstrings [%s:%s]\n", tmp, sep);
-         goto errorexit;
-      }
+   return (xcgi_upload_t *)ctx->uploads[index];
+}
 
+const xcgi_upload_t *xcgi_ctx_upload_get (xcgi_ctx_t *ctx, const char *name)
+{
+   for (size_t i=0; ctx && name && i<ctx->nuploads; i++) {
+      xcgi_upload_t *upload = (xcgi_upload_t *)ctx->uploads[i];
+      if ((strcmp (upload->name, name))==0)
+         return upload;
    }
 
-   error = false;
-
-errorexit:
+   return NULL;
+}
 
-   free (tmp);
+size_t xcgi_ctx_path_info_count (xcgi_ctx_t *ctx)
+{
+   return ctx ? ctx->npath_info : 0;
+}
 
-   return !error;
+size_t xcgi_ctx_headers_count (xcgi_ctx_t *ctx)
+{
+   return ctx ? ctx->nresponse_headers : 0;
 }
 
+/* ************************************************************************
+ * The functions that operate on the default context.
+ */
 bool xcgi_qstrings_parse (void)
 {
-   bool error = true;
+   bool ret = xcgi_ctx_qstrings_parse (ctx_default ());
+   ctx_publish ();
+   return ret;
+}
 
-   if (!(xcgi_parse_query_string ()))
-      goto errorexit;
+size_t xcgi_qstrings_count (void)
+{
+   return xcgi_ctx_qstrings_count (ctx_default ());
+}
 
-   if ((qs_content_types_check (xcgi_CONTENT_TYPE))) {
-      if (!(xcgi_parse_POST_query_string ()))
-         goto errorexit;
-   }
+bool xcgi_qstrings_scan (void)
+{
+   return xcgi_ctx_qstrings_scan (ctx_default ());
+}
 
-   error = false;
+const char *xcgi_qstrings_name (size_t index)
+{
+   return xcgi_ctx_qstrings_name (ctx_default (), index);
+}
 
-errorexit:
-   return !error;
+const char *xcgi_qstrings_value (size_t index)
+{
+   return xcgi_ctx_qstrings_value (ctx_default (), index);
 }
 
-size_t xcgi_qstrings_count (void)
+const char *xcgi_qstrings_get (const char *name)
 {
-   return ds_array_length ((void **)xcgi_qstrings);
+   return xcgi_ctx_qstrings_get (ctx_default (), name);
 }
 
-bool xcgi_headers_value_set (const char *header, const char *value)
+const char **xcgi_qstrings_get_all (const char *name, size_t *nvalues)
 {
-   size_t index = response_headers_find (header);
-   char *tmp = NULL;
+   return xcgi_ctx_qstrings_get_all (ctx_default (), name, nvalues);
+}
 
-   if (index == (size_t)-1) {
+bool xcgi_headers_value_set (const char *header, const char *value)
+{
+   bool ret = xcgi_ctx_headers_value_set (ctx_default (), header, value);
+   ctx_publish ();
+   return ret;
+}
 
-      if (!(ds_str_printf (&tmp, "%s: %s", header, value)))
-         return false;
+void xcgi_headers_clear (const char *header)
+{
+   xcgi_ctx_headers_clear (ctx_default (), header);
+   ctx_publish ();
+}
 
-      bool ret = ds_array_ins_tail ((void ***)&xcgi_response_headers, tmp);
-      if (!ret)
-         free (tmp);
-      return ret;
+bool xcgi_headers_write (void)
+{
+   return xcgi_ctx_headers_write (ctx_default ());
+}
 
-   }
+bool xcgi_response_write (const void *body, size_t len)
+{
+   return xcgi_ctx_response_write (ctx_default (), body, len);
+}
 
-   if (!(ds_str_printf (&tmp, "%s, %s", xcgi_response_headers[index], value)))
-      return false;
+bool xcgi_header_cookie_set (const char *name, const char *value,
+                             time_t    expires,
+                             uint32_t  flags)
+{
+   return xcgi_ctx_header_cookie_set (ctx_default (), name, value,
+                                      expires, flags);
+}
 
-   free ((void *)xcgi_response_headers[index]);
-   xcgi_response_headers[index] = tmp;
-   return true;
+void xcgi_header_cookie_clear (const char *name)
+{
+   xcgi_ctx_header_cookie_clear (ctx_default (), name);
 }
 
-void xcgi_headers_clear (const char *header)
+bool xcgi_body_write (const void *data, size_t len)
 {
-   size_t index = response_headers_find (header);
+   return xcgi_ctx_body_write (ctx_default (), data, len);
+}
 
-   if (index != (size_t)-1) {
-      free ((void *)xcgi_response_headers[index]);
-      ds_array_remove ((void ***)&xcgi_response_headers, index);
-   }
+bool xcgi_body_flush (void)
+{
+   return xcgi_ctx_body_flush (ctx_default ());
 }
 
-bool xcgi_headers_write (void)
+bool xcgi_body_end (void)
 {
-   if (!xcgi_response_headers)
-      return true;
+   return xcgi_ctx_body_end (ctx_default ());
+}
 
-   if (!(cookielist_write ()))
-      return false;
+bool xcgi_etag_check (const char *version)
+{
+   bool ret = xcgi_ctx_etag_check (ctx_default (), version);
+   ctx_publish ();
+   return ret;
+}
 
-   for (size_t i=0; xcgi_response_headers[i]; i++) {
-      fprintf (stdout, "%s\r\n", xcgi_response_headers[i]);
-   }
+bool xcgi_send_file (const char *path)
+{
+   bool ret = xcgi_ctx_send_file (ctx_default (), path);
+   ctx_publish ();
+   return ret;
+}
 
-   fprintf (stdout, "\r\n\r\n");
+size_t xcgi_cookies_count (void)
+{
+   return xcgi_ctx_cookies_count (ctx_default ());
+}
 
-   return true;
+const char *xcgi_cookie_get (const char *name)
+{
+   return xcgi_ctx_cookie_get (ctx_default (), name);
 }
 
-size_t xcgi_cookies_count (void)
+void xcgi_uploads_sink_set (xcgi_upload_sink_t *sink, void *param)
 {
-   size_t ret = 0;
+   xcgi_ctx_uploads_sink_set (ctx_default (), sink, param);
+}
 
-   if (!xcgi_cookies)
-      return 0;
+size_t xcgi_uploads_count (void)
+{
+   return xcgi_ctx_uploads_count (ctx_default ());
+}
 
-   for (size_t i=0; xcgi_cookies[i]; i++)
-      ret++;
+const xcgi_upload_t *xcgi_uploads_entry (size_t index)
+{
+   return xcgi_ctx_uploads_entry (ctx_default (), index);
+}
 
-   return ret;
+const xcgi_upload_t *xcgi_upload_get (const char *name)
+{
+   return xcgi_ctx_upload_get (ctx_default (), name);
 }
 
 size_t xcgi_path_info_count (void)
 {
-   return ds_array_length ((void **)xcgi_path_info);
+   return xcgi_ctx_path_info_count (ctx_default ());
 }
 
 size_t xcgi_headers_count (void)
 {
-   return ds_array_length ((void **)xcgi_response_headers);
+   return xcgi_ctx_headers_count (ctx_default ());
 }
 
 const char *xcgi_reason_phrase (int status_code)
 {
-   static char ret[55];
    static const struct {
       int code;
       const char *phrase;
@@ -1201,9 +3428,6 @@ const char *xcgi_reason_phrase (int status_code)
          return codes[i].phrase;
    }
 
-   snprintf (ret, sizeof ret,
-                  "Internal Server Error (Unknown status code %i)\n",
-                  status_code);
-   return ret;
+   return "Internal Server Error";
 }
 
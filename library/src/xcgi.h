@@ -9,12 +9,28 @@
 
 #include "sqldb.h"
 
+#include "xcgi_arena.h"
+
 // Overview
-// This is a global non-thread-safe library. A CGI program runs once and
-// then exits. Memory used by this module is potentially never freed. The
-// caller MUST call xcgi_init() before calling any other function. Before
-// program return the caller can call xcgi_shutdown() to ensure that all
-// files are closed, although this is not necessary.
+// A CGI program runs once and then exits. Memory used by this module is
+// potentially never freed. The caller MUST call xcgi_init() before
+// calling any other function. Before program return the caller can call
+// xcgi_shutdown() to ensure that all files are closed, although this is
+// not necessary.
+//
+// All the state for a single request (the cgi variables, query strings,
+// cookies, path info, response headers and the input and output streams)
+// is held in a request context, xcgi_ctx_t. The global xcgi_[A-Z]*
+// variables and all the functions that do not take a context operate on
+// the default context, which is created by xcgi_init() and by
+// xcgi_request_begin(); these are not thread-safe.
+//
+// Programs that serve many requests concurrently create one context per
+// request with xcgi_ctx_new() and use the xcgi_ctx_*() functions. Any
+// number of threads may each use their own context at the same time. The
+// configuration, the database handle and the list of query string
+// content-types remain process-wide, and must not be changed while
+// requests are being served.
 //
 // On startup the xcgi library attempts to switch to a directory specified
 // by the caller. Failure to switch directory is fatal. All data storage
@@ -43,6 +59,30 @@
 #define XCGI_COOKIE_SAMESITE_STRICT    (1 << 2)
 #define XCGI_COOKIE_SAMESITE_LAX       (1 << 3)
 
+typedef struct xcgi_ctx_t xcgi_ctx_t;
+
+// A file received in a multipart/form-data request body. 'name' is the
+// name of the form field, 'filename' and 'content_type' are as sent by
+// the client ('content_type' may be NULL), 'path' is the temporary file
+// holding the content (NULL if the file was passed to an upload sink),
+// and 'size' is the number of bytes received.
+typedef struct xcgi_upload_t xcgi_upload_t;
+struct xcgi_upload_t {
+   const char *name;
+   const char *filename;
+   const char *content_type;
+   const char *path;
+   uint64_t    size;
+};
+
+// Receives the content of uploaded files in place of temporary files;
+// see xcgi_uploads_sink_set(). Called with each piece of the content,
+// then once with NULL and zero at the end of the file. 'upload->size'
+// is the number of bytes passed before this call. Returns false to fail
+// the parse.
+typedef bool (xcgi_upload_sink_t) (void *param, const xcgi_upload_t *upload,
+                                   const void *data, size_t len);
+
 
 #ifdef __cplusplus
 extern "C" {
@@ -74,11 +114,72 @@ extern "C" {
    // course of execution of this library.
    void xcgi_shutdown (void);
 
+   // Opens a new handle to the database specified in the 'xcgi.ini' file
+   // (see xcgi_db below). Returns NULL on error or if no database is
+   // configured. The caller must close the handle with sqldb_close().
+   sqldb_t *xcgi_dbms_open (void);
+
+
+   //////////////////////////////////////////////////////////////////
+   // Per-request functions for long-running processes
+   //
+   // A plain CGI program never needs these; xcgi_init() starts the single
+   // request from the environment and xcgi_shutdown() ends it. Programs
+   // that serve multiple requests from a single process (see xcgi_fcgi.h)
+   // use these so that the configuration, the database handle and the
+   // query string content-types are kept across requests while everything
+   // else is reset.
+
+   // Starts a new request. Every cgi variable is retrieved by calling
+   // 'getvar' with 'param' and the variable name; 'getvar' returns NULL
+   // if the variable is not present. The returned strings must remain
+   // valid until xcgi_request_end() is called. The streams 'inf' and
+   // 'outf' become xcgi_stdin and xcgi_stdout respectively; the caller
+   // retains ownership of both streams.
+   //
+   // The path info and cookies are parsed, and all the response headers
+   // are cleared. Returns true on success and false on error.
+   bool xcgi_request_begin (const char *(*getvar) (void *, const char *),
+                            void *param,
+                            FILE *inf, FILE *outf);
+
+   // Frees all the storage for the current request: the query strings,
+   // path info, cookies and response headers. All the xcgi_[A-Z]*
+   // variables are set to the empty string.
+   void xcgi_request_end (void);
+
+   // Completes the previous request, if any, and waits for the next one
+   // using the front end selected by the 'xcgi_frontend' entry in the
+   // 'xcgi.ini' file:
+   //    fastcgi     See xcgi_fcgi.h. This is the default.
+   //    scgi        See xcgi_scgi.h.
+   //    http        See xcgi_http.h; no web server is needed.
+   //
+   // Each of the front ends falls back to serving the single request in
+   // the environment when the program is run as a plain CGI program, so
+   // a program that loops on xcgi_accept() works unchanged in all of
+   // these deployments:
+   //
+   //    while (xcgi_accept ()) {
+   //       ... handle the request ...
+   //    }
+   //
+   // When the 'xcgi_workers' entry is set the first call turns the
+   // process into a supervisor for a pool of worker processes, and only
+   // returns in the workers (see xcgi_prefork.h).
+   //
+   // Returns true when a request has been loaded and false when no more
+   // requests will be served.
+   bool xcgi_accept (void);
+
 
    //////////////////////////////////////////////////////////////////
    // Environment functions
 
-   // Load/save the cgi environment for later playback.
+   // Load/save the cgi environment for later playback. The values are
+   // saved escaped with xcgi_string_escape() and loaded with
+   // xcgi_string_unescape(), so a literal '+' in a value saved by an
+   // older version of the library is loaded back as a space.
    bool xcgi_load (const char *path, const char *fname);
    bool xcgi_save (const char *fname);
 
@@ -93,22 +194,40 @@ extern "C" {
 
    // Returns a copy of the specified string with all the non-ascii
    // characters replaced with their hex equivalent using %xx as the
-   // format. The replacement is performed for any characters not in the
-   // regex [a-zA-Z0-9$-_.+!*'(),].
+   // format. The replacement is performed for every character other
+   // than the ASCII letters and digits and the characters
+   // $ - _ . ! * ' ( ) , so a '+' is escaped too, and is not read back
+   // as a space by xcgi_string_unescape(). Strings escaped by older
+   // versions of the library, which copied a '+' unchanged, get a space
+   // in its place when they are unescaped.
    //
    // On success a new string allocated with malloc() is returned. On
    // failure NULL is returned. The caller must free the result.
    char *xcgi_string_escape (const char *src);
 
+   // Escapes the first 'len' bytes of 'src' as for xcgi_string_escape(),
+   // but into the caller's buffer 'dst', which must have room for
+   // 3 * 'len' + 1 bytes. The result is NUL-terminated. Returns the
+   // length of the result.
+   size_t xcgi_string_escape_into (char *dst, const char *src, size_t len);
+
    // Returns a copy of the specified string with all the escaped
    // characters replaced with their ascii equivalent using %xx as the
-   // escape format. This function undoes the escaping performed by
-   // xcgi_string_escape().
+   // escape format, and each '+' replaced with a space. A '%' that does
+   // not start a valid escape is kept as it is. This function undoes the
+   // escaping performed by xcgi_string_escape().
    //
    // On success a new string allocated with malloc() is returned. On
    // failure NULL is returned. The caller must free the result.
    char *xcgi_string_unescape (const char *src);
 
+   // Unescapes the first 'len' bytes of 'src' as for
+   // xcgi_string_unescape(), but into the caller's buffer 'dst', which
+   // must have room for 'len' + 1 bytes. The result is NUL-terminated.
+   // 'dst' may be the same as 'src' to unescape a string in place.
+   // Returns the length of the result.
+   size_t xcgi_string_unescape_into (char *dst, const char *src, size_t len);
+
 
    //////////////////////////////////////////////////////////////////
    // Query strings functions
@@ -161,9 +280,78 @@ extern "C" {
    bool xcgi_qstrings_parse (void);
 
    // Return the number of query strings found. Must be called only after
-   // a successful call to xcgi_qstrings_parse().
+   // a successful call to xcgi_qstrings_parse() or xcgi_qstrings_scan().
    size_t xcgi_qstrings_count (void);
 
+   // Zero-copy alternative to xcgi_qstrings_parse(). The query strings
+   // are found exactly as for xcgi_qstrings_parse(), but nothing is
+   // decoded or copied: the names and values are only recorded as slices
+   // of a single copy of the query string, and each one is decoded (in
+   // place) the first time it is read with xcgi_qstrings_name() or
+   // xcgi_qstrings_value(). The xcgi_qstrings array is not filled in.
+   //
+   // Use this for requests that may carry many parameters of which only a
+   // few are read. Calling xcgi_qstrings_parse() afterwards fills in the
+   // xcgi_qstrings array from the slices without scanning again. Returns
+   // true on success and false on error.
+   bool xcgi_qstrings_scan (void);
+
+   // Return the decoded name or value of the query string at 'index',
+   // which must be less than xcgi_qstrings_count(). Returns NULL if the
+   // index is out of range. The strings remain valid until the end of
+   // the request. Works after either xcgi_qstrings_scan() or
+   // xcgi_qstrings_parse().
+   const char *xcgi_qstrings_name (size_t index);
+   const char *xcgi_qstrings_value (size_t index);
+
+   // Return the decoded value of the first query string named 'name', or
+   // NULL if there is no query string with that name. The name is
+   // compared exactly (case-sensitive) with the decoded names.
+   //
+   // The lookup uses a hash index of the names, which is built once per
+   // request by xcgi_qstrings_parse() (or on the first lookup after
+   // xcgi_qstrings_scan()), so it takes constant time however many query
+   // strings there are. The result remains valid until the end of the
+   // request.
+   const char *xcgi_qstrings_get (const char *name);
+
+   // Return all the values of the query strings named 'name', in the
+   // order in which they appear, for names that are repeated (such as
+   // the values of a multiple select). The returned array is terminated
+   // with a NULL, and the number of values is stored in '*nvalues' if
+   // 'nvalues' is not NULL. Returns NULL (and a count of zero) if there
+   // is no query string with that name. The array and the values are
+   // allocated from the request arena and must not be freed.
+   const char **xcgi_qstrings_get_all (const char *name, size_t *nvalues);
+
+   //////////////////////////////////////////////////////////////////
+   // File uploads
+   //
+   // A POST body of type multipart/form-data is parsed as it is read, by
+   // both xcgi_qstrings_parse() and xcgi_qstrings_scan(), once the type
+   // has been accepted with xcgi_qstrings_accept_content_type(). The body
+   // is never held in memory in full. The fields without a filename
+   // become query strings (up to 'xcgi_multipart_max_field' bytes each,
+   // from the 'xcgi.ini' file, default 1MB). The files are written to
+   // temporary files in 'xcgi_upload_dir' (default $TMPDIR, or /tmp),
+   // which are removed at the end of the request; a handler that wants
+   // to keep one must rename() or link() it elsewhere.
+
+   // Sends the content of the files in the next parse to 'sink' (with
+   // 'param') instead of to temporary files. Must be called before
+   // xcgi_qstrings_parse() or xcgi_qstrings_scan().
+   void xcgi_uploads_sink_set (xcgi_upload_sink_t *sink, void *param);
+
+   // Returns the number of files received, and the file at 'index' (NULL
+   // if the index is out of range), in the order in which they appear in
+   // the body.
+   size_t xcgi_uploads_count (void);
+   const xcgi_upload_t *xcgi_uploads_entry (size_t index);
+
+   // Returns the first file received for the field 'name', or NULL if
+   // there is none.
+   const xcgi_upload_t *xcgi_upload_get (const char *name);
+
 
    //////////////////////////////////////////////////////////////////
    // Header functions
@@ -186,8 +374,15 @@ extern "C" {
    // xcgi_header_SetCookie(), xcgi_header_Accept(), etc.
    //
 
+   // Header names are matched in full and without regard to case, so
+   // "content-type" names the same header as "Content-Type", but
+   // "Content" does not. A hash index of the names is used, so setting
+   // or appending to a header takes constant time however many headers
+   // have been set.
+
    // Append a new value to the named header. If the header does not exist
-   // it will be created. Returns true on success and false on failure.
+   // it will be created. The value is appended to the existing values,
+   // separated by ", ". Returns true on success and false on failure.
    //
    bool xcgi_headers_value_set (const char *header, const char *value);
 
@@ -195,9 +390,117 @@ extern "C" {
    // Does nothing if the header does not exist.
    void xcgi_headers_clear (const char *header);
 
-   // Writes the headers out
+   // Writes the headers out. The whole header block is assembled first
+   // and written to xcgi_stdout in one go; the body is then written to
+   // xcgi_stdout by the caller.
    bool xcgi_headers_write (void);
 
+   // Writes the complete response: the headers as for
+   // xcgi_headers_write(), followed by the 'len' bytes of 'body'. A
+   // Content-Length header is added for the body unless one has already
+   // been set. The header block and the body are written together, with
+   // a single writev() when xcgi_stdout is a file descriptor, so the
+   // response costs one system call instead of one per header.
+   //
+   // Use this instead of xcgi_headers_write() when the body is complete
+   // before it is sent. Anything already written to xcgi_stdout is
+   // flushed first. Returns true on success and false on error.
+   bool xcgi_response_write (const void *body, size_t len);
+
+   //////////////////////////////////////////////////////////////////
+   // Body functions
+   //
+   // An alternative to writing the body to xcgi_stdout after calling
+   // xcgi_headers_write(), for responses that may be too large to build in
+   // memory first. The body is written in pieces with xcgi_body_write(),
+   // which collects it in a buffer. A body that fits in the buffer is sent
+   // together with the headers, and with a Content-Length, when the
+   // request ends. Once the buffer fills up, or xcgi_body_flush() is
+   // called, the headers are sent (so they cannot be changed after that)
+   // and the body is streamed to the client as it is written: the web
+   // server, or the embedded HTTP server with chunked transfer encoding,
+   // passes it on without the length being known in advance.
+   //
+   // Writing blocks while the client is not accepting data, so the memory
+   // used for a response stays bounded however large the body is.
+   //
+   // Do not mix these with xcgi_headers_write(), xcgi_response_write() or
+   // writing to xcgi_stdout directly.
+
+   // Appends 'len' bytes of 'data' to the body. Returns true on success
+   // and false on error, after which the rest of the body cannot be sent.
+   bool xcgi_body_write (const void *data, size_t len);
+
+   // Sends the headers, if they have not been sent yet, and everything
+   // written to the body so far. Returns true on success and false on
+   // error.
+   bool xcgi_body_flush (void);
+
+   // Completes the body: sends whatever is still buffered, with the
+   // headers if they have not been sent yet. The front ends call this
+   // when the request is finished (and xcgi_shutdown() calls it for a
+   // plain CGI program), so the caller only needs to call it to complete
+   // the response early. Does nothing if the body functions were not
+   // used. Returns true on success and false on error.
+   bool xcgi_body_end (void);
+
+   //////////////////////////////////////////////////////////////////
+   // Conditional responses
+   //
+   // With 'xcgi_auto_etag=1' in the 'xcgi.ini' file, xcgi_response_write()
+   // (and xcgi_body_end() for a body that fits in the buffer) hashes the
+   // body and sends the hash as a strong ETag header on successful GET and
+   // HEAD responses, unless the handler has set an ETag itself. A
+   // compressed body has the content-coding appended to its tag. Whether
+   // the tag is set automatically or by the handler, when it matches the
+   // If-None-Match request header a "304 Not Modified" response is sent
+   // with the headers only.
+   //
+   // Hashing saves sending the body, but the body must still be built.
+   // A handler that can tell cheaply whether its output has changed, such
+   // as from a change counter in the database, can avoid that as well.
+
+   // Sets the ETag header from 'version', a string that changes whenever
+   // the body of the response changes. Returns true if the client already
+   // has the current version (the If-None-Match request header matches),
+   // in which case the handler should not produce a body: the 304
+   // response is sent by xcgi_body_end(), or by any of the functions that
+   // write the response. Returns false if the body must be sent, or on
+   // error.
+   bool xcgi_etag_check (const char *version);
+
+   //////////////////////////////////////////////////////////////////
+   // File responses
+
+   // Sends the file at 'path' as the complete response, with the
+   // headers set so far. The path is opened relative to the working
+   // directory of the program; absolute paths, paths containing a ".."
+   // component and paths with a symbolic link in any component are
+   // refused.
+   // Content-Type is set from the file name unless the handler has set
+   // it, and Last-Modified, ETag and Accept-Ranges are set from the
+   // file.
+   //
+   // GET and HEAD requests get a "304 Not Modified" response when the
+   // If-None-Match or If-Modified-Since request header shows that the
+   // client's copy is current. A GET request for a single byte range
+   // (the Range header, subject to If-Range) is sent the range with
+   // "206 Partial Content", or "416 Range Not Satisfiable" if the range
+   // is outside the file.
+   //
+   // The embedded HTTP server and the SCGI front end (including the
+   // thread pool) send the file with sendfile(), without copying it
+   // through the process. FastCGI and plain CGI programs copy it through
+   // a large buffer.
+   //
+   // The length, date and ETag are taken from the file that is opened,
+   // so a file that is being replaced is always sent with its own.
+   //
+   // Returns false, having sent nothing, if the file does not exist or
+   // cannot be opened, so that the handler can send its own error
+   // response. Also returns false if sending the file failed.
+   bool xcgi_send_file (const char *path);
+
    // ///////////////////////////////////////////////////////////////
    // Set specific headers
 
@@ -221,6 +524,14 @@ extern "C" {
    // Returns the number of strings in the xcgi_cookies array.
    size_t xcgi_cookies_count (void);
 
+   // Returns the value of the request cookie named 'name', or NULL if
+   // there is no such cookie. The name must match exactly; if the same
+   // name was sent more than once the first one is returned. Whitespace
+   // around the name and value is ignored. The lookup uses an index of
+   // the cookies, built on the first call for each request. The result
+   // remains valid until the end of the request.
+   const char *xcgi_cookie_get (const char *name);
+
    // Returns the number of strings in the xcgi_path_info array.
    size_t xcgi_path_info_count (void);
 
@@ -228,16 +539,185 @@ extern "C" {
    size_t xcgi_headers_count (void);
 
    // Returns the reason phrase for the specified http status code. If the
-   // code is unknown then the string "Internal Server Error" with the
-   // code embedded into it is returned.
+   // code is unknown then the string "Internal Server Error" is returned.
+   // The caller must not free the result.
    const char *xcgi_reason_phrase (int status_code);
 
+
+   //////////////////////////////////////////////////////////////////
+   // Request context functions
+   //
+   // Each of these behaves exactly like the function of the same name
+   // without the 'ctx_' prefix, except that it operates on the specified
+   // context instead of on the default context. A NULL context is
+   // treated as an error (or as empty, for the functions that return a
+   // count or a string).
+
+   // Creates a new request context. The arguments are the same as for
+   // xcgi_request_begin(): the strings returned by 'getvar' and the
+   // streams 'inf' and 'outf' must remain valid until the context is
+   // deleted, and the caller retains ownership of them. Returns NULL on
+   // error. The caller must delete the context with xcgi_ctx_del().
+   xcgi_ctx_t *xcgi_ctx_new (const char *(*getvar) (void *, const char *),
+                             void *param,
+                             FILE *inf, FILE *outf);
+
+   // Frees all the storage for the context. Does nothing if 'ctx' is
+   // NULL.
+   void xcgi_ctx_del (xcgi_ctx_t *ctx);
+
+   // Returns the default context, which is the context reflected by the
+   // global variables. Returns NULL if there is no current request.
+   xcgi_ctx_t *xcgi_ctx_default (void);
+
+   const char *xcgi_ctx_getenv (xcgi_ctx_t *ctx, const char *name);
+
+   bool xcgi_ctx_qstrings_parse (xcgi_ctx_t *ctx);
+   size_t xcgi_ctx_qstrings_count (xcgi_ctx_t *ctx);
+   bool xcgi_ctx_qstrings_scan (xcgi_ctx_t *ctx);
+   const char *xcgi_ctx_qstrings_name (xcgi_ctx_t *ctx, size_t index);
+   const char *xcgi_ctx_qstrings_value (xcgi_ctx_t *ctx, size_t index);
+   const char *xcgi_ctx_qstrings_get (xcgi_ctx_t *ctx, const char *name);
+   const char **xcgi_ctx_qstrings_get_all (xcgi_ctx_t *ctx, const char *name,
+                                           size_t *nvalues);
+
+   void xcgi_ctx_uploads_sink_set (xcgi_ctx_t *ctx, xcgi_upload_sink_t *sink,
+                                   void *param);
+   size_t xcgi_ctx_uploads_count (xcgi_ctx_t *ctx);
+   const xcgi_upload_t *xcgi_ctx_uploads_entry (xcgi_ctx_t *ctx, size_t index);
+   const xcgi_upload_t *xcgi_ctx_upload_get (xcgi_ctx_t *ctx, const char *name);
+
+   bool xcgi_ctx_headers_value_set (xcgi_ctx_t *ctx,
+                                    const char *header, const char *value);
+   void xcgi_ctx_headers_clear (xcgi_ctx_t *ctx, const char *header);
+   bool xcgi_ctx_headers_write (xcgi_ctx_t *ctx);
+   bool xcgi_ctx_response_write (xcgi_ctx_t *ctx,
+                                 const void *body, size_t len);
+
+   bool xcgi_ctx_header_cookie_set (xcgi_ctx_t *ctx,
+                                    const char *name, const char *value,
+                                    time_t    expires,
+                                    uint32_t  flags);
+   void xcgi_ctx_header_cookie_clear (xcgi_ctx_t *ctx, const char *name);
+
+   bool xcgi_ctx_body_write (xcgi_ctx_t *ctx, const void *data, size_t len);
+   bool xcgi_ctx_body_flush (xcgi_ctx_t *ctx);
+   bool xcgi_ctx_body_end (xcgi_ctx_t *ctx);
+
+   bool xcgi_ctx_etag_check (xcgi_ctx_t *ctx, const char *version);
+   bool xcgi_ctx_send_file (xcgi_ctx_t *ctx, const char *path);
+
+   size_t xcgi_ctx_cookies_count (xcgi_ctx_t *ctx);
+   const char *xcgi_ctx_cookie_get (xcgi_ctx_t *ctx, const char *name);
+   size_t xcgi_ctx_path_info_count (xcgi_ctx_t *ctx);
+   size_t xcgi_ctx_headers_count (xcgi_ctx_t *ctx);
+
 #ifdef __cplusplus
 };
 #endif
 
+// The request context. Each of the fields has the same meaning as the
+// global variable of the same name (xcgi_CONTENT_LENGTH, xcgi_path_info,
+// etc) described below, for this request only. The caller MUST NOT modify
+// any of the fields; 'inf' and 'outf' are the streams to use in place of
+// xcgi_stdin and xcgi_stdout.
+struct xcgi_ctx_t {
+   const char *CONTENT_LENGTH;
+   const char *CONTENT_TYPE;
+   const char *CONTEXT_DOCUMENT_ROOT;
+   const char *CONTENT_PREFIX;
+   const char *DOCUMENT_ROOT;
+   const char *GATEWAY_INTERFACE;
+   const char *HOSTNAME;
+   const char *HOSTTYPE;
+   const char *HTTP_ACCEPT;
+   const char *HTTP_ACCEPT_ENCODING;
+   const char *HTTP_COOKIE;
+   const char *HTTP_HOST;
+   const char *HTTP_IF_MODIFIED_SINCE;
+   const char *HTTP_IF_NONE_MATCH;
+   const char *HTTP_IF_RANGE;
+   const char *HTTP_RANGE;
+   const char *HTTP_REFERER;
+   const char *HTTP_USER_AGENT;
+   const char *HTTPS;
+   const char *PATH;
+   const char *PATH_INFO;
+   const char *PWD;
+   const char *QUERY_STRING;
+   const char *REMOTE_ADDR;
+   const char *REMOTE_HOST;
+   const char *REMOTE_PORT;
+   const char *REMOTE_USER;
+   const char *REQUEST_METHOD;
+   const char *REQUEST_SCHEME;
+   const char *REQUEST_URI;
+   const char *SCRIPT_FILENAME;
+   const char *SCRIPT_NAME;
+   const char *SERVER_ADDR;
+   const char *SERVER_ADMIN;
+   const char *SERVER_NAME;
+   const char *SERVER_PORT;
+   const char *SERVER_PROTOCOL;
+   const char *SERVER_SIGNATURE;
+   const char *SERVER_SOFTWARE;
+
+   FILE *inf;
+   FILE *outf;
+
+   // The socket that 'outf' writes to unchanged, so that files can be
+   // sent to it directly, or -1. Set by the front ends.
+   int out_fd;
+
+   // The database handle for this request. This is xcgi_db for the
+   // default context; thread pool workers each have their own.
+   sqldb_t *db;
+
+   const char **path_info;
+   const char **cookies;
+   const char ***qstrings;
+   const char **response_headers;
+
+   // All of the above is allocated from this arena, which is released in
+   // one go when the request is done. Handlers may allocate from it as
+   // well; see xcgi_arena.h.
+   xcgi_arena_t *arena;
+
+   // Private to the library.
+   void **cookielist;
+   size_t ncookielist, scookielist;
+   size_t npath_info, spath_info;
+   size_t ncookies, scookies;
+   size_t nqstrings, sqstrings;
+   void **qpairs;
+   size_t nqpairs, sqpairs;
+   bool qscanned;
+   void *qindex;
+   size_t qindex_size;
+   void **uploads;
+   size_t nuploads, suploads;
+   xcgi_upload_sink_t *upload_sink;
+   void *upload_sink_param;
+   void *cookie_entries;
+   void *cookie_index;
+   size_t cookie_index_size;
+   size_t nresponse_headers, sresponse_headers;
+   void **header_entries;
+   size_t nheader_entries, sheader_entries;
+   void *header_index;
+   size_t header_index_size;
+   char *body_buf;
+   size_t body_len;
+   void *body_compress;
+   bool body_streaming;
+   bool body_done;
+   bool body_error;
+   bool response_sent;
+   bool not_modified;
+};
+
 // All of these variables are non-NULL after a successful xcgi_init(). The
-// caller MUST NOT modify the variables.
+// caller MUST NOT modify the variables. They reflect the default context.
 
 extern const char *xcgi_CONTENT_LENGTH;
 extern const char *xcgi_CONTENT_TYPE;
@@ -248,8 +728,13 @@ extern const char *xcgi_GATEWAY_INTERFACE;
 extern const char *xcgi_HOSTNAME;
 extern const char *xcgi_HOSTTYPE;
 extern const char *xcgi_HTTP_ACCEPT;
+extern const char *xcgi_HTTP_ACCEPT_ENCODING;
 extern const char *xcgi_HTTP_COOKIE;
 extern const char *xcgi_HTTP_HOST;
+extern const char *xcgi_HTTP_IF_MODIFIED_SINCE;
+extern const char *xcgi_HTTP_IF_NONE_MATCH;
+extern const char *xcgi_HTTP_IF_RANGE;
+extern const char *xcgi_HTTP_RANGE;
 extern const char *xcgi_HTTP_REFERER;
 extern const char *xcgi_HTTP_USER_AGENT;
 extern const char *xcgi_HTTPS;
@@ -278,6 +763,11 @@ extern const char *xcgi_SERVER_SOFTWARE;
 // guaranteed to be the the source of POST data.
 extern FILE *xcgi_stdin;
 
+// All output must be written to this stream, because stdout is not
+// guaranteed to be the destination of the response (for example, when
+// running as a FastCGI responder).
+extern FILE *xcgi_stdout;
+
 // These variables are all available after certain parsing is performed
 // and not necessarily after xcgi_init(). An indication of when each
 // variable is available is given in the comments.
@@ -294,7 +784,9 @@ extern const char **xcgi_path_info;
 // xcgi_HTTP_COOKIE environment variable. Use the function
 // xcgi_cookies_count() to get the number of cookies found.
 //
-// Each cookie is stored as a single string of name=value.
+// Each cookie is stored as a single string of name=value, with the
+// whitespace around it removed. Use xcgi_cookie_get() to find the value
+// of a cookie by name.
 extern const char **xcgi_cookies;
 
 // Available after xcgi_qstrings_parse(). Contains an array of the
@@ -317,6 +809,13 @@ extern const char ***xcgi_qstrings;
 // verbatim.
 extern const char **xcgi_response_headers;
 
+// Available after xcgi_init(). The arena of the default context, from
+// which all of the arrays above are allocated. Everything allocated from
+// it is released when the next request is accepted, so the caller may
+// use it for memory that is only needed while handling the current
+// request. See xcgi_arena.h.
+extern xcgi_arena_t *xcgi_arena;
+
 
 /* The following variables are all non-const and may be modified by the
  * caller as specified.
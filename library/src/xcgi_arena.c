@@ -0,0 +1,201 @@
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stdint.h>
+
+#include "xcgi_arena.h"
+
+#define DEFAULT_BLOCK_SIZE    (1024 * 16)
+#define ALIGNMENT             (16)
+#define ALIGN_UP(x)           (((x) + (ALIGNMENT - 1)) & ~(size_t)(ALIGNMENT - 1))
+
+typedef struct block_t block_t;
+struct block_t {
+   block_t    *next;
+   size_t      size;
+   size_t      used;
+   // Keeps the data that follows the header aligned.
+   union {
+      long double ld;
+      void       *p;
+      uint64_t    u;
+   } data[];
+};
+
+// New blocks are added at the head of the list. The first block created
+// with the arena is kept when the arena is reset.
+struct xcgi_arena_t {
+   block_t    *head;
+   block_t    *first;
+   size_t      block_size;
+};
+
+static block_t *block_new (size_t size)
+{
+   block_t *ret = NULL;
+
+   if (size > SIZE_MAX - sizeof *ret || !(ret = malloc (sizeof *ret + size)))
+      return NULL;
+
+   ret->next = NULL;
+   ret->size = size;
+   ret->used = 0;
+
+   return ret;
+}
+
+xcgi_arena_t *xcgi_arena_new (size_t block_size)
+{
+   xcgi_arena_t *ret = NULL;
+
+   if (block_size > SIZE_MAX - ALIGNMENT || !(ret = malloc (sizeof *ret)))
+      return NULL;
+
+   ret->block_size = block_size ? ALIGN_UP (block_size) : DEFAULT_BLOCK_SIZE;
+
+   if (!(ret->head = block_new (ret->block_size))) {
+      free (ret);
+      return NULL;
+   }
+
+   ret->first = ret->head;
+
+   return ret;
+}
+
+void xcgi_arena_del (xcgi_arena_t *arena)
+{
+   if (!arena)
+      return;
+
+   block_t *block = arena->head;
+   while (block) {
+      block_t *next = block->next;
+      free (block);
+      block = next;
+   }
+
+   free (arena);
+}
+
+void xcgi_arena_reset (xcgi_arena_t *arena)
+{
+   if (!arena)
+      return;
+
+   block_t *block = arena->head;
+   while (block) {
+      block_t *next = block->next;
+      if (block != arena->first)
+         free (block);
+      block = next;
+   }
+
+   arena->first->next = NULL;
+   arena->first->used = 0;
+   arena->head = arena->first;
+}
+
+void *xcgi_arena_alloc (xcgi_arena_t *arena, size_t len)
+{
+   // Rounding up must not wrap around to a small size.
+   if (!arena || len > SIZE_MAX - ALIGNMENT)
+      return NULL;
+
+   len = ALIGN_UP (len ? len : 1);
+
+   block_t *block = arena->head;
+
+   if (block->size - block->used < len) {
+      // Large allocations get a block of their own, placed behind the
+      // current block so that the space left in it is not wasted.
+      if (len > arena->block_size / 4) {
+         block_t *big = block_new (len);
+         if (!big)
+            return NULL;
+         big->used = len;
+         big->next = block->next;
+         block->next = big;
+         return big->data;
+      }
+
+      if (!(block = block_new (arena->block_size)))
+         return NULL;
+
+      block->next = arena->head;
+      arena->head = block;
+   }
+
+   void *ret = (char *)block->data + block->used;
+   block->used += len;
+
+   return ret;
+}
+
+void *xcgi_arena_calloc (xcgi_arena_t *arena, size_t len)
+{
+   void *ret = xcgi_arena_alloc (arena, len);
+   if (ret)
+      memset (ret, 0, len);
+   return ret;
+}
+
+char *xcgi_arena_strndup (xcgi_arena_t *arena, const char *src, size_t len)
+{
+   char *ret = NULL;
+
+   if (!src || len == SIZE_MAX || !(ret = xcgi_arena_alloc (arena, len + 1)))
+      return NULL;
+
+   memcpy (ret, src, len);
+   ret[len] = 0;
+
+   return ret;
+}
+
+char *xcgi_arena_strdup (xcgi_arena_t *arena, const char *src)
+{
+   return src ? xcgi_arena_strndup (arena, src, strlen (src)) : NULL;
+}
+
+char *xcgi_arena_printf (xcgi_arena_t *arena, const char *fmts, ...)
+{
+   char *ret = NULL;
+   va_list ap;
+
+   va_start (ap, fmts);
+   int len = vsnprintf (NULL, 0, fmts, ap);
+   va_end (ap);
+
+   if (len < 0 || !(ret = xcgi_arena_alloc (arena, len + 1)))
+      return NULL;
+
+   va_start (ap, fmts);
+   vsnprintf (ret, len + 1, fmts, ap);
+   va_end (ap);
+
+   return ret;
+}
+
+bool xcgi_arena_array_append (xcgi_arena_t *arena, void ***array,
+                              size_t *count, size_t *size, void *item)
+{
+   if (*count + 1 >= *size || !*array) {
+      size_t newsize = *size ? *size * 2 : 8;
+      void **tmp = xcgi_arena_alloc (arena, sizeof *tmp * newsize);
+      if (!tmp)
+         return false;
+      if (*array)
+         memcpy (tmp, *array, sizeof *tmp * *count);
+      *array = tmp;
+      *size = newsize;
+   }
+
+   (*array)[(*count)++] = item;
+   (*array)[*count] = NULL;
+
+   return true;
+}
+
@@ -0,0 +1,71 @@
+
+#ifndef H_XCGI_ARENA
+#define H_XCGI_ARENA
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Arena (bump) allocator for memory that lives exactly as long as a
+// request. Allocations are carved sequentially out of large blocks and
+// are never freed individually; everything is released at once when the
+// arena is reset or deleted.
+//
+// Every request context has its own arena (ctx->arena, and xcgi_arena for
+// the default context), from which the library allocates all of the
+// parsed request data. Handlers may allocate from it too, for anything
+// that is not needed after the request has been completed.
+//
+// An arena must not be used by more than one thread at a time.
+
+typedef struct xcgi_arena_t xcgi_arena_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Creates a new arena. The arena grows in blocks of at least
+   // 'block_size' bytes; zero selects the default size. Returns NULL on
+   // error. The caller must delete the arena with xcgi_arena_del().
+   xcgi_arena_t *xcgi_arena_new (size_t block_size);
+
+   // Frees the arena and everything allocated from it.
+   void xcgi_arena_del (xcgi_arena_t *arena);
+
+   // Frees everything allocated from the arena, so that the arena can be
+   // reused. The first block is kept, so an arena that is reset between
+   // requests only needs to call malloc() for requests that are larger
+   // than usual.
+   void xcgi_arena_reset (xcgi_arena_t *arena);
+
+   // Returns 'len' bytes of memory, suitably aligned for any type, or
+   // NULL on error. The memory is not cleared.
+   void *xcgi_arena_alloc (xcgi_arena_t *arena, size_t len);
+
+   // As xcgi_arena_alloc(), but the memory is cleared.
+   void *xcgi_arena_calloc (xcgi_arena_t *arena, size_t len);
+
+   // Returns a copy of 'src' (or of the first 'len' bytes of 'src',
+   // which need not be NUL-terminated), allocated from the arena. The
+   // copy is always NUL-terminated. Returns NULL on error.
+   char *xcgi_arena_strdup (xcgi_arena_t *arena, const char *src);
+   char *xcgi_arena_strndup (xcgi_arena_t *arena, const char *src,
+                             size_t len);
+
+   // Returns a string formatted as for printf(), allocated from the
+   // arena. Returns NULL on error.
+   char *xcgi_arena_printf (xcgi_arena_t *arena, const char *fmts, ...);
+
+   // Appends 'item' to the NULL-terminated array '*array' which holds
+   // '*count' items and has room for '*size' pointers, growing it from
+   // the arena as needed. The array is always kept NULL-terminated.
+   // Returns true on success and false on error, in which case the array
+   // is unchanged.
+   bool xcgi_arena_array_append (xcgi_arena_t *arena, void ***array,
+                                 size_t *count, size_t *size, void *item);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -162,8 +162,10 @@ static size_t xcgi_cfg_find (const char **xcgi_cfg, const char *name)
       return (size_t)-1;
 
    size_t name_len = strlen (name);
+   // The entries are stored as "name=value"; the whole name must match.
    for (size_t i=0; xcgi_cfg[i]; i++) {
-      if ((memcmp (xcgi_cfg[i], name, name_len))==0)
+      if ((strncmp (xcgi_cfg[i], name, name_len))==0 &&
+            xcgi_cfg[i][name_len] == '=')
          return i;
    }
 
@@ -0,0 +1,243 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+
+#include <zlib.h>
+
+#include "xcgi_compress.h"
+
+#define OUT_SIZE           (1024 * 16)
+
+// zlib counts the input in an unsigned int, so larger inputs are fed to
+// it in pieces of this size.
+#define MAX_IN             (1024 * 1024 * 1024)
+
+struct xcgi_compress_t {
+   z_stream    strm;
+   bool        finished;
+   unsigned char out[OUT_SIZE];
+};
+
+/* ************************************************************************
+ * Negotiation.
+ */
+static bool is_ows (char c)
+{
+   return c == ' ' || c == '\t';
+}
+
+// Returns the q-value in the parameters that follow a coding in an
+// Accept-Encoding header ("; q=0.5"), or 1 if there is none.
+static double qvalue (const char *params, const char *end)
+{
+   while (params < end) {
+      const char *semi = memchr (params, ';', end - params);
+      if (!semi)
+         break;
+      params = semi + 1;
+      while (params < end && is_ows (*params))
+         params++;
+      if (end - params > 2 && tolower ((unsigned char)params[0]) == 'q' &&
+            params[1] == '=')
+         return strtod (&params[2], NULL);
+   }
+
+   return 1.0;
+}
+
+int xcgi_compress_negotiate (const char *accept_encoding)
+{
+   double q_gzip = -1, q_deflate = -1, q_any = -1;
+   const char *ptr = accept_encoding;
+
+   while (ptr && *ptr) {
+      const char *end = strchr (ptr, ',');
+      if (!end)
+         end = &ptr[strlen (ptr)];
+
+      while (ptr < end && is_ows (*ptr))
+         ptr++;
+
+      size_t len = 0;
+      while (&ptr[len] < end && ptr[len] != ';' && !is_ows (ptr[len]))
+         len++;
+
+      double q = qvalue (&ptr[len], end);
+
+      if ((len == 4 && (strncasecmp (ptr, "gzip", 4))==0) ||
+          (len == 6 && (strncasecmp (ptr, "x-gzip", 6))==0))
+         q_gzip = q;
+      if (len == 7 && (strncasecmp (ptr, "deflate", 7))==0)
+         q_deflate = q;
+      if (len == 1 && ptr[0] == '*')
+         q_any = q;
+
+      ptr = *end ? end + 1 : end;
+   }
+
+   // A wildcard covers the codings that are not listed.
+   if (q_gzip < 0)
+      q_gzip = q_any;
+   if (q_deflate < 0)
+      q_deflate = q_any;
+
+   if (q_gzip > 0 && q_gzip >= q_deflate)
+      return XCGI_ENCODING_GZIP;
+
+   if (q_deflate > 0)
+      return XCGI_ENCODING_DEFLATE;
+
+   return XCGI_ENCODING_IDENTITY;
+}
+
+const char *xcgi_compress_encoding_name (int encoding)
+{
+   switch (encoding) {
+      case XCGI_ENCODING_GZIP:      return "gzip";
+      case XCGI_ENCODING_DEFLATE:   return "deflate";
+   }
+
+   return NULL;
+}
+
+bool xcgi_compress_type_ok (const char *content_type)
+{
+   static const char *types[] = {
+      "application/json",
+      "application/javascript",
+      "application/xml",
+      "application/xhtml+xml",
+      "application/x-www-form-urlencoded",
+      "image/svg+xml",
+   };
+
+   if (!content_type)
+      return false;
+
+   size_t len = strcspn (content_type, ";");
+   while (len && is_ows (content_type[len - 1]))
+      len--;
+
+   if (len > 5 && (strncasecmp (content_type, "text/", 5))==0)
+      return true;
+
+   for (size_t i=0; i<sizeof types/sizeof types[0]; i++) {
+      if (strlen (types[i]) == len &&
+            (strncasecmp (content_type, types[i], len))==0)
+         return true;
+   }
+
+   // Structured syntax suffixes, as in application/problem+json.
+   if ((len > 5 && (strncasecmp (&content_type[len - 5], "+json", 5))==0) ||
+       (len > 4 && (strncasecmp (&content_type[len - 4], "+xml", 4))==0))
+      return true;
+
+   return false;
+}
+
+/* ************************************************************************
+ * Compression. zlib allocates its state through the arena; the arena
+ * frees it all when the request is done.
+ */
+static voidpf arena_zalloc (voidpf opaque, uInt items, uInt size)
+{
+   return xcgi_arena_alloc (opaque, (size_t)items * size);
+}
+
+static void arena_zfree (voidpf opaque, voidpf address)
+{
+   opaque = opaque;
+   address = address;
+}
+
+xcgi_compress_t *xcgi_compress_new (xcgi_arena_t *arena,
+                                    int encoding, int level)
+{
+   xcgi_compress_t *ret = NULL;
+   int window_bits;
+
+   switch (encoding) {
+      case XCGI_ENCODING_GZIP:      window_bits = 15 + 16;  break;
+      case XCGI_ENCODING_DEFLATE:   window_bits = 15;       break;
+      default:                      return NULL;
+   }
+
+   if (!(ret = xcgi_arena_calloc (arena, sizeof *ret)))
+      return NULL;
+
+   ret->strm.zalloc = arena_zalloc;
+   ret->strm.zfree = arena_zfree;
+   ret->strm.opaque = arena;
+
+   if ((deflateInit2 (&ret->strm, level, Z_DEFLATED, window_bits, 8,
+                      Z_DEFAULT_STRATEGY))!=Z_OK) {
+      fprintf (stderr, "%s: deflateInit2() failed\n", __func__);
+      return NULL;
+   }
+
+   return ret;
+}
+
+void xcgi_compress_del (xcgi_compress_t *z)
+{
+   if (z)
+      deflateEnd (&z->strm);
+}
+
+size_t xcgi_compress_bound (xcgi_compress_t *z, size_t len)
+{
+   return z ? deflateBound (&z->strm, len) : 0;
+}
+
+bool xcgi_compress_write (xcgi_compress_t *z,
+                          const void *src, size_t len, int flush,
+                          bool (*out) (void *, const void *, size_t),
+                          void *param)
+{
+   static const int zflush[] = { Z_NO_FLUSH, Z_SYNC_FLUSH, Z_FINISH };
+
+   if (!z || z->finished || !out || (!src && len) ||
+         flush < XCGI_COMPRESS_NONE || flush > XCGI_COMPRESS_FINISH)
+      return false;
+
+   const unsigned char *in = src;
+
+   do {
+      size_t n = len > MAX_IN ? MAX_IN : len;
+      int mode = n == len ? zflush[flush] : Z_NO_FLUSH;
+      int rc;
+
+      z->strm.next_in = (unsigned char *)in;
+      z->strm.avail_in = n;
+
+      // zlib is done with the input when it does not fill the output.
+      do {
+         z->strm.next_out = z->out;
+         z->strm.avail_out = sizeof z->out;
+
+         if ((rc = deflate (&z->strm, mode))==Z_STREAM_ERROR)
+            return false;
+
+         size_t produced = sizeof z->out - z->strm.avail_out;
+         if (produced && !(out (param, z->out, produced)))
+            return false;
+      } while (z->strm.avail_out == 0);
+
+      if (mode == Z_FINISH) {
+         if (rc != Z_STREAM_END)
+            return false;
+         z->finished = true;
+      }
+
+      in += n;
+      len -= n;
+   } while (len);
+
+   return true;
+}
+
@@ -0,0 +1,86 @@
+
+#ifndef H_XCGI_COMPRESS
+#define H_XCGI_COMPRESS
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "xcgi_arena.h"
+
+// Compression of response bodies with zlib, in the gzip and deflate
+// content-codings. This is used by the response functions in xcgi.h,
+// which negotiate the coding from the Accept-Encoding request header and
+// compress a body when it is of a compressible type and large enough:
+//
+//    xcgi_compress_level      The zlib level, 1 (fastest) to 9 (smallest).
+//                             Zero turns compression off. The default is 6.
+//    xcgi_compress_min_size   Bodies smaller than this many bytes are sent
+//                             as they are. The default is 1024.
+//
+// Both are read from the 'xcgi.ini' file.
+//
+// A compressor must not be used by more than one thread at a time.
+
+#define XCGI_ENCODING_IDENTITY      (0)
+#define XCGI_ENCODING_GZIP          (1)
+#define XCGI_ENCODING_DEFLATE       (2)
+
+// How much of the input is pushed out by xcgi_compress_write().
+#define XCGI_COMPRESS_NONE          (0)
+#define XCGI_COMPRESS_SYNC          (1)
+#define XCGI_COMPRESS_FINISH        (2)
+
+typedef struct xcgi_compress_t xcgi_compress_t;
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the content-coding to use for a client that sent
+   // 'accept_encoding' as its Accept-Encoding header: the coding with the
+   // highest q-value (gzip when they are equal), or
+   // XCGI_ENCODING_IDENTITY if the client accepts neither gzip nor
+   // deflate. A NULL or empty header accepts neither.
+   int xcgi_compress_negotiate (const char *accept_encoding);
+
+   // Returns the name of the content-coding, for the Content-Encoding
+   // header, or NULL for XCGI_ENCODING_IDENTITY.
+   const char *xcgi_compress_encoding_name (int encoding);
+
+   // Returns true if a body with the specified Content-Type is worth
+   // compressing: text, and the JSON, XML and JavaScript types. Images,
+   // archives and other types that are already compressed are not.
+   bool xcgi_compress_type_ok (const char *content_type);
+
+   // Creates a compressor for the 'encoding' at zlib level 'level'. All
+   // of its memory, including the zlib state, is allocated from 'arena'.
+   // Returns NULL on error. The caller must delete the compressor with
+   // xcgi_compress_del() before the arena is reset.
+   xcgi_compress_t *xcgi_compress_new (xcgi_arena_t *arena,
+                                       int encoding, int level);
+
+   // Releases the compressor. Does nothing if 'z' is NULL.
+   void xcgi_compress_del (xcgi_compress_t *z);
+
+   // Returns the largest size that 'len' bytes of input can compress to
+   // when compressed in one go with XCGI_COMPRESS_FINISH.
+   size_t xcgi_compress_bound (xcgi_compress_t *z, size_t len);
+
+   // Compresses the 'len' bytes of 'src'. The compressed output is passed
+   // to 'out' with 'param', in pieces of up to 16KB, as it is produced;
+   // 'out' returns false to stop. With XCGI_COMPRESS_NONE zlib may hold
+   // back some of the output, XCGI_COMPRESS_SYNC pushes out everything so
+   // far and XCGI_COMPRESS_FINISH ends the compressed stream, after which
+   // the compressor cannot be used again. Returns true on success and
+   // false on error.
+   bool xcgi_compress_write (xcgi_compress_t *z,
+                             const void *src, size_t len, int flush,
+                             bool (*out) (void *, const void *, size_t),
+                             void *param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
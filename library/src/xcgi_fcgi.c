@@ -0,0 +1,662 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include <unistd.h>
+
+#include "xcgi.h"
+#include "xcgi_fcgi.h"
+#include "xcgi_net.h"
+
+/* ************************************************************************
+ * Protocol constants, from the FastCGI specification.
+ */
+#define FCGI_LISTENSOCK_FILENO      (0)
+
+#define FCGI_VERSION_1              (1)
+#define FCGI_HEADER_LEN             (8)
+#define FCGI_MAX_CONTENT            (65535)
+
+#define FCGI_BEGIN_REQUEST          (1)
+#define FCGI_ABORT_REQUEST          (2)
+#define FCGI_END_REQUEST            (3)
+#define FCGI_PARAMS                 (4)
+#define FCGI_STDIN                  (5)
+#define FCGI_STDOUT                 (6)
+#define FCGI_STDERR                 (7)
+#define FCGI_DATA                   (8)
+#define FCGI_GET_VALUES             (9)
+#define FCGI_GET_VALUES_RESULT      (10)
+#define FCGI_UNKNOWN_TYPE           (11)
+
+#define FCGI_KEEP_CONN              (1)
+#define FCGI_RESPONDER              (1)
+
+#define FCGI_REQUEST_COMPLETE       (0)
+#define FCGI_CANT_MPX_CONN          (1)
+#define FCGI_UNKNOWN_ROLE           (3)
+
+// Size of the buffer for xcgi_stdout. Each flush of the buffer is sent
+// as a single FCGI_STDOUT record, so this must not exceed
+// FCGI_MAX_CONTENT.
+#define OUTPUT_BUFSIZE              (1024 * 32)
+#define INPUT_BUFSIZE               (1024 * 16)
+
+/* ************************************************************************
+ * All the state for the single connection and request that is served at
+ * any given time. The buffers for the parameters are kept between
+ * requests and only grow.
+ */
+static struct {
+   int         mode;
+   int         listen_fd;
+   int         conn_fd;
+   bool        conn_error;
+
+   bool        in_request;
+   bool        keep_conn;
+   uint16_t    request_id;
+
+   bool        stdin_eof;
+   size_t      rec_remaining;
+   size_t      rec_padding;
+
+   uint8_t    *params;
+   size_t      params_len;
+   size_t      params_size;
+
+   char       *strings;
+   size_t      strings_size;
+   const char **pairs;
+   size_t      npairs;
+   size_t      pairs_size;
+
+   FILE       *inf;
+   FILE       *outf;
+
+   uint8_t     rbuf[INPUT_BUFSIZE];
+   size_t      rpos;
+   size_t      rlen;
+
+   char        obuf[OUTPUT_BUFSIZE];
+} g_fcgi = {
+   .listen_fd = -1,
+   .conn_fd = -1,
+};
+
+/* ************************************************************************
+ * Reading and writing of records.
+ */
+static bool conn_read (void *dst, size_t len)
+{
+   uint8_t *out = dst;
+
+   while (len) {
+      if (g_fcgi.rpos == g_fcgi.rlen) {
+         ssize_t nbytes = xcgi_net_read (g_fcgi.conn_fd, g_fcgi.rbuf,
+                                         sizeof g_fcgi.rbuf);
+         if (nbytes <= 0) {
+            g_fcgi.conn_error = true;
+            return false;
+         }
+         g_fcgi.rpos = 0;
+         g_fcgi.rlen = nbytes;
+      }
+
+      size_t avail = g_fcgi.rlen - g_fcgi.rpos;
+      size_t n = avail < len ? avail : len;
+      if (out) {
+         memcpy (out, &g_fcgi.rbuf[g_fcgi.rpos], n);
+         out += n;
+      }
+      g_fcgi.rpos += n;
+      len -= n;
+   }
+
+   return true;
+}
+
+// Skips 'len' bytes of input.
+static bool conn_skip (size_t len)
+{
+   return conn_read (NULL, len);
+}
+
+static bool record_read_header (uint8_t *type, uint16_t *id,
+                                size_t *content_len, size_t *padding_len)
+{
+   uint8_t hdr[FCGI_HEADER_LEN];
+
+   if (!(conn_read (hdr, sizeof hdr)))
+      return false;
+
+   if (hdr[0] != FCGI_VERSION_1) {
+      fprintf (stderr, "%s: Unsupported FastCGI version %u\n", __func__,
+                        hdr[0]);
+      g_fcgi.conn_error = true;
+      return false;
+   }
+
+   *type = hdr[1];
+   *id = (hdr[2] << 8) | hdr[3];
+   *content_len = (hdr[4] << 8) | hdr[5];
+   *padding_len = hdr[6];
+
+   return true;
+}
+
+static bool record_write (uint8_t type, uint16_t id,
+                          const void *content, size_t len)
+{
+   if (g_fcgi.conn_error)
+      return false;
+
+   do {
+      size_t n = len > FCGI_MAX_CONTENT ? FCGI_MAX_CONTENT : len;
+      uint8_t hdr[FCGI_HEADER_LEN] = {
+         FCGI_VERSION_1, type,
+         (id >> 8) & 0xff, id & 0xff,
+         (n >> 8) & 0xff, n & 0xff,
+         0, 0,
+      };
+      struct iovec iov[2] = {
+         { hdr,            sizeof hdr },
+         { (void *)content, n         },
+      };
+
+      if (!(xcgi_net_writev (g_fcgi.conn_fd, iov, 2))) {
+         g_fcgi.conn_error = true;
+         return false;
+      }
+
+      content = (const uint8_t *)content + n;
+      len -= n;
+   } while (len);
+
+   return true;
+}
+
+static bool record_end_request (uint16_t id, uint8_t protocol_status)
+{
+   uint8_t body[8] = { 0, 0, 0, 0, protocol_status, 0, 0, 0 };
+
+   return record_write (FCGI_END_REQUEST, id, body, sizeof body);
+}
+
+/* ************************************************************************
+ * Name-value pairs, as used by FCGI_PARAMS and FCGI_GET_VALUES.
+ */
+static bool nv_length (const uint8_t *src, size_t len, size_t *index,
+                       size_t *dst)
+{
+   if (*index >= len)
+      return false;
+
+   if (!(src[*index] & 0x80)) {
+      *dst = src[(*index)++];
+      return true;
+   }
+
+   if (*index + 4 > len)
+      return false;
+
+   *dst = ((size_t)(src[*index] & 0x7f) << 24)
+        | ((size_t)src[*index + 1] << 16)
+        | ((size_t)src[*index + 2] << 8)
+        | ((size_t)src[*index + 3]);
+   *index += 4;
+   return true;
+}
+
+static size_t nv_put (uint8_t *dst, const char *name, const char *value)
+{
+   size_t nlen = strlen (name),
+          vlen = strlen (value);
+
+   // Only used for the short management values, so single-byte lengths
+   // are sufficient.
+   dst[0] = nlen;
+   dst[1] = vlen;
+   memcpy (&dst[2], name, nlen);
+   memcpy (&dst[2 + nlen], value, vlen);
+
+   return 2 + nlen + vlen;
+}
+
+// Appends the next 'len' bytes of input to the parameter stream.
+static bool params_read (size_t len)
+{
+   if (g_fcgi.params_len + len > g_fcgi.params_size) {
+      size_t newsize = (g_fcgi.params_len + len) * 2;
+      uint8_t *tmp = realloc (g_fcgi.params, newsize);
+      if (!tmp)
+         return false;
+      g_fcgi.params = tmp;
+      g_fcgi.params_size = newsize;
+   }
+
+   if (!(conn_read (&g_fcgi.params[g_fcgi.params_len], len)))
+      return false;
+
+   g_fcgi.params_len += len;
+
+   return true;
+}
+
+// Splits the received FCGI_PARAMS stream into NUL-terminated names and
+// values. The pairs array stores each name followed by its value.
+static bool params_decode (void)
+{
+   size_t index = 0,
+          sindex = 0;
+
+   // Every pair adds at most two terminators to the encoded size.
+   size_t max_strings = g_fcgi.params_len * 2 + 1;
+   size_t max_pairs = g_fcgi.params_len + 1;
+
+   if (max_strings > g_fcgi.strings_size) {
+      char *tmp = realloc (g_fcgi.strings, max_strings);
+      if (!tmp)
+         return false;
+      g_fcgi.strings = tmp;
+      g_fcgi.strings_size = max_strings;
+   }
+
+   if (max_pairs > g_fcgi.pairs_size) {
+      const char **tmp = realloc (g_fcgi.pairs, sizeof *tmp * max_pairs);
+      if (!tmp)
+         return false;
+      g_fcgi.pairs = tmp;
+      g_fcgi.pairs_size = max_pairs;
+   }
+
+   g_fcgi.npairs = 0;
+
+   while (index < g_fcgi.params_len) {
+      size_t nlen, vlen;
+
+      if (!(nv_length (g_fcgi.params, g_fcgi.params_len, &index, &nlen)) ||
+          !(nv_length (g_fcgi.params, g_fcgi.params_len, &index, &vlen)) ||
+          index + nlen + vlen > g_fcgi.params_len) {
+         fprintf (stderr, "%s: Malformed FCGI_PARAMS\n", __func__);
+         return false;
+      }
+
+      char *name = &g_fcgi.strings[sindex];
+      memcpy (name, &g_fcgi.params[index], nlen);
+      name[nlen] = 0;
+      index += nlen;
+      sindex += nlen + 1;
+
+      char *value = &g_fcgi.strings[sindex];
+      memcpy (value, &g_fcgi.params[index], vlen);
+      value[vlen] = 0;
+      index += vlen;
+      sindex += vlen + 1;
+
+      g_fcgi.pairs[g_fcgi.npairs++] = name;
+      g_fcgi.pairs[g_fcgi.npairs++] = value;
+   }
+
+   return true;
+}
+
+static const char *fcgi_getvar (void *param, const char *name)
+{
+   param = param;
+
+   for (size_t i=0; i<g_fcgi.npairs; i+=2) {
+      if ((strcmp (g_fcgi.pairs[i], name))==0)
+         return g_fcgi.pairs[i + 1];
+   }
+
+   return NULL;
+}
+
+/* ************************************************************************
+ * Handling of records that arrive outside of the current request.
+ */
+static bool management_reply (uint8_t type, size_t content_len)
+{
+   uint8_t reply[128];
+   size_t len = 0;
+
+   if (!(conn_skip (content_len)))
+      return false;
+
+   if (type != FCGI_GET_VALUES) {
+      uint8_t body[8] = { type, 0, 0, 0, 0, 0, 0, 0 };
+      return record_write (FCGI_UNKNOWN_TYPE, 0, body, sizeof body);
+   }
+
+   // The same answer is sent regardless of what was asked for.
+   len += nv_put (&reply[len], "FCGI_MAX_CONNS", "1");
+   len += nv_put (&reply[len], "FCGI_MAX_REQS", "1");
+   len += nv_put (&reply[len], "FCGI_MPXS_CONNS", "0");
+
+   return record_write (FCGI_GET_VALUES_RESULT, 0, reply, len);
+}
+
+// Handles a record that is not part of the current request. Returns
+// false only if the connection has failed.
+static bool record_other (uint8_t type, uint16_t id, size_t content_len,
+                          size_t padding_len)
+{
+   bool ret;
+
+   if (id == 0) {
+      ret = management_reply (type, content_len);
+   } else if (type == FCGI_BEGIN_REQUEST) {
+      ret = conn_skip (content_len) &&
+            record_end_request (id, FCGI_CANT_MPX_CONN);
+   } else {
+      ret = conn_skip (content_len);
+   }
+
+   return ret && conn_skip (padding_len);
+}
+
+/* ************************************************************************
+ * The streams for xcgi_stdin and xcgi_stdout.
+ */
+static ssize_t stdin_read (void *cookie, char *buf, size_t size)
+{
+   cookie = cookie;
+
+   while (!g_fcgi.stdin_eof && g_fcgi.rec_remaining == 0) {
+      uint8_t type;
+      uint16_t id;
+      size_t clen, plen;
+
+      if (!(conn_skip (g_fcgi.rec_padding)))
+         return -1;
+      g_fcgi.rec_padding = 0;
+
+      if (!(record_read_header (&type, &id, &clen, &plen)))
+         return -1;
+
+      if (id != g_fcgi.request_id) {
+         if (!(record_other (type, id, clen, plen)))
+            return -1;
+         continue;
+      }
+
+      if (type == FCGI_STDIN) {
+         g_fcgi.rec_remaining = clen;
+         g_fcgi.rec_padding = plen;
+         if (clen == 0) {
+            g_fcgi.stdin_eof = true;
+            if (!(conn_skip (plen)))
+               return -1;
+            g_fcgi.rec_padding = 0;
+         }
+         continue;
+      }
+
+      if (!(conn_skip (clen + plen)))
+         return -1;
+
+      if (type == FCGI_ABORT_REQUEST) {
+         g_fcgi.stdin_eof = true;
+         g_fcgi.keep_conn = false;
+      }
+   }
+
+   if (g_fcgi.stdin_eof)
+      return 0;
+
+   size_t n = g_fcgi.rec_remaining < size ? g_fcgi.rec_remaining : size;
+   if (!(conn_read (buf, n)))
+      return -1;
+
+   g_fcgi.rec_remaining -= n;
+
+   return n;
+}
+
+static ssize_t stdout_write (void *cookie, const char *buf, size_t size)
+{
+   cookie = cookie;
+
+   if (size == 0)
+      return 0;
+
+   if (!(record_write (FCGI_STDOUT, g_fcgi.request_id, buf, size)))
+      return -1;
+
+   return size;
+}
+
+static bool streams_open (void)
+{
+   cookie_io_functions_t in_funcs = {
+      .read = stdin_read,
+      .close = xcgi_net_stream_close,
+   };
+   cookie_io_functions_t out_funcs = {
+      .write = stdout_write,
+      .close = xcgi_net_stream_close,
+   };
+
+   if (!(g_fcgi.inf = fopencookie (NULL, "r", in_funcs)))
+      return false;
+
+   if (!(g_fcgi.outf = fopencookie (NULL, "w", out_funcs))) {
+      fclose (g_fcgi.inf);
+      g_fcgi.inf = NULL;
+      return false;
+   }
+
+   setvbuf (g_fcgi.outf, g_fcgi.obuf, _IOFBF, sizeof g_fcgi.obuf);
+
+   return true;
+}
+
+static void streams_close (void)
+{
+   if (g_fcgi.outf)
+      fclose (g_fcgi.outf);
+
+   if (g_fcgi.inf)
+      fclose (g_fcgi.inf);
+
+   g_fcgi.outf = NULL;
+   g_fcgi.inf = NULL;
+}
+
+/* ************************************************************************
+ * Request management.
+ */
+static void conn_close (void)
+{
+   if (g_fcgi.conn_fd >= 0)
+      close (g_fcgi.conn_fd);
+
+   g_fcgi.conn_fd = -1;
+   g_fcgi.conn_error = false;
+   g_fcgi.rpos = 0;
+   g_fcgi.rlen = 0;
+}
+
+// Reads records until a responder request has been received together
+// with all of its parameters, or the request is aborted first (when the
+// request id is left at zero). Returns false if the connection fails.
+static bool request_read (void)
+{
+   uint8_t type;
+   uint16_t id;
+   size_t clen, plen;
+
+   g_fcgi.request_id = 0;
+   g_fcgi.params_len = 0;
+
+   while (g_fcgi.request_id == 0) {
+      uint8_t body[8];
+
+      if (!(record_read_header (&type, &id, &clen, &plen)))
+         return false;
+
+      if (type != FCGI_BEGIN_REQUEST || id == 0 || clen != sizeof body) {
+         if (!(record_other (type, id, clen, plen)))
+            return false;
+         continue;
+      }
+
+      if (!(conn_read (body, sizeof body)) || !(conn_skip (plen)))
+         return false;
+
+      if (((body[0] << 8) | body[1]) != FCGI_RESPONDER) {
+         if (!(record_end_request (id, FCGI_UNKNOWN_ROLE)))
+            return false;
+         continue;
+      }
+
+      g_fcgi.request_id = id;
+      g_fcgi.keep_conn = body[2] & FCGI_KEEP_CONN;
+   }
+
+   while (true) {
+      if (!(record_read_header (&type, &id, &clen, &plen)))
+         return false;
+
+      if (id != g_fcgi.request_id || type != FCGI_PARAMS) {
+         if (!(record_other (type, id, clen, plen)))
+            return false;
+         // An aborted request still ends with FCGI_END_REQUEST, which
+         // the web server waits for.
+         if (id == g_fcgi.request_id && type == FCGI_ABORT_REQUEST) {
+            g_fcgi.request_id = 0;
+            return record_end_request (id, FCGI_REQUEST_COMPLETE);
+         }
+         continue;
+      }
+
+      if (clen == 0)
+         break;
+
+      if (!(params_read (clen)) || !(conn_skip (plen)))
+         return false;
+   }
+
+   return conn_skip (plen);
+}
+
+void xcgi_fcgi_finish (void)
+{
+   char discard[1024];
+
+   if (!g_fcgi.in_request)
+      return;
+
+   xcgi_body_end ();
+
+   if (g_fcgi.outf)
+      fflush (g_fcgi.outf);
+
+   // The web server may not read the response until all of the input
+   // has been consumed.
+   while (g_fcgi.inf && !g_fcgi.conn_error && !g_fcgi.stdin_eof) {
+      if (stdin_read (NULL, discard, sizeof discard) < 0)
+         break;
+   }
+
+   streams_close ();
+
+   record_write (FCGI_STDOUT, g_fcgi.request_id, NULL, 0);
+   record_end_request (g_fcgi.request_id, FCGI_REQUEST_COMPLETE);
+
+   xcgi_request_end ();
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   if (!g_fcgi.keep_conn || g_fcgi.conn_error)
+      conn_close ();
+
+   g_fcgi.in_request = false;
+}
+
+static bool mode_detect (void)
+{
+   g_fcgi.listen_fd = xcgi_net_listener (FCGI_LISTENSOCK_FILENO);
+
+   if (g_fcgi.listen_fd == XCGI_NET_CGI) {
+      g_fcgi.mode = XCGI_NET_MODE_CGI;
+      return true;
+   }
+
+   if (g_fcgi.listen_fd < 0)
+      return false;
+
+   // Discard the request that xcgi_init() loaded from the (empty)
+   // environment; descriptor 0 is not the request input.
+   xcgi_request_end ();
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   g_fcgi.mode = XCGI_NET_MODE_SERVER;
+
+   return true;
+}
+
+bool xcgi_fcgi_accept (void)
+{
+   if (g_fcgi.mode == XCGI_NET_MODE_UNKNOWN && !(mode_detect ()))
+      return false;
+
+   if (g_fcgi.mode == XCGI_NET_MODE_CGI) {
+      g_fcgi.mode = XCGI_NET_MODE_CGI_DONE;
+      return true;
+   }
+
+   if (g_fcgi.mode != XCGI_NET_MODE_SERVER)
+      return false;
+
+   xcgi_fcgi_finish ();
+
+   while (true) {
+      if (g_fcgi.conn_fd < 0) {
+         if ((g_fcgi.conn_fd = xcgi_net_accept (g_fcgi.listen_fd)) < 0)
+            return false;
+      }
+
+      // A failure here is usually the web server closing a kept-alive
+      // connection, so we simply wait for the next one.
+      if (!(request_read ())) {
+         conn_close ();
+         continue;
+      }
+
+      // The request was aborted before it started.
+      if (g_fcgi.request_id == 0) {
+         if (!g_fcgi.keep_conn)
+            conn_close ();
+         continue;
+      }
+
+      g_fcgi.stdin_eof = false;
+      g_fcgi.rec_remaining = 0;
+      g_fcgi.rec_padding = 0;
+
+      if (!(params_decode ()) || !(streams_open ())) {
+         record_end_request (g_fcgi.request_id, FCGI_REQUEST_COMPLETE);
+         conn_close ();
+         continue;
+      }
+
+      g_fcgi.in_request = true;
+
+      if (!(xcgi_request_begin (fcgi_getvar, NULL,
+                                g_fcgi.inf, g_fcgi.outf))) {
+         fprintf (stderr, "%s: Failed to start request\n", __func__);
+         xcgi_fcgi_finish ();
+         continue;
+      }
+
+      return true;
+   }
+}
+
@@ -0,0 +1,62 @@
+
+#ifndef H_XCGI_FCGI
+#define H_XCGI_FCGI
+
+#include <stdbool.h>
+
+// FastCGI responder support. A program that uses this module keeps the
+// configuration, the database handle and all other process-wide state
+// alive between requests; only the per-request state (the xcgi_[A-Z]*
+// variables, query strings, cookies, path info and response headers) is
+// rebuilt for each request.
+//
+// The typical usage is:
+//
+//    if (!(xcgi_init (path)))
+//       ...
+//
+//    while (xcgi_fcgi_accept ()) {
+//       ... handle exactly as a CGI request, writing to xcgi_stdout ...
+//    }
+//
+//    xcgi_shutdown ();
+//
+// The listening socket is taken from the 'xcgi_listen' entry in the
+// 'xcgi.ini' file if it exists (see xcgi_net_listen() for the format).
+// Otherwise the program expects the web server to pass the listening
+// socket as descriptor 0, as specified by FastCGI.
+//
+// When neither is true the program is assumed to have been started as a
+// plain CGI program: the first call to xcgi_fcgi_accept() returns true
+// (the request has already been loaded by xcgi_init()) and the next call
+// returns false. The same program can therefore be deployed as either a
+// CGI or a FastCGI program.
+//
+// Only a single request per connection is served at a time; multiplexed
+// requests are refused with FCGI_CANT_MPX_CONN.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Completes the previous request, if any, and waits for the next one.
+   // On success the xcgi_[A-Z]* variables, xcgi_stdin, xcgi_stdout,
+   // xcgi_path_info and xcgi_cookies are populated for the new request
+   // and true is returned. Returns false when no more requests will be
+   // served.
+   bool xcgi_fcgi_accept (void);
+
+   // Completes the current request: all output in xcgi_stdout is
+   // flushed, any unread input is discarded and the web server is told
+   // that the request is complete. Does nothing if no request is active.
+   // There is no need to call this function before xcgi_fcgi_accept();
+   // it is provided for callers that want to release the client before
+   // performing more work.
+   void xcgi_fcgi_finish (void);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
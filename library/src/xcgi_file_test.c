@@ -0,0 +1,112 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "xcgi.h"
+
+// Runs in a new directory under /tmp that holds a file, a directory, a
+// FIFO and symbolic links that point out of the directory or back into
+// it. Only the plain paths to the file may be sent.
+
+#define FILE_CONTENT    ("file content\n")
+
+static const struct {
+   const char *path;
+   bool        sent;
+} g_paths[] = {
+   { "dir/file.txt",          true  },
+   { "./dir//file.txt",       true  },
+   { "/etc/passwd",           false },
+   { "dir/../dir/file.txt",   false },
+   { "../etc/passwd",         false },
+   { "root/etc/passwd",       false },
+   { "dlink/file.txt",        false },
+   { "dir/flink",             false },
+   { "dir",                   false },
+   { "fifo",                  false },
+   { "missing.txt",           false },
+};
+
+static bool tree_make (void)
+{
+   FILE *outf = NULL;
+
+   if ((mkdir ("dir", 0700))!=0 ||
+       !(outf = fopen ("dir/file.txt", "w")))
+      return false;
+
+   fputs (FILE_CONTENT, outf);
+   fclose (outf);
+
+   return (mkfifo ("fifo", 0600))==0 &&
+          (symlink ("/", "root"))==0 &&
+          (symlink ("dir", "dlink"))==0 &&
+          (symlink ("file.txt", "dir/flink"))==0;
+}
+
+static void tree_remove (void)
+{
+   unlink ("dir/flink");
+   unlink ("dlink");
+   unlink ("root");
+   unlink ("fifo");
+   unlink ("dir/file.txt");
+   rmdir ("dir");
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   char tmpdir[] = "/tmp/xcgi-file-test-XXXXXX";
+
+   printf ("Testing xcgi_send_file\n");
+
+   if (!(mkdtemp (tmpdir)) || (chdir (tmpdir))!=0) {
+      fprintf (stderr, "Failed to create [%s]\n", tmpdir);
+      return EXIT_FAILURE;
+   }
+
+   setenv ("REQUEST_METHOD", "GET", 1);
+
+   if (!(tree_make ())) {
+      fprintf (stderr, "Failed to create the files in [%s]\n", tmpdir);
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<sizeof g_paths / sizeof g_paths[0]; i++) {
+      if (!(xcgi_init ("./"))) {
+         fprintf (stderr, "Failed to initialise the library\n");
+         goto errorexit;
+      }
+
+      fflush (stdout);
+      bool sent = xcgi_send_file (g_paths[i].path);
+      fflush (xcgi_stdout);
+      xcgi_shutdown ();
+
+      printf ("\n[%s]: %s\n", g_paths[i].path, sent ? "sent" : "refused");
+      if (sent != g_paths[i].sent) {
+         fprintf (stderr, "Expected [%s] to be %s\n", g_paths[i].path,
+                  g_paths[i].sent ? "sent" : "refused");
+         goto errorexit;
+      }
+   }
+
+   printf ("======================================\n\n");
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   tree_remove ();
+   if ((chdir ("/"))==0)
+      rmdir (tmpdir);
+
+   printf ("%s\n", ret == EXIT_SUCCESS ? "PASSED" : "FAILED");
+   return ret;
+}
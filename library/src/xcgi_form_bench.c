@@ -0,0 +1,243 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "xcgi.h"
+
+#include "ds_str.h"
+
+// Measures the throughput of decoding application/x-www-form-urlencoded
+// POST bodies of 1KB to 10MB, with the library's block-buffered reader
+// and with the byte-at-a-time reader that it replaced.
+//
+// Two body shapes are used: many small fields (a typical form), and a
+// single large field (a big textarea or an encoded upload). The old
+// reader is quadratic in the length of each field, so for the single
+// large field it is only run on the smaller sizes.
+
+#define FORM_CONTENT_TYPE     ("application/x-www-form-urlencoded")
+#define MIN_SECONDS           (0.25)
+#define LEGACY_MAX_FIELD      (1024 * 64)
+
+static double now_secs (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+/* ************************************************************************
+ * Body generation.
+ */
+// The last field is padded so that the body is exactly 'size' bytes.
+static char *make_small_fields (size_t size)
+{
+   char *ret = malloc (size + 1);
+   char field[64];
+   size_t len = 0;
+
+   if (!ret)
+      return NULL;
+
+   for (size_t i=0; ; i++) {
+      int flen = snprintf (field, sizeof field, "%sfield%zu=value+%zu%%21%%3F",
+                           i ? "&" : "", i, i * 7);
+      if (len + flen + 3 > size)
+         break;
+      memcpy (&ret[len], field, flen);
+      len += flen;
+   }
+
+   len += sprintf (&ret[len], "%s", len ? "&z=" : "z=");
+   while (len < size)
+      ret[len++] = 'a';
+
+   ret[len] = 0;
+   return ret;
+}
+
+static char *make_large_field (size_t size)
+{
+   static const char pattern[] = "Some+text%2C+with%20escapes%21+";
+   char *ret = malloc (size + 1);
+
+   if (!ret)
+      return NULL;
+
+   strcpy (ret, "text=");
+   for (size_t len=5; len < size; len++) {
+      ret[len] = pattern[len % (sizeof pattern - 1)];
+   }
+
+   ret[size] = 0;
+   return ret;
+}
+
+/* ************************************************************************
+ * The readers.
+ */
+typedef struct body_t body_t;
+struct body_t {
+   const char *data;
+   size_t      len;
+   char        clen[32];
+};
+
+static const char *body_getvar (void *param, const char *name)
+{
+   body_t *body = param;
+
+   if ((strcmp (name, "REQUEST_METHOD"))==0)
+      return "POST";
+   if ((strcmp (name, "CONTENT_TYPE"))==0)
+      return FORM_CONTENT_TYPE;
+   if ((strcmp (name, "CONTENT_LENGTH"))==0)
+      return body->clen;
+
+   return "";
+}
+
+static size_t run_library (body_t *body)
+{
+   FILE *inf = fmemopen ((void *)body->data, body->len, "r");
+   size_t ret = 0;
+
+   xcgi_ctx_t *ctx = xcgi_ctx_new (body_getvar, body, inf, NULL);
+   if (ctx && xcgi_ctx_qstrings_parse (ctx))
+      ret = xcgi_ctx_qstrings_count (ctx);
+
+   xcgi_ctx_del (ctx);
+   fclose (inf);
+
+   return ret;
+}
+
+// The reader that the library used to use: one fgetc() and one
+// reallocation per byte, and a separate allocation for every decoded
+// field.
+static char *legacy_next_pair (FILE *inf)
+{
+   char *ret = NULL;
+   char tmp[2] = { 0, 0 };
+   int c;
+
+   while ((c = fgetc (inf)) != EOF) {
+      if (c == '&')
+         break;
+      tmp[0] = c;
+      if (!(ds_str_append (&ret, tmp, NULL))) {
+         free (ret);
+         return NULL;
+      }
+   }
+
+   return ret;
+}
+
+static size_t run_legacy (body_t *body)
+{
+   FILE *inf = fmemopen ((void *)body->data, body->len, "r");
+   char *pair;
+   size_t ret = 0;
+
+   while ((pair = legacy_next_pair (inf))) {
+      char *tmp = xcgi_string_unescape (pair);
+      if (tmp && strchr (tmp, '='))
+         ret++;
+      free (tmp);
+      free (pair);
+   }
+
+   fclose (inf);
+
+   return ret;
+}
+
+static double measure (size_t (*fptr) (body_t *), body_t *body,
+                       size_t *npairs)
+{
+   size_t iterations = 0;
+   double start = now_secs ();
+   double elapsed;
+
+   do {
+      *npairs = fptr (body);
+      iterations++;
+      elapsed = now_secs () - start;
+   } while (elapsed < MIN_SECONDS);
+
+   return (body->len * (double)iterations) / (elapsed * 1024 * 1024);
+}
+
+int main (void)
+{
+   static const size_t sizes[] = {
+      1024,
+      1024 * 16,
+      1024 * 256,
+      1024 * 1024,
+      1024 * 1024 * 10,
+   };
+   static const struct {
+      const char *name;
+      char *(*make) (size_t);
+      bool single_field;
+   } shapes[] = {
+      { "fields",    make_small_fields,   false },
+      { "large",     make_large_field,    true  },
+   };
+
+   if (!(xcgi_init ("."))) {
+      fprintf (stderr, "Failed to initialise the library\n");
+      return EXIT_FAILURE;
+   }
+
+   xcgi_qstrings_accept_content_type (FORM_CONTENT_TYPE);
+
+   printf ("%-8s %10s %8s %14s %14s %8s\n",
+           "shape", "bytes", "pairs", "legacy MB/s", "block MB/s", "speedup");
+
+   for (size_t i=0; i<sizeof shapes/sizeof shapes[0]; i++) {
+      for (size_t j=0; j<sizeof sizes/sizeof sizes[0]; j++) {
+         body_t body;
+         size_t npairs = 0, nlegacy = 0;
+
+         char *data = shapes[i].make (sizes[j]);
+         if (!data) {
+            fprintf (stderr, "OOM error creating %zu byte body\n", sizes[j]);
+            xcgi_shutdown ();
+            return EXIT_FAILURE;
+         }
+
+         body.data = data;
+         body.len = strlen (data);
+         snprintf (body.clen, sizeof body.clen, "%zu", body.len);
+
+         double block = measure (run_library, &body, &npairs);
+
+         if (shapes[i].single_field && body.len > LEGACY_MAX_FIELD) {
+            printf ("%-8s %10zu %8zu %14s %14.1f %8s\n",
+                    shapes[i].name, body.len, npairs, "-", block, "-");
+         } else {
+            double legacy = measure (run_legacy, &body, &nlegacy);
+            if (nlegacy != npairs) {
+               fprintf (stderr, "Mismatch: %zu pairs vs %zu legacy pairs\n",
+                                 npairs, nlegacy);
+            }
+            printf ("%-8s %10zu %8zu %14.1f %14.1f %7.1fx\n",
+                    shapes[i].name, body.len, npairs, legacy, block,
+                    block / legacy);
+         }
+
+         free (data);
+      }
+   }
+
+   xcgi_shutdown ();
+
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+
+#include <string.h>
+
+#include "xcgi_hash.h"
+
+#define PRIME1       (11400714785074694791ULL)
+#define PRIME2       (14029467366897019727ULL)
+#define PRIME3       (1609587929392839161ULL)
+#define PRIME4       (9650029242287828579ULL)
+#define PRIME5       (2870177450012600261ULL)
+
+static uint64_t rotl (uint64_t x, int r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64 (const uint8_t *p)
+{
+   uint64_t ret;
+   memcpy (&ret, p, sizeof ret);
+   return ret;
+}
+
+static uint32_t read32 (const uint8_t *p)
+{
+   uint32_t ret;
+   memcpy (&ret, p, sizeof ret);
+   return ret;
+}
+
+static uint64_t round64 (uint64_t acc, uint64_t input)
+{
+   acc += input * PRIME2;
+   acc = rotl (acc, 31);
+   return acc * PRIME1;
+}
+
+static uint64_t merge64 (uint64_t acc, uint64_t val)
+{
+   acc ^= round64 (0, val);
+   return acc * PRIME1 + PRIME4;
+}
+
+uint64_t xcgi_hash64 (const void *data, size_t len, uint64_t seed)
+{
+   const uint8_t *p = data;
+   const uint8_t *end = p + len;
+   uint64_t ret;
+
+   if (len >= 32) {
+      // Four independent lanes of 8 bytes each.
+      uint64_t v1 = seed + PRIME1 + PRIME2;
+      uint64_t v2 = seed + PRIME2;
+      uint64_t v3 = seed;
+      uint64_t v4 = seed - PRIME1;
+
+      do {
+         v1 = round64 (v1, read64 (p));
+         v2 = round64 (v2, read64 (p + 8));
+         v3 = round64 (v3, read64 (p + 16));
+         v4 = round64 (v4, read64 (p + 24));
+         p += 32;
+      } while (end - p >= 32);
+
+      ret = rotl (v1, 1) + rotl (v2, 7) + rotl (v3, 12) + rotl (v4, 18);
+      ret = merge64 (ret, v1);
+      ret = merge64 (ret, v2);
+      ret = merge64 (ret, v3);
+      ret = merge64 (ret, v4);
+   } else {
+      ret = seed + PRIME5;
+   }
+
+   ret += len;
+
+   for (; end - p >= 8; p += 8) {
+      ret ^= round64 (0, read64 (p));
+      ret = rotl (ret, 27) * PRIME1 + PRIME4;
+   }
+
+   if (end - p >= 4) {
+      ret ^= read32 (p) * PRIME1;
+      ret = rotl (ret, 23) * PRIME2 + PRIME3;
+      p += 4;
+   }
+
+   for (; p < end; p++) {
+      ret ^= *p * PRIME5;
+      ret = rotl (ret, 11) * PRIME1;
+   }
+
+   ret ^= ret >> 33;
+   ret *= PRIME2;
+   ret ^= ret >> 29;
+   ret *= PRIME3;
+   ret ^= ret >> 32;
+
+   return ret;
+}
+
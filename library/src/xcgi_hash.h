@@ -0,0 +1,28 @@
+
+#ifndef H_XCGI_HASH
+#define H_XCGI_HASH
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Fast non-cryptographic hashing of memory, for detecting changed
+// content (such as the ETag of a response body). The hash is XXH64,
+// which runs at several GB/s; it gives the same results as the reference
+// implementation on little-endian hosts.
+//
+// This is not suitable where the input may be chosen by an attacker to
+// produce collisions.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the 64-bit hash of the 'len' bytes at 'data', with 'seed'.
+   uint64_t xcgi_hash64 (const void *data, size_t len, uint64_t seed);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
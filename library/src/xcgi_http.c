@@ -0,0 +1,1193 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+
+#include "xcgi.h"
+#include "xcgi_cfg.h"
+#include "xcgi_http.h"
+#include "xcgi_net.h"
+
+#define CFG_LISTEN                  ("xcgi_listen")
+#define CFG_MAX_BODY                ("xcgi_http_max_body")
+
+#define DEFAULT_MAX_BODY            (1024 * 1024 * 16)
+#define MAX_HEADERS_SIZE            (1024 * 64)
+#define MAX_EVENTS                  (64)
+#define READ_SIZE                   (1024 * 16)
+
+// How long (in milliseconds) a streamed response waits for a client
+// that is not reading.
+#define SEND_TIMEOUT                (1000 * 30)
+
+#define SERVER_SOFTWARE             ("libxcgi/" XCGI_VERSION)
+
+/* ************************************************************************
+ * A single client connection. The input buffer holds the request being
+ * served followed by any pipelined requests; the output buffer holds
+ * responses that have not yet been sent.
+ */
+typedef struct http_conn_t http_conn_t;
+struct http_conn_t {
+   int            fd;
+
+   char          *ibuf;
+   size_t         ilen;
+   size_t         isize;
+
+   char          *obuf;
+   size_t         olen;
+   size_t         opos;
+   size_t         osize;
+
+   // A file being sent after the output buffer, and the part of it that
+   // has not been sent yet. 'file_fd' is -1 when there is none.
+   int            file_fd;
+   off_t          file_pos;
+   size_t         file_left;
+
+   bool           keep_alive;
+   bool           closing;
+   bool           eof;
+   bool           queued;
+   uint32_t       events;
+
+   http_conn_t   *next;
+
+   char           remote_addr[NI_MAXHOST];
+   char           remote_port[NI_MAXSERV];
+   char           server_addr[NI_MAXHOST];
+   char           server_port[NI_MAXSERV];
+};
+
+// The variables that are not request headers. The order must match the
+// VAR_* indices.
+#define VAR_REQUEST_METHOD          (0)
+#define VAR_REQUEST_URI             (1)
+#define VAR_QUERY_STRING            (2)
+#define VAR_PATH_INFO               (3)
+#define VAR_SERVER_PROTOCOL         (4)
+#define VAR_CONTENT_LENGTH          (5)
+#define VAR_CONTENT_TYPE            (6)
+#define VAR_REMOTE_ADDR             (7)
+#define VAR_REMOTE_PORT             (8)
+#define VAR_SERVER_ADDR             (9)
+#define VAR_SERVER_PORT             (10)
+#define VAR_SERVER_NAME             (11)
+#define VAR_SERVER_SOFTWARE         (12)
+#define VAR_GATEWAY_INTERFACE       (13)
+#define VAR_REQUEST_SCHEME          (14)
+#define VAR_SCRIPT_NAME             (15)
+#define VAR_COUNT                   (16)
+
+static const char *g_var_names[VAR_COUNT] = {
+   "REQUEST_METHOD",
+   "REQUEST_URI",
+   "QUERY_STRING",
+   "PATH_INFO",
+   "SERVER_PROTOCOL",
+   "CONTENT_LENGTH",
+   "CONTENT_TYPE",
+   "REMOTE_ADDR",
+   "REMOTE_PORT",
+   "SERVER_ADDR",
+   "SERVER_PORT",
+   "SERVER_NAME",
+   "SERVER_SOFTWARE",
+   "GATEWAY_INTERFACE",
+   "REQUEST_SCHEME",
+   "SCRIPT_NAME",
+};
+
+static struct {
+   int            mode;
+   int            listen_fd;
+   int            epoll_fd;
+   size_t         max_body;
+
+   http_conn_t   *ready_head;
+   http_conn_t   *ready_tail;
+
+   // The request currently being served.
+   http_conn_t   *current;
+   size_t         req_len;
+   bool           req_head;
+   const char    *vars[VAR_COUNT];
+   char          *strings;
+   size_t         strings_size;
+   const char   **headers;
+   size_t         nheaders;
+   size_t         headers_size;
+   const char    *body;
+   size_t         body_len;
+   size_t         body_pos;
+
+   // The CGI response written by the caller for the current request.
+   // Once the response is being streamed this only holds the part of
+   // the body that has not been sent yet.
+   char          *resp;
+   size_t         resp_len;
+   size_t         resp_size;
+   bool           streaming;
+   bool           chunked;
+   bool           send_body;
+   bool           stream_error;
+
+   // The file that follows the CGI response (see xcgi_http_sendfile()),
+   // or -1.
+   int            file_fd;
+   off_t          file_pos;
+   size_t         file_len;
+
+   FILE          *inf;
+   FILE          *outf;
+
+   time_t         date_time;
+   char           date[64];
+} g_http = {
+   .listen_fd = -1,
+   .epoll_fd = -1,
+   .file_fd = -1,
+};
+
+/* ************************************************************************
+ * Buffer helpers.
+ */
+static bool buf_reserve (char **buf, size_t *size, size_t needed)
+{
+   if (needed <= *size)
+      return true;
+
+   size_t newsize = *size ? *size : 1024;
+   while (newsize < needed)
+      newsize *= 2;
+
+   char *tmp = realloc (*buf, newsize);
+   if (!tmp)
+      return false;
+
+   *buf = tmp;
+   *size = newsize;
+   return true;
+}
+
+static bool out_append (http_conn_t *c, const void *src, size_t len)
+{
+   if (!(buf_reserve (&c->obuf, &c->osize, c->olen + len)))
+      return false;
+
+   memcpy (&c->obuf[c->olen], src, len);
+   c->olen += len;
+   return true;
+}
+
+static bool out_printf (http_conn_t *c, const char *fmts, ...)
+{
+   char tmp[512];
+   va_list ap;
+
+   va_start (ap, fmts);
+   int len = vsnprintf (tmp, sizeof tmp, fmts, ap);
+   va_end (ap);
+
+   if (len < 0 || (size_t)len >= sizeof tmp)
+      return false;
+
+   return out_append (c, tmp, len);
+}
+
+static const char *http_date (void)
+{
+   time_t now = time (NULL);
+
+   if (now != g_http.date_time) {
+      struct tm tm;
+      gmtime_r (&now, &tm);
+      strftime (g_http.date, sizeof g_http.date,
+                "%a, %d %b %Y %H:%M:%S GMT", &tm);
+      g_http.date_time = now;
+   }
+
+   return g_http.date;
+}
+
+/* ************************************************************************
+ * Connection management.
+ */
+// Returns true while the connection has output that is not sent yet.
+static bool conn_pending (http_conn_t *c)
+{
+   return c->opos < c->olen || c->file_fd >= 0;
+}
+
+static void conn_update_events (http_conn_t *c)
+{
+   uint32_t events = 0;
+
+   if (conn_pending (c))
+      events |= EPOLLOUT;
+   else if (!c->queued && !c->closing && !c->eof && c != g_http.current)
+      events |= EPOLLIN;
+
+   if (events == c->events)
+      return;
+
+   struct epoll_event ev = { .events = events, .data.ptr = c };
+   epoll_ctl (g_http.epoll_fd, EPOLL_CTL_MOD, c->fd, &ev);
+   c->events = events;
+}
+
+static void conn_close (http_conn_t *c)
+{
+   epoll_ctl (g_http.epoll_fd, EPOLL_CTL_DEL, c->fd, NULL);
+   close (c->fd);
+   if (c->file_fd >= 0)
+      close (c->file_fd);
+   free (c->ibuf);
+   free (c->obuf);
+   free (c);
+}
+
+static void conn_new (int fd)
+{
+   http_conn_t *c = NULL;
+   struct sockaddr_storage addr;
+   socklen_t len;
+
+   if (!(c = calloc (1, sizeof *c))) {
+      close (fd);
+      return;
+   }
+
+   c->fd = fd;
+   c->file_fd = -1;
+
+   len = sizeof addr;
+   if ((getpeername (fd, (struct sockaddr *)&addr, &len))==0)
+      getnameinfo ((struct sockaddr *)&addr, len,
+                   c->remote_addr, sizeof c->remote_addr,
+                   c->remote_port, sizeof c->remote_port,
+                   NI_NUMERICHOST | NI_NUMERICSERV);
+
+   len = sizeof addr;
+   if ((getsockname (fd, (struct sockaddr *)&addr, &len))==0)
+      getnameinfo ((struct sockaddr *)&addr, len,
+                   c->server_addr, sizeof c->server_addr,
+                   c->server_port, sizeof c->server_port,
+                   NI_NUMERICHOST | NI_NUMERICSERV);
+
+   c->events = EPOLLIN;
+   struct epoll_event ev = { .events = c->events, .data.ptr = c };
+   if ((epoll_ctl (g_http.epoll_fd, EPOLL_CTL_ADD, fd, &ev))!=0) {
+      close (fd);
+      free (c);
+   }
+}
+
+static void conn_accept_all (void)
+{
+   int fd;
+
+   while ((fd = accept4 (g_http.listen_fd, NULL, NULL,
+                         SOCK_NONBLOCK | SOCK_CLOEXEC)) >= 0) {
+      conn_new (fd);
+   }
+}
+
+// Sends as much pending output as the socket accepts. Returns false if
+// the connection has failed.
+static bool conn_flush (http_conn_t *c)
+{
+   while (c->opos < c->olen) {
+      ssize_t nbytes = send (c->fd, &c->obuf[c->opos], c->olen - c->opos,
+                             MSG_NOSIGNAL);
+      if (nbytes < 0) {
+         if (errno == EINTR)
+            continue;
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+      c->opos += nbytes;
+   }
+
+   c->opos = 0;
+   c->olen = 0;
+
+   // The file follows the rest of the response, straight from the page
+   // cache to the socket.
+   while (c->file_fd >= 0 && c->file_left) {
+      ssize_t nbytes = xcgi_net_sendfile (c->fd, c->file_fd, &c->file_pos,
+                                          c->file_left);
+      if (nbytes < 0)
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+
+      // The file is shorter than it was when the response was made.
+      if (nbytes == 0)
+         return false;
+
+      c->file_left -= nbytes;
+   }
+
+   if (c->file_fd >= 0) {
+      close (c->file_fd);
+      c->file_fd = -1;
+   }
+
+   return true;
+}
+
+// Reads everything available on the connection. Returns false if the
+// connection has failed.
+static bool conn_fill (http_conn_t *c)
+{
+   size_t limit = MAX_HEADERS_SIZE + g_http.max_body + READ_SIZE;
+
+   while (c->ilen < limit) {
+      if (!(buf_reserve (&c->ibuf, &c->isize, c->ilen + READ_SIZE)))
+         return false;
+
+      ssize_t nbytes = read (c->fd, &c->ibuf[c->ilen], READ_SIZE);
+      if (nbytes < 0) {
+         if (errno == EINTR)
+            continue;
+         return errno == EAGAIN || errno == EWOULDBLOCK;
+      }
+
+      if (nbytes == 0) {
+         c->eof = true;
+         break;
+      }
+
+      c->ilen += nbytes;
+   }
+
+   return true;
+}
+
+/* ************************************************************************
+ * Request framing. Returns the length of the first complete request in
+ * the input buffer, zero if the request is incomplete and -1 (with the
+ * status set) if the request must be refused.
+ */
+static bool header_is (const char *line, const char *name, size_t nlen)
+{
+   return (strncasecmp (line, name, nlen))==0 && line[nlen] == ':';
+}
+
+static const char *header_value (const char *line, size_t nlen)
+{
+   const char *ret = &line[nlen + 1];
+   while (*ret == ' ' || *ret == '\t')
+      ret++;
+   return ret;
+}
+
+static ssize_t request_framing (http_conn_t *c, int *status)
+{
+   char *end = memmem (c->ibuf, c->ilen, "\r\n\r\n", 4);
+
+   if (!end) {
+      if (c->ilen > MAX_HEADERS_SIZE) {
+         *status = 431;
+         return -1;
+      }
+      return 0;
+   }
+
+   size_t hlen = end - c->ibuf + 4;
+   size_t clen = 0;
+
+   for (char *line = c->ibuf; line < end; ) {
+      char *eol = memchr (line, '\r', end - line);
+      if (!eol)
+         eol = end;
+
+      if (header_is (line, "Content-Length", 14)) {
+         char *endp = NULL;
+         const char *value = header_value (line, 14);
+         uintmax_t tmp = strtoumax (value, &endp, 10);
+         if (endp == value || (endp != eol && !isspace ((unsigned char)*endp))) {
+            *status = 400;
+            return -1;
+         }
+         if (tmp > g_http.max_body) {
+            *status = 413;
+            return -1;
+         }
+         clen = tmp;
+      }
+
+      if (header_is (line, "Transfer-Encoding", 17)) {
+         *status = 411;
+         return -1;
+      }
+
+      line = eol + 2;
+   }
+
+   return c->ilen >= hlen + clen ? (ssize_t)(hlen + clen) : 0;
+}
+
+static void conn_refuse (http_conn_t *c, int status)
+{
+   const char *phrase = xcgi_reason_phrase (status);
+
+   out_printf (c, "HTTP/1.1 %i %s\r\n"
+                  "Date: %s\r\n"
+                  "Server: %s\r\n"
+                  "Content-Type: text/plain\r\n"
+                  "Content-Length: %zu\r\n"
+                  "Connection: close\r\n"
+                  "\r\n"
+                  "%s\n",
+                  status, phrase, http_date (), SERVER_SOFTWARE,
+                  strlen (phrase) + 1, phrase);
+   c->closing = true;
+   c->ilen = 0;
+}
+
+// Queues the connection if it has a complete request and no pending
+// output. Connections that are finished are closed.
+static void conn_check (http_conn_t *c)
+{
+   if (!c->queued && !c->closing && !(conn_pending (c))) {
+      int status = 0;
+      ssize_t len = request_framing (c, &status);
+
+      if (len < 0) {
+         conn_refuse (c, status);
+      } else if (len > 0) {
+         c->queued = true;
+         c->next = NULL;
+         if (g_http.ready_tail)
+            g_http.ready_tail->next = c;
+         else
+            g_http.ready_head = c;
+         g_http.ready_tail = c;
+      } else if (c->eof) {
+         c->closing = true;
+      }
+   }
+
+   if (c->closing && !(conn_pending (c))) {
+      conn_close (c);
+      return;
+   }
+
+   conn_update_events (c);
+}
+
+static void conn_event (http_conn_t *c, uint32_t events)
+{
+   if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN)) {
+      conn_close (c);
+      return;
+   }
+
+   if (events & EPOLLOUT && !(conn_flush (c))) {
+      conn_close (c);
+      return;
+   }
+
+   if (events & EPOLLIN && !(conn_fill (c))) {
+      conn_close (c);
+      return;
+   }
+
+   conn_check (c);
+}
+
+/* ************************************************************************
+ * Request parsing. The request line and headers are NUL-terminated in
+ * place in the connection's input buffer.
+ */
+static char *strings_add (size_t *index, const char *src, size_t len)
+{
+   char *ret = &g_http.strings[*index];
+
+   memcpy (ret, src, len);
+   ret[len] = 0;
+   *index += len + 1;
+
+   return ret;
+}
+
+// Returns NULL for a path containing an encoded NUL (%00), which would
+// otherwise cut PATH_INFO short.
+static char *path_decode (char *dst, const char *src, size_t len)
+{
+   char *ret = dst;
+
+   for (size_t i=0; i<len; i++) {
+      if (src[i] == '%' && i + 2 < len &&
+          isxdigit ((unsigned char)src[i + 1]) &&
+          isxdigit ((unsigned char)src[i + 2])) {
+         char hex[3] = { src[i + 1], src[i + 2], 0 };
+         if (!(*dst++ = (char)strtol (hex, NULL, 16)))
+            return NULL;
+         i += 2;
+         continue;
+      }
+      *dst++ = src[i];
+   }
+   *dst = 0;
+
+   return ret;
+}
+
+static bool request_parse (http_conn_t *c, size_t req_len)
+{
+   char *end = memmem (c->ibuf, req_len, "\r\n\r\n", 4);
+   size_t hlen = end - c->ibuf + 4;
+   size_t sindex = 0;
+
+   // The derived strings are all bounded by the size of the headers.
+   if (!(buf_reserve (&g_http.strings, &g_http.strings_size,
+                      hlen * 2 + sizeof c->remote_addr * 4 + 64)))
+      return false;
+
+   if (!(buf_reserve ((char **)&g_http.headers, &g_http.headers_size,
+                      sizeof *g_http.headers * (hlen + 1))))
+      return false;
+
+   memset (g_http.vars, 0, sizeof g_http.vars);
+   g_http.nheaders = 0;
+
+   // The request line: METHOD SP URI SP VERSION
+   char *line = c->ibuf;
+   char *eol = memmem (line, hlen, "\r\n", 2);
+   *eol = 0;
+
+   char *method = line;
+   char *uri = strchr (method, ' ');
+   if (!uri)
+      return false;
+   *uri++ = 0;
+
+   char *version = strchr (uri, ' ');
+   if (!version || (strncmp (&version[1], "HTTP/1.", 7))!=0)
+      return false;
+   *version++ = 0;
+
+   char *query = strchr (uri, '?');
+   size_t plen = query ? (size_t)(query - uri) : strlen (uri);
+
+   g_http.vars[VAR_REQUEST_METHOD] = method;
+   g_http.vars[VAR_SERVER_PROTOCOL] = version;
+   g_http.vars[VAR_REQUEST_URI] = uri;
+   g_http.vars[VAR_QUERY_STRING] = query ? &query[1] : "";
+   g_http.vars[VAR_PATH_INFO] = path_decode (&g_http.strings[sindex],
+                                             uri, plen);
+   if (!g_http.vars[VAR_PATH_INFO])
+      return false;
+   sindex += plen + 1;
+   if (query)
+      *query = 0;
+
+   // HTTP/1.1 defaults to keep-alive, HTTP/1.0 does not.
+   c->keep_alive = (strcmp (version, "HTTP/1.0"))!=0;
+
+   // The headers: Name: value
+   for (line = eol + 2; line < end; line = eol + 2) {
+      eol = memmem (line, end + 2 - line, "\r\n", 2);
+      *eol = 0;
+
+      char *colon = strchr (line, ':');
+      if (!colon)
+         return false;
+      *colon++ = 0;
+      while (*colon == ' ' || *colon == '\t')
+         colon++;
+
+      char *vend = eol;
+      while (vend > colon && (vend[-1] == ' ' || vend[-1] == '\t'))
+         *--vend = 0;
+
+      g_http.headers[g_http.nheaders++] = line;
+      g_http.headers[g_http.nheaders++] = colon;
+
+      if ((strcasecmp (line, "Content-Length"))==0)
+         g_http.vars[VAR_CONTENT_LENGTH] = colon;
+
+      if ((strcasecmp (line, "Content-Type"))==0)
+         g_http.vars[VAR_CONTENT_TYPE] = colon;
+
+      if ((strcasecmp (line, "Connection"))==0) {
+         if ((strcasecmp (colon, "close"))==0)
+            c->keep_alive = false;
+         if ((strcasecmp (colon, "keep-alive"))==0)
+            c->keep_alive = true;
+      }
+
+      if ((strcasecmp (line, "Host"))==0) {
+         const char *port = strrchr (colon, ':');
+         size_t len = port && !strchr (port, ']') ?
+                        (size_t)(port - colon) : strlen (colon);
+         g_http.vars[VAR_SERVER_NAME] = strings_add (&sindex, colon, len);
+      }
+   }
+
+   g_http.vars[VAR_REMOTE_ADDR] = c->remote_addr;
+   g_http.vars[VAR_REMOTE_PORT] = c->remote_port;
+   g_http.vars[VAR_SERVER_ADDR] = c->server_addr;
+   g_http.vars[VAR_SERVER_PORT] = c->server_port;
+   g_http.vars[VAR_SERVER_SOFTWARE] = SERVER_SOFTWARE;
+   g_http.vars[VAR_GATEWAY_INTERFACE] = "CGI/1.1";
+   g_http.vars[VAR_REQUEST_SCHEME] = "http";
+   g_http.vars[VAR_SCRIPT_NAME] = "";
+
+   if (!g_http.vars[VAR_SERVER_NAME])
+      g_http.vars[VAR_SERVER_NAME] = c->server_addr;
+
+   g_http.body = &c->ibuf[hlen];
+   g_http.body_len = req_len - hlen;
+   g_http.body_pos = 0;
+   g_http.req_len = req_len;
+   g_http.req_head = (strcmp (method, "HEAD"))==0;
+
+   return true;
+}
+
+// Compares an environment variable name (HTTP_USER_AGENT) with a header
+// name (User-Agent).
+static bool header_matches (const char *varname, const char *header)
+{
+   for (; *varname && *header; varname++, header++) {
+      char h = *header == '-' ? '_' : toupper ((unsigned char)*header);
+      if (h != *varname)
+         return false;
+   }
+   return !*varname && !*header;
+}
+
+static const char *http_getvar (void *param, const char *name)
+{
+   param = param;
+
+   for (size_t i=0; i<VAR_COUNT; i++) {
+      if ((strcmp (g_var_names[i], name))==0)
+         return g_http.vars[i];
+   }
+
+   if ((strncmp (name, "HTTP_", 5))!=0)
+      return NULL;
+
+   for (size_t i=0; i<g_http.nheaders; i+=2) {
+      if (header_matches (&name[5], g_http.headers[i]))
+         return g_http.headers[i + 1];
+   }
+
+   return NULL;
+}
+
+/* ************************************************************************
+ * The streams for xcgi_stdin and xcgi_stdout.
+ */
+static ssize_t stdin_read (void *cookie, char *buf, size_t size)
+{
+   cookie = cookie;
+
+   size_t avail = g_http.body_len - g_http.body_pos;
+   if (size > avail)
+      size = avail;
+
+   memcpy (buf, &g_http.body[g_http.body_pos], size);
+   g_http.body_pos += size;
+
+   return size;
+}
+
+static ssize_t stdout_write (void *cookie, const char *buf, size_t size)
+{
+   cookie = cookie;
+
+   // Nothing more can be sent once streaming the response has failed.
+   if (g_http.stream_error)
+      return size;
+
+   if (!(buf_reserve (&g_http.resp, &g_http.resp_size,
+                      g_http.resp_len + size)))
+      return -1;
+
+   memcpy (&g_http.resp[g_http.resp_len], buf, size);
+   g_http.resp_len += size;
+
+   return size;
+}
+
+static bool streams_open (void)
+{
+   cookie_io_functions_t in_funcs = {
+      .read = stdin_read,
+      .close = xcgi_net_stream_close,
+   };
+   cookie_io_functions_t out_funcs = {
+      .write = stdout_write,
+      .close = xcgi_net_stream_close,
+   };
+
+   if (!(g_http.inf = fopencookie (NULL, "r", in_funcs)))
+      return false;
+
+   if (!(g_http.outf = fopencookie (NULL, "w", out_funcs))) {
+      fclose (g_http.inf);
+      g_http.inf = NULL;
+      return false;
+   }
+
+   return true;
+}
+
+static void streams_close (void)
+{
+   if (g_http.outf)
+      fclose (g_http.outf);
+
+   if (g_http.inf)
+      fclose (g_http.inf);
+
+   g_http.outf = NULL;
+   g_http.inf = NULL;
+}
+
+/* ************************************************************************
+ * Converts the CGI response in g_http.resp into an HTTP response in the
+ * connection's output buffer.
+ */
+// Writes the status line and the headers for the CGI response in 'resp'
+// to the connection's output buffer, and returns the start of the body
+// (with its length in '*body_len'), or NULL on error. A streamed
+// response has no Content-Length: it is sent with chunked transfer
+// encoding to HTTP/1.1 clients, and is ended by closing the connection
+// for HTTP/1.0 clients.
+static const char *response_head (http_conn_t *c, const char *resp,
+                                  size_t len, bool streamed,
+                                  size_t *body_len)
+{
+   const char *body = NULL;
+   int status = 200;
+   bool location = false;
+
+   // The header block ends with an empty line, with either CRLF or LF
+   // line endings.
+   for (size_t i=0; i<len; i++) {
+      if (resp[i] != '\n')
+         continue;
+      if (i + 1 < len && resp[i + 1] == '\n') {
+         body = &resp[i + 2];
+         break;
+      }
+      if (i + 2 < len && resp[i + 1] == '\r' && resp[i + 2] == '\n') {
+         body = &resp[i + 3];
+         break;
+      }
+   }
+
+   if (!body) {
+      fprintf (stderr, "%s: Response has no header block\n", __func__);
+      status = 500;
+      body = resp;
+      len = 0;
+   }
+
+   *body_len = len - (body - resp);
+
+   // First pass: the status line depends on the Status and Location
+   // headers.
+   for (const char *line = resp; line < body; ) {
+      const char *eol = memchr (line, '\n', body - line);
+      if (header_is (line, "Status", 6))
+         status = atoi (header_value (line, 6));
+      if (header_is (line, "Location", 8))
+         location = true;
+      line = eol + 1;
+   }
+
+   if (location && status == 200)
+      status = 302;
+
+   if (status < 100 || status > 999)
+      status = 500;
+
+   if (!(out_printf (c, "HTTP/1.1 %i %s\r\n",
+                        status, xcgi_reason_phrase (status))))
+      return NULL;
+
+   // Second pass: copy the headers that are not supplied by the server.
+   for (const char *line = resp; line < body; ) {
+      const char *eol = memchr (line, '\n', body - line);
+      size_t llen = eol - line;
+      if (llen && line[llen - 1] == '\r')
+         llen--;
+
+      if (llen == 0)
+         break;
+
+      if (!header_is (line, "Status", 6) &&
+          !header_is (line, "Content-Length", 14) &&
+          !header_is (line, "Connection", 10) &&
+          !header_is (line, "Transfer-Encoding", 17)) {
+         if (!(out_append (c, line, llen)) || !(out_append (c, "\r\n", 2)))
+            return NULL;
+      }
+
+      line = eol + 1;
+   }
+
+   bool no_body = status == 204 || status == 304 || status < 200;
+
+   g_http.send_body = !no_body && !g_http.req_head;
+
+   if (!no_body && !streamed &&
+         !(out_printf (c, "Content-Length: %zu\r\n",
+                          *body_len + g_http.file_len)))
+      return NULL;
+
+   if (!no_body && streamed) {
+      g_http.chunked =
+         (strcmp (g_http.vars[VAR_SERVER_PROTOCOL], "HTTP/1.0"))!=0;
+      if (!g_http.chunked)
+         c->keep_alive = false;
+      else if (!(out_printf (c, "Transfer-Encoding: chunked\r\n")))
+         return NULL;
+   }
+
+   if (!(out_printf (c, "Date: %s\r\n"
+                        "Server: %s\r\n"
+                        "Connection: %s\r\n"
+                        "\r\n",
+                        http_date (), SERVER_SOFTWARE,
+                        c->keep_alive ? "keep-alive" : "close")))
+      return NULL;
+
+   return body;
+}
+
+static bool response_build (http_conn_t *c)
+{
+   size_t body_len = 0;
+   const char *body = response_head (c, g_http.resp, g_http.resp_len,
+                                     false, &body_len);
+
+   if (!body)
+      return false;
+
+   if (g_http.send_body && !(out_append (c, body, body_len)))
+      return false;
+
+   // The connection takes over the file, and sends it once the output
+   // buffer has gone.
+   if (g_http.send_body && g_http.file_fd >= 0) {
+      c->file_fd = g_http.file_fd;
+      c->file_pos = g_http.file_pos;
+      c->file_left = g_http.file_len;
+      g_http.file_fd = -1;
+   }
+
+   return true;
+}
+
+// Appends part of a streamed body to the connection's output buffer.
+static bool response_chunk (http_conn_t *c, const char *data, size_t len)
+{
+   if (!g_http.send_body || !len)
+      return true;
+
+   if (!g_http.chunked)
+      return out_append (c, data, len);
+
+   return out_printf (c, "%zx\r\n", len) &&
+          out_append (c, data, len) &&
+          out_append (c, "\r\n", 2);
+}
+
+// Sends all of the pending output, waiting for the socket to accept it.
+// This is only used while a response is being streamed, so that a slow
+// client holds up the caller instead of letting the response pile up in
+// memory.
+static bool conn_send_all (http_conn_t *c)
+{
+   while (c->opos < c->olen) {
+      if (!(conn_flush (c)))
+         return false;
+
+      if (c->opos < c->olen) {
+         struct pollfd pfd = { .fd = c->fd, .events = POLLOUT };
+         int rc = poll (&pfd, 1, SEND_TIMEOUT);
+         if (rc == 0 || (rc < 0 && errno != EINTR))
+            return false;
+      }
+   }
+
+   return true;
+}
+
+bool xcgi_http_flush (FILE *outf)
+{
+   http_conn_t *c = g_http.current;
+
+   if (!c || !outf || outf != g_http.outf)
+      return true;
+
+   if (g_http.stream_error)
+      return false;
+
+   if ((fflush (g_http.outf))!=0)
+      goto errorexit;
+
+   const char *data = g_http.resp;
+   size_t len = g_http.resp_len;
+
+   if (!g_http.streaming) {
+      if (!(data = response_head (c, g_http.resp, g_http.resp_len,
+                                  true, &len)))
+         goto errorexit;
+      g_http.streaming = true;
+   }
+
+   if (!(response_chunk (c, data, len)))
+      goto errorexit;
+
+   g_http.resp_len = 0;
+
+   if (!(conn_send_all (c)))
+      goto errorexit;
+
+   return true;
+
+errorexit:
+   // The client cannot be sent a proper response any more; the rest of
+   // the output is discarded and the connection is closed.
+   g_http.stream_error = true;
+   g_http.resp_len = 0;
+   c->keep_alive = false;
+   return false;
+}
+
+bool xcgi_http_sendfile (FILE *outf, int fd, off_t offset, size_t len)
+{
+   if (!g_http.current || !outf || outf != g_http.outf ||
+         g_http.streaming || g_http.stream_error || g_http.file_fd >= 0)
+      return false;
+
+   if ((fflush (g_http.outf))!=0)
+      return false;
+
+   if ((g_http.file_fd = fcntl (fd, F_DUPFD_CLOEXEC, 0)) < 0)
+      return false;
+
+   g_http.file_pos = offset;
+   g_http.file_len = len;
+
+   return true;
+}
+
+/* ************************************************************************
+ * Request management.
+ */
+void xcgi_http_finish (void)
+{
+   http_conn_t *c = g_http.current;
+
+   if (!c)
+      return;
+
+   xcgi_body_end ();
+
+   if (g_http.outf)
+      fflush (g_http.outf);
+
+   streams_close ();
+
+   if (g_http.streaming) {
+      // The rest of the body, and the chunk that ends the body.
+      if (g_http.stream_error ||
+            !(response_chunk (c, g_http.resp, g_http.resp_len)) ||
+            (g_http.chunked && g_http.send_body &&
+               !(out_append (c, "0\r\n\r\n", 5)))) {
+         c->olen = c->opos;
+         c->keep_alive = false;
+      }
+   } else if (!(response_build (c))) {
+      c->olen = c->opos;
+      c->keep_alive = false;
+   }
+
+   g_http.streaming = false;
+   g_http.chunked = false;
+   g_http.stream_error = false;
+
+   // A file that was not sent (a HEAD request, or a failed response).
+   if (g_http.file_fd >= 0)
+      close (g_http.file_fd);
+   g_http.file_fd = -1;
+   g_http.file_len = 0;
+
+   xcgi_request_end ();
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   memmove (c->ibuf, &c->ibuf[g_http.req_len], c->ilen - g_http.req_len);
+   c->ilen -= g_http.req_len;
+   g_http.req_len = 0;
+   g_http.resp_len = 0;
+   g_http.current = NULL;
+
+   if (!c->keep_alive)
+      c->closing = true;
+
+   if (!(conn_flush (c))) {
+      conn_close (c);
+      return;
+   }
+
+   conn_check (c);
+}
+
+static bool mode_detect (void)
+{
+   int64_t max_body = 0;
+
+   if ((g_http.listen_fd = xcgi_net_listener (0)) == XCGI_NET_CGI) {
+      g_http.mode = XCGI_NET_MODE_CGI;
+      return true;
+   }
+
+   if (g_http.listen_fd < 0)
+      return false;
+
+   g_http.max_body = DEFAULT_MAX_BODY;
+   if ((xcgi_cfg_get_int (xcgi_config, CFG_MAX_BODY, &max_body))
+         && max_body >= 0)
+      g_http.max_body = max_body;
+
+   int flags = fcntl (g_http.listen_fd, F_GETFL);
+   fcntl (g_http.listen_fd, F_SETFL, flags | O_NONBLOCK);
+
+   if ((g_http.epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) < 0) {
+      fprintf (stderr, "%s: epoll_create1() failed: %m\n", __func__);
+      return false;
+   }
+
+   struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+   if ((epoll_ctl (g_http.epoll_fd, EPOLL_CTL_ADD,
+                   g_http.listen_fd, &ev))!=0) {
+      fprintf (stderr, "%s: epoll_ctl() failed: %m\n", __func__);
+      return false;
+   }
+
+   // Discard the request that xcgi_init() loaded from the environment.
+   xcgi_request_end ();
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   g_http.mode = XCGI_NET_MODE_SERVER;
+
+   return true;
+}
+
+bool xcgi_http_accept (void)
+{
+   struct epoll_event events[MAX_EVENTS];
+
+   if (g_http.mode == XCGI_NET_MODE_UNKNOWN && !(mode_detect ()))
+      return false;
+
+   if (g_http.mode == XCGI_NET_MODE_CGI) {
+      g_http.mode = XCGI_NET_MODE_CGI_DONE;
+      return true;
+   }
+
+   if (g_http.mode != XCGI_NET_MODE_SERVER)
+      return false;
+
+   xcgi_http_finish ();
+
+   while (true) {
+      http_conn_t *c = g_http.ready_head;
+
+      if (c) {
+         g_http.ready_head = c->next;
+         if (!g_http.ready_head)
+            g_http.ready_tail = NULL;
+         c->queued = false;
+
+         int status = 0;
+         ssize_t req_len = request_framing (c, &status);
+
+         if (req_len <= 0 || !(request_parse (c, req_len))) {
+            conn_refuse (c, 400);
+            if (conn_flush (c))
+               conn_check (c);
+            else
+               conn_close (c);
+            continue;
+         }
+
+         if (!(streams_open ())) {
+            conn_close (c);
+            continue;
+         }
+
+         g_http.current = c;
+         conn_update_events (c);
+
+         if (!(xcgi_request_begin (http_getvar, NULL,
+                                   g_http.inf, g_http.outf))) {
+            fprintf (stderr, "%s: Failed to start request\n", __func__);
+            xcgi_http_finish ();
+            continue;
+         }
+
+         return true;
+      }
+
+      int nevents = epoll_wait (g_http.epoll_fd, events, MAX_EVENTS, -1);
+      if (nevents < 0) {
+         if (errno == EINTR)
+            continue;
+         fprintf (stderr, "%s: epoll_wait() failed: %m\n", __func__);
+         return false;
+      }
+
+      for (int i=0; i<nevents; i++) {
+         if (!events[i].data.ptr)
+            conn_accept_all ();
+         else
+            conn_event (events[i].data.ptr, events[i].events);
+      }
+   }
+}
+
+bool xcgi_serve (const char *listen,
+                 void (*handler) (void *), void *param)
+{
+   if (!handler)
+      return false;
+
+   if (listen && g_http.mode == XCGI_NET_MODE_UNKNOWN) {
+      if (!(xcgi_cfg_set (&xcgi_config, CFG_LISTEN, listen)))
+         return false;
+   }
+
+   while (xcgi_http_accept ()) {
+      handler (param);
+   }
+
+   return g_http.mode == XCGI_NET_MODE_CGI_DONE;
+}
+
@@ -0,0 +1,99 @@
+
+#ifndef H_XCGI_HTTP
+#define H_XCGI_HTTP
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include <sys/types.h>
+
+// Embedded HTTP/1.1 server. This allows an xcgi program to run as a
+// standalone daemon without a web server in front of it. Like the
+// FastCGI and SCGI support (xcgi_fcgi.h, xcgi_scgi.h) the configuration,
+// the database handle and all other process-wide state stays alive
+// between requests.
+//
+// The server is event-driven: all connections are non-blocking and are
+// multiplexed with epoll in the calling thread, so a single process can
+// hold many idle keep-alive connections. Requests are handed to the
+// caller one at a time. Pipelined requests on a connection are served in
+// order.
+//
+// The request line and headers are decoded straight into the usual
+// variables (xcgi_REQUEST_METHOD, xcgi_PATH_INFO, xcgi_QUERY_STRING,
+// xcgi_HTTP_COOKIE, etc); every request header is available to
+// xcgi_getenv() as HTTP_<NAME>. The whole path of the request URI is
+// placed in xcgi_PATH_INFO. The request body is read from xcgi_stdin.
+//
+// The caller writes a CGI response to xcgi_stdout, exactly as for a CGI
+// program, and the server turns it into an HTTP response: the 'Status'
+// header becomes the status line, and the Content-Length, Connection and
+// Date headers are supplied by the server.
+//
+// A response that is flushed before it is complete (see xcgi_body_flush()
+// in xcgi.h) is streamed instead: the headers and the body so far are sent
+// at once, with chunked transfer encoding (or, for HTTP/1.0 clients, with
+// the connection closed at the end of the body), and each later flush
+// sends the next part of the body. A streamed response waits for the
+// client to accept each part, so it is never held in memory in full.
+//
+// The listening socket is taken from the 'xcgi_listen' entry in the
+// 'xcgi.ini' file (see xcgi_net_listen() for the format), otherwise
+// descriptor 0 is used if it is a listening socket. When neither is true
+// the program is assumed to have been started as a plain CGI program;
+// the first call to xcgi_http_accept() returns true and the next call
+// returns false.
+//
+// Request bodies are buffered in memory before the request is handed to
+// the caller, and are limited to 'xcgi_http_max_body' bytes (from the
+// 'xcgi.ini' file, default 16MB). Requests using a chunked request body
+// are refused with '411 Length Required'.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Completes the previous request, if any, and waits for the next one.
+   // On success the xcgi_[A-Z]* variables, xcgi_stdin, xcgi_stdout,
+   // xcgi_path_info and xcgi_cookies are populated for the new request
+   // and true is returned. Returns false when no more requests will be
+   // served.
+   bool xcgi_http_accept (void);
+
+   // Completes the current request: the response is queued for
+   // transmission to the client. Does nothing if no request is active.
+   void xcgi_http_finish (void);
+
+   // Sends everything written so far to 'outf' to the client, switching
+   // the response to streaming as described above, and waits until the
+   // client has accepted it. Does nothing if 'outf' is not the output
+   // stream of the current request. Returns false if the client could
+   // not be sent the data, in which case the rest of the response is
+   // discarded.
+   bool xcgi_http_flush (FILE *outf);
+
+   // Arranges for the 'len' bytes of the file 'fd', from 'offset', to be
+   // sent to the client after the CGI response written to 'outf', which
+   // must hold the complete headers and nothing of the body. The file is
+   // sent with sendfile() as the client accepts it, after the handler has
+   // returned; the Content-Length sent covers the file. The descriptor is
+   // duplicated, so the caller still closes 'fd'. Returns false, without
+   // doing anything, if 'outf' is not the output stream of the current
+   // request or the response is being streamed; the caller then writes
+   // the file to 'outf' itself.
+   bool xcgi_http_sendfile (FILE *outf, int fd, off_t offset, size_t len);
+
+   // Listens on the address 'listen' (or, if 'listen' is NULL, on the
+   // address as described for xcgi_http_accept()) and calls 'handler'
+   // with 'param' for every request. Only returns on a fatal error, in
+   // which case false is returned. The library must already be
+   // initialised with xcgi_init().
+   bool xcgi_serve (const char *listen,
+                    void (*handler) (void *), void *param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -1,10 +1,16 @@
 
 #include <string.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <ctype.h>
 
 #include "xcgi_json.h"
 
+#if defined (__x86_64__) && defined (__GNUC__)
+#define JSON_X86        (1)
+#include <immintrin.h>
+#endif
+
 // A strchr() implementation that respects escaped characters.
 static const char *lstrchr (const char *haystack, char needle)
 {
@@ -17,68 +23,620 @@ static const char *lstrchr (const char *haystack, char needle)
    return NULL;
 }
 
-// Find the position of a json field named 'field' (no quotes) within the
-// string 'start'. Returns a pointer to the start of the field if the
-// field exists, or NULL if the field was not found in the string.
-static const char *find_field (const char *start, const char *field)
+/* ************************************************************************
+ * Stage 1: finding the structure. The source is classified 64 bytes at a
+ * time into bit masks (one bit per byte) of quotes, backslashes,
+ * operators ({}[]:,) and whitespace. The escaped quotes are removed, the
+ * bytes inside strings are found with a prefix XOR of the quotes, and
+ * the result is a mask of the bytes that start a token: the operators
+ * outside strings, both quotes of each string, and the first byte of
+ * each number or literal. Only the classification differs between the
+ * AVX2, SSE4.2 and scalar versions.
+ */
+#define BLOCK_SIZE      (64)
+
+// The state is in the header, so that iterators can hold it.
+typedef xcgi_json_scan_t scan_t;
+
+// Returns the bytes escaped by a backslash. A run of backslashes escapes
+// the byte after it if the run is of odd length.
+static uint64_t escaped_find (scan_t *scan, uint64_t backslash)
 {
-   const char *tmp = start;
-   size_t flen = strlen (field);
+   const uint64_t even = 0x5555555555555555ULL;
 
-   while ((tmp = lstrchr (tmp, '"'))) {
-      if ((strncmp (++tmp, field, flen))==0) {
-         const char *end = lstrchr (tmp, '"');
-         if (!end)
-            continue;
+   backslash &= ~scan->escaped;
+   uint64_t follows = (backslash << 1) | scan->escaped;
+   uint64_t odd_starts = backslash & ~even & ~follows;
+   uint64_t even_runs = odd_starts + backslash;
 
-         size_t tmplen = end - tmp;
+   // The carry out of the addition is a run that crosses into the next
+   // block.
+   scan->escaped = even_runs < backslash;
 
-         if (tmplen < (flen + 2)) {
-            if (tmp[flen] == '"') {
-               const char *end = &tmp[flen + 1];
-               while (*end && isspace (*end))
-                  end++;
-               return *end == ':' ? &tmp[0] : NULL;
-            }
-         }
+   return (even ^ (even_runs << 1)) & follows;
+}
+
+static uint64_t tokens_find (scan_t *scan, uint64_t quote, uint64_t in_string,
+                             uint64_t op, uint64_t ws)
+{
+   // 'in_string' includes the opening quote but not the closing one.
+   in_string ^= scan->in_string;
+   scan->in_string = (uint64_t)((int64_t)in_string >> 63);
+
+   op &= ~in_string;
+   ws &= ~in_string;
+
+   uint64_t boundary = op | ws | (quote & ~in_string);
+   uint64_t scalar = ~(boundary | in_string) &
+                     ((boundary << 1) | scan->boundary);
+   scan->boundary = boundary >> 63;
+
+   return op | quote | scalar;
+}
+
+static uint64_t prefix_xor_scalar (uint64_t x)
+{
+   x ^= x << 1;
+   x ^= x << 2;
+   x ^= x << 4;
+   x ^= x << 8;
+   x ^= x << 16;
+   x ^= x << 32;
+   return x;
+}
+
+static uint64_t block_scalar (scan_t *scan, const uint8_t *src)
+{
+   uint64_t quote = 0, backslash = 0, op = 0, ws = 0;
+
+   for (size_t i=0; i<BLOCK_SIZE; i++) {
+      uint64_t bit = (uint64_t)1 << i;
+      switch (src[i]) {
+         case '"':   quote |= bit;        break;
+         case '\\':  backslash |= bit;    break;
+         case '{':
+         case '}':
+         case '[':
+         case ']':
+         case ':':
+         case ',':   op |= bit;           break;
+         case ' ':
+         case '\t':
+         case '\n':
+         case '\r':  ws |= bit;           break;
       }
    }
-   return NULL;
+
+   quote &= ~escaped_find (scan, backslash);
+   return tokens_find (scan, quote, prefix_xor_scalar (quote), op, ws);
 }
 
-// Returns a pointer to the value part of a json field. Note that field
-// values which are strings in json (they have quotes) are returned as is,
-// and no validation on the field syntax is performed.
-static const char *find_value (const char *field)
+#ifdef JSON_X86
+
+// '[' and ']' differ from '{' and '}' only in bit 0x20, so setting that
+// bit finds both pairs with two comparisons.
+
+__attribute__ ((target ("sse4.2,pclmul")))
+static uint64_t prefix_xor_clmul (uint64_t x)
 {
-   const char *ret = lstrchr (field, '"');
-   if (!ret)
+   __m128i all = _mm_set1_epi8 ((char)0xff);
+   return _mm_cvtsi128_si64 (
+            _mm_clmulepi64_si128 (_mm_set_epi64x (0, x), all, 0));
+}
+
+__attribute__ ((target ("sse4.2,pclmul")))
+static uint64_t block_sse42 (scan_t *scan, const uint8_t *src)
+{
+   uint64_t quote = 0, backslash = 0, op = 0, ws = 0;
+
+   for (size_t i=0; i<BLOCK_SIZE; i+=16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)&src[i]);
+      __m128i lower = _mm_or_si128 (v, _mm_set1_epi8 (0x20));
+
+      __m128i o = _mm_or_si128 (
+                     _mm_or_si128 (_mm_cmpeq_epi8 (lower, _mm_set1_epi8 ('{')),
+                                   _mm_cmpeq_epi8 (lower, _mm_set1_epi8 ('}'))),
+                     _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (':')),
+                                   _mm_cmpeq_epi8 (v, _mm_set1_epi8 (','))));
+      __m128i w = _mm_or_si128 (
+                     _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 (' ')),
+                                   _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\t'))),
+                     _mm_or_si128 (_mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\n')),
+                                   _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\r'))));
+
+      quote |= (uint64_t)(uint16_t)_mm_movemask_epi8 (
+                  _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('"'))) << i;
+      backslash |= (uint64_t)(uint16_t)_mm_movemask_epi8 (
+                  _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('\\'))) << i;
+      op |= (uint64_t)(uint16_t)_mm_movemask_epi8 (o) << i;
+      ws |= (uint64_t)(uint16_t)_mm_movemask_epi8 (w) << i;
+   }
+
+   quote &= ~escaped_find (scan, backslash);
+   return tokens_find (scan, quote, prefix_xor_clmul (quote), op, ws);
+}
+
+__attribute__ ((target ("avx2,pclmul")))
+static uint64_t block_avx2 (scan_t *scan, const uint8_t *src)
+{
+   uint64_t quote = 0, backslash = 0, op = 0, ws = 0;
+
+   for (size_t i=0; i<BLOCK_SIZE; i+=32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)&src[i]);
+      __m256i lower = _mm256_or_si256 (v, _mm256_set1_epi8 (0x20));
+
+      __m256i o = _mm256_or_si256 (
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (lower, _mm256_set1_epi8 ('{')),
+                             _mm256_cmpeq_epi8 (lower, _mm256_set1_epi8 ('}'))),
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (':')),
+                             _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (','))));
+      __m256i w = _mm256_or_si256 (
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 (' ')),
+                             _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\t'))),
+            _mm256_or_si256 (_mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\n')),
+                             _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\r'))));
+
+      quote |= (uint64_t)(uint32_t)_mm256_movemask_epi8 (
+                  _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('"'))) << i;
+      backslash |= (uint64_t)(uint32_t)_mm256_movemask_epi8 (
+                  _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('\\'))) << i;
+      op |= (uint64_t)(uint32_t)_mm256_movemask_epi8 (o) << i;
+      ws |= (uint64_t)(uint32_t)_mm256_movemask_epi8 (w) << i;
+   }
+
+   quote &= ~escaped_find (scan, backslash);
+   return tokens_find (scan, quote, prefix_xor_clmul (quote), op, ws);
+}
+
+#endif
+
+static void scan_init (scan_t *scan, const char *src, size_t len)
+{
+   memset (scan, 0, sizeof *scan);
+   scan->src = src;
+   scan->len = len;
+   scan->base = (size_t)-BLOCK_SIZE;
+   scan->boundary = 1;
+
+#ifdef JSON_X86
+   if (__builtin_cpu_supports ("avx2") && __builtin_cpu_supports ("pclmul"))
+      scan->block = block_avx2;
+   else if (__builtin_cpu_supports ("sse4.2") &&
+            __builtin_cpu_supports ("pclmul"))
+      scan->block = block_sse42;
+   else
+#endif
+      scan->block = block_scalar;
+}
+
+// Returns the offset of the next token, or the length of the source if
+// there are no more.
+static size_t scan_next (scan_t *scan)
+{
+   while (!scan->tokens) {
+      scan->base += BLOCK_SIZE;
+      if (scan->base >= scan->len)
+         return scan->len;
+
+      const uint8_t *src = (const uint8_t *)&scan->src[scan->base];
+      size_t left = scan->len - scan->base;
+
+      // The last block is padded with whitespace.
+      if (left < BLOCK_SIZE) {
+         uint8_t tmp[BLOCK_SIZE];
+         memset (tmp, ' ', sizeof tmp);
+         memcpy (tmp, src, left);
+         scan->tokens = scan->block (scan, tmp);
+      } else {
+         scan->tokens = scan->block (scan, src);
+      }
+   }
+
+   size_t ret = scan->base + __builtin_ctzll (scan->tokens);
+   scan->tokens &= scan->tokens - 1;
+   return ret;
+}
+
+size_t xcgi_json_structurals (const char *src, size_t len, uint32_t *offsets)
+{
+   scan_t scan;
+   size_t ret = 0;
+   size_t pos;
+
+   if (!src || !offsets || len >= UINT32_MAX)
+      return 0;
+
+   scan_init (&scan, src, len);
+   while ((pos = scan_next (&scan)) < len) {
+      offsets[ret++] = pos;
+   }
+
+   return ret;
+}
+
+/* ************************************************************************
+ * The tape. Each node is a value, in the order in which the values start
+ * in the source, so the first value in an object or array is always the
+ * node after it. Offsets and links are 32 bits to keep the tape small;
+ * documents of 4GB or more are refused.
+ */
+typedef struct node_t node_t;
+struct node_t {
+   uint32_t    offset;
+   uint32_t    len;
+   // The key of an object member, without the quotes.
+   uint32_t    key;
+   uint32_t    klen;
+   uint32_t    parent;
+   // The next value in the same object or array, or zero (the top-level
+   // value is node 0 and is nobody's sibling).
+   uint32_t    next;
+   uint32_t    count;
+   // For arrays, the position of the first value in the table of array
+   // values.
+   uint32_t    values;
+   uint8_t     type;
+   bool        member;
+};
+
+struct xcgi_json_t {
+   const char *src;
+   size_t      len;
+   node_t     *nodes;
+   size_t      nnodes;
+   size_t      snodes;
+   // The node of each value of each array, so that any value of an array
+   // is found in constant time. The values of each array are together,
+   // in order.
+   uint32_t   *values;
+};
+
+static bool is_ws (char c)
+{
+   return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static bool is_delim (char c)
+{
+   return is_ws (c) || c == ',' || c == ':' || c == ']' || c == '}';
+}
+
+// Returns the offset just past the number or literal at 'pos'.
+static size_t scalar_end (const char *src, size_t pos, size_t len)
+{
+   while (pos < len && src[pos] && src[pos] != '"' && !is_delim (src[pos]))
+      pos++;
+   return pos;
+}
+
+static node_t *node_new (xcgi_json_t *json)
+{
+   if (json->nnodes >= json->snodes) {
+      // Most documents need fewer nodes than one for every eight bytes.
+      size_t newsize = json->snodes ? json->snodes * 2 : json->len / 8 + 64;
+      node_t *tmp = realloc (json->nodes, newsize * sizeof *tmp);
+      if (!tmp)
+         return NULL;
+      json->nodes = tmp;
+      json->snodes = newsize;
+   }
+
+   node_t *ret = &json->nodes[json->nnodes++];
+   memset (ret, 0, sizeof *ret);
+   return ret;
+}
+
+static int scalar_type (char c)
+{
+   switch (c) {
+      case 't':
+      case 'f':   return XCGI_JSON_BOOLEAN;
+      case 'n':   return XCGI_JSON_NULL;
+      case '-':   return XCGI_JSON_NUMBER;
+   }
+   return isdigit ((unsigned char)c) ? XCGI_JSON_NUMBER : XCGI_JSON_NONE;
+}
+
+// Builds the table of array values, once the tape is complete.
+static bool values_index (xcgi_json_t *json)
+{
+   size_t total = 0;
+
+   for (size_t i=0; i<json->nnodes; i++) {
+      node_t *node = &json->nodes[i];
+      if (node->type == XCGI_JSON_ARRAY) {
+         node->values = total;
+         total += node->count;
+      }
+   }
+
+   if (!total)
+      return true;
+
+   if (!(json->values = malloc (total * sizeof *json->values)))
+      return false;
+
+   // The position of each array moves along as its values are added,
+   // and is then moved back to the start.
+   for (size_t i=1; i<json->nnodes; i++) {
+      node_t *parent = &json->nodes[json->nodes[i].parent];
+      if (parent->type == XCGI_JSON_ARRAY)
+         json->values[parent->values++] = i;
+   }
+
+   for (size_t i=0; i<json->nnodes; i++) {
+      node_t *node = &json->nodes[i];
+      if (node->type == XCGI_JSON_ARRAY)
+         node->values -= node->count;
+   }
+
+   return true;
+}
+
+xcgi_json_t *xcgi_json_parse (const char *src, size_t len)
+{
+   bool error = true;
+   xcgi_json_t *ret = NULL;
+   scan_t scan;
+   // The open object or array, and the last value added to it.
+   size_t cur = XCGI_JSON_NOTFOUND;
+   size_t prev = XCGI_JSON_NOTFOUND;
+   size_t pos = 0;
+
+   if (!src || len >= UINT32_MAX || !(ret = calloc (1, sizeof *ret)))
       return NULL;
 
-   if (!(ret = lstrchr (ret, ':')))
+   ret->src = src;
+   ret->len = len;
+
+   // Stage 2: the tape is built from the tokens found by stage 1, so
+   // the contents of strings are never looked at.
+   scan_init (&scan, src, len);
+
+   while ((pos = scan_next (&scan)) < len) {
+      uint32_t key = 0, klen = 0;
+      bool member = false;
+
+      if (src[pos] == ',')
+         continue;
+
+      if (src[pos] == ']' || src[pos] == '}') {
+         if (cur == XCGI_JSON_NOTFOUND)
+            goto errorexit;
+
+         node_t *node = &ret->nodes[cur];
+         if (src[pos] != (node->type == XCGI_JSON_OBJECT ? '}' : ']'))
+            goto errorexit;
+
+         node->len = pos + 1 - node->offset;
+         prev = cur;
+         cur = cur ? node->parent : XCGI_JSON_NOTFOUND;
+         if (cur == XCGI_JSON_NOTFOUND)
+            break;
+         continue;
+      }
+
+      if (cur != XCGI_JSON_NOTFOUND &&
+            ret->nodes[cur].type == XCGI_JSON_OBJECT) {
+         size_t kend = scan_next (&scan);
+         if (src[pos] != '"' || kend >= len)
+            goto errorexit;
+         key = pos + 1;
+         klen = kend - key;
+         member = true;
+
+         if ((pos = scan_next (&scan)) >= len || src[pos] != ':' ||
+             (pos = scan_next (&scan)) >= len)
+            goto errorexit;
+      }
+
+      size_t index = ret->nnodes;
+      node_t *node = node_new (ret);
+      if (!node)
+         goto errorexit;
+
+      node->offset = pos;
+      node->key = key;
+      node->klen = klen;
+      node->member = member;
+      node->parent = cur == XCGI_JSON_NOTFOUND ? 0 : cur;
+
+      if (cur != XCGI_JSON_NOTFOUND) {
+         ret->nodes[cur].count++;
+         if (prev != XCGI_JSON_NOTFOUND)
+            ret->nodes[prev].next = index;
+      }
+
+      switch (src[pos]) {
+         case '{':
+         case '[':
+            node->type = src[pos] == '{' ? XCGI_JSON_OBJECT : XCGI_JSON_ARRAY;
+            cur = index;
+            prev = XCGI_JSON_NOTFOUND;
+            continue;
+
+         case '"':
+            if ((pos = scan_next (&scan)) >= len)
+               goto errorexit;
+            node->type = XCGI_JSON_STRING;
+            pos++;
+            break;
+
+         default:
+            if (!(node->type = scalar_type (src[pos])))
+               goto errorexit;
+            pos = scalar_end (src, pos, len);
+            break;
+      }
+
+      node->len = pos - node->offset;
+      prev = index;
+
+      // The top-level value is complete, and anything after it is ignored.
+      if (cur == XCGI_JSON_NOTFOUND)
+         break;
+   }
+
+   // An object or array that is not closed, or nothing at all.
+   if (cur != XCGI_JSON_NOTFOUND || !ret->nnodes)
+      goto errorexit;
+
+   if (!(values_index (ret)))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   if (error) {
+      xcgi_json_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void xcgi_json_del (xcgi_json_t *json)
+{
+   if (!json)
+      return;
+
+   free (json->values);
+   free (json->nodes);
+   free (json);
+}
+
+size_t xcgi_json_nodes (const xcgi_json_t *json)
+{
+   return json ? json->nnodes : 0;
+}
+
+static const node_t *node_get (const xcgi_json_t *json, size_t node)
+{
+   return json && node < json->nnodes ? &json->nodes[node] : NULL;
+}
+
+int xcgi_json_type (const xcgi_json_t *json, size_t node)
+{
+   const node_t *n = node_get (json, node);
+   return n ? n->type : XCGI_JSON_NONE;
+}
+
+const char *xcgi_json_value (const xcgi_json_t *json, size_t node,
+                             size_t *len)
+{
+   const node_t *n = node_get (json, node);
+
+   if (len)
+      *len = n ? n->len : 0;
+
+   return n ? &json->src[n->offset] : NULL;
+}
+
+const char *xcgi_json_key (const xcgi_json_t *json, size_t node, size_t *len)
+{
+   const node_t *n = node_get (json, node);
+
+   if (!n || !n->member) {
+      if (len)
+         *len = 0;
       return NULL;
+   }
 
-   ret++;
+   if (len)
+      *len = n->klen;
 
-   while (*ret && isspace (*ret))
-      ret++;
+   return &json->src[n->key];
+}
+
+size_t xcgi_json_count (const xcgi_json_t *json, size_t node)
+{
+   const node_t *n = node_get (json, node);
+   return n ? n->count : 0;
+}
+
+size_t xcgi_json_child (const xcgi_json_t *json, size_t node)
+{
+   const node_t *n = node_get (json, node);
+   return n && n->count ? node + 1 : XCGI_JSON_NOTFOUND;
+}
+
+size_t xcgi_json_next (const xcgi_json_t *json, size_t node)
+{
+   const node_t *n = node_get (json, node);
+   return n && n->next ? n->next : XCGI_JSON_NOTFOUND;
+}
+
+size_t xcgi_json_parent (const xcgi_json_t *json, size_t node)
+{
+   const node_t *n = node_get (json, node);
+   return n && node ? n->parent : XCGI_JSON_NOTFOUND;
+}
+
+size_t xcgi_json_index (const xcgi_json_t *json, size_t node, size_t index)
+{
+   const node_t *n = node_get (json, node);
+
+   if (!n || n->type != XCGI_JSON_ARRAY || index >= n->count)
+      return XCGI_JSON_NOTFOUND;
+
+   return json->values[n->values + index];
+}
+
+size_t xcgi_json_member (const xcgi_json_t *json, size_t node,
+                         const char *name)
+{
+   if (!name || xcgi_json_type (json, node) != XCGI_JSON_OBJECT)
+      return XCGI_JSON_NOTFOUND;
+
+   size_t nlen = strlen (name);
+
+   for (size_t i = xcgi_json_child (json, node);
+         i != XCGI_JSON_NOTFOUND;
+         i = xcgi_json_next (json, i)) {
+      const node_t *n = &json->nodes[i];
+      if (n->klen == nlen && (memcmp (&json->src[n->key], name, nlen))==0)
+         return i;
+   }
+
+   return XCGI_JSON_NOTFOUND;
+}
+
+size_t xcgi_json_vpath (const xcgi_json_t *json, size_t node,
+                        const char *field, va_list ap)
+{
+   while (field && node != XCGI_JSON_NOTFOUND) {
+      node = xcgi_json_member (json, node, field);
+      field = va_arg (ap, const char *);
+   }
+
+   return node;
+}
+
+size_t xcgi_json_path (const xcgi_json_t *json, size_t node,
+                       const char *field, ...)
+{
+   va_list ap;
+   va_start (ap, field);
+
+   size_t ret = xcgi_json_vpath (json, node, field, ap);
 
+   va_end (ap);
    return ret;
 }
 
 const char *xcgi_json_vfind (const char *json_src, const char *field, va_list ap)
 {
-   const char *begin = json_src;
+   xcgi_json_t *json = NULL;
+   const char *ret = NULL;
 
-   while (begin && field) {
-      if (!(begin = find_field (begin, field)))
-         break;
+   if (!json_src || !field ||
+         !(json = xcgi_json_parse (json_src, strlen (json_src))))
+      return NULL;
 
-      if (!(field = va_arg (ap, char *)))
-         return find_value (begin);
-   }
+   ret = xcgi_json_value (json, xcgi_json_vpath (json, 0, field, ap), NULL);
 
-   return NULL;
+   xcgi_json_del (json);
+   return ret;
 }
 
 const char *xcgi_json_find (const char *json_src, const char *field, ...)
@@ -92,6 +650,787 @@ const char *xcgi_json_find (const char *json_src, const char *field, ...)
    return ret;
 }
 
+/* ************************************************************************
+ * Extracting a list of values in one walk, without a tape. Each wanted
+ * path records how many of its fields are matched by the keys of the
+ * objects that enclose the current value; a value completes a path when
+ * its key matches the last field.
+ */
+#define MAX_DEPTH       (1024)
+
+typedef struct want_t want_t;
+struct want_t {
+   const char *path;
+   size_t      nfields;
+   size_t      matched;
+   // The field after the matched ones.
+   const char *field;
+   // The depth at which a member has already been matched, so that only
+   // the first member with the key is followed (as xcgi_json_member()
+   // does).
+   size_t      matched_at;
+   // The depth of the object or array that completes the path, until it
+   // is closed, or zero.
+   size_t      open;
+   // The path has been found, and was found by the value just started.
+   bool        found;
+   bool        hit;
+};
+
+static bool wants_init (want_t *wants, const char **paths, size_t n)
+{
+   for (size_t i=0; i<n; i++) {
+      if (!paths[i] || !paths[i][0])
+         return false;
+      wants[i].path = wants[i].field = paths[i];
+      wants[i].nfields = 1;
+      for (const char *tmp = paths[i]; (tmp = strchr (tmp, '.')); tmp++)
+         wants[i].nfields++;
+   }
+   return true;
+}
+
+static const char *path_field (const char *path, size_t index)
+{
+   while (index--) {
+      path = strchr (path, '.') + 1;
+   }
+   return path;
+}
+
+static bool field_is (const char *field, const char *key, size_t klen)
+{
+   return (strncmp (field, key, klen))==0 &&
+          (field[klen] == '.' || field[klen] == 0);
+}
+
+// Called for each value, with its depth (one for the members of the
+// top-level value) and key (NULL in arrays). Returns the number of paths
+// that the value completes, which are marked as hit.
+static size_t wants_match (want_t *wants, size_t n,
+                           size_t depth, const char *key, size_t klen)
+{
+   size_t ret = 0;
+
+   for (size_t i=0; i<n; i++) {
+      want_t *want = &wants[i];
+
+      // Leaving the member that matched the field at this depth.
+      if (want->matched >= depth) {
+         want->matched = depth - 1;
+         want->matched_at = depth;
+         want->field = path_field (want->path, want->matched);
+      }
+
+      if (want->matched != depth - 1 || want->matched_at == depth ||
+            !key || want->found || !(field_is (want->field, key, klen)))
+         continue;
+
+      if (++want->matched < want->nfields) {
+         want->field = path_field (want->path, want->matched);
+         continue;
+      }
+
+      want->found = want->hit = true;
+      ret++;
+   }
+
+   return ret;
+}
+
+bool xcgi_json_extract (const char *src, const char **paths, size_t n,
+                        xcgi_json_slice_t *out)
+{
+   bool error = true;
+   want_t *wants = NULL;
+   scan_t scan;
+   size_t len, pos, depth = 0;
+   size_t nopen = 0;
+   bool seen = false;
+   // One bit for each open object or array, set for objects.
+   uint64_t objects[MAX_DEPTH / 64];
+
+   if (!src || (n && (!paths || !out)))
+      return false;
+
+   memset (out, 0, n * sizeof *out);
+
+   if (n && !(wants = calloc (n, sizeof *wants)))
+      return false;
+
+   if (!(wants_init (wants, paths, n)))
+      goto errorexit;
+
+   len = strlen (src);
+   scan_init (&scan, src, len);
+
+   while ((pos = scan_next (&scan)) < len) {
+      const char *key = NULL;
+      size_t klen = 0;
+
+      if (src[pos] == ',')
+         continue;
+
+      if (src[pos] == ']' || src[pos] == '}') {
+         bool object = depth && objects[(depth - 1) / 64] &
+                                 ((uint64_t)1 << ((depth - 1) % 64));
+         if (!depth || src[pos] != (object ? '}' : ']'))
+            goto errorexit;
+
+         for (size_t i=0; nopen && i<n; i++) {
+            if (wants[i].open == depth) {
+               out[i].len = &src[pos + 1] - out[i].ptr;
+               wants[i].open = 0;
+               nopen--;
+            }
+         }
+
+         if (!--depth)
+            break;
+         continue;
+      }
+
+      if (depth && objects[(depth - 1) / 64] &
+                   ((uint64_t)1 << ((depth - 1) % 64))) {
+         size_t kend = scan_next (&scan);
+         if (src[pos] != '"' || kend >= len)
+            goto errorexit;
+         key = &src[pos + 1];
+         klen = kend - pos - 1;
+
+         if ((pos = scan_next (&scan)) >= len || src[pos] != ':' ||
+             (pos = scan_next (&scan)) >= len)
+            goto errorexit;
+      }
+
+      int type;
+      size_t end = pos;
+
+      seen = true;
+
+      switch (src[pos]) {
+         case '{':   type = XCGI_JSON_OBJECT;   break;
+         case '[':   type = XCGI_JSON_ARRAY;    break;
+         case '"':   type = XCGI_JSON_STRING;
+                     if ((end = scan_next (&scan)) >= len)
+                        goto errorexit;
+                     end++;
+                     break;
+         default:    if (!(type = scalar_type (src[pos])))
+                        goto errorexit;
+                     end = scalar_end (src, pos, len);
+                     break;
+      }
+
+      size_t found = depth ? wants_match (wants, n, depth, key, klen) : 0;
+
+      if (type == XCGI_JSON_OBJECT || type == XCGI_JSON_ARRAY) {
+         if (depth >= MAX_DEPTH)
+            goto errorexit;
+
+         uint64_t bit = (uint64_t)1 << (depth % 64);
+         if (type == XCGI_JSON_OBJECT)
+            objects[depth / 64] |= bit;
+         else
+            objects[depth / 64] &= ~bit;
+         depth++;
+      }
+
+      for (size_t i=0; found && i<n; i++) {
+         if (!wants[i].hit)
+            continue;
+
+         out[i].ptr = &src[pos];
+         out[i].type = type;
+         out[i].len = end - pos;
+         wants[i].hit = false;
+         found--;
+
+         // The slice is completed when the object or array is closed.
+         if (type == XCGI_JSON_OBJECT || type == XCGI_JSON_ARRAY) {
+            wants[i].open = depth;
+            nopen++;
+         }
+      }
+
+      if (type == XCGI_JSON_OBJECT || type == XCGI_JSON_ARRAY)
+         continue;
+
+      if (!depth)
+         break;
+   }
+
+   // No value at all, or an object or array that is not closed.
+   if (!seen || depth)
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   free (wants);
+
+   if (error)
+      memset (out, 0, n * sizeof *out);
+
+   return !error;
+}
+
+/* ************************************************************************
+ * Iterating over the values of an object or array in the source, with
+ * the first stage and nothing else. Nested objects and arrays are
+ * skipped by counting brackets.
+ */
+bool xcgi_json_iter_init (xcgi_json_iter_t *iter, const char *src, size_t len)
+{
+   size_t pos;
+
+   if (!iter)
+      return false;
+
+   memset (iter, 0, sizeof *iter);
+   iter->done = true;
+
+   if (!src)
+      return false;
+
+   scan_init (&iter->scan, src, len);
+   if ((pos = scan_next (&iter->scan)) >= len ||
+         (src[pos] != '[' && src[pos] != '{')) {
+      iter->failed = true;
+      return false;
+   }
+
+   iter->object = src[pos] == '{';
+   iter->done = false;
+   return true;
+}
+
+// Returns the offset of the bracket that closes the object or array that
+// was opened at 'pos', or the length of the source.
+static size_t iter_skip (xcgi_json_iter_t *iter, size_t pos)
+{
+   const char *src = iter->scan.src;
+   size_t len = iter->scan.len;
+   size_t depth = 1;
+
+   while (depth && (pos = scan_next (&iter->scan)) < len) {
+      if (src[pos] == '[' || src[pos] == '{')
+         depth++;
+      else if (src[pos] == ']' || src[pos] == '}')
+         depth--;
+   }
+
+   return pos;
+}
+
+bool xcgi_json_iter_next (xcgi_json_iter_t *iter, xcgi_json_slice_t *key,
+                          xcgi_json_slice_t *value)
+{
+   const char *src;
+   size_t len, pos, end;
+   int type;
+
+   if (key)
+      memset (key, 0, sizeof *key);
+   if (value)
+      memset (value, 0, sizeof *value);
+
+   if (!iter || iter->done)
+      return false;
+
+   src = iter->scan.src;
+   len = iter->scan.len;
+
+   while ((pos = scan_next (&iter->scan)) < len && src[pos] == ',')
+      ;
+
+   if (pos < len && src[pos] == (iter->object ? '}' : ']')) {
+      iter->done = true;
+      return false;
+   }
+
+   if (pos < len && iter->object) {
+      end = scan_next (&iter->scan);
+      if (src[pos] != '"' || end >= len)
+         goto errorexit;
+      if (key) {
+         key->ptr = &src[pos + 1];
+         key->len = end - pos - 1;
+         key->type = XCGI_JSON_STRING;
+      }
+      if ((pos = scan_next (&iter->scan)) >= len || src[pos] != ':')
+         goto errorexit;
+      pos = scan_next (&iter->scan);
+   }
+
+   if (pos >= len)
+      goto errorexit;
+
+   switch (src[pos]) {
+      case '{':
+      case '[':   type = src[pos] == '{' ? XCGI_JSON_OBJECT : XCGI_JSON_ARRAY;
+                  if ((end = iter_skip (iter, pos)) >= len ||
+                        src[end] != (type == XCGI_JSON_OBJECT ? '}' : ']'))
+                     goto errorexit;
+                  end++;
+                  break;
+
+      case '"':   type = XCGI_JSON_STRING;
+                  if ((end = scan_next (&iter->scan)) >= len)
+                     goto errorexit;
+                  end++;
+                  break;
+
+      default:    if (!(type = scalar_type (src[pos])))
+                     goto errorexit;
+                  end = scalar_end (src, pos, len);
+                  break;
+   }
+
+   if (value) {
+      value->ptr = &src[pos];
+      value->len = end - pos;
+      value->type = type;
+   }
+
+   return true;
+
+errorexit:
+   if (key)
+      memset (key, 0, sizeof *key);
+   iter->done = true;
+   iter->failed = true;
+   return false;
+}
+
+bool xcgi_json_iter_failed (const xcgi_json_iter_t *iter)
+{
+   return !iter || iter->failed;
+}
+
+const char *json_index (const char *json_src, size_t index)
+{
+   xcgi_json_iter_t iter;
+   xcgi_json_slice_t value;
+
+   if (!json_src ||
+         !(xcgi_json_iter_init (&iter, json_src, strlen (json_src))) ||
+         iter.object)
+      return NULL;
+
+   while ((xcgi_json_iter_next (&iter, NULL, &value))) {
+      if (!index--)
+         return value.ptr;
+   }
+
+   return NULL;
+}
+
+/* ************************************************************************
+ * Parsing a source that is pushed in pieces. The parser is a state
+ * machine that is fed one piece at a time, so a piece may end anywhere,
+ * even inside a key or a number. The paths are matched as in
+ * xcgi_json_extract(). While a wanted value is open, its bytes in the
+ * current piece (from the start of the value, or of the piece) are
+ * copied to its buffer when the value or the piece ends.
+ */
+#define PUSH_VALUE      (0)
+#define PUSH_NEXT       (1)
+#define PUSH_KEY        (2)
+#define PUSH_COLON      (3)
+#define PUSH_STRING     (4)
+#define PUSH_SCALAR     (5)
+#define PUSH_DONE       (6)
+#define PUSH_ERROR      (7)
+
+typedef struct spill_t spill_t;
+struct spill_t {
+   char       *buf;
+   size_t      len;
+   size_t      size;
+   int         type;
+   bool        complete;
+   // The value is being copied, starting from offset 'from' in the
+   // current piece.
+   bool        open;
+   size_t      from;
+};
+
+struct xcgi_json_push_t {
+   xcgi_json_push_fn_t *fn;
+   void                *param;
+   size_t               n;
+   want_t              *wants;
+   spill_t             *spills;
+   size_t               nopen;
+
+   int                  state;
+   bool                 escaped;
+   size_t               depth;
+   // One bit for each open object or array, set for objects.
+   uint64_t             objects[MAX_DEPTH / 64];
+
+   // The key of the current member. Keys longer than every field cannot
+   // match, and are not kept.
+   char                *key;
+   size_t               klen;
+   size_t               skey;
+   bool                 klong;
+};
+
+static bool spill_append (spill_t *spill, const char *src, size_t len)
+{
+   if (spill->len + len >= spill->size) {
+      size_t newsize = spill->size ? spill->size : 64;
+      while (spill->len + len >= newsize)
+         newsize *= 2;
+      char *tmp = realloc (spill->buf, newsize);
+      if (!tmp)
+         return false;
+      spill->buf = tmp;
+      spill->size = newsize;
+   }
+
+   memcpy (&spill->buf[spill->len], src, len);
+   spill->len += len;
+   spill->buf[spill->len] = 0;
+   return true;
+}
+
+// Copies the rest of value 'index', which ends at 'end' in the piece at
+// 'src'.
+static bool push_complete (xcgi_json_push_t *push, size_t index,
+                           const char *src, size_t end)
+{
+   spill_t *spill = &push->spills[index];
+
+   if (end > spill->from &&
+         !(spill_append (spill, &src[spill->from], end - spill->from)))
+      return false;
+
+   spill->open = false;
+   spill->complete = true;
+   push->nopen--;
+
+   return !push->fn || push->fn (push->param, index, spill->buf, spill->len,
+                                 spill->type);
+}
+
+// Ends the string, number or literal that ends at 'end'.
+static bool push_value_end (xcgi_json_push_t *push, const char *src,
+                            size_t end)
+{
+   for (size_t i=0; push->nopen && i<push->n; i++) {
+      if (push->spills[i].open && !push->wants[i].open &&
+            !(push_complete (push, i, src, end)))
+         return false;
+   }
+
+   push->state = push->depth ? PUSH_NEXT : PUSH_DONE;
+   return true;
+}
+
+// Returns the offset of the next quote or backslash in the string at
+// 'pos', or 'len' if there is none.
+static size_t string_stop (const char *src, size_t pos, size_t len)
+{
+   const char *quote = memchr (&src[pos], '"', len - pos);
+   size_t end = quote ? (size_t)(quote - src) : len;
+   const char *bslash = memchr (&src[pos], '\\', end - pos);
+   return bslash ? (size_t)(bslash - src) : end;
+}
+
+static void push_key (xcgi_json_push_t *push, const char *src, size_t len)
+{
+   if (push->klong || push->klen + len > push->skey) {
+      push->klong = true;
+      return;
+   }
+   memcpy (&push->key[push->klen], src, len);
+   push->klen += len;
+}
+
+xcgi_json_push_t *xcgi_json_push_new (const char **paths, size_t n,
+                                      xcgi_json_push_fn_t *fn,
+                                      void *param)
+{
+   bool error = true;
+   xcgi_json_push_t *ret = NULL;
+
+   if (n && !paths)
+      return NULL;
+
+   if (!(ret = calloc (1, sizeof *ret)))
+      return NULL;
+
+   ret->fn = fn;
+   ret->param = param;
+   ret->n = n;
+   ret->state = PUSH_VALUE;
+
+   if (n && (!(ret->wants = calloc (n, sizeof *ret->wants)) ||
+             !(ret->spills = calloc (n, sizeof *ret->spills))))
+      goto errorexit;
+
+   if (!(wants_init (ret->wants, paths, n)))
+      goto errorexit;
+
+   // Room for the longest field.
+   for (size_t i=0; i<n; i++) {
+      for (const char *field = paths[i]; field; ) {
+         const char *dot = strchr (field, '.');
+         size_t flen = dot ? (size_t)(dot - field) : strlen (field);
+         if (flen > ret->skey)
+            ret->skey = flen;
+         field = dot ? dot + 1 : NULL;
+      }
+   }
+
+   if (!(ret->key = malloc (ret->skey + 1)))
+      goto errorexit;
+
+   error = false;
+
+errorexit:
+   if (error) {
+      xcgi_json_push_del (ret);
+      ret = NULL;
+   }
+
+   return ret;
+}
+
+void xcgi_json_push_del (xcgi_json_push_t *push)
+{
+   if (!push)
+      return;
+
+   for (size_t i=0; push->spills && i<push->n; i++) {
+      free (push->spills[i].buf);
+   }
+   free (push->spills);
+   free (push->wants);
+   free (push->key);
+   free (push);
+}
+
+bool xcgi_json_push_write (xcgi_json_push_t *push,
+                           const void *data, size_t len)
+{
+   const char *src = data;
+   size_t pos = 0;
+
+   if (!push || push->state == PUSH_ERROR || (!data && len))
+      return false;
+
+   while (pos < len) {
+      char c = src[pos];
+      bool object = push->depth &&
+                    push->objects[(push->depth - 1) / 64] &
+                    ((uint64_t)1 << ((push->depth - 1) % 64));
+
+      switch (push->state) {
+         case PUSH_DONE:
+            // Anything after the top-level value is ignored.
+            pos = len;
+            break;
+
+         case PUSH_KEY:
+         case PUSH_STRING: {
+            size_t start = pos;
+
+            while (pos < len) {
+               if (push->escaped) {
+                  push->escaped = false;
+                  pos++;
+                  continue;
+               }
+               pos = string_stop (src, pos, len);
+               if (pos >= len || src[pos] != '\\')
+                  break;
+               push->escaped = true;
+               pos++;
+            }
+
+            if (push->state == PUSH_KEY)
+               push_key (push, &src[start], pos - start);
+
+            if (pos >= len)
+               break;
+
+            // The closing quote.
+            pos++;
+            if (push->state == PUSH_KEY)
+               push->state = PUSH_COLON;
+            else if (!(push_value_end (push, src, pos)))
+               goto errorexit;
+            break;
+         }
+
+         case PUSH_SCALAR:
+            // Ends where the first stage would find the next token.
+            while (pos < len && src[pos] && src[pos] != '"' &&
+                   src[pos] != '[' && src[pos] != '{' &&
+                   !is_delim (src[pos]))
+               pos++;
+
+            // The delimiter is not part of the value.
+            if (pos < len && !(push_value_end (push, src, pos)))
+               goto errorexit;
+            break;
+
+         case PUSH_COLON:
+            if (!is_ws (c) && c != ':')
+               goto errorexit;
+            if (c == ':')
+               push->state = PUSH_VALUE;
+            pos++;
+            break;
+
+         case PUSH_NEXT:
+            if (is_ws (c) || c == ',') {
+               pos++;
+               break;
+            }
+
+            if (c == ']' || c == '}') {
+               if (c != (object ? '}' : ']'))
+                  goto errorexit;
+               pos++;
+
+               // The slices are completed when the object or array is
+               // closed.
+               for (size_t i=0; push->nopen && i<push->n; i++) {
+                  if (push->wants[i].open == push->depth) {
+                     push->wants[i].open = 0;
+                     if (!(push_complete (push, i, src, pos)))
+                        goto errorexit;
+                  }
+               }
+
+               push->state = --push->depth ? PUSH_NEXT : PUSH_DONE;
+               break;
+            }
+
+            if (object) {
+               if (c != '"')
+                  goto errorexit;
+               pos++;
+               push->klen = 0;
+               push->klong = false;
+               push->state = PUSH_KEY;
+               break;
+            }
+
+            // The byte starts a value in the array.
+            push->state = PUSH_VALUE;
+            break;
+
+         case PUSH_VALUE: {
+            if (is_ws (c) || (c == ',' && !push->depth)) {
+               pos++;
+               break;
+            }
+
+            int type;
+            switch (c) {
+               case '{':   type = XCGI_JSON_OBJECT;   break;
+               case '[':   type = XCGI_JSON_ARRAY;    break;
+               case '"':   type = XCGI_JSON_STRING;   break;
+               default:    if (!(type = scalar_type (c)))
+                              goto errorexit;
+                           break;
+            }
+
+            const char *key = object && !push->klong ? push->key : NULL;
+            size_t found = push->depth ? wants_match (push->wants, push->n,
+                                                      push->depth,
+                                                      key, push->klen)
+                                       : 0;
+
+            if (type == XCGI_JSON_OBJECT || type == XCGI_JSON_ARRAY) {
+               if (push->depth >= MAX_DEPTH)
+                  goto errorexit;
+
+               uint64_t bit = (uint64_t)1 << (push->depth % 64);
+               if (type == XCGI_JSON_OBJECT)
+                  push->objects[push->depth / 64] |= bit;
+               else
+                  push->objects[push->depth / 64] &= ~bit;
+               push->depth++;
+               push->state = PUSH_NEXT;
+            } else {
+               push->escaped = false;
+               push->state = type == XCGI_JSON_STRING ? PUSH_STRING
+                                                      : PUSH_SCALAR;
+            }
+
+            for (size_t i=0; found && i<push->n; i++) {
+               if (!push->wants[i].hit)
+                  continue;
+
+               push->wants[i].hit = false;
+               if (type == XCGI_JSON_OBJECT || type == XCGI_JSON_ARRAY)
+                  push->wants[i].open = push->depth;
+               push->spills[i].open = true;
+               push->spills[i].from = pos;
+               push->spills[i].type = type;
+               push->nopen++;
+               found--;
+            }
+
+            pos++;
+            break;
+         }
+      }
+   }
+
+   // Keep the part of each open value that is in this piece.
+   for (size_t i=0; push->nopen && i<push->n; i++) {
+      spill_t *spill = &push->spills[i];
+      if (!spill->open)
+         continue;
+      if (!(spill_append (spill, &src[spill->from], len - spill->from)))
+         goto errorexit;
+      spill->from = 0;
+   }
+
+   return true;
+
+errorexit:
+   push->state = PUSH_ERROR;
+   return false;
+}
+
+bool xcgi_json_push_done (xcgi_json_push_t *push)
+{
+   if (!push || push->state == PUSH_ERROR)
+      return false;
+
+   // A number or literal at the top level ends with the source.
+   if (push->state == PUSH_SCALAR && !push->depth &&
+         !(push_value_end (push, "", 0))) {
+      push->state = PUSH_ERROR;
+      return false;
+   }
+
+   return push->state == PUSH_DONE;
+}
+
+void xcgi_json_push_slices (const xcgi_json_push_t *push,
+                            xcgi_json_slice_t *out)
+{
+   if (!push || !out)
+      return;
+
+   for (size_t i=0; i<push->n; i++) {
+      const spill_t *spill = &push->spills[i];
+      out[i].ptr = spill->complete ? spill->buf : NULL;
+      out[i].len = spill->complete ? spill->len : 0;
+      out[i].type = spill->complete ? spill->type : XCGI_JSON_NONE;
+   }
+}
+
 static const char *find_closing (const char *s, char close_char)
 {
    size_t nlevels = 1;
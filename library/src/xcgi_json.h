@@ -4,6 +4,88 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// The types of JSON values.
+#define XCGI_JSON_NONE        (0)
+#define XCGI_JSON_OBJECT      (1)
+#define XCGI_JSON_ARRAY       (2)
+#define XCGI_JSON_STRING      (3)
+#define XCGI_JSON_NUMBER      (4)
+#define XCGI_JSON_BOOLEAN     (5)
+#define XCGI_JSON_NULL        (6)
+
+// Returned in place of a node when there is no such node.
+#define XCGI_JSON_NOTFOUND    ((size_t)-1)
+
+// A parsed JSON document. The document is parsed once into a tape of
+// nodes, one for each value (objects and arrays included), in the order
+// in which they appear in the source. Each node records where its value
+// (and its key, for object members) is in the source, the node of the
+// object or array that contains it, and the node of the next value in
+// the same object or array, so that finding a value is a walk over the
+// nodes and the source is not scanned again.
+//
+// Nodes are referred to by their index in the tape: the top-level value
+// is node 0, and the first member of an object or array is the node
+// that follows it.
+typedef struct xcgi_json_t xcgi_json_t;
+
+// A value in the source, exactly as it appears there (see
+// xcgi_json_value()). 'ptr' is NULL and 'type' is XCGI_JSON_NONE for a
+// value that was not found.
+typedef struct xcgi_json_slice_t xcgi_json_slice_t;
+struct xcgi_json_slice_t {
+   const char *ptr;
+   size_t      len;
+   int         type;
+};
+
+// Private to the library: the state of the first stage of parsing (see
+// xcgi_json_structurals()).
+typedef struct xcgi_json_scan_t xcgi_json_scan_t;
+struct xcgi_json_scan_t {
+   const char *src;
+   size_t      len;
+   // The offset of the current block, and the tokens left in it.
+   size_t      base;
+   uint64_t    tokens;
+   uint64_t  (*block) (xcgi_json_scan_t *scan, const uint8_t *src);
+   // Carried from one block to the next: the first byte of the block is
+   // escaped (1 or 0), the block starts inside a string (all ones or
+   // zero), and the byte before the block ends a token (1 or 0).
+   uint64_t    escaped;
+   uint64_t    in_string;
+   uint64_t    boundary;
+};
+
+// A walk over the values of one object or array in the source, which
+// needs no storage other than this structure; see xcgi_json_iter_init().
+// The caller MUST NOT modify any of the fields.
+typedef struct xcgi_json_iter_t xcgi_json_iter_t;
+struct xcgi_json_iter_t {
+   // True if the values are the members of an object.
+   bool              object;
+
+   // Private to the library.
+   bool              done;
+   bool              failed;
+   xcgi_json_scan_t  scan;
+};
+
+// A parser that is given the source a piece at a time, and keeps only
+// the values of the paths that it was asked for; see
+// xcgi_json_push_new().
+typedef struct xcgi_json_push_t xcgi_json_push_t;
+
+// Called with 'param' when the value of path 'index' is complete, with
+// the value exactly as in the source ('len' bytes at 'value', followed by
+// a NUL that is not part of it). Returns false to stop parsing, in which
+// case xcgi_json_push_write() returns false.
+typedef bool (xcgi_json_push_fn_t) (void *param, size_t index,
+                                    const char *value, size_t len,
+                                    int type);
 
 #ifdef __cplusplus
 extern "C" {
@@ -12,7 +94,13 @@ extern "C" {
    /* ********************************************************************
     * Searches the specified JSON string and returns the location of the
     * value named by the fields {field1, ... fieldN}, where the fields are
-    * specified as variadic arguments to this function.
+    * specified as variadic arguments to this function. Each field is a
+    * member of the object named by the field before it, starting at the
+    * top-level object.
+    *
+    * This parses the whole string with xcgi_json_parse() on each call;
+    * callers that look up more than one value should parse it once and
+    * use xcgi_json_path() instead.
     *
     * Note that the returned value is a pointer into the original JSON
     * source string, and thus is not NULL-terminated. Use the
@@ -23,15 +111,15 @@ extern "C" {
     * Given the following JSON input:
     * {  "some_fields": 3.14598,
     *    "one" :
-    *       { "two" : [ "ONE": 1, "TWO": 2, "THREE": 3, "FOUR": 4 ] },
+    *       { "two" : { "ONE": 1, "TWO": 2, "THREE": 3, "FOUR": 4 } },
     *    "some_other_fields": "More data"
     * }
     *
     * We find the value of element 'one.two.THREE' in JSON tree 'src':
-    *       const char *val = xcgi_json_find (src, "one", "two", "three", NULL);
+    *       const char *val = xcgi_json_find (src, "one", "two", "THREE", NULL);
     *
     * The value 'val' will now contain a pointer to the substring:
-    *    '3,  "FOUR": 4 ] },\n      "some_other_fields": "More data"\n}'
+    *    '3,  "FOUR": 4 } },\n      "some_other_fields": "More data"\n}'
     *
     * The exact substring consisting of only the value and not the rest of
     * the JSON source ('3', instead of '3, "FOUR"...') can be copied using
@@ -49,9 +137,199 @@ extern "C" {
     */
    size_t xcgi_json_length (const char *json_element);
 
-   // TODO: Implement this when json[index] functionality is needed
+   /* ********************************************************************
+    * Parses the 'len' bytes of JSON at 'src' into a tape of nodes, in a
+    * single pass. The source is not copied, and must not be changed or
+    * freed while the result is in use. Returns NULL if the source is not
+    * a JSON value or on error. The caller must free the result with
+    * xcgi_json_del().
+    *
+    * Like xcgi_json_find(), the parser is forgiving: missing or extra
+    * commas between values, and anything after the top-level value, are
+    * accepted.
+    */
+   xcgi_json_t *xcgi_json_parse (const char *src, size_t len);
+   void xcgi_json_del (xcgi_json_t *json);
+
+   /* ********************************************************************
+    * Stores in 'offsets' the offset of each token in the 'len' bytes of
+    * JSON at 'src', in order, and returns the number of tokens. The tokens
+    * are the structural characters ({}[]:,) outside of strings, the
+    * opening and closing quotes of each string, and the first character
+    * of each number or literal. 'offsets' must have room for 'len'
+    * entries. This is the first stage of xcgi_json_parse().
+    *
+    * The source is examined 64 bytes at a time with AVX2 or SSE4.2 (and
+    * PCLMULQDQ) when the processor has them, and without otherwise.
+    */
+   size_t xcgi_json_structurals (const char *src, size_t len,
+                                 uint32_t *offsets);
+
+   // Returns the number of nodes in the tape.
+   size_t xcgi_json_nodes (const xcgi_json_t *json);
+
+   // Returns the type of 'node', or XCGI_JSON_NONE if there is no such
+   // node.
+   int xcgi_json_type (const xcgi_json_t *json, size_t node);
+
+   // Returns a pointer to the value of 'node' in the source, and stores
+   // its length in '*len' if 'len' is not NULL. The value is exactly as
+   // in the source: strings keep their quotes and escapes, and objects
+   // and arrays include their brackets. Returns NULL if there is no such
+   // node.
+   const char *xcgi_json_value (const xcgi_json_t *json, size_t node,
+                                size_t *len);
+
+   // Returns a pointer to the key of the object member 'node' in the
+   // source, without the quotes (escapes are kept), and stores its length
+   // in '*len' if 'len' is not NULL. Returns NULL if 'node' is not an
+   // object member.
+   const char *xcgi_json_key (const xcgi_json_t *json, size_t node,
+                              size_t *len);
+
+   // Return the number of values in the object or array 'node' (zero for
+   // any other node), its first value, the next value after 'node' in
+   // the object or array that contains it, and that object or array.
+   // The last three return XCGI_JSON_NOTFOUND if there is no such node.
+   size_t xcgi_json_count (const xcgi_json_t *json, size_t node);
+   size_t xcgi_json_child (const xcgi_json_t *json, size_t node);
+   size_t xcgi_json_next (const xcgi_json_t *json, size_t node);
+   size_t xcgi_json_parent (const xcgi_json_t *json, size_t node);
+
+   // Returns the first member named 'name' of the object 'node', or
+   // XCGI_JSON_NOTFOUND. The name is compared with the key exactly as it
+   // appears in the source.
+   size_t xcgi_json_member (const xcgi_json_t *json, size_t node,
+                            const char *name);
+
+   // Returns the value found by following the members named by the
+   // NULL-terminated list of fields {field, ... fieldN} from the object
+   // 'node', so that xcgi_json_path (json, 0, "one", "two", NULL) is
+   // the value of 'one.two' in the document. Returns XCGI_JSON_NOTFOUND
+   // if any of the members does not exist.
+   size_t xcgi_json_vpath (const xcgi_json_t *json, size_t node,
+                           const char *field, va_list ap);
+   size_t xcgi_json_path (const xcgi_json_t *json, size_t node,
+                          const char *field, ...);
+
+   /* ********************************************************************
+    * Finds each of the 'n' values named by 'paths' in the JSON string
+    * 'src', in a single walk over the source, and stores them in the 'n'
+    * slices at 'out'. A path is a list of fields separated by dots, each
+    * of them a member of the object named by the one before it, so that
+    * "one.two" is field 'two' in field 'one' of the top-level object
+    * (fields that contain dots cannot be named). The first value found
+    * for a path is used.
+    *
+    * No tape is built and the values are not copied, so this is the
+    * quickest way to get a set of values that is known in advance.
+    * Returns false if the source is not a JSON value (in which case all
+    * the slices are empty) or on error.
+    */
+   bool xcgi_json_extract (const char *src, const char **paths, size_t n,
+                           xcgi_json_slice_t *out);
+
+   /* ********************************************************************
+    * Returns the value at 'index' in the array 'node', or
+    * XCGI_JSON_NOTFOUND if 'node' is not an array or has no such value.
+    * The values of every array are indexed when the document is parsed,
+    * so this takes constant time however long the array is.
+    */
+   size_t xcgi_json_index (const xcgi_json_t *json, size_t node,
+                           size_t index);
+
+   /* ********************************************************************
+    * Walks over the values of an object or array in the source, one at a
+    * time, without building a tape or allocating anything. Use this to
+    * read the values of a large array in order.
+    *
+    * xcgi_json_iter_init() starts a walk over the object or array at the
+    * start of the 'len' bytes at 'src' (a value returned by any of the
+    * functions above, for example). Returns false if there is none.
+    *
+    * xcgi_json_iter_next() finds the next value, and stores it in
+    * '*value' and its key (for the members of an object, without the
+    * quotes as for xcgi_json_key()) in '*key', if they are not NULL.
+    * Returns false when there are no more values, or if the source is
+    * malformed, which xcgi_json_iter_failed() then reports.
+    *
+    * EXAMPLE:
+    *    xcgi_json_iter_t iter;
+    *    xcgi_json_slice_t value;
+    *    xcgi_json_iter_init (&iter, ids, ids_len);
+    *    while ((xcgi_json_iter_next (&iter, NULL, &value))) {
+    *       ... value.ptr, value.len ...
+    *    }
+    */
+   bool xcgi_json_iter_init (xcgi_json_iter_t *iter,
+                             const char *src, size_t len);
+   bool xcgi_json_iter_next (xcgi_json_iter_t *iter,
+                             xcgi_json_slice_t *key,
+                             xcgi_json_slice_t *value);
+   bool xcgi_json_iter_failed (const xcgi_json_iter_t *iter);
+
+   /* ********************************************************************
+    * Returns the location of the value at 'index' in the JSON array
+    * 'json_src', or NULL if 'json_src' is not an array or has no such
+    * value. Like xcgi_json_find(), the returned value is not
+    * NULL-terminated; use xcgi_json_length() to find its length.
+    *
+    * This walks the array up to the value on each call; callers that
+    * read more than one value should use xcgi_json_iter_next() or
+    * xcgi_json_index() instead.
+    */
    const char *json_index (const char *json_src, size_t index);
 
+   /* ********************************************************************
+    * Finds the 'n' values named by 'paths' (as for xcgi_json_extract())
+    * in a source that is given to the parser a piece at a time, so that
+    * a body can be read in blocks of any size and parsed as it arrives,
+    * without ever holding all of it. Only the bytes of the values that
+    * are found are kept, each copied into a buffer of its own; the rest
+    * of the source is parsed and dropped.
+    *
+    * xcgi_json_push_new() creates the parser. 'fn', if not NULL, is
+    * called with 'param' as each value is completed. The paths are not
+    * copied, and must remain valid until the parser is deleted with
+    * xcgi_json_push_del(). Returns NULL on error.
+    *
+    * xcgi_json_push_write() parses the next 'len' bytes of the source.
+    * Returns false if the source is malformed or the callback stopped
+    * the parse; the parser cannot be used after that.
+    *
+    * xcgi_json_push_done() ends the source (completing a top-level
+    * number or literal, which may have been waiting for a delimiter), and
+    * returns true if it held a complete JSON value.
+    *
+    * xcgi_json_push_slices() stores the values found so far in the 'n'
+    * slices at 'out', as xcgi_json_extract() does, except that each
+    * slice points into the parser and is NUL-terminated. The slices are
+    * valid until the parser is deleted.
+    *
+    * EXAMPLE:
+    *    const char *paths[] = { "user.name", "items" };
+    *    xcgi_json_slice_t values[2];
+    *    xcgi_json_push_t *push = xcgi_json_push_new (paths, 2, NULL, NULL);
+    *    while ((nbytes = fread (buf, 1, sizeof buf, inf)) > 0) {
+    *       if (!(xcgi_json_push_write (push, buf, nbytes)))
+    *          ... error ...
+    *    }
+    *    if (!(xcgi_json_push_done (push)))
+    *       ... error ...
+    *    xcgi_json_push_slices (push, values);
+    *    ...
+    *    xcgi_json_push_del (push);
+    */
+   xcgi_json_push_t *xcgi_json_push_new (const char **paths, size_t n,
+                                         xcgi_json_push_fn_t *fn,
+                                         void *param);
+   bool xcgi_json_push_write (xcgi_json_push_t *push,
+                              const void *data, size_t len);
+   bool xcgi_json_push_done (xcgi_json_push_t *push);
+   void xcgi_json_push_slices (const xcgi_json_push_t *push,
+                               xcgi_json_slice_t *out);
+   void xcgi_json_push_del (xcgi_json_push_t *push);
+
 
 #ifdef __cplusplus
 };
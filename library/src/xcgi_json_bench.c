@@ -0,0 +1,187 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include "xcgi_json.h"
+
+// Measures the throughput of finding the structure of JSON bodies of 1KB
+// to 10MB: with the scanner that xcgi_json_find() used to use, which
+// looks for a field with strchr() and finds the end of a value a byte at
+// a time; with the vectorised first stage alone; and with the whole
+// parse into a tape followed by a lookup.
+//
+// Each body is an object holding an array of records (with strings that
+// contain escaped quotes and structural characters) followed by the
+// field that is looked up, so every method has to get past all of it.
+
+#define MIN_SECONDS           (0.25)
+#define LAST_FIELD            ("email")
+
+static double now_secs (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+static char *make_body (size_t size)
+{
+   char *ret = malloc (size + 512);
+   size_t len = 0;
+
+   if (!ret)
+      return NULL;
+
+   len += sprintf (&ret[len], "{\n   \"items\": [\n");
+   for (size_t i=0; len < size; i++) {
+      len += sprintf (&ret[len],
+                      "%s      { \"id\": %zu, \"name\": \"item \\\"%zu\\\" {x: [y]}\","
+                      " \"tags\": [\"a\", \"b\"], \"value\": %zu.25, \"ok\": true }",
+                      i ? ",\n" : "", i, i, i * 3);
+   }
+   len += sprintf (&ret[len], "\n   ],\n   \"%s\": \"someone@example.com\"\n}\n",
+                   LAST_FIELD);
+
+   ret[len] = 0;
+   return ret;
+}
+
+/* ************************************************************************
+ * The scanner that the library used to use.
+ */
+static const char *legacy_lstrchr (const char *haystack, char needle)
+{
+   const char *tmp = haystack;
+   while ((tmp = strchr (tmp, needle))) {
+      if (tmp == haystack || tmp[-1] != '\\')
+         return tmp;
+      tmp++;
+   }
+   return NULL;
+}
+
+static const char *legacy_find_field (const char *start, const char *field)
+{
+   const char *tmp = start;
+   size_t flen = strlen (field);
+
+   while ((tmp = legacy_lstrchr (tmp, '"'))) {
+      if ((strncmp (++tmp, field, flen))==0) {
+         const char *end = legacy_lstrchr (tmp, '"');
+         if (!end)
+            continue;
+
+         size_t tmplen = end - tmp;
+
+         if (tmplen < (flen + 2)) {
+            if (tmp[flen] == '"') {
+               const char *end = &tmp[flen + 1];
+               while (*end && isspace (*end))
+                  end++;
+               return *end == ':' ? &tmp[0] : NULL;
+            }
+         }
+      }
+   }
+   return NULL;
+}
+
+/* ************************************************************************
+ * The methods. Each returns a value that the others are checked against.
+ */
+static size_t run_legacy (const char *body, size_t len)
+{
+   len = len;
+   // Finding the field and then the length of the whole body, which is
+   // what finding the end of any large value costs.
+   const char *field = legacy_find_field (body, LAST_FIELD);
+   return field && xcgi_json_length (body) ? (size_t)(field - body) - 1 : 0;
+}
+
+static uint32_t *g_offsets;
+
+static size_t run_stage1 (const char *body, size_t len)
+{
+   size_t n = xcgi_json_structurals (body, len, g_offsets);
+   // The opening quote of the last key.
+   return n > 5 ? g_offsets[n - 6] : 0;
+}
+
+static size_t run_parse (const char *body, size_t len)
+{
+   size_t ret = 0;
+   xcgi_json_t *json = xcgi_json_parse (body, len);
+   size_t klen;
+   const char *key = xcgi_json_key (json,
+                                    xcgi_json_member (json, 0, LAST_FIELD),
+                                    &klen);
+   if (key)
+      ret = (key - body) - 1;
+
+   xcgi_json_del (json);
+   return ret;
+}
+
+static double measure (size_t (*fptr) (const char *, size_t),
+                       const char *body, size_t len, size_t *result)
+{
+   size_t iterations = 0;
+   double start = now_secs ();
+   double elapsed;
+
+   do {
+      *result = fptr (body, len);
+      iterations++;
+      elapsed = now_secs () - start;
+   } while (elapsed < MIN_SECONDS);
+
+   return (len * (double)iterations) / (elapsed * 1024 * 1024);
+}
+
+int main (void)
+{
+   static const size_t sizes[] = {
+      1024,
+      1024 * 16,
+      1024 * 256,
+      1024 * 1024,
+      1024 * 1024 * 10,
+   };
+
+   printf ("%10s %14s %14s %14s %8s\n",
+           "bytes", "legacy MB/s", "stage1 MB/s", "parse MB/s", "speedup");
+
+   for (size_t i=0; i<sizeof sizes/sizeof sizes[0]; i++) {
+      size_t rlegacy = 0, rstage1 = 0, rparse = 0;
+
+      char *body = make_body (sizes[i]);
+      size_t len = body ? strlen (body) : 0;
+      if (!body || !(g_offsets = malloc (len * sizeof *g_offsets))) {
+         fprintf (stderr, "OOM error creating %zu byte body\n", sizes[i]);
+         free (body);
+         return EXIT_FAILURE;
+      }
+
+      double legacy = measure (run_legacy, body, len, &rlegacy);
+      double stage1 = measure (run_stage1, body, len, &rstage1);
+      double parse = measure (run_parse, body, len, &rparse);
+
+      if (rlegacy != rstage1 || rlegacy != rparse) {
+         fprintf (stderr, "Mismatch: %zu legacy, %zu stage1, %zu parse\n",
+                          rlegacy, rstage1, rparse);
+      }
+
+      printf ("%10zu %14.1f %14.1f %14.1f %7.1fx\n",
+              len, legacy, stage1, parse, parse / legacy);
+
+      free (g_offsets);
+      free (body);
+   }
+
+   return EXIT_SUCCESS;
+}
@@ -1,6 +1,7 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "xcgi_json.h"
 
@@ -25,6 +26,7 @@
 int main (void)
 {
    int ret = EXIT_FAILURE;
+   xcgi_json_t *json = NULL;
    printf ("Testing xcgi_json_find\n%s\n", JSOURCE);
 
    const char *needle1 = xcgi_json_find (JSOURCE, FIELD, NULL);
@@ -68,16 +70,154 @@ int main (void)
    printf ("Element length: %zu\n", needle1_len);
    printf ("======================================\n\n");
 
-   // TODO: This is an array; test that accessing via index is possible.
    needle1 = xcgi_json_find (JSOURCE, "field4", NULL);
    needle1_len = xcgi_json_length (needle1);
    printf ("Element : [%s]\n", needle1);
    printf ("Element length: %zu\n", needle1_len);
    printf ("======================================\n\n");
 
+   printf ("Testing json_index\n");
+   for (size_t i=0; i<5; i++) {
+      const char *element = json_index (needle1, i);
+      printf ("Index %zu: [%.*s]\n", i, (int)xcgi_json_length (element),
+              element ? element : "");
+   }
+   printf ("======================================\n\n");
+
+   printf ("Testing xcgi_json_iter_next\n");
+   xcgi_json_iter_t iter;
+   xcgi_json_slice_t key, value;
+   if (!(xcgi_json_iter_init (&iter, JSOURCE, strlen (JSOURCE)))) {
+      fprintf (stderr, "Failed to start the walk\n");
+      goto errorexit;
+   }
+   while ((xcgi_json_iter_next (&iter, &key, &value))) {
+      printf ("Member %.*s (type %i): %zu bytes\n", (int)key.len, key.ptr,
+              value.type, value.len);
+   }
+   if ((xcgi_json_iter_failed (&iter))) {
+      fprintf (stderr, "The walk failed\n");
+      goto errorexit;
+   }
+   printf ("======================================\n\n");
+
+   printf ("Testing xcgi_json_parse\n");
+
+   json = xcgi_json_parse (JSOURCE, strlen (JSOURCE));
+   if (!json) {
+      fprintf (stderr, "Failed to parse the source\n");
+      goto errorexit;
+   }
+   printf ("Nodes: %zu\n", xcgi_json_nodes (json));
+
+   size_t node = xcgi_json_path (json, 0, FIELD, NULL);
+   const char *needle2 = xcgi_json_value (json, node, &needle1_len);
+   if (needle2 != xcgi_json_find (JSOURCE, FIELD, NULL)) {
+      fprintf (stderr, "Path and find differ\n");
+      goto errorexit;
+   }
+   printf ("Element : [%.*s]\n", (int)needle1_len, needle2);
+
+   node = xcgi_json_path (json, 0, "field4", NULL);
+   for (size_t i=0; i<xcgi_json_count (json, node); i++) {
+      needle2 = xcgi_json_value (json, xcgi_json_index (json, node, i),
+                                 &needle1_len);
+      printf ("Index %zu: [%.*s]\n", i, (int)needle1_len, needle2);
+   }
+
+   for (node = xcgi_json_child (json, 0);
+         node != XCGI_JSON_NOTFOUND;
+         node = xcgi_json_next (json, node)) {
+      size_t klen = 0;
+      const char *key = xcgi_json_key (json, node, &klen);
+      needle2 = xcgi_json_value (json, node, &needle1_len);
+      printf ("Member [%.*s] (type %i, %zu values): %zu bytes\n",
+              (int)klen, key, xcgi_json_type (json, node),
+              xcgi_json_count (json, node), needle1_len);
+   }
+   printf ("======================================\n\n");
+
+   printf ("Testing xcgi_json_extract\n");
+
+   // The keys inside field3 contain dots, so they cannot be named.
+   const char *paths[] = { "field2", "field3", "field5",
+                           "field4", "missing" };
+   xcgi_json_slice_t slices[sizeof paths / sizeof paths[0]];
+   if (!(xcgi_json_extract (JSOURCE, paths, sizeof paths / sizeof paths[0],
+                            slices))) {
+      fprintf (stderr, "Failed to extract the fields\n");
+      goto errorexit;
+   }
+   for (size_t i=0; i<sizeof paths / sizeof paths[0]; i++) {
+      printf ("Path [%s] (type %i): [%.*s]\n", paths[i], slices[i].type,
+              (int)slices[i].len, slices[i].ptr ? slices[i].ptr : "");
+   }
+
+   // A source with no value in it is not a JSON value.
+   static const char *empty[] = { "", " ", " \r\n\t " };
+   for (size_t i=0; i<sizeof empty / sizeof empty[0]; i++) {
+      xcgi_json_slice_t none[sizeof paths / sizeof paths[0]];
+      xcgi_json_t *tmp = xcgi_json_parse (empty[i], strlen (empty[i]));
+      bool extracted = xcgi_json_extract (empty[i], paths,
+                                          sizeof paths / sizeof paths[0],
+                                          none);
+      xcgi_json_del (tmp);
+      if (tmp || extracted) {
+         fprintf (stderr, "Accepted an empty source [%s]\n", empty[i]);
+         goto errorexit;
+      }
+   }
+   printf ("======================================\n\n");
+
+   printf ("Testing xcgi_json_push_write\n");
+
+   // Every piece size, so that the pieces end at every possible offset
+   // in the keys and values.
+   size_t srclen = strlen (JSOURCE);
+   for (size_t step=1; step<=srclen; step++) {
+      xcgi_json_slice_t pushed[sizeof paths / sizeof paths[0]];
+      xcgi_json_push_t *push = xcgi_json_push_new (paths,
+                                           sizeof paths / sizeof paths[0],
+                                           NULL, NULL);
+      bool ok = push != NULL;
+      for (size_t i=0; ok && i<srclen; i+=step) {
+         size_t n = srclen - i < step ? srclen - i : step;
+         ok = xcgi_json_push_write (push, &JSOURCE[i], n);
+      }
+      ok = ok && xcgi_json_push_done (push);
+      xcgi_json_push_slices (push, pushed);
+      for (size_t i=0; ok && i<sizeof paths / sizeof paths[0]; i++) {
+         ok = pushed[i].len == slices[i].len &&
+              pushed[i].type == slices[i].type &&
+              (!slices[i].ptr ||
+                  (memcmp (pushed[i].ptr, slices[i].ptr, slices[i].len))==0);
+      }
+      xcgi_json_push_del (push);
+      if (!ok) {
+         fprintf (stderr, "Push and extract differ (step %zu)\n", step);
+         goto errorexit;
+      }
+   }
+   for (size_t i=0; i<sizeof empty / sizeof empty[0]; i++) {
+      xcgi_json_push_t *push = xcgi_json_push_new (paths,
+                                           sizeof paths / sizeof paths[0],
+                                           NULL, NULL);
+      bool ok = push &&
+                xcgi_json_push_write (push, empty[i], strlen (empty[i])) &&
+                xcgi_json_push_done (push);
+      xcgi_json_push_del (push);
+      if (ok) {
+         fprintf (stderr, "Pushed an empty source [%s]\n", empty[i]);
+         goto errorexit;
+      }
+   }
+   printf ("Parsed correctly in pieces of 1 to %zu bytes\n", srclen);
+   printf ("======================================\n\n");
+
    ret = EXIT_SUCCESS;
 
 errorexit:
+   xcgi_json_del (json);
 
    return ret;
 }
@@ -0,0 +1,431 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "xcgi_multipart.h"
+
+// The window must hold the headers of a part, which are refused if they
+// do not fit.
+#define WINDOW_SIZE        (1024 * 64)
+#define MAX_BOUNDARY       (70)
+
+#define STATE_PREAMBLE     (0)
+#define STATE_DELIMITER    (1)
+#define STATE_HEADERS      (2)
+#define STATE_BODY         (3)
+#define STATE_DONE         (4)
+#define STATE_ERROR        (5)
+
+struct xcgi_multipart_t {
+   xcgi_arena_t           *arena;
+   xcgi_multipart_fn_t    *fn;
+   void                   *param;
+   int                     state;
+
+   // The delimiter is the boundary preceded by CRLF and "--"; the CRLF
+   // belongs to the delimiter and not to the content before it.
+   char                    delim[MAX_BOUNDARY + 4];
+   size_t                  dlen;
+   size_t                  skip[256];
+
+   xcgi_multipart_part_t   part;
+
+   // The part of the body that has been pushed in but not yet parsed.
+   char                   *window;
+   size_t                  wlen;
+};
+
+static bool is_ows (char c)
+{
+   return c == ' ' || c == '\t';
+}
+
+/* ************************************************************************
+ * Header parameters, as in 'form-data; name="field"; filename="a.txt"'.
+ * Calls 'fn' for each parameter with its name and its (unquoted) value.
+ */
+static bool params_scan (xcgi_arena_t *arena, const char *src, const char *end,
+                         bool (*fn) (void *, const char *, size_t,
+                                     const char *),
+                         void *param)
+{
+   while (src < end) {
+      const char *semi = memchr (src, ';', end - src);
+      if (!semi)
+         break;
+
+      src = semi + 1;
+      while (src < end && is_ows (*src))
+         src++;
+
+      const char *name = src;
+      while (src < end && *src != '=' && *src != ';' && !is_ows (*src))
+         src++;
+      size_t nlen = src - name;
+
+      while (src < end && is_ows (*src))
+         src++;
+      if (src >= end || *src != '=')
+         continue;
+      src++;
+      while (src < end && is_ows (*src))
+         src++;
+
+      char *value = NULL;
+      if (src < end && *src == '"') {
+         // Quoted string, with backslash escapes.
+         if (!(value = xcgi_arena_alloc (arena, end - src)))
+            return false;
+         size_t vlen = 0;
+         for (src++; src < end && *src != '"'; src++) {
+            if (*src == '\\' && src + 1 < end)
+               src++;
+            value[vlen++] = *src;
+         }
+         value[vlen] = 0;
+         if (src < end)
+            src++;
+      } else {
+         const char *vstart = src;
+         while (src < end && *src != ';' && !is_ows (*src))
+            src++;
+         if (!(value = xcgi_arena_strndup (arena, vstart, src - vstart)))
+            return false;
+      }
+
+      if (!(fn (param, name, nlen, value)))
+         return false;
+   }
+
+   return true;
+}
+
+static bool boundary_param (void *param, const char *name, size_t nlen,
+                            const char *value)
+{
+   if (nlen == 8 && (strncasecmp (name, "boundary", 8))==0)
+      *(const char **)param = value;
+   return true;
+}
+
+char *xcgi_multipart_boundary (xcgi_arena_t *arena, const char *content_type)
+{
+   static const char media[] = "multipart/form-data";
+   const char *ret = NULL;
+
+   if (!arena || !content_type)
+      return NULL;
+
+   while (is_ows (*content_type))
+      content_type++;
+
+   size_t mlen = strcspn (content_type, ";");
+   while (mlen && is_ows (content_type[mlen - 1]))
+      mlen--;
+
+   if (mlen != sizeof media - 1 ||
+         (strncasecmp (content_type, media, mlen))!=0)
+      return NULL;
+
+   if (!(params_scan (arena, content_type,
+                      content_type + strlen (content_type),
+                      boundary_param, &ret)))
+      return NULL;
+
+   if (!ret || !*ret || strlen (ret) > MAX_BOUNDARY)
+      return NULL;
+
+   return (char *)ret;
+}
+
+/* ************************************************************************
+ * The boundary search. The delimiter is compared from its last byte, and
+ * on a mismatch the search moves on by the distance from the last
+ * occurrence of the byte under the end of the delimiter to the end of the
+ * delimiter, which is the whole length of the delimiter for bytes that do
+ * not occur in it.
+ */
+static void skip_build (xcgi_multipart_t *mp)
+{
+   size_t last = mp->dlen - 1;
+
+   for (size_t i=0; i<256; i++) {
+      mp->skip[i] = mp->dlen;
+   }
+
+   for (size_t i=0; i<last; i++) {
+      mp->skip[(unsigned char)mp->delim[i]] = last - i;
+   }
+}
+
+// Returns the offset of the first delimiter in the 'len' bytes at 'src',
+// or -1 if there is none.
+static size_t delim_find (xcgi_multipart_t *mp, const char *src, size_t len)
+{
+   const unsigned char *hay = (const unsigned char *)src;
+   size_t last = mp->dlen - 1;
+   unsigned char tail = mp->delim[last];
+
+   for (size_t i=0; i + mp->dlen <= len; ) {
+      unsigned char c = hay[i + last];
+      if (c == tail && (memcmp (&hay[i], mp->delim, last))==0)
+         return i;
+      i += mp->skip[c];
+   }
+
+   return (size_t)-1;
+}
+
+/* ************************************************************************
+ * The part headers.
+ */
+static bool disposition_param (void *param, const char *name, size_t nlen,
+                               const char *value)
+{
+   xcgi_multipart_part_t *part = param;
+
+   if (nlen == 4 && (strncasecmp (name, "name", 4))==0)
+      part->name = value;
+
+   if (nlen == 8 && (strncasecmp (name, "filename", 8))==0)
+      part->filename = value;
+
+   return true;
+}
+
+static bool header_is (const char *line, size_t len, const char *name)
+{
+   size_t nlen = strlen (name);
+   return len > nlen && line[nlen] == ':' &&
+          (strncasecmp (line, name, nlen))==0;
+}
+
+// Reads the Content-Disposition and Content-Type headers from the 'len'
+// bytes of headers at 'src'.
+static bool headers_parse (xcgi_multipart_t *mp, const char *src, size_t len)
+{
+   const char *end = src + len;
+
+   memset (&mp->part, 0, sizeof mp->part);
+
+   while (src < end) {
+      const char *eol = memmem (src, end - src, "\r\n", 2);
+      if (!eol)
+         eol = end;
+
+      size_t llen = eol - src;
+
+      if (header_is (src, llen, "Content-Disposition")) {
+         if (!(params_scan (mp->arena, src, eol,
+                            disposition_param, &mp->part)))
+            return false;
+      }
+
+      if (header_is (src, llen, "Content-Type")) {
+         const char *value = src + 13;
+         while (value < eol && is_ows (*value))
+            value++;
+         const char *vend = eol;
+         while (vend > value && is_ows (vend[-1]))
+            vend--;
+         if (!(mp->part.content_type = xcgi_arena_strndup (mp->arena, value,
+                                                           vend - value)))
+            return false;
+      }
+
+      src = eol + 2;
+   }
+
+   if (!mp->part.name)
+      mp->part.name = "";
+
+   return true;
+}
+
+/* ************************************************************************
+ * The parser.
+ */
+xcgi_multipart_t *xcgi_multipart_new (xcgi_arena_t *arena,
+                                      const char *content_type,
+                                      xcgi_multipart_fn_t *fn,
+                                      void *param)
+{
+   xcgi_multipart_t *ret = NULL;
+   const char *boundary = NULL;
+
+   if (!arena || !fn ||
+         !(boundary = xcgi_multipart_boundary (arena, content_type)))
+      return NULL;
+
+   if (!(ret = xcgi_arena_calloc (arena, sizeof *ret)) ||
+       !(ret->window = xcgi_arena_alloc (arena, WINDOW_SIZE)))
+      return NULL;
+
+   ret->arena = arena;
+   ret->fn = fn;
+   ret->param = param;
+   ret->state = STATE_PREAMBLE;
+
+   ret->dlen = snprintf (ret->delim, sizeof ret->delim, "\r\n--%s", boundary);
+   skip_build (ret);
+
+   // The first boundary is usually at the very start of the body, where
+   // there is no CRLF before it.
+   memcpy (ret->window, "\r\n", 2);
+   ret->wlen = 2;
+
+   return ret;
+}
+
+// Parses as much of the window as possible, and moves what is left to
+// the start of the window.
+static bool window_parse (xcgi_multipart_t *mp)
+{
+   size_t pos = 0;
+   bool more = true;
+
+   while (more) {
+      char *src = &mp->window[pos];
+      size_t avail = mp->wlen - pos;
+
+      switch (mp->state) {
+         case STATE_PREAMBLE:
+         case STATE_BODY: {
+            size_t found = delim_find (mp, src, avail);
+            size_t n = found;
+
+            // The end of the window may be the start of a delimiter.
+            if (found == (size_t)-1)
+               n = avail >= mp->dlen ? avail - (mp->dlen - 1) : 0;
+
+            if (mp->state == STATE_BODY && n &&
+                  !(mp->fn (mp->param, XCGI_MULTIPART_DATA, &mp->part,
+                            src, n)))
+               return false;
+
+            pos += n;
+
+            if (found == (size_t)-1) {
+               more = false;
+               break;
+            }
+
+            if (mp->state == STATE_BODY &&
+                  !(mp->fn (mp->param, XCGI_MULTIPART_END, &mp->part,
+                            NULL, 0)))
+               return false;
+
+            pos += mp->dlen;
+            mp->state = STATE_DELIMITER;
+            break;
+         }
+
+         case STATE_DELIMITER:
+            // Transport padding may follow the boundary.
+            while (avail && is_ows (*src)) {
+               src++;
+               avail--;
+               pos++;
+            }
+
+            if (avail < 2) {
+               more = false;
+               break;
+            }
+
+            if (src[0] == '-' && src[1] == '-') {
+               mp->state = STATE_DONE;
+               break;
+            }
+
+            if (src[0] != '\r' || src[1] != '\n')
+               return false;
+
+            pos += 2;
+            mp->state = STATE_HEADERS;
+            break;
+
+         case STATE_HEADERS: {
+            size_t hlen = 0, used = 0;
+
+            if (avail >= 2 && src[0] == '\r' && src[1] == '\n') {
+               // No headers at all.
+               used = 2;
+            } else {
+               char *end = memmem (src, avail, "\r\n\r\n", 4);
+               if (!end) {
+                  more = false;
+                  break;
+               }
+               hlen = end - src;
+               used = hlen + 4;
+            }
+
+            if (!(headers_parse (mp, src, hlen)) ||
+                !(mp->fn (mp->param, XCGI_MULTIPART_BEGIN, &mp->part,
+                          NULL, 0)))
+               return false;
+
+            pos += used;
+            mp->state = STATE_BODY;
+            break;
+         }
+
+         case STATE_DONE:
+            // The epilogue is ignored.
+            pos = mp->wlen;
+            more = false;
+            break;
+      }
+   }
+
+   memmove (mp->window, &mp->window[pos], mp->wlen - pos);
+   mp->wlen -= pos;
+
+   return true;
+}
+
+bool xcgi_multipart_write (xcgi_multipart_t *mp, const void *data, size_t len)
+{
+   const char *src = data;
+
+   if (!mp || mp->state == STATE_ERROR || (!data && len))
+      return false;
+
+   while (len) {
+      size_t n = WINDOW_SIZE - mp->wlen;
+      if (n > len)
+         n = len;
+
+      memcpy (&mp->window[mp->wlen], src, n);
+      mp->wlen += n;
+      src += n;
+      len -= n;
+
+      if (!(window_parse (mp))) {
+         mp->state = STATE_ERROR;
+         return false;
+      }
+
+      // Nothing could be parsed from a full window: the headers of a part
+      // are too large.
+      if (mp->wlen == WINDOW_SIZE) {
+         fprintf (stderr, "%s: Part headers larger than %i bytes\n",
+                  __func__, WINDOW_SIZE);
+         mp->state = STATE_ERROR;
+         return false;
+      }
+   }
+
+   return true;
+}
+
+bool xcgi_multipart_done (xcgi_multipart_t *mp)
+{
+   return mp && mp->state == STATE_DONE;
+}
+
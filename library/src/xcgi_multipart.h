@@ -0,0 +1,84 @@
+
+#ifndef H_XCGI_MULTIPART
+#define H_XCGI_MULTIPART
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "xcgi_arena.h"
+
+// Streaming parser for multipart/form-data request bodies (RFC 7578).
+// The body is pushed into the parser in pieces of any size as it is read,
+// and the parts are passed to a callback as they are found: the headers
+// of each part first, then its content in pieces, then the end of the
+// part. The parser holds one fixed-size window of the body, so the memory
+// it uses does not depend on the size of the body or of any part.
+//
+// The boundaries are found with a Boyer-Moore-Horspool search, which
+// skips over most of the bytes of a large part without looking at them.
+//
+// Most callers want xcgi_qstrings_parse() (in xcgi.h), which uses this
+// parser to place the fields in xcgi_qstrings and the files in temporary
+// files.
+
+// The events passed to the callback.
+#define XCGI_MULTIPART_BEGIN        (0)
+#define XCGI_MULTIPART_DATA         (1)
+#define XCGI_MULTIPART_END          (2)
+
+typedef struct xcgi_multipart_t xcgi_multipart_t;
+
+// The headers of a part. 'filename' is NULL for a part that is not a
+// file, and 'content_type' is NULL when the part has no Content-Type
+// header.
+typedef struct xcgi_multipart_part_t xcgi_multipart_part_t;
+struct xcgi_multipart_part_t {
+   const char *name;
+   const char *filename;
+   const char *content_type;
+};
+
+// Called with 'param' for each event of each part: XCGI_MULTIPART_BEGIN
+// (without data) when the headers of a part have been read,
+// XCGI_MULTIPART_DATA for each piece of the content of the part, and
+// XCGI_MULTIPART_END (without data) after the last piece. Returns false
+// to stop parsing, in which case xcgi_multipart_write() returns false.
+typedef bool (xcgi_multipart_fn_t) (void *param, int event,
+                                    const xcgi_multipart_part_t *part,
+                                    const void *data, size_t len);
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the boundary in the Content-Type header 'content_type',
+   // allocated from 'arena', or NULL if 'content_type' is not
+   // multipart/form-data with a valid boundary.
+   char *xcgi_multipart_boundary (xcgi_arena_t *arena,
+                                  const char *content_type);
+
+   // Creates a parser for a body with the Content-Type 'content_type'.
+   // Everything the parser needs, including the part headers passed to
+   // 'fn', is allocated from 'arena'. Returns NULL if the content type is
+   // not multipart/form-data with a boundary, or on error.
+   xcgi_multipart_t *xcgi_multipart_new (xcgi_arena_t *arena,
+                                         const char *content_type,
+                                         xcgi_multipart_fn_t *fn,
+                                         void *param);
+
+   // Parses the next 'len' bytes of the body. Returns true on success and
+   // false if the body is malformed or the callback stopped the parse;
+   // the parser cannot be used after that.
+   bool xcgi_multipart_write (xcgi_multipart_t *mp,
+                              const void *data, size_t len);
+
+   // Returns true if the whole body has been parsed, up to the closing
+   // boundary.
+   bool xcgi_multipart_done (xcgi_multipart_t *mp);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
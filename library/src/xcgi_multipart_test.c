@@ -0,0 +1,130 @@
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "xcgi_multipart.h"
+
+#define CONTENT_TYPE "multipart/form-data; boundary=\"--xyz\""
+
+#define BODY \
+  "----xyz\r\n"\
+  "Content-Disposition: form-data; name=\"field1\"\r\n"\
+  "\r\n"\
+  "value1\r\n"\
+  "----xyz\r\n"\
+  "Content-Disposition: form-data; name=\"fi\\\"eld2\"\r\n"\
+  "\r\n"\
+  "line1\r\n----xy\r\nline2\r\n"\
+  "----xyz  \r\n"\
+  "Content-Disposition: form-data; name=\"file1\"; filename=\"a.txt\"\r\n"\
+  "Content-Type: text/plain\r\n"\
+  "\r\n"\
+  "\r\n\r\n----xy--xyz\r\n"\
+  "----xyz\r\n"\
+  "Content-Disposition: form-data; name=\"empty\"\r\n"\
+  "\r\n"\
+  "\r\n"\
+  "----xyz--\r\n"\
+  "epilogue\r\n"
+
+#define EXPECTED \
+  "[field1][-][-][value1]"\
+  "[fi\"eld2][-][-][line1\r\n----xy\r\nline2]"\
+  "[file1][a.txt][text/plain][\r\n\r\n----xy--xyz]"\
+  "[empty][-][-][]"
+
+typedef struct result_t result_t;
+struct result_t {
+   char   buf[1024];
+   size_t len;
+};
+
+static void append (result_t *result, const char *src, size_t len)
+{
+   if (result->len + len < sizeof result->buf) {
+      memcpy (&result->buf[result->len], src, len);
+      result->len += len;
+      result->buf[result->len] = 0;
+   }
+}
+
+static bool part_fn (void *param, int event,
+                     const xcgi_multipart_part_t *part,
+                     const void *data, size_t len)
+{
+   result_t *result = param;
+   const char *ct = part->content_type ? part->content_type : "-";
+   const char *fn = part->filename ? part->filename : "-";
+
+   switch (event) {
+      case XCGI_MULTIPART_BEGIN:
+         append (result, "[", 1);
+         append (result, part->name, strlen (part->name));
+         append (result, "][", 2);
+         append (result, fn, strlen (fn));
+         append (result, "][", 2);
+         append (result, ct, strlen (ct));
+         append (result, "][", 2);
+         break;
+
+      case XCGI_MULTIPART_DATA:
+         append (result, data, len);
+         break;
+
+      case XCGI_MULTIPART_END:
+         append (result, "]", 1);
+         break;
+   }
+
+   return true;
+}
+
+int main (void)
+{
+   int ret = EXIT_FAILURE;
+   size_t len = strlen (BODY);
+
+   printf ("Testing xcgi_multipart\n%s\n", BODY);
+
+   // Every piece size, so that the boundaries fall across pieces at every
+   // possible offset.
+   for (size_t step=1; step<=len; step++) {
+      xcgi_arena_t *arena = xcgi_arena_new (0);
+      result_t result = { "", 0 };
+      xcgi_multipart_t *mp = xcgi_multipart_new (arena, CONTENT_TYPE,
+                                                 part_fn, &result);
+      if (!mp) {
+         fprintf (stderr, "Failed to create the parser\n");
+         xcgi_arena_del (arena);
+         goto errorexit;
+      }
+
+      for (size_t i=0; i<len; i+=step) {
+         size_t n = len - i < step ? len - i : step;
+         if (!(xcgi_multipart_write (mp, &BODY[i], n))) {
+            fprintf (stderr, "Failed to parse at %zu (step %zu)\n", i, step);
+            xcgi_arena_del (arena);
+            goto errorexit;
+         }
+      }
+
+      bool ok = xcgi_multipart_done (mp) &&
+                (strcmp (result.buf, EXPECTED))==0;
+      if (!ok) {
+         fprintf (stderr, "Mismatch (step %zu):\n[%s]\n", step, result.buf);
+      }
+      xcgi_arena_del (arena);
+      if (!ok)
+         goto errorexit;
+   }
+
+   printf ("Parsed correctly in pieces of 1 to %zu bytes\n", len);
+   printf ("======================================\n\n");
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   printf ("%s\n", ret == EXIT_SUCCESS ? "PASSED" : "FAILED");
+   return ret;
+}
@@ -0,0 +1,268 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/un.h>
+
+#include "xcgi.h"
+#include "xcgi_cfg.h"
+#include "xcgi_net.h"
+#include "xcgi_prefork.h"
+
+#define CFG_LISTEN         ("xcgi_listen")
+
+#define LISTEN_BACKLOG     (1024)
+
+static int listen_unix (const char *path)
+{
+   int ret = -1;
+   struct sockaddr_un addr;
+
+   if (strlen (path) >= sizeof addr.sun_path) {
+      fprintf (stderr, "%s: Socket path too long [%s]\n", __func__, path);
+      return -1;
+   }
+
+   memset (&addr, 0, sizeof addr);
+   addr.sun_family = AF_UNIX;
+   strcpy (addr.sun_path, path);
+
+   if ((ret = socket (AF_UNIX, SOCK_STREAM, 0)) < 0) {
+      fprintf (stderr, "%s: socket() failed: %m\n", __func__);
+      return -1;
+   }
+
+   unlink (path);
+
+   if ((bind (ret, (struct sockaddr *)&addr, sizeof addr))!=0 ||
+       (listen (ret, LISTEN_BACKLOG))!=0) {
+      fprintf (stderr, "%s: Failed to listen on [%s]: %m\n", __func__, path);
+      close (ret);
+      return -1;
+   }
+
+   return ret;
+}
+
+static int listen_tcp (const char *spec, bool reuseport)
+{
+   int ret = -1;
+   char *host = NULL;
+   const char *port = NULL;
+   struct addrinfo hints, *ai = NULL;
+   int rc;
+
+   if (!(host = malloc (strlen (spec) + 1)))
+      return -1;
+
+   strcpy (host, spec);
+
+   char *sep = strrchr (host, ':');
+   if (sep) {
+      *sep++ = 0;
+      port = sep;
+   } else {
+      port = host;
+   }
+
+   memset (&hints, 0, sizeof hints);
+   hints.ai_family = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags = AI_PASSIVE;
+
+   if ((rc = getaddrinfo (sep && host[0] ? host : NULL, port,
+                          &hints, &ai))!=0) {
+      fprintf (stderr, "%s: Cannot resolve [%s]: %s\n", __func__, spec,
+                        gai_strerror (rc));
+      goto errorexit;
+   }
+
+   for (struct addrinfo *a = ai; a; a = a->ai_next) {
+      int one = 1;
+      if ((ret = socket (a->ai_family, a->ai_socktype, a->ai_protocol)) < 0)
+         continue;
+
+      setsockopt (ret, SOL_SOCKET, SO_REUSEADDR, &one, sizeof one);
+#ifdef SO_REUSEPORT
+      // Lets each preforked worker bind its own socket to the same port;
+      // the kernel then balances new connections across the workers.
+      // Other processes must not share the port, so that a second copy
+      // started by mistake fails with EADDRINUSE.
+      if (reuseport)
+         setsockopt (ret, SOL_SOCKET, SO_REUSEPORT, &one, sizeof one);
+#endif
+
+      if ((bind (ret, a->ai_addr, a->ai_addrlen))==0 &&
+          (listen (ret, LISTEN_BACKLOG))==0)
+         break;
+
+      close (ret);
+      ret = -1;
+   }
+
+   if (ret < 0)
+      fprintf (stderr, "%s: Failed to listen on [%s]: %m\n", __func__, spec);
+
+errorexit:
+   if (ai)
+      freeaddrinfo (ai);
+   free (host);
+
+   return ret;
+}
+
+int xcgi_net_listen (const char *spec, bool reuseport)
+{
+   if (!spec || !spec[0])
+      return -1;
+
+   if ((strncmp (spec, "unix:", 5))==0)
+      return listen_unix (&spec[5]);
+
+   return listen_tcp (spec, reuseport);
+}
+
+int xcgi_net_listener (int inherited_fd)
+{
+   const char *spec = xcgi_cfg_get (xcgi_config, CFG_LISTEN);
+
+   // Preforked workers each bind their own socket to the port.
+   if (spec && spec[0])
+      return xcgi_net_listen (spec, xcgi_prefork_workers () > 0);
+
+   if (xcgi_net_is_listener (inherited_fd))
+      return inherited_fd;
+
+   return XCGI_NET_CGI;
+}
+
+bool xcgi_net_is_listener (int fd)
+{
+   struct sockaddr_storage addr;
+   socklen_t len = sizeof addr;
+
+   // A listening socket is a socket with no peer.
+   return (getpeername (fd, (struct sockaddr *)&addr, &len))!=0
+            && errno==ENOTCONN;
+}
+
+int xcgi_net_stream_close (void *cookie)
+{
+   cookie = cookie;
+   return 0;
+}
+
+int xcgi_net_accept (int fd)
+{
+   int ret;
+
+   while ((ret = accept (fd, NULL, NULL)) < 0) {
+      if (errno!=EINTR && errno!=ECONNABORTED) {
+         fprintf (stderr, "%s: accept() failed: %m\n", __func__);
+         break;
+      }
+   }
+
+   return ret;
+}
+
+ssize_t xcgi_net_read (int fd, void *buf, size_t len)
+{
+   ssize_t ret;
+
+   while ((ret = read (fd, buf, len)) < 0 && errno==EINTR)
+      ;
+
+   return ret;
+}
+
+bool xcgi_net_writev (int fd, struct iovec *iov, int niov)
+{
+   while (niov > 0) {
+      struct msghdr msg;
+      ssize_t nbytes;
+
+      memset (&msg, 0, sizeof msg);
+      msg.msg_iov = iov;
+      msg.msg_iovlen = niov;
+
+      if ((nbytes = sendmsg (fd, &msg, MSG_NOSIGNAL)) < 0) {
+         if (errno==EINTR)
+            continue;
+         if (errno!=ENOTSOCK)
+            return false;
+         // Not a socket (for example, stdout of a cgi program)
+         if ((nbytes = writev (fd, iov, niov)) < 0) {
+            if (errno==EINTR)
+               continue;
+            return false;
+         }
+      }
+
+      while (niov > 0 && (size_t)nbytes >= iov->iov_len) {
+         nbytes -= iov->iov_len;
+         iov++;
+         niov--;
+      }
+
+      if (niov > 0) {
+         iov->iov_base = (char *)iov->iov_base + nbytes;
+         iov->iov_len -= nbytes;
+      }
+   }
+
+   return true;
+}
+
+bool xcgi_net_write (int fd, const void *buf, size_t len)
+{
+   struct iovec iov = { (void *)buf, len };
+
+   return xcgi_net_writev (fd, &iov, 1);
+}
+
+
+ssize_t xcgi_net_sendfile (int fd, int in_fd, off_t *offset, size_t len)
+{
+   sigset_t pipe_set, old_set, pending;
+   ssize_t ret;
+   int saved_errno;
+
+   // sendfile() has no MSG_NOSIGNAL, so SIGPIPE is blocked around it and
+   // any SIGPIPE that it raises is discarded.
+   sigemptyset (&pipe_set);
+   sigaddset (&pipe_set, SIGPIPE);
+   sigpending (&pending);
+   bool was_pending = sigismember (&pending, SIGPIPE);
+   pthread_sigmask (SIG_BLOCK, &pipe_set, &old_set);
+
+   while ((ret = sendfile (fd, in_fd, offset, len)) < 0 && errno==EINTR)
+      ;
+
+   // A partial send can raise SIGPIPE too, so the pending set is checked
+   // whatever the result.
+   saved_errno = errno;
+   sigpending (&pending);
+   if (!was_pending && sigismember (&pending, SIGPIPE)) {
+      struct timespec zero = { 0, 0 };
+      while ((sigtimedwait (&pipe_set, NULL, &zero)) < 0 && errno==EINTR)
+         ;
+   }
+
+   pthread_sigmask (SIG_SETMASK, &old_set, NULL);
+   errno = saved_errno;
+
+   return ret;
+}
+
@@ -0,0 +1,90 @@
+
+#ifndef H_XCGI_NET
+#define H_XCGI_NET
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+// The states of a front end, which serves either the one CGI request in
+// the environment or the connections on a listening socket.
+#define XCGI_NET_MODE_UNKNOWN       (0)
+#define XCGI_NET_MODE_CGI           (1)
+#define XCGI_NET_MODE_CGI_DONE      (2)
+#define XCGI_NET_MODE_SERVER        (3)
+
+// Returned by xcgi_net_listener() for a plain CGI program.
+#define XCGI_NET_CGI                (-2)
+
+// Socket helpers shared by the modules that serve multiple requests from
+// a single long-running process (FastCGI, etc). All functions retry on
+// EINTR, and none of the write functions will raise SIGPIPE when the
+// peer has gone away; they return false instead.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Creates a socket listening on the address specified in 'spec'. The
+   // address is either "unix:/path/to/socket" for a unix domain socket,
+   // or "host:port" for a TCP socket. The host may be omitted (":port" or
+   // "port") to listen on all interfaces. An existing unix socket file
+   // is removed before binding. When 'reuseport' is true TCP sockets are
+   // created with SO_REUSEPORT so that several processes (the preforked
+   // workers) may listen on the same port; otherwise binding a port that
+   // is already in use fails.
+   //
+   // Returns the listening descriptor on success and -1 on error.
+   int xcgi_net_listen (const char *spec, bool reuseport);
+
+   // Finds the socket a front end accepts connections on. When
+   // 'xcgi_listen' is set in the configuration a socket is created on
+   // that address, shared with the other preforked workers if there are
+   // any. Otherwise 'inherited_fd' is used if it is a listening socket,
+   // as when a web server starts the program.
+   //
+   // Returns the listening descriptor, XCGI_NET_CGI when the program was
+   // started as a plain CGI program, and -1 on error.
+   int xcgi_net_listener (int inherited_fd);
+
+   // Returns true if the descriptor 'fd' is a listening socket, such as
+   // the one passed to a FastCGI application on descriptor 0.
+   bool xcgi_net_is_listener (int fd);
+
+   // The close function of the fopencookie() streams that the front ends
+   // wrap around a connection; the connection is closed by its owner.
+   int xcgi_net_stream_close (void *cookie);
+
+   // Accepts the next connection on the listening socket 'fd'. Returns
+   // the connected descriptor on success and -1 on error.
+   int xcgi_net_accept (int fd);
+
+   // Reads up to 'len' bytes from 'fd' into 'buf'. Returns the number of
+   // bytes read, zero on end-of-file and -1 on error.
+   ssize_t xcgi_net_read (int fd, void *buf, size_t len);
+
+   // Writes all of the 'niov' buffers in 'iov' to 'fd', in order. The
+   // contents of 'iov' are modified. Returns true only if every byte was
+   // written.
+   bool xcgi_net_writev (int fd, struct iovec *iov, int niov);
+
+   // Writes all 'len' bytes in 'buf' to 'fd'. Returns true only if every
+   // byte was written.
+   bool xcgi_net_write (int fd, const void *buf, size_t len);
+
+   // Sends up to 'len' bytes of the file 'in_fd', starting at '*offset',
+   // to the socket 'fd' with sendfile(), so that the data does not pass
+   // through a user space buffer. '*offset' is advanced past the data
+   // sent; the file position of 'in_fd' is not changed. Returns the
+   // number of bytes sent, zero at the end of the file and -1 on error
+   // (EAGAIN for a non-blocking socket that is full).
+   ssize_t xcgi_net_sendfile (int fd, int in_fd, off_t *offset, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
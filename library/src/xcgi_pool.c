@@ -0,0 +1,360 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "xcgi.h"
+#include "xcgi_cfg.h"
+#include "xcgi_net.h"
+#include "xcgi_scgi.h"
+#include "xcgi_pool.h"
+
+#define CFG_THREADS                 ("xcgi_threads")
+
+#define DEQUE_INITIAL_SIZE          (64)
+
+/* ************************************************************************
+ * A double-ended queue of accepted connections. The owning worker takes
+ * connections from the front (oldest first) and other workers steal from
+ * the back.
+ */
+typedef struct deque_t deque_t;
+struct deque_t {
+   pthread_mutex_t   lock;
+   int              *fds;
+   size_t            size;
+   size_t            head;
+   size_t            count;
+};
+
+static bool deque_init (deque_t *dq)
+{
+   memset (dq, 0, sizeof *dq);
+
+   if (!(dq->fds = malloc (sizeof *dq->fds * DEQUE_INITIAL_SIZE)))
+      return false;
+
+   dq->size = DEQUE_INITIAL_SIZE;
+   pthread_mutex_init (&dq->lock, NULL);
+
+   return true;
+}
+
+static void deque_shutdown (deque_t *dq)
+{
+   for (size_t i=0; i<dq->count; i++) {
+      close (dq->fds[(dq->head + i) % dq->size]);
+   }
+
+   free (dq->fds);
+   pthread_mutex_destroy (&dq->lock);
+   memset (dq, 0, sizeof *dq);
+}
+
+static bool deque_push (deque_t *dq, int fd)
+{
+   bool ret = true;
+
+   pthread_mutex_lock (&dq->lock);
+
+   if (dq->count == dq->size) {
+      size_t newsize = dq->size * 2;
+      int *tmp = malloc (sizeof *tmp * newsize);
+      if (!tmp) {
+         ret = false;
+         goto errorexit;
+      }
+      for (size_t i=0; i<dq->count; i++) {
+         tmp[i] = dq->fds[(dq->head + i) % dq->size];
+      }
+      free (dq->fds);
+      dq->fds = tmp;
+      dq->size = newsize;
+      dq->head = 0;
+   }
+
+   dq->fds[(dq->head + dq->count) % dq->size] = fd;
+   dq->count++;
+
+errorexit:
+   pthread_mutex_unlock (&dq->lock);
+   return ret;
+}
+
+static int deque_pop_front (deque_t *dq)
+{
+   int ret = -1;
+
+   pthread_mutex_lock (&dq->lock);
+   if (dq->count) {
+      ret = dq->fds[dq->head];
+      dq->head = (dq->head + 1) % dq->size;
+      dq->count--;
+   }
+   pthread_mutex_unlock (&dq->lock);
+
+   return ret;
+}
+
+static int deque_pop_back (deque_t *dq)
+{
+   int ret = -1;
+
+   pthread_mutex_lock (&dq->lock);
+   if (dq->count) {
+      dq->count--;
+      ret = dq->fds[(dq->head + dq->count) % dq->size];
+   }
+   pthread_mutex_unlock (&dq->lock);
+
+   return ret;
+}
+
+/* ************************************************************************
+ * The pool. The pool lock and condition only protect the count of queued
+ * connections, which idle workers sleep on.
+ */
+typedef struct worker_t worker_t;
+struct worker_t {
+   pthread_t   thread;
+   size_t      index;
+   bool        started;
+   deque_t     queue;
+};
+
+static struct {
+   worker_t         *workers;
+   size_t            nworkers;
+
+   pthread_mutex_t   lock;
+   pthread_cond_t    cond;
+   size_t            pending;
+   bool              stop;
+
+   void (*handler) (xcgi_ctx_t *, void *);
+   void             *param;
+} g_pool = {
+   .lock = PTHREAD_MUTEX_INITIALIZER,
+   .cond = PTHREAD_COND_INITIALIZER,
+};
+
+static volatile sig_atomic_t g_signalled;
+
+static void on_signal (int signum)
+{
+   g_signalled = signum;
+}
+
+static void pending_add (int delta)
+{
+   pthread_mutex_lock (&g_pool.lock);
+   g_pool.pending += delta;
+   if (delta > 0)
+      pthread_cond_signal (&g_pool.cond);
+   pthread_mutex_unlock (&g_pool.lock);
+}
+
+// Returns the next connection for the worker: from its own queue if
+// possible, otherwise stolen from the other workers. Returns -1 if there
+// is no work anywhere.
+static int worker_next (worker_t *worker)
+{
+   int ret;
+
+   if ((ret = deque_pop_front (&worker->queue)) >= 0)
+      return ret;
+
+   for (size_t i=1; i<g_pool.nworkers; i++) {
+      worker_t *victim = &g_pool.workers[(worker->index + i) % g_pool.nworkers];
+      if ((ret = deque_pop_back (&victim->queue)) >= 0)
+         return ret;
+   }
+
+   return -1;
+}
+
+static void *worker_run (void *arg)
+{
+   worker_t *worker = arg;
+   sqldb_t *db = xcgi_dbms_open ();
+
+   while (true) {
+      int fd = worker_next (worker);
+
+      if (fd >= 0) {
+         pending_add (-1);
+         xcgi_scgi_serve_conn (fd, db, g_pool.handler, g_pool.param);
+         continue;
+      }
+
+      pthread_mutex_lock (&g_pool.lock);
+      while (g_pool.pending == 0 && !g_pool.stop)
+         pthread_cond_wait (&g_pool.cond, &g_pool.lock);
+      bool done = g_pool.pending == 0 && g_pool.stop;
+      pthread_mutex_unlock (&g_pool.lock);
+
+      if (done)
+         break;
+   }
+
+   sqldb_close (db);
+
+   return NULL;
+}
+
+static size_t threads_count (void)
+{
+   const char *value = xcgi_cfg_get (xcgi_config, CFG_THREADS);
+   int64_t ret = 0;
+
+   if (value && value[0] && (strcmp (value, "auto"))!=0) {
+      if (!(xcgi_cfg_get_int (xcgi_config, CFG_THREADS, &ret)) || ret <= 0) {
+         fprintf (stderr, "%s: Invalid value [%s] for [%s], using 'auto'\n",
+                           __func__, value, CFG_THREADS);
+         ret = 0;
+      }
+   }
+
+   if (ret <= 0)
+      ret = sysconf (_SC_NPROCESSORS_ONLN);
+
+   return ret > 0 ? (size_t)ret : 1;
+}
+
+static void pool_stop (void)
+{
+   pthread_mutex_lock (&g_pool.lock);
+   g_pool.stop = true;
+   pthread_cond_broadcast (&g_pool.cond);
+   pthread_mutex_unlock (&g_pool.lock);
+
+   for (size_t i=0; i<g_pool.nworkers; i++) {
+      if (g_pool.workers[i].started)
+         pthread_join (g_pool.workers[i].thread, NULL);
+   }
+
+   for (size_t i=0; i<g_pool.nworkers; i++) {
+      deque_shutdown (&g_pool.workers[i].queue);
+   }
+
+   free (g_pool.workers);
+   g_pool.workers = NULL;
+   g_pool.nworkers = 0;
+   g_pool.pending = 0;
+   g_pool.stop = false;
+}
+
+bool xcgi_pool_serve (void (*handler) (xcgi_ctx_t *, void *),
+                      void *param)
+{
+   bool error = true;
+   int listen_fd = -1;
+   sigset_t mask, oldmask;
+   struct sigaction sa, old_term, old_int;
+
+   if (!handler)
+      return false;
+
+   if ((listen_fd = xcgi_net_listener (0)) == XCGI_NET_CGI) {
+      // Plain CGI: serve the one request in the environment.
+      handler (xcgi_ctx_default (), param);
+      return true;
+   }
+
+   if (listen_fd < 0)
+      return false;
+
+   // The signals are blocked in the workers, which inherit the mask, and
+   // are only received by this thread while it waits for connections.
+   memset (&sa, 0, sizeof sa);
+   sa.sa_handler = on_signal;
+   sigaction (SIGTERM, &sa, &old_term);
+   sigaction (SIGINT, &sa, &old_int);
+
+   sigemptyset (&mask);
+   sigaddset (&mask, SIGTERM);
+   sigaddset (&mask, SIGINT);
+   pthread_sigmask (SIG_BLOCK, &mask, &oldmask);
+
+   g_pool.handler = handler;
+   g_pool.param = param;
+   g_pool.nworkers = threads_count ();
+
+   if (!(g_pool.workers = calloc (g_pool.nworkers, sizeof *g_pool.workers))) {
+      fprintf (stderr, "%s: OOM error allocating workers\n", __func__);
+      g_pool.nworkers = 0;
+      goto errorexit;
+   }
+
+   for (size_t i=0; i<g_pool.nworkers; i++) {
+      g_pool.workers[i].index = i;
+      if (!(deque_init (&g_pool.workers[i].queue))) {
+         fprintf (stderr, "%s: OOM error allocating queues\n", __func__);
+         goto errorexit;
+      }
+   }
+
+   for (size_t i=0; i<g_pool.nworkers; i++) {
+      worker_t *worker = &g_pool.workers[i];
+      if ((pthread_create (&worker->thread, NULL, worker_run, worker))!=0) {
+         fprintf (stderr, "%s: Failed to start thread %zu\n", __func__, i);
+         goto errorexit;
+      }
+      worker->started = true;
+   }
+
+   struct pollfd pfd = { .fd = listen_fd, .events = POLLIN };
+   size_t next = 0;
+   g_signalled = 0;
+
+   while (!g_signalled) {
+      int rc = ppoll (&pfd, 1, NULL, &oldmask);
+      if (rc < 0) {
+         if (errno == EINTR)
+            continue;
+         fprintf (stderr, "%s: ppoll() failed: %m\n", __func__);
+         goto errorexit;
+      }
+
+      int fd = accept4 (listen_fd, NULL, NULL, SOCK_CLOEXEC);
+      if (fd < 0) {
+         if (errno == EINTR || errno == EAGAIN || errno == ECONNABORTED)
+            continue;
+         fprintf (stderr, "%s: accept() failed: %m\n", __func__);
+         goto errorexit;
+      }
+
+      worker_t *worker = &g_pool.workers[next++ % g_pool.nworkers];
+      if (!(deque_push (&worker->queue, fd))) {
+         close (fd);
+         continue;
+      }
+      pending_add (1);
+   }
+
+   error = false;
+
+errorexit:
+   if (g_pool.workers)
+      pool_stop ();
+
+   pthread_sigmask (SIG_SETMASK, &oldmask, NULL);
+   sigaction (SIGTERM, &old_term, NULL);
+   sigaction (SIGINT, &old_int, NULL);
+
+   if (listen_fd > 0)
+      close (listen_fd);
+
+   return !error;
+}
+
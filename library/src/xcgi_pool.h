@@ -0,0 +1,52 @@
+
+#ifndef H_XCGI_POOL
+#define H_XCGI_POOL
+
+#include <stdbool.h>
+
+#include "xcgi.h"
+
+// Thread pool request executor. This is the in-process alternative to
+// the prefork workers (xcgi_prefork.h): a single process serves many
+// requests concurrently, one per thread.
+//
+// The calling thread accepts connections and hands them to the worker
+// threads in turn. Each worker has its own queue of accepted connections;
+// a worker with nothing left in its own queue takes work from the queues
+// of the other workers, so that a single slow request only holds up its
+// own thread and not the connections queued behind it.
+//
+// Every request is served with its own request context (see xcgi_ctx_t
+// in xcgi.h), which the handler must use instead of the global variables
+// and the functions that operate on the default context. Each worker
+// thread opens its own database handle (see xcgi_dbms_open()), which is
+// available to the handler as ctx->db.
+//
+// The number of threads is taken from the 'xcgi_threads' entry in the
+// 'xcgi.ini' file; either a number or 'auto' for one thread per online
+// CPU (the default).
+//
+// The requests are read using the SCGI protocol (see xcgi_scgi.h), and
+// the listening socket is found in the same way as for the SCGI front
+// end. When there is no listening socket the program is assumed to have
+// been started as a plain CGI program, and the handler is called once
+// with the default context.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Serves requests until SIGTERM or SIGINT is received, calling
+   // 'handler' with the request context and 'param' for each request.
+   // The handler is called from many threads at the same time. The
+   // library must already be initialised with xcgi_init(). Returns true
+   // after a clean shutdown and false on error.
+   bool xcgi_pool_serve (void (*handler) (xcgi_ctx_t *, void *),
+                         void *param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
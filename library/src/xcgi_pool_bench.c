@@ -0,0 +1,320 @@
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "xcgi.h"
+#include "xcgi_pool.h"
+
+// Compares the prefork workers with the thread pool, both serving SCGI
+// requests on the loopback interface. One request in every SLOW_EVERY
+// is slow (it sleeps), to show how well each mode keeps the fast
+// requests moving while a slow one is in progress.
+
+#define SLOW_EVERY      (50)
+#define SLOW_MSECS      (20)
+#define BUSY_LOOPS      (20000)
+
+static unsigned short g_port;
+static size_t g_nclients = 32;
+static size_t g_nrequests = 500;
+
+static double now_ms (void)
+{
+   struct timespec ts;
+   clock_gettime (CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* ************************************************************************
+ * The server.
+ */
+static void handler (xcgi_ctx_t *ctx, void *param)
+{
+   volatile unsigned long sum = 0;
+
+   param = param;
+
+   if ((strcmp (ctx->QUERY_STRING, "slow=1"))==0) {
+      struct timespec ts = { 0, SLOW_MSECS * 1000000L };
+      nanosleep (&ts, NULL);
+   }
+
+   for (unsigned long i=0; i<BUSY_LOOPS; i++)
+      sum += i;
+
+   xcgi_ctx_headers_value_set (ctx, "Content-Type", "text/plain");
+   xcgi_ctx_headers_write (ctx);
+   fprintf (ctx->outf, "%lu\n", sum);
+}
+
+static void server_run (const char *dir, bool pool)
+{
+   if (!(xcgi_init (dir))) {
+      fprintf (stderr, "Failed to initialise the library\n");
+      exit (EXIT_FAILURE);
+   }
+
+   if (pool) {
+      xcgi_pool_serve (handler, NULL);
+   } else {
+      while (xcgi_accept ()) {
+         handler (xcgi_ctx_default (), NULL);
+      }
+   }
+
+   xcgi_shutdown ();
+   exit (EXIT_SUCCESS);
+}
+
+static pid_t server_start (const char *dir, bool pool, size_t nworkers)
+{
+   char fname[1024];
+   FILE *outf;
+
+   snprintf (fname, sizeof fname, "%s/xcgi.ini", dir);
+   if (!(outf = fopen (fname, "w"))) {
+      fprintf (stderr, "Failed to create [%s]: %m\n", fname);
+      return -1;
+   }
+   fprintf (outf, "xcgi_frontend = scgi\n");
+   fprintf (outf, "xcgi_listen = 127.0.0.1:%u\n", g_port);
+   fprintf (outf, "%s = %zu\n", pool ? "xcgi_threads" : "xcgi_workers",
+                                nworkers);
+   fclose (outf);
+
+   fflush (stdout);
+
+   pid_t pid = fork ();
+   if (pid == 0)
+      server_run (dir, pool);
+
+   return pid;
+}
+
+/* ************************************************************************
+ * The clients.
+ */
+typedef struct client_t client_t;
+struct client_t {
+   pthread_t   thread;
+   size_t      index;
+   double     *latencies;
+   size_t      nfailed;
+};
+
+static int client_connect (void)
+{
+   struct sockaddr_in addr;
+   int fd;
+
+   memset (&addr, 0, sizeof addr);
+   addr.sin_family = AF_INET;
+   addr.sin_port = htons (g_port);
+   addr.sin_addr.s_addr = htonl (INADDR_LOOPBACK);
+
+   if ((fd = socket (AF_INET, SOCK_STREAM, 0)) < 0)
+      return -1;
+
+   if ((connect (fd, (struct sockaddr *)&addr, sizeof addr))!=0) {
+      close (fd);
+      return -1;
+   }
+
+   return fd;
+}
+
+static bool client_request (bool slow)
+{
+   static const char fast_headers[] =
+      "CONTENT_LENGTH\0" "0\0" "SCGI\0" "1\0"
+      "REQUEST_METHOD\0" "GET\0" "QUERY_STRING\0" "slow=0\0";
+   static const char slow_headers[] =
+      "CONTENT_LENGTH\0" "0\0" "SCGI\0" "1\0"
+      "REQUEST_METHOD\0" "GET\0" "QUERY_STRING\0" "slow=1\0";
+   const char *headers = slow ? slow_headers : fast_headers;
+   size_t hlen = sizeof fast_headers - 1;
+   char buf[4096];
+   int fd;
+   bool ret = false;
+
+   if ((fd = client_connect ()) < 0)
+      return false;
+
+   int len = snprintf (buf, sizeof buf, "%zu:", hlen);
+   memcpy (&buf[len], headers, hlen);
+   len += hlen;
+   buf[len++] = ',';
+
+   if ((write (fd, buf, len))!=len)
+      goto errorexit;
+
+   ssize_t nbytes;
+   size_t total = 0;
+   while ((nbytes = read (fd, buf, sizeof buf)) > 0)
+      total += nbytes;
+
+   ret = nbytes == 0 && total > 0;
+
+errorexit:
+   close (fd);
+   return ret;
+}
+
+static void *client_run (void *arg)
+{
+   client_t *client = arg;
+
+   for (size_t i=0; i<g_nrequests; i++) {
+      bool slow = ((client->index * g_nrequests + i) % SLOW_EVERY)==0;
+      double start = now_ms ();
+      if (!(client_request (slow)))
+         client->nfailed++;
+      client->latencies[i] = now_ms () - start;
+   }
+
+   return NULL;
+}
+
+static int cmp_double (const void *lhs, const void *rhs)
+{
+   double l = *(const double *)lhs, r = *(const double *)rhs;
+   return l < r ? -1 : l > r ? 1 : 0;
+}
+
+static bool run_clients (const char *name)
+{
+   bool error = true;
+   client_t *clients = NULL;
+   double *all = NULL;
+   size_t total = g_nclients * g_nrequests;
+   size_t nfailed = 0;
+
+   // Wait for the server to start listening.
+   for (size_t i=0; i<200; i++) {
+      int fd = client_connect ();
+      if (fd >= 0) {
+         close (fd);
+         break;
+      }
+      usleep (10000);
+   }
+
+   if (!(clients = calloc (g_nclients, sizeof *clients)) ||
+       !(all = malloc (sizeof *all * total)))
+      goto errorexit;
+
+   double start = now_ms ();
+
+   for (size_t i=0; i<g_nclients; i++) {
+      clients[i].index = i;
+      clients[i].latencies = &all[i * g_nrequests];
+      pthread_create (&clients[i].thread, NULL, client_run, &clients[i]);
+   }
+
+   for (size_t i=0; i<g_nclients; i++) {
+      pthread_join (clients[i].thread, NULL);
+      nfailed += clients[i].nfailed;
+   }
+
+   double elapsed = now_ms () - start;
+
+   qsort (all, total, sizeof *all, cmp_double);
+
+   printf ("%-10s %10.0f %10.2f %10.2f %10.2f %8zu\n",
+           name,
+           total / (elapsed / 1000.0),
+           all[total / 2],
+           all[total * 99 / 100],
+           all[total - 1],
+           nfailed);
+
+   error = false;
+
+errorexit:
+   free (clients);
+   free (all);
+   return !error;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   char dir[] = "/tmp/xcgi_pool_bench.XXXXXX";
+   size_t nworkers = sysconf (_SC_NPROCESSORS_ONLN);
+   struct {
+      const char *name;
+      bool pool;
+   } modes[] = {
+      { "prefork",   false },
+      { "threads",   true  },
+   };
+
+   if (argc > 1)
+      nworkers = strtoul (argv[1], NULL, 0);
+   if (argc > 2)
+      g_nclients = strtoul (argv[2], NULL, 0);
+   if (argc > 3)
+      g_nrequests = strtoul (argv[3], NULL, 0);
+
+   if (!nworkers || !g_nclients || !g_nrequests) {
+      fprintf (stderr, "Usage: %s [workers] [clients] [requests-per-client]\n",
+                        argv[0]);
+      return EXIT_FAILURE;
+   }
+
+   if (!(mkdtemp (dir))) {
+      fprintf (stderr, "Failed to create temporary directory: %m\n");
+      return EXIT_FAILURE;
+   }
+
+   g_port = 20000 + getpid () % 20000;
+
+   printf ("%zu workers, %zu clients, %zu requests each, "
+           "1 in %i requests sleeps %ims\n\n",
+           nworkers, g_nclients, g_nrequests, SLOW_EVERY, SLOW_MSECS);
+   printf ("%-10s %10s %10s %10s %10s %8s\n",
+           "mode", "req/s", "p50 ms", "p99 ms", "max ms", "failed");
+
+   for (size_t i=0; i<sizeof modes/sizeof modes[0]; i++) {
+      pid_t pid = server_start (dir, modes[i].pool, nworkers);
+      if (pid < 0)
+         goto errorexit;
+
+      bool ok = run_clients (modes[i].name);
+
+      kill (pid, SIGTERM);
+      waitpid (pid, NULL, 0);
+
+      if (!ok)
+         goto errorexit;
+
+      // Use a fresh port, rather than wait for the old one to be freed.
+      g_port++;
+   }
+
+   ret = EXIT_SUCCESS;
+
+errorexit:
+   {
+      char fname[sizeof dir + 16];
+      snprintf (fname, sizeof fname, "%s/xcgi.ini", dir);
+      unlink (fname);
+      rmdir (dir);
+   }
+
+   return ret;
+}
+
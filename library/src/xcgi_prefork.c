@@ -0,0 +1,258 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include "xcgi.h"
+#include "xcgi_cfg.h"
+#include "xcgi_net.h"
+#include "xcgi_prefork.h"
+
+#define CFG_LISTEN                  ("xcgi_listen")
+#define CFG_WORKERS                 ("xcgi_workers")
+
+// A worker that exits sooner than this after being started is restarted
+// only after a delay, so that a worker that cannot start does not make
+// the supervisor spin.
+#define MIN_WORKER_LIFETIME         (1)
+#define RESTART_DELAY               (1)
+
+typedef struct worker_t worker_t;
+struct worker_t {
+   pid_t    pid;
+   time_t   started;
+};
+
+static void on_sigchld (int signum)
+{
+   signum = signum;
+}
+
+/* ************************************************************************
+ * The listening socket must exist before the workers are started. Unix
+ * sockets are created once and passed to every worker on descriptor 0;
+ * each worker creates its own TCP socket, so here the address is only
+ * checked.
+ */
+static bool listener_prepare (void)
+{
+   const char *spec = xcgi_cfg_get (xcgi_config, CFG_LISTEN);
+   int fd;
+
+   if (!spec || !spec[0])
+      return true;
+
+   // Without SO_REUSEPORT, so that this fails if another program (or
+   // another copy of this one) is already listening on the port.
+   if ((fd = xcgi_net_listen (spec, false)) < 0)
+      return false;
+
+   if ((strncmp (spec, "unix:", 5))!=0) {
+      close (fd);
+      return true;
+   }
+
+   if (fd != 0) {
+      if ((dup2 (fd, 0)) < 0) {
+         fprintf (stderr, "%s: dup2() failed: %m\n", __func__);
+         close (fd);
+         return false;
+      }
+      close (fd);
+   }
+
+   return xcgi_cfg_set (&xcgi_config, CFG_LISTEN, "");
+}
+
+/* ************************************************************************
+ * Worker management.
+ */
+static const int g_signals[] = { SIGTERM, SIGINT, SIGHUP, SIGCHLD };
+
+static void signals_restore (const sigset_t *oldmask)
+{
+   for (size_t i=0; i<sizeof g_signals/sizeof g_signals[0]; i++) {
+      signal (g_signals[i], SIG_DFL);
+   }
+   sigprocmask (SIG_SETMASK, oldmask, NULL);
+}
+
+// Returns zero in the new worker, the worker's pid in the supervisor and
+// -1 on error.
+static pid_t worker_start (worker_t *worker, const sigset_t *oldmask)
+{
+   pid_t pid = fork ();
+
+   if (pid < 0) {
+      fprintf (stderr, "%s: fork() failed: %m\n", __func__);
+      return -1;
+   }
+
+   if (pid == 0) {
+      signals_restore (oldmask);
+      return 0;
+   }
+
+   worker->pid = pid;
+   worker->started = time (NULL);
+
+   return pid;
+}
+
+static void worker_report (pid_t pid, int status)
+{
+   if (WIFSIGNALED (status)) {
+      fprintf (stderr, "%s: Worker %i killed by signal %i, restarting\n",
+                        __func__, (int)pid, WTERMSIG (status));
+   } else if (WIFEXITED (status) && WEXITSTATUS (status) != 0) {
+      fprintf (stderr, "%s: Worker %i exited with %i, restarting\n",
+                        __func__, (int)pid, WEXITSTATUS (status));
+   }
+}
+
+static void workers_stop (worker_t *workers, int nworkers)
+{
+   for (int i=0; i<nworkers; i++) {
+      if (workers[i].pid > 0)
+         kill (workers[i].pid, SIGTERM);
+   }
+
+   for (int i=0; i<nworkers; i++) {
+      if (workers[i].pid <= 0)
+         continue;
+
+      while ((waitpid (workers[i].pid, NULL, 0)) < 0 && errno == EINTR)
+         ;
+      workers[i].pid = 0;
+   }
+}
+
+int xcgi_prefork_workers (void)
+{
+   const char *value = xcgi_cfg_get (xcgi_config, CFG_WORKERS);
+   const char *spec = xcgi_cfg_get (xcgi_config, CFG_LISTEN);
+   int64_t ret = 0;
+
+   if (!value || !value[0])
+      return 0;
+
+   if ((strcmp (value, "auto"))==0) {
+      ret = sysconf (_SC_NPROCESSORS_ONLN);
+   } else if (!(xcgi_cfg_get_int (xcgi_config, CFG_WORKERS, &ret))) {
+      fprintf (stderr, "%s: Invalid value [%s] for [%s]\n", __func__,
+                        value, CFG_WORKERS);
+      return 0;
+   }
+
+   if (ret <= 0)
+      return 0;
+
+   // Plain CGI programs have nothing to accept connections on.
+   if ((!spec || !spec[0]) && !(xcgi_net_is_listener (0)))
+      return 0;
+
+   return ret > INT32_MAX ? INT32_MAX : (int)ret;
+}
+
+bool xcgi_prefork_run (int nworkers)
+{
+   bool error = true;
+   worker_t *workers = NULL;
+   sigset_t mask, oldmask;
+   struct sigaction sa;
+
+   if (nworkers <= 0)
+      return false;
+
+   if (!(listener_prepare ()))
+      return false;
+
+   if (!(workers = calloc (nworkers, sizeof *workers))) {
+      fprintf (stderr, "%s: OOM error allocating workers\n", __func__);
+      return false;
+   }
+
+   // The signals are only ever received synchronously, with
+   // sigwaitinfo(). SIGCHLD needs a handler, otherwise it is discarded.
+   memset (&sa, 0, sizeof sa);
+   sa.sa_handler = on_sigchld;
+   sigaction (SIGCHLD, &sa, NULL);
+
+   sigemptyset (&mask);
+   for (size_t i=0; i<sizeof g_signals/sizeof g_signals[0]; i++) {
+      sigaddset (&mask, g_signals[i]);
+   }
+   sigprocmask (SIG_BLOCK, &mask, &oldmask);
+
+   for (int i=0; i<nworkers; i++) {
+      pid_t pid = worker_start (&workers[i], &oldmask);
+      if (pid == 0) {
+         free (workers);
+         return true;
+      }
+      if (pid < 0)
+         goto errorexit;
+   }
+
+   while (true) {
+      int signum = sigwaitinfo (&mask, NULL);
+
+      if (signum < 0) {
+         if (errno == EINTR)
+            continue;
+         fprintf (stderr, "%s: sigwaitinfo() failed: %m\n", __func__);
+         goto errorexit;
+      }
+
+      if (signum != SIGCHLD)
+         break;
+
+      pid_t pid;
+      int status;
+      while ((pid = waitpid (-1, &status, WNOHANG)) > 0) {
+         for (int i=0; i<nworkers; i++) {
+            if (workers[i].pid != pid)
+               continue;
+
+            worker_report (pid, status);
+            workers[i].pid = 0;
+
+            if (time (NULL) - workers[i].started < MIN_WORKER_LIFETIME)
+               sleep (RESTART_DELAY);
+
+            pid_t newpid = worker_start (&workers[i], &oldmask);
+            if (newpid == 0) {
+               free (workers);
+               return true;
+            }
+            if (newpid < 0)
+               goto errorexit;
+         }
+      }
+   }
+
+   error = false;
+
+errorexit:
+   if (error) {
+      fprintf (stderr, "%s: Stopping all workers\n", __func__);
+   }
+
+   workers_stop (workers, nworkers);
+   free (workers);
+
+   signals_restore (&oldmask);
+
+   return false;
+}
+
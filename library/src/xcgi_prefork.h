@@ -0,0 +1,52 @@
+
+#ifndef H_XCGI_PREFORK
+#define H_XCGI_PREFORK
+
+#include <stdbool.h>
+
+// Prefork process manager for the persistent front ends (xcgi_fcgi.h,
+// xcgi_scgi.h and xcgi_http.h). This is used by xcgi_accept() and is not
+// normally called directly.
+//
+// When the 'xcgi_workers' entry in the 'xcgi.ini' file is set, the
+// process that calls xcgi_accept() for the first time becomes a
+// supervisor: it forks that many worker processes and then only waits
+// for them. Each worker inherits the loaded configuration, opens its own
+// database handle once and returns from xcgi_accept() to serve requests
+// for the rest of its life. A worker that exits for any reason is
+// replaced. On SIGTERM, SIGINT or SIGHUP the supervisor stops all the
+// workers and its own call to xcgi_accept() returns false, so the caller
+// exits normally.
+//
+// The value of 'xcgi_workers' is either the number of workers or 'auto'
+// for one worker per online CPU. A value of zero (or no entry at all)
+// disables preforking.
+//
+// When listening on a TCP address ('xcgi_listen' = host:port) each worker
+// binds its own SO_REUSEPORT socket, so the kernel spreads connections
+// across the workers. Unix sockets, and listening sockets passed in on
+// descriptor 0, are opened once and shared by all the workers.
+//
+// A program started as a plain CGI program (no listening socket) is never
+// preforked.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Returns the number of workers to prefork, or zero if preforking is
+   // disabled or there is no listening socket.
+   int xcgi_prefork_workers (void);
+
+   // Starts 'nworkers' workers and supervises them. Returns true in each
+   // worker process. In the supervisor, returns false once all the
+   // workers have been stopped after a termination signal, or on a fatal
+   // error.
+   bool xcgi_prefork_run (int nworkers);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,392 @@
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#include <unistd.h>
+
+#include "xcgi.h"
+#include "xcgi_scgi.h"
+#include "xcgi_net.h"
+
+// The netstring length prefix is limited to this many digits, which
+// limits the size of the request headers to just under 100MB.
+#define MAX_LENGTH_DIGITS           (8)
+
+#define OUTPUT_BUFSIZE              (1024 * 32)
+#define INPUT_BUFSIZE               (1024 * 16)
+
+/* ************************************************************************
+ * A single connection, which carries a single request. The header
+ * buffers are kept between requests and only grow.
+ */
+typedef struct scgi_conn_t scgi_conn_t;
+struct scgi_conn_t {
+   int         fd;
+
+   size_t      body_remaining;
+
+   char       *headers;
+   size_t      headers_size;
+   const char **pairs;
+   size_t      npairs;
+   size_t      pairs_size;
+
+   FILE       *inf;
+   FILE       *outf;
+
+   uint8_t     rbuf[INPUT_BUFSIZE];
+   size_t      rpos;
+   size_t      rlen;
+
+   char        obuf[OUTPUT_BUFSIZE];
+};
+
+// The state for the requests served by xcgi_scgi_accept(). The threads
+// used by xcgi_scgi_serve_conn() each have their own connection.
+static struct {
+   int         mode;
+   int         listen_fd;
+
+   bool        in_request;
+   scgi_conn_t conn;
+} g_scgi = {
+   .listen_fd = -1,
+   .conn.fd = -1,
+};
+
+/* ************************************************************************
+ * Reading from the connection.
+ */
+static ssize_t conn_read_some (scgi_conn_t *conn, void *dst, size_t len)
+{
+   if (conn->rpos == conn->rlen) {
+      ssize_t nbytes = xcgi_net_read (conn->fd, conn->rbuf,
+                                      sizeof conn->rbuf);
+      if (nbytes <= 0)
+         return nbytes;
+      conn->rpos = 0;
+      conn->rlen = nbytes;
+   }
+
+   size_t avail = conn->rlen - conn->rpos;
+   size_t n = avail < len ? avail : len;
+   memcpy (dst, &conn->rbuf[conn->rpos], n);
+   conn->rpos += n;
+
+   return n;
+}
+
+static bool conn_read (scgi_conn_t *conn, void *dst, size_t len)
+{
+   uint8_t *out = dst;
+
+   while (len) {
+      ssize_t nbytes = conn_read_some (conn, out, len);
+      if (nbytes <= 0)
+         return false;
+      out += nbytes;
+      len -= nbytes;
+   }
+
+   return true;
+}
+
+/* ************************************************************************
+ * Decoding of the request headers, which are sent as a netstring
+ * containing NUL-terminated names and values:
+ *    <length>:<name>\0<value>\0...<name>\0<value>\0,
+ */
+static bool headers_read (scgi_conn_t *conn)
+{
+   size_t len = 0;
+   size_t ndigits = 0;
+   char c;
+
+   while (true) {
+      if (!(conn_read (conn, &c, 1)))
+         return false;
+      if (c == ':')
+         break;
+      if (!isdigit ((unsigned char)c) || ++ndigits > MAX_LENGTH_DIGITS) {
+         fprintf (stderr, "%s: Malformed netstring length\n", __func__);
+         return false;
+      }
+      len = len * 10 + (c - '0');
+   }
+
+   if (len == 0) {
+      fprintf (stderr, "%s: Empty request headers\n", __func__);
+      return false;
+   }
+
+   if (len + 1 > conn->headers_size) {
+      char *tmp = realloc (conn->headers, len + 1);
+      if (!tmp)
+         return false;
+      conn->headers = tmp;
+      conn->headers_size = len + 1;
+   }
+
+   if (!(conn_read (conn, conn->headers, len)) ||
+       !(conn_read (conn, &c, 1)))
+      return false;
+
+   if (c != ',' || conn->headers[len - 1] != 0) {
+      fprintf (stderr, "%s: Malformed netstring\n", __func__);
+      return false;
+   }
+
+   // The strings in the netstring are already NUL-terminated, so the
+   // pairs simply point into the buffer.
+   size_t max_pairs = len + 1;
+   if (max_pairs > conn->pairs_size) {
+      const char **tmp = realloc (conn->pairs, sizeof *tmp * max_pairs);
+      if (!tmp)
+         return false;
+      conn->pairs = tmp;
+      conn->pairs_size = max_pairs;
+   }
+
+   conn->npairs = 0;
+   for (size_t i=0; i<len; i += strlen (&conn->headers[i]) + 1) {
+      conn->pairs[conn->npairs++] = &conn->headers[i];
+   }
+
+   if (conn->npairs & 1) {
+      fprintf (stderr, "%s: Header [%s] has no value\n", __func__,
+                        conn->pairs[conn->npairs - 1]);
+      return false;
+   }
+
+   return true;
+}
+
+static const char *scgi_getvar (void *param, const char *name)
+{
+   scgi_conn_t *conn = param;
+
+   for (size_t i=0; i<conn->npairs; i+=2) {
+      if ((strcmp (conn->pairs[i], name))==0)
+         return conn->pairs[i + 1];
+   }
+
+   return NULL;
+}
+
+/* ************************************************************************
+ * The streams for xcgi_stdin and xcgi_stdout. The input is limited to
+ * CONTENT_LENGTH bytes, as the web server does not close its end of the
+ * connection after sending the body.
+ */
+static ssize_t stdin_read (void *cookie, char *buf, size_t size)
+{
+   scgi_conn_t *conn = cookie;
+
+   if (conn->body_remaining == 0)
+      return 0;
+
+   if (size > conn->body_remaining)
+      size = conn->body_remaining;
+
+   ssize_t nbytes = conn_read_some (conn, buf, size);
+   if (nbytes > 0)
+      conn->body_remaining -= nbytes;
+
+   return nbytes;
+}
+
+static ssize_t stdout_write (void *cookie, const char *buf, size_t size)
+{
+   scgi_conn_t *conn = cookie;
+
+   return xcgi_net_write (conn->fd, buf, size) ? (ssize_t)size : -1;
+}
+
+static bool streams_open (scgi_conn_t *conn)
+{
+   cookie_io_functions_t in_funcs = {
+      .read = stdin_read,
+      .close = xcgi_net_stream_close,
+   };
+   cookie_io_functions_t out_funcs = {
+      .write = stdout_write,
+      .close = xcgi_net_stream_close,
+   };
+
+   if (!(conn->inf = fopencookie (conn, "r", in_funcs)))
+      return false;
+
+   if (!(conn->outf = fopencookie (conn, "w", out_funcs))) {
+      fclose (conn->inf);
+      conn->inf = NULL;
+      return false;
+   }
+
+   setvbuf (conn->outf, conn->obuf, _IOFBF, sizeof conn->obuf);
+
+   return true;
+}
+
+static void streams_close (scgi_conn_t *conn)
+{
+   if (conn->outf)
+      fclose (conn->outf);
+
+   if (conn->inf)
+      fclose (conn->inf);
+
+   conn->outf = NULL;
+   conn->inf = NULL;
+}
+
+/* ************************************************************************
+ * Request management.
+ */
+static void conn_close (scgi_conn_t *conn)
+{
+   if (conn->fd >= 0)
+      close (conn->fd);
+
+   conn->fd = -1;
+   conn->rpos = 0;
+   conn->rlen = 0;
+}
+
+// Reads the request headers from the connection and opens the streams.
+static bool conn_start (scgi_conn_t *conn)
+{
+   if (!(headers_read (conn)) || !(streams_open (conn)))
+      return false;
+
+   const char *clen = scgi_getvar (conn, "CONTENT_LENGTH");
+   if (!clen || (sscanf (clen, "%zu", &conn->body_remaining))!=1)
+      conn->body_remaining = 0;
+
+   return true;
+}
+
+void xcgi_scgi_finish (void)
+{
+   if (!g_scgi.in_request)
+      return;
+
+   xcgi_body_end ();
+
+   streams_close (&g_scgi.conn);
+
+   xcgi_request_end ();
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   conn_close (&g_scgi.conn);
+
+   g_scgi.in_request = false;
+}
+
+static bool mode_detect (void)
+{
+   if ((g_scgi.listen_fd = xcgi_net_listener (0)) == XCGI_NET_CGI) {
+      g_scgi.mode = XCGI_NET_MODE_CGI;
+      return true;
+   }
+
+   if (g_scgi.listen_fd < 0)
+      return false;
+
+   // Discard the request that xcgi_init() loaded from the environment.
+   xcgi_request_end ();
+   xcgi_stdin = NULL;
+   xcgi_stdout = NULL;
+
+   g_scgi.mode = XCGI_NET_MODE_SERVER;
+
+   return true;
+}
+
+bool xcgi_scgi_accept (void)
+{
+   scgi_conn_t *conn = &g_scgi.conn;
+
+   if (g_scgi.mode == XCGI_NET_MODE_UNKNOWN && !(mode_detect ()))
+      return false;
+
+   if (g_scgi.mode == XCGI_NET_MODE_CGI) {
+      g_scgi.mode = XCGI_NET_MODE_CGI_DONE;
+      return true;
+   }
+
+   if (g_scgi.mode != XCGI_NET_MODE_SERVER)
+      return false;
+
+   xcgi_scgi_finish ();
+
+   while (true) {
+      if ((conn->fd = xcgi_net_accept (g_scgi.listen_fd)) < 0)
+         return false;
+
+      if (!(conn_start (conn))) {
+         streams_close (conn);
+         conn_close (conn);
+         continue;
+      }
+
+      g_scgi.in_request = true;
+
+      if (!(xcgi_request_begin (scgi_getvar, conn, conn->inf, conn->outf))) {
+         fprintf (stderr, "%s: Failed to start request\n", __func__);
+         xcgi_scgi_finish ();
+         continue;
+      }
+
+      xcgi_ctx_default ()->out_fd = conn->fd;
+
+      return true;
+   }
+}
+
+bool xcgi_scgi_serve_conn (int fd, sqldb_t *db,
+                           void (*handler) (xcgi_ctx_t *, void *),
+                           void *param)
+{
+   bool error = true;
+   scgi_conn_t *conn = NULL;
+   xcgi_ctx_t *ctx = NULL;
+
+   if (!(conn = calloc (1, sizeof *conn))) {
+      close (fd);
+      return false;
+   }
+
+   conn->fd = fd;
+
+   if (!(conn_start (conn)))
+      goto errorexit;
+
+   if (!(ctx = xcgi_ctx_new (scgi_getvar, conn, conn->inf, conn->outf))) {
+      fprintf (stderr, "%s: Failed to start request\n", __func__);
+      goto errorexit;
+   }
+
+   ctx->db = db;
+   ctx->out_fd = fd;
+   handler (ctx, param);
+   xcgi_ctx_body_end (ctx);
+
+   error = false;
+
+errorexit:
+   xcgi_ctx_del (ctx);
+   streams_close (conn);
+   conn_close (conn);
+   free (conn->headers);
+   free (conn->pairs);
+   free (conn);
+
+   return !error;
+}
+
@@ -0,0 +1,65 @@
+
+#ifndef H_XCGI_SCGI
+#define H_XCGI_SCGI
+
+#include <stdbool.h>
+
+#include "xcgi.h"
+
+// SCGI support. This works exactly like the FastCGI support in
+// xcgi_fcgi.h: the configuration, the database handle and all other
+// process-wide state stays alive between requests and only the
+// per-request state is rebuilt for each request.
+//
+// The typical usage is:
+//
+//    if (!(xcgi_init (path)))
+//       ...
+//
+//    while (xcgi_scgi_accept ()) {
+//       ... handle exactly as a CGI request, writing to xcgi_stdout ...
+//    }
+//
+//    xcgi_shutdown ();
+//
+// The listening socket is taken from the 'xcgi_listen' entry in the
+// 'xcgi.ini' file if it exists (see xcgi_net_listen() for the format),
+// otherwise descriptor 0 is used if it is a listening socket. When
+// neither is true the program is assumed to have been started as a plain
+// CGI program; the first call to xcgi_scgi_accept() returns true and the
+// next call returns false.
+//
+// Each connection carries a single request, and the connection is closed
+// when the request is complete.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Completes the previous request, if any, and waits for the next one.
+   // On success the xcgi_[A-Z]* variables, xcgi_stdin, xcgi_stdout,
+   // xcgi_path_info and xcgi_cookies are populated for the new request
+   // and true is returned. Returns false when no more requests will be
+   // served.
+   bool xcgi_scgi_accept (void);
+
+   // Completes the current request by flushing xcgi_stdout and closing
+   // the connection. Does nothing if no request is active.
+   void xcgi_scgi_finish (void);
+
+   // Serves the single request on the connected socket 'fd' in a new
+   // request context, by calling 'handler' with the context and 'param'.
+   // The context uses 'db' as its database handle. The connection is
+   // closed before returning. This does not use any of the global state,
+   // so it may be called from many threads at the same time (see
+   // xcgi_pool.h). Returns false if the request could not be read.
+   bool xcgi_scgi_serve_conn (int fd, sqldb_t *db,
+                              void (*handler) (xcgi_ctx_t *, void *),
+                              void *param);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -0,0 +1,382 @@
+
+#include <stdint.h>
+#include <string.h>
+
+#include "xcgi_url.h"
+
+#if (defined (__x86_64__) || defined (__i386__)) && defined (__GNUC__)
+#define URL_X86         (1)
+#include <immintrin.h>
+#endif
+
+/* ************************************************************************
+ * Decoding. The value of each hex digit, and X for every other character.
+ */
+#define X               (0xff)
+
+static const uint8_t g_hex[256] = {
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    0,  1,  2,  3,  4,  5,  6,  7,  8,  9,  X,  X,  X,  X,  X,  X,
+    X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X, 10, 11, 12, 13, 14, 15,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+    X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,  X,
+};
+
+#undef X
+
+// Decodes the '+' or '%' at 'src' into 'dst'. Returns the number of input
+// bytes consumed.
+static inline size_t decode_special (char *dst, const char *src,
+                                     const char *end)
+{
+   if (*src == '+') {
+      *dst = ' ';
+      return 1;
+   }
+
+   if (end - src >= 3) {
+      uint8_t hi = g_hex[(uint8_t)src[1]];
+      uint8_t lo = g_hex[(uint8_t)src[2]];
+      if ((hi | lo) < 16) {
+         *dst = (char)((hi << 4) | lo);
+         return 3;
+      }
+   }
+
+   *dst = '%';
+   return 1;
+}
+
+static size_t decode_scalar (char *dst, const char *src, size_t len)
+{
+   const char *end = src + len;
+   char *start = dst;
+
+   while (src < end) {
+      if (*src != '%' && *src != '+') {
+         *dst++ = *src++;
+         continue;
+      }
+      src += decode_special (dst++, src, end);
+   }
+
+   return dst - start;
+}
+
+#ifdef URL_X86
+
+// The vector kernels look for the next '%' or '+' a block at a time.
+// Blocks without one are stored whole; otherwise the bytes before it are
+// copied and it is decoded by decode_special(). A whole block is only
+// stored when every byte of it has been loaded, which keeps in-place
+// decoding safe.
+
+__attribute__ ((target ("sse2")))
+static size_t decode_sse2 (char *dst, const char *src, size_t len)
+{
+   const char *end = src + len;
+   char *start = dst;
+   const __m128i pct = _mm_set1_epi8 ('%');
+   const __m128i plus = _mm_set1_epi8 ('+');
+
+   while (end - src >= 16) {
+      __m128i v = _mm_loadu_si128 ((const __m128i *)src);
+      unsigned mask = _mm_movemask_epi8 (
+                        _mm_or_si128 (_mm_cmpeq_epi8 (v, pct),
+                                      _mm_cmpeq_epi8 (v, plus)));
+      if (!mask) {
+         _mm_storeu_si128 ((__m128i *)dst, v);
+         dst += 16;
+         src += 16;
+         continue;
+      }
+
+      size_t n = __builtin_ctz (mask);
+      memmove (dst, src, n);
+      dst += n;
+      src += n;
+      src += decode_special (dst++, src, end);
+   }
+
+   return (dst - start) + decode_scalar (dst, src, end - src);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t decode_avx2 (char *dst, const char *src, size_t len)
+{
+   const char *end = src + len;
+   char *start = dst;
+   const __m256i pct = _mm256_set1_epi8 ('%');
+   const __m256i plus = _mm256_set1_epi8 ('+');
+
+   while (end - src >= 32) {
+      __m256i v = _mm256_loadu_si256 ((const __m256i *)src);
+      unsigned mask = _mm256_movemask_epi8 (
+                        _mm256_or_si256 (_mm256_cmpeq_epi8 (v, pct),
+                                         _mm256_cmpeq_epi8 (v, plus)));
+      if (!mask) {
+         _mm256_storeu_si256 ((__m256i *)dst, v);
+         dst += 32;
+         src += 32;
+         continue;
+      }
+
+      size_t n = __builtin_ctz (mask);
+      memmove (dst, src, n);
+      dst += n;
+      src += n;
+      src += decode_special (dst++, src, end);
+   }
+
+   return (dst - start) + decode_sse2 (dst, src, end - src);
+}
+
+#endif
+
+size_t xcgi_url_decode (char *dst, const char *src, size_t len)
+{
+   size_t ret;
+
+#ifdef URL_X86
+   if (__builtin_cpu_supports ("avx2"))
+      ret = decode_avx2 (dst, src, len);
+   else if (__builtin_cpu_supports ("sse2"))
+      ret = decode_sse2 (dst, src, len);
+   else
+#endif
+      ret = decode_scalar (dst, src, len);
+
+   dst[ret] = 0;
+
+   return ret;
+}
+
+/* ************************************************************************
+ * Encoding. The bytes that are copied as they are; every other byte is
+ * escaped as %xx. The vector kernels test the same set with range
+ * comparisons.
+ */
+static const uint8_t g_safe[256] = {
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 1, 0, 0, 1, 0, 0, 1, 1, 1, 1, 0, 1, 1, 1, 0,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0, 0,
+   0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 1,
+   0, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1,
+   1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+   0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+};
+
+static const char g_hexdigits[] = "0123456789abcdef";
+
+static inline char *encode_byte (char *dst, uint8_t c)
+{
+   *dst++ = '%';
+   *dst++ = g_hexdigits[c >> 4];
+   *dst++ = g_hexdigits[c & 0x0f];
+   return dst;
+}
+
+static size_t encode_scalar (char *dst, const char *src, size_t len)
+{
+   char *start = dst;
+
+   for (size_t i=0; i<len; i++) {
+      uint8_t c = src[i];
+      if (g_safe[c])
+         *dst++ = c;
+      else
+         dst = encode_byte (dst, c);
+   }
+
+   return dst - start;
+}
+
+static size_t encoded_len_scalar (const char *src, size_t len)
+{
+   size_t ret = len;
+
+   for (size_t i=0; i<len; i++) {
+      if (!g_safe[(uint8_t)src[i]])
+         ret += 2;
+   }
+
+   return ret;
+}
+
+#ifdef URL_X86
+
+// An unsigned byte is in [lo, hi] when (byte - lo) wraps to no more than
+// (hi - lo). The ranges and single bytes together make up g_safe.
+__attribute__ ((target ("sse2")))
+static inline __m128i in_range_sse2 (__m128i v, char lo, char hi)
+{
+   __m128i t = _mm_sub_epi8 (v, _mm_set1_epi8 (lo));
+   return _mm_cmpeq_epi8 (_mm_min_epu8 (t, _mm_set1_epi8 (hi - lo)), t);
+}
+
+__attribute__ ((target ("sse2")))
+static unsigned safe_mask_sse2 (const char *src)
+{
+   __m128i v = _mm_loadu_si128 ((const __m128i *)src);
+   __m128i ret = in_range_sse2 (v, 'a', 'z');
+
+   ret = _mm_or_si128 (ret, in_range_sse2 (v, 'A', 'Z'));
+   ret = _mm_or_si128 (ret, in_range_sse2 (v, '0', '9'));
+   ret = _mm_or_si128 (ret, in_range_sse2 (v, '\'', '*'));
+   ret = _mm_or_si128 (ret, in_range_sse2 (v, ',', '.'));
+   ret = _mm_or_si128 (ret, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('!')));
+   ret = _mm_or_si128 (ret, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('$')));
+   ret = _mm_or_si128 (ret, _mm_cmpeq_epi8 (v, _mm_set1_epi8 ('_')));
+
+   return _mm_movemask_epi8 (ret);
+}
+
+__attribute__ ((target ("avx2")))
+static inline __m256i in_range_avx2 (__m256i v, char lo, char hi)
+{
+   __m256i t = _mm256_sub_epi8 (v, _mm256_set1_epi8 (lo));
+   return _mm256_cmpeq_epi8 (_mm256_min_epu8 (t, _mm256_set1_epi8 (hi - lo)),
+                             t);
+}
+
+__attribute__ ((target ("avx2")))
+static unsigned safe_mask_avx2 (const char *src)
+{
+   __m256i v = _mm256_loadu_si256 ((const __m256i *)src);
+   __m256i ret = in_range_avx2 (v, 'a', 'z');
+
+   ret = _mm256_or_si256 (ret, in_range_avx2 (v, 'A', 'Z'));
+   ret = _mm256_or_si256 (ret, in_range_avx2 (v, '0', '9'));
+   ret = _mm256_or_si256 (ret, in_range_avx2 (v, '\'', '*'));
+   ret = _mm256_or_si256 (ret, in_range_avx2 (v, ',', '.'));
+   ret = _mm256_or_si256 (ret, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('!')));
+   ret = _mm256_or_si256 (ret, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('$')));
+   ret = _mm256_or_si256 (ret, _mm256_cmpeq_epi8 (v, _mm256_set1_epi8 ('_')));
+
+   return _mm256_movemask_epi8 (ret);
+}
+
+// Copies the block of 'len' bytes at 'src' into 'dst', escaping the
+// bytes whose bits are set in 'unsafe'. Runs of safe bytes are copied in
+// bulk. Returns the new end of 'dst'.
+static inline char *encode_block (char *dst, const char *src, size_t len,
+                                  unsigned unsafe)
+{
+   size_t pos = 0;
+
+   while (unsafe) {
+      size_t n = __builtin_ctz (unsafe);
+      memcpy (dst, &src[pos], n - pos);
+      dst += n - pos;
+      dst = encode_byte (dst, src[n]);
+      pos = n + 1;
+      unsafe &= unsafe - 1;
+   }
+
+   memcpy (dst, &src[pos], len - pos);
+   return dst + len - pos;
+}
+
+__attribute__ ((target ("sse2")))
+static size_t encode_sse2 (char *dst, const char *src, size_t len)
+{
+   const char *end = src + len;
+   char *start = dst;
+
+   for (; end - src >= 16; src += 16) {
+      dst = encode_block (dst, src, 16, ~safe_mask_sse2 (src) & 0xffff);
+   }
+
+   return (dst - start) + encode_scalar (dst, src, end - src);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t encode_avx2 (char *dst, const char *src, size_t len)
+{
+   const char *end = src + len;
+   char *start = dst;
+
+   for (; end - src >= 32; src += 32) {
+      dst = encode_block (dst, src, 32, ~safe_mask_avx2 (src));
+   }
+
+   return (dst - start) + encode_sse2 (dst, src, end - src);
+}
+
+__attribute__ ((target ("sse2")))
+static size_t encoded_len_sse2 (const char *src, size_t len)
+{
+   const char *end = src + len;
+   size_t ret = len;
+
+   for (; end - src >= 16; src += 16) {
+      ret += 2 * __builtin_popcount (~safe_mask_sse2 (src) & 0xffff);
+   }
+
+   return ret + encoded_len_scalar (src, end - src) - (end - src);
+}
+
+__attribute__ ((target ("avx2")))
+static size_t encoded_len_avx2 (const char *src, size_t len)
+{
+   const char *end = src + len;
+   size_t ret = len;
+
+   for (; end - src >= 32; src += 32) {
+      ret += 2 * __builtin_popcount (~safe_mask_avx2 (src));
+   }
+
+   return ret + encoded_len_sse2 (src, end - src) - (end - src);
+}
+
+#endif
+
+size_t xcgi_url_encoded_len (const char *src, size_t len)
+{
+#ifdef URL_X86
+   if (__builtin_cpu_supports ("avx2"))
+      return encoded_len_avx2 (src, len);
+   if (__builtin_cpu_supports ("sse2"))
+      return encoded_len_sse2 (src, len);
+#endif
+   return encoded_len_scalar (src, len);
+}
+
+size_t xcgi_url_encode (char *dst, const char *src, size_t len)
+{
+   size_t ret;
+
+#ifdef URL_X86
+   if (__builtin_cpu_supports ("avx2"))
+      ret = encode_avx2 (dst, src, len);
+   else if (__builtin_cpu_supports ("sse2"))
+      ret = encode_sse2 (dst, src, len);
+   else
+#endif
+      ret = encode_scalar (dst, src, len);
+
+   dst[ret] = 0;
+
+   return ret;
+}
+
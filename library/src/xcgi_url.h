@@ -0,0 +1,45 @@
+
+#ifndef H_XCGI_URL
+#define H_XCGI_URL
+
+#include <stddef.h>
+
+// URL encoding and decoding kernels used by the string and query string
+// functions in xcgi.h. On x86 processors the kernels use SSE2 or AVX2,
+// whichever is the best that the processor supports, and fall back to
+// plain C everywhere else. The choice is made at runtime, so the library
+// does not have to be built for a particular processor.
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+   // Decodes the first 'len' bytes of 'src' into 'dst', which must have
+   // room for 'len' + 1 bytes. Each %xx escape is replaced by the byte it
+   // encodes and each '+' by a space; a '%' that does not start a valid
+   // escape is copied unchanged. The result is NUL-terminated and is
+   // never longer than the input, so 'dst' may be the same as 'src' to
+   // decode in place.
+   //
+   // Returns the length of the result, excluding the NUL.
+   size_t xcgi_url_decode (char *dst, const char *src, size_t len);
+
+   // Encodes the first 'len' bytes of 'src' into 'dst'. ASCII letters
+   // and digits and the characters $ - _ . ! * ' ( ) , are copied, and
+   // every other byte is replaced by a %xx escape. 'dst' must have room
+   // for the number of bytes returned by xcgi_url_encoded_len() plus the
+   // NUL, which is at most 3 * 'len' + 1.
+   //
+   // Returns the length of the result, excluding the NUL.
+   size_t xcgi_url_encode (char *dst, const char *src, size_t len);
+
+   // Returns the length of the first 'len' bytes of 'src' once encoded
+   // with xcgi_url_encode(), excluding the NUL.
+   size_t xcgi_url_encoded_len (const char *src, size_t len);
+
+#ifdef __cplusplus
+};
+#endif
+
+#endif
+
@@ -21,6 +21,9 @@
 #define TYPE_INT           (2)
 #define TYPE_ARRAY         (3)
 
+// The size of the blocks in which the request body is read and parsed.
+#define INCOMING_BLOCK_SIZE      (1024 * 4)
+
 // Used to determine permissions type (builtin group/user/acl or
 // user-defined arbitrary permissions in a bitstream)
 #define PERM_TYPE_ERROR          (0)
@@ -76,7 +79,7 @@ static char *perms_encode (int perm_type, uint64_t perms);
 /* ******************************************************************
  * Globals. Ugly but necessary.
  */
-char       *g_session_id = NULL;
+const char *g_session_id = NULL;
 char       *g_email = NULL;
 char       *g_nick = NULL;
 uint64_t    g_flags = 0;
@@ -312,7 +315,8 @@ static bool incoming_valid (uint64_t mask)
 static bool incoming_init (void)
 {
    size_t content_length = 0;
-   char *input = NULL;
+   char block[INCOMING_BLOCK_SIZE];
+   xcgi_json_push_t *push = NULL;
 
    // We return true because having no POST data is not an error
    if ((sscanf (xcgi_CONTENT_LENGTH, "%zu", &content_length))!=1)
@@ -322,25 +326,48 @@ static bool incoming_init (void)
    if (!(strstr (xcgi_CONTENT_TYPE, "application/json")))
       return true;
 
-   if (!(input = malloc (content_length + 1)))
-      return false;
+   // All the fields are found in a single walk over the body, which is
+   // parsed a block at a time as it is read; only the values of the
+   // fields are kept. A body that is not valid json simply has none of
+   // the fields.
+   const char *paths[sizeof g_incoming/sizeof g_incoming[0]];
+   xcgi_json_slice_t slices[sizeof g_incoming/sizeof g_incoming[0]];
+   for (size_t i=0; i<sizeof g_incoming/sizeof g_incoming[0]; i++) {
+      paths[i] = g_incoming[i].name;
+   }
 
-   memset (input, 0, content_length + 1);
+   if (!(push = xcgi_json_push_new (paths, sizeof paths/sizeof paths[0],
+                                    NULL, NULL)))
+      return false;
 
-   size_t nbytes = fread (input, 1, content_length, xcgi_stdin);
+   bool valid = true;
+   while (content_length) {
+      size_t want = content_length < sizeof block ?
+                        content_length : sizeof block;
+      size_t nbytes = fread (block, 1, want, xcgi_stdin);
+      if (nbytes!=want) {
+         xcgi_json_push_del (push);
+         return false;
+      }
+      content_length -= nbytes;
 
-   if (nbytes!=content_length) {
-      free (input);
-      return false;
+      // The rest of the body is still read after the json is found to be
+      // invalid.
+      if (valid && !(xcgi_json_push_write (push, block, nbytes)))
+         valid = false;
    }
 
+   memset (slices, 0, sizeof slices);
+   if (valid && (xcgi_json_push_done (push)))
+      xcgi_json_push_slices (push, slices);
+
    bool error = false;
    for (size_t i=0; i<sizeof g_incoming/sizeof g_incoming[0]; i++) {
-      const char *tmp = xcgi_json_find (input, g_incoming[i].name, NULL);
+      size_t len = slices[i].len;
+      const char *tmp = slices[i].ptr;
       if (!tmp)
          continue;
 
-      size_t len = xcgi_json_length (tmp);
       if (!(g_incoming[i].value = malloc (len + 1))) {
          error = true;
          break;
@@ -354,7 +381,7 @@ static bool incoming_init (void)
       }
    }
 
-   free (input);
+   xcgi_json_push_del (push);
 
    if (error) {
       incoming_shutdown ();
@@ -410,6 +437,8 @@ static bool set_afield (ds_hmap_t *hm, const char *name, const char * value)
    return set_field (hm, name, value, TYPE_ARRAY);
 }
 
+// The arrays are only needed while the response is built, so they are
+// allocated from the request arena and never freed here.
 static char *make_sarray (const char **src, size_t len)
 {
    char *ret = NULL;
@@ -419,23 +448,29 @@ static char *make_sarray (const char **src, size_t len)
 
    size_t slen = 3;  // "[]"
    for (size_t i=0; i<len; i++) {
-      slen += strlen (src[i]) + 5; // "s, "
+      slen += strlen (src[i]) + 4; // ""s", "
    }
 
-   if (!(ret = malloc (slen + 1)))
+   if (!(ret = xcgi_arena_alloc (xcgi_arena, slen + 1)))
       return NULL;
 
-   strcpy (ret, "[");
+   char *dst = ret;
+   *dst++ = '[';
 
    for (size_t i=0; i<len; i++) {
-      strcat (ret, "\"");
-      strcat (ret, src[i]);
-      strcat (ret, "\"");
-      if (i<(len - 1))
-         strcat (ret, ", ");
+      size_t n = strlen (src[i]);
+      *dst++ = '"';
+      memcpy (dst, src[i], n);
+      dst += n;
+      *dst++ = '"';
+      if (i<(len - 1)) {
+         *dst++ = ',';
+         *dst++ = ' ';
+      }
    }
 
-   strcat (ret, "]");
+   *dst++ = ']';
+   *dst = 0;
 
    return ret;
 }
@@ -444,49 +479,69 @@ static char *make_iarray (uint64_t *src, size_t len)
 {
    char *ret = NULL;
 
-   size_t slen = 3;  // "[]"
-   for (size_t i=0; i<len; i++) {
-      char tmp[22];
-      snprintf (tmp, sizeof tmp, "%" PRIu64, src[i]);
-      slen += strlen (tmp) + 3; // "s, "
-   }
-
-   if (!(ret = malloc (slen + 1)))
+   // At most 20 digits and ", " for each value.
+   if (!(ret = xcgi_arena_alloc (xcgi_arena, 3 + len * 22)))
       return NULL;
 
-   strcpy (ret, "[");
+   char *dst = ret;
+   *dst++ = '[';
 
    for (size_t i=0; i<len; i++) {
-      char tmp[22];
-      snprintf (tmp, sizeof tmp, "%" PRIu64, src[i]);
-      strcat (ret, tmp);
-      if (i<(len - 1))
-         strcat (ret, ", ");
+      dst += sprintf (dst, "%" PRIu64, src[i]);
+      if (i<(len - 1)) {
+         *dst++ = ',';
+         *dst++ = ' ';
+      }
    }
 
-   strcat (ret, "]");
+   *dst++ = ']';
+   *dst = 0;
 
    return ret;
 }
 
-static void print_json (ds_hmap_t *hm)
+// Returns the JSON object for the fields in 'hm', allocated from the
+// request arena, with its length in '*len'. Returns NULL on error.
+static char *format_json (ds_hmap_t *hm, size_t *len)
 {
    char **keys = NULL;
+   char **values = NULL;
+   char *ret = NULL;
    size_t nkeys = ds_hmap_keys (hm, (void ***)&keys, NULL);
 
-   printf ("{");
+   if (!(values = calloc (nkeys + 1, sizeof *values))) {
+      PROG_ERR ("OOM error allocating %zu values\n", nkeys);
+      goto errorexit;
+   }
+
+   // "{", "\n}\n" and, for each field, ",\n\"key\": value".
+   size_t total = 4;
    for (size_t i=0; i<nkeys; i++) {
-      char *value = NULL;
-      if (!(ds_hmap_get_str_str (hm, keys[i], &value))) {
+      if (!(ds_hmap_get_str_str (hm, keys[i], &values[i]))) {
          PROG_ERR ("Failed to retrieve key [%s]\n", keys[i]);
          goto errorexit;
       }
-      printf ("%s\n\"%s\": %s", i ? "," : "", keys[i], value);
+      total += strlen (keys[i]) + strlen (values[i]) + 6;
    }
-   printf ("\n}\n");
+
+   if (!(ret = xcgi_arena_alloc (xcgi_arena, total + 1))) {
+      PROG_ERR ("OOM error allocating %zu bytes\n", total);
+      goto errorexit;
+   }
+
+   char *dst = ret;
+   dst += sprintf (dst, "{");
+   for (size_t i=0; i<nkeys; i++) {
+      dst += sprintf (dst, "%s\n\"%s\": %s", i ? "," : "", keys[i], values[i]);
+   }
+   dst += sprintf (dst, "\n}\n");
+
+   *len = dst - ret;
 
 errorexit:
+   free (values);
    free (keys);
+   return ret;
 }
 
 static void free_json (ds_hmap_t *hm)
@@ -844,11 +899,6 @@ errorexit:
    free (emails);
    free (nicks);
 
-   free (res_emails);
-   free (res_nicks);
-   free (res_flags);
-   free (res_ids);
-
    return !error;
 }
 
@@ -1185,10 +1235,6 @@ errorexit:
    free (names);
    free (descriptions);
 
-   free (res_names);
-   free (res_descriptions);
-   free (res_ids);
-
    return !error;
 }
 
@@ -1285,11 +1331,6 @@ errorexit:
    free (emails);
    free (nicks);
 
-   free (res_emails);
-   free (res_nicks);
-   free (res_flags);
-   free (res_ids);
-
    return !error;
 }
 
@@ -2089,13 +2130,14 @@ static void print_help (void)
 
 #define WORKING_DIR                 ("PUBSUB_WORKING_DIR")
 
-int main (int argc, char **argv)
+// Handles a single request. The xcgi library must already have been
+// initialised, and the request loaded, by the caller.
+static int pubsub_request (void)
 {
    int ret = EXIT_FAILURE;
 
    int error_code = 0;
    const char *error_message = "Success";
-   const char *wdir = getenv (WORKING_DIR);
 
    int statusCode = 200;
    const char *statusMessage = "Internal Server Error";
@@ -2103,16 +2145,12 @@ int main (int argc, char **argv)
    ds_hmap_t *jfields = NULL;
    endpoint_func_t *endpoint = endpoint_ERROR;
 
-   if (argc>1 || argv[1]) {
-      print_help ();
-      return EXIT_FAILURE;
-   }
-
-   if (!wdir || !wdir[0]) {
-      PROG_ERR ("Environment variable [%s] is not set.\n", WORKING_DIR);
-      error_code = EPUBSUB_INTERNAL_ERROR;
-      return EXIT_FAILURE;
-   }
+   g_session_id = NULL;
+   g_email = NULL;
+   g_nick = NULL;
+   g_flags = 0;
+   g_id = 0;
+   g_perms_allowed = false;
 
    if (!(jfields = ds_hmap_new (32))) {
       PROG_ERR ("Failed to create hashmap for json fields\n");
@@ -2120,28 +2158,9 @@ int main (int argc, char **argv)
       return EXIT_FAILURE;
    }
 
-   if (!(xcgi_init (wdir))) {
-      PROG_ERR ("Failed to initialise the xcgi library\n");
-      error_code = EPUBSUB_INTERNAL_ERROR;
-      goto errorexit;
-   }
-
-   {
-      size_t ncookies = xcgi_cookies_count ();
-      size_t slen = strlen (FIELD_STR_SESSION);
-
+   if (!(g_session_id = xcgi_cookie_get (FIELD_STR_SESSION)))
       g_session_id = "";
 
-      for (size_t i=0; xcgi_cookies[i] && i<ncookies; i++) {
-         if ((strncmp (FIELD_STR_SESSION, xcgi_cookies[i], slen))==0) {
-            g_session_id = strchr (xcgi_cookies[i], '=');
-            if (g_session_id)
-               g_session_id++;
-            break;
-         }
-      }
-   }
-
    if (!xcgi_db) {
       PROG_ERR ("No database available\n");
       error_code = EPUBSUB_INTERNAL_ERROR;
@@ -2236,20 +2255,57 @@ errorexit:
    snprintf (tmp, sizeof tmp, "%i", statusCode);
    xcgi_headers_value_set ("Status", tmp);
 
-   xcgi_headers_write ();
-
    if (endpoint!=endpoint_QUEUE_GET) {
-      print_json (jfields);
+      size_t len = 0;
+      char *body = format_json (jfields, &len);
+      if (!body || !(xcgi_response_write (body, len))) {
+         PROG_ERR ("Failed to write the response\n");
+         ret = EXIT_FAILURE;
+      }
+   } else {
+      xcgi_headers_write ();
    }
    free_json (jfields);
 
-   xcgi_shutdown ();
    incoming_shutdown ();
 
    free (g_email);
    free (g_nick);
+   g_email = NULL;
+   g_nick = NULL;
+
+   fflush (xcgi_stdout);
+
+   return ret;
+}
+
+int main (int argc, char **argv)
+{
+   int ret = EXIT_FAILURE;
+   const char *wdir = getenv (WORKING_DIR);
 
-   fflush (stdout);
+   if (argc>1 || argv[1]) {
+      print_help ();
+      return EXIT_FAILURE;
+   }
+
+   if (!wdir || !wdir[0]) {
+      PROG_ERR ("Environment variable [%s] is not set.\n", WORKING_DIR);
+      return EXIT_FAILURE;
+   }
+
+   if (!(xcgi_init (wdir))) {
+      PROG_ERR ("Failed to initialise the xcgi library\n");
+      return EXIT_FAILURE;
+   }
+
+   // Serves a single request when run as a CGI program, and every
+   // request when run as a FastCGI, SCGI or HTTP program.
+   while (xcgi_accept ()) {
+      ret = pubsub_request ();
+   }
+
+   xcgi_shutdown ();
 
    return ret;
 }